@@ -0,0 +1,392 @@
+/*
+	File:
+		bench.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Microbenchmarks of the building blocks every request goes through,
+		run in one process with no server or network:
+		- read_socket_blocking()/write_socket_blocking() at several sizes,
+		  over a socketpair and over a pipe, with a thread on each end
+		- comms_sendb()/comms_getb() and comms_sendq()/comms_getq()
+		- server_dispatch_command() on a socketpair, fed batches of empty
+		  range reads (opcode and field decode, one byte back) and of page
+		  requests; the region lives in a scratch directory
+		- memcpy() at several sizes, from cache
+
+		Each case prints one line: case, bytes per op, ops, ns/op,
+		syscalls/op and MB/s. Case names and columns do not change, so the
+		output of two builds can be joined on the first two columns.
+		System calls are the read and write calls counted in /proc/self/io
+		for the whole process; "-" if the kernel does not keep them.
+		Dispatch cases include the server's debug printf() of each
+		request, sent to /dev/null while they run.
+
+		Usage: b [-ops count] [-only name]
+*/
+
+#include "shared.h"
+#include <dirent.h>
+using namespace std;
+
+#define BENCH_OPS		100000		/* Default ops per case */
+#define BENCH_BYTES_MAX		0x10000000	/* Cap on bytes moved per case */
+#define BENCH_BATCH		64		/* Requests sent per write to dispatch */
+
+static uint64 bench_ops = BENCH_OPS;
+static char *bench_only = NULL;
+static FILE *bench_out = NULL;		/* Where results go */
+
+/* Read and write system calls made by this process so far, or ~0 */
+static uint64 bench_syscalls(void)
+{
+	char line[128];
+	uint64 total = 0;
+	int found = 0;
+	FILE *fd = fopen("/proc/self/io", "r");
+
+	if(!fd)
+		return ~(uint64)0;
+	while(fgets(line, sizeof(line), fd))
+	{
+		unsigned long long value;
+
+		if(sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1)
+		{
+			total += value;
+			found++;
+		}
+	}
+	fclose(fd);
+
+	return (found == 2) ? total : ~(uint64)0;
+}
+
+static bool bench_wanted(const char *name)
+{
+	return !bench_only || strstr(name, bench_only);
+}
+
+/* Ops for a case moving size bytes each */
+static uint64 bench_count(uint64 size)
+{
+	return MAX(MIN(bench_ops, BENCH_BYTES_MAX / MAX(size, 1)), 1);
+}
+
+static void bench_print(const char *name, uint64 size, uint64 ops, uint64 ns, uint64 syscalls)
+{
+	char calls[32];
+
+	if(syscalls == ~(uint64)0)
+		strcpy(calls, "-");
+	else
+		snprintf(calls, sizeof(calls), "%.2f", (double)syscalls / ops);
+
+	fprintf(bench_out, "%-22s %10llu %10llu %12.1f %12s %12.1f\n", name, size, ops,
+		(double)ns / ops, calls, ns ? size * ops * 1e3 / ns : 0.0);
+	fflush(bench_out);
+}
+
+/* Start and end counts of a timed case */
+struct bench_mark {
+	uint64 time;
+	uint64 syscalls;
+};
+
+static void bench_start(struct bench_mark *mark)
+{
+	mark->syscalls = bench_syscalls();
+	mark->time = trace_time();
+}
+
+static void bench_stop(const char *name, uint64 size, uint64 ops, struct bench_mark *mark)
+{
+	uint64 ns = trace_time() - mark->time;
+	uint64 syscalls = bench_syscalls();
+
+	/* Reading /proc/self/io is one read call of its own */
+	if(syscalls != ~(uint64)0 && mark->syscalls != ~(uint64)0)
+		syscalls = syscalls - mark->syscalls - 1;
+	else
+		syscalls = ~(uint64)0;
+	bench_print(name, size, ops, ns, syscalls);
+}
+
+/*------------------------------------------------*/
+
+/* Writing end of a transfer case */
+struct bench_writer {
+	pthread_t thread;
+	int fd;
+	int kind;		/* What the thread sends */
+	uint64 size;
+	uint64 ops;
+};
+
+enum {
+	BENCH_SEND_BLOCK,	/* write_socket_blocking() of size bytes */
+	BENCH_SEND_BYTE,	/* comms_sendb() */
+	BENCH_SEND_QWORD	/* comms_sendq() */
+};
+
+static void *bench_writer_thread(void *arg)
+{
+	struct bench_writer *writer = (struct bench_writer *)arg;
+	uint8 *buffer = new uint8 [MAX(writer->size, 1)];
+	int transferred;
+
+	memset(buffer, 0x5A, MAX(writer->size, 1));
+	for(uint64 i = 0; i < writer->ops; i++)
+	{
+		if(writer->kind == BENCH_SEND_BLOCK)
+			write_socket_blocking(writer->fd, buffer, (int)writer->size, transferred);
+		else if(writer->kind == BENCH_SEND_BYTE)
+			comms_sendb(writer->fd, (uint8)i);
+		else
+			comms_sendq(writer->fd, i);
+	}
+
+	delete []buffer;
+	return NULL;
+}
+
+/* One thread sends ops items, this one receives them */
+static void bench_transfer(const char *name, bool use_pipe, int kind, uint64 size)
+{
+	struct bench_writer writer;
+	struct bench_mark mark;
+	uint8 *buffer = new uint8 [MAX(size, 1)];
+	uint64 ops = bench_count(size);
+	uint64 check = 0;
+	int fd[2];
+	int transferred;
+
+	if(!bench_wanted(name))
+	{
+		delete []buffer;
+		return;
+	}
+	if(use_pipe ? pipe(fd) == -1 : socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == -1)
+		die_errno("Error: %s: ", use_pipe ? "pipe()" : "socketpair()");
+
+	writer.fd = fd[1];
+	writer.kind = kind;
+	writer.size = size;
+	writer.ops = ops;
+
+	bench_start(&mark);
+	if(pthread_create(&writer.thread, NULL, bench_writer_thread, &writer) != 0)
+		die("Error: pthread_create(): bench\n");
+	for(uint64 i = 0; i < ops; i++)
+	{
+		if(kind == BENCH_SEND_BLOCK)
+			read_socket_blocking(fd[0], buffer, (int)size, transferred);
+		else if(kind == BENCH_SEND_BYTE)
+			check += comms_getb(fd[0]);
+		else
+			check += comms_getq(fd[0]);
+	}
+	pthread_join(writer.thread, NULL);
+	bench_stop(name, size, ops, &mark);
+
+	/* Keep the decode from being optimised away */
+	if(check == 1)
+		printf(" ");
+	close(fd[0]);
+	close(fd[1]);
+	delete []buffer;
+}
+
+/*------------------------------------------------*/
+
+static void *bench_dispatch_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+
+	qos_connect(fd);
+	heat_connect(fd);
+	server_dispatch_command(fd);
+	heat_disconnect(fd);
+	qos_disconnect(fd);
+	return NULL;
+}
+
+/* Batches of one request through the server's dispatch loop */
+static void bench_dispatch(const char *name, int fd, uint8 opcode, uint64 reply_size)
+{
+	uint8 request[BENCH_BATCH * (1 + 2 * PTR_SIZE)];
+	uint8 *reply = new uint8 [BENCH_BATCH * reply_size];
+	uint64 batches = MAX(bench_count(reply_size) / BENCH_BATCH, 1);
+	uint64 request_size = (opcode == REQUEST_PAGE) ? 1 + PTR_SIZE : 1 + 2 * PTR_SIZE;
+	struct bench_mark mark;
+
+	if(!bench_wanted(name))
+	{
+		delete []reply;
+		return;
+	}
+
+	/* Empty range reads at offset 0; page requests over the region */
+	for(int i = 0; i < BENCH_BATCH; i++)
+	{
+		uint8 *entry = &request[i * request_size];
+
+		entry[0] = opcode;
+		*(uint64 *)&entry[1] = (opcode == REQUEST_PAGE) ?
+			(i * shared_page_size) % shared_memory_size : 0;
+		if(opcode != REQUEST_PAGE)
+			*(uint64 *)&entry[1 + PTR_SIZE] = 0;
+	}
+
+	bench_start(&mark);
+	for(uint64 i = 0; i < batches; i++)
+	{
+		comms_send(fd, request, BENCH_BATCH * request_size);
+		comms_get(fd, reply, BENCH_BATCH * reply_size);
+	}
+	bench_stop(name, reply_size, batches * BENCH_BATCH, &mark);
+
+	delete []reply;
+}
+
+/* Remove the scratch region and anything else left in its directory */
+static void bench_scratch_remove(const char *path)
+{
+	DIR *dir = opendir(path);
+	struct dirent *entry;
+
+	if(dir)
+	{
+		while((entry = readdir(dir)) != NULL)
+		{
+			char file[512];
+
+			if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+				continue;
+			snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+			unlink(file);
+		}
+		closedir(dir);
+	}
+	rmdir(path);
+}
+
+static void bench_dispatch_cases(int argc, char *argv[])
+{
+	char scratch[] = "/tmp/netmem-bench-XXXXXX";
+	char cwd[4096];
+	pthread_t thread;
+	int fd[2];
+
+	if(!bench_wanted("dispatch"))
+		return;
+	if(!getcwd(cwd, sizeof(cwd)) || !mkdtemp(scratch) || chdir(scratch) == -1)
+		die_errno("Error: scratch directory: ");
+
+	/* Same setup as a server, minus the network */
+	placement_setup(argc, argv);
+	qos_setup(argc, argv);
+	heat_setup(argc, argv);
+	region_open(true);
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fd) == -1)
+		die_errno("Error: socketpair(): ");
+
+	/* The dispatch loop logs every request; keep it off the results */
+	fflush(stdout);
+	int saved_stdout = dup(1);
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, 1);
+
+	if(pthread_create(&thread, NULL, bench_dispatch_thread, (void *)(intptr_t)fd[1]) != 0)
+		die("Error: pthread_create(): bench\n");
+
+	/* Results still go to the real stdout */
+	bench_out = fdopen(dup(saved_stdout), "w");
+	bench_dispatch("dispatch decode", fd[0], REQUEST_READ_RANGE, 1);
+	bench_dispatch("dispatch page", fd[0], REQUEST_PAGE, shared_page_size);
+	fclose(bench_out);
+	bench_out = stdout;
+
+	comms_sendb(fd[0], CLIENT_DISCONNECT);
+	pthread_join(thread, NULL);
+	fflush(stdout);
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+	close(null_fd);
+	close(fd[0]);
+	close(fd[1]);
+
+	region_close();
+	if(chdir(cwd) == -1)
+		die_errno("Error: chdir(): ");
+	bench_scratch_remove(scratch);
+}
+
+/*------------------------------------------------*/
+
+static void bench_memcpy(const char *name, uint64 size)
+{
+	uint64 ops = bench_count(size);
+	uint8 *source = new uint8 [size];
+	uint8 *destination = new uint8 [size];
+	struct bench_mark mark;
+
+	if(!bench_wanted(name))
+	{
+		delete []source;
+		delete []destination;
+		return;
+	}
+
+	/* Warm both buffers into the cache first */
+	memset(source, 0x5A, size);
+	memset(destination, 0, size);
+
+	bench_start(&mark);
+	for(uint64 i = 0; i < ops; i++)
+	{
+		memcpy(destination, source, size);
+		source[i % size] = (uint8)i;
+	}
+	bench_stop(name, size, ops, &mark);
+
+	/* Keep the copies from being optimised away */
+	if(destination[0] == 0xFF && destination[size - 1] == 0xFE)
+		printf(" ");
+	delete []source;
+	delete []destination;
+}
+
+/*------------------------------------------------*/
+
+int run_bench(int argc, char *argv[])
+{
+	static const uint64 block_sizes[] = { 1, 8, 64, 4096, 65536 };
+	static const uint64 copy_sizes[] = { 64, 512, 4096, 65536, 1048576 };
+	int index;
+
+	if((index = find_option(argc, argv, "-ops")) != -1 && index + 1 < argc)
+		bench_ops = MAX(strtoull(argv[index + 1], NULL, 0), 1);
+	if((index = find_option(argc, argv, "-only")) != -1 && index + 1 < argc)
+		bench_only = argv[index + 1];
+
+	bench_out = stdout;
+	printf("%-22s %10s %10s %12s %12s %12s\n", "case", "bytes", "ops", "ns/op", "syscalls/op", "MB/s");
+
+	for(int i = 0; i < (int)(sizeof(block_sizes) / sizeof(block_sizes[0])); i++)
+		bench_transfer("socketpair read/write", false, BENCH_SEND_BLOCK, block_sizes[i]);
+	for(int i = 0; i < (int)(sizeof(block_sizes) / sizeof(block_sizes[0])); i++)
+		bench_transfer("pipe read/write", true, BENCH_SEND_BLOCK, block_sizes[i]);
+	bench_transfer("comms sendb/getb", false, BENCH_SEND_BYTE, 1);
+	bench_transfer("comms sendq/getq", false, BENCH_SEND_QWORD, PTR_SIZE);
+
+	bench_dispatch_cases(argc, argv);
+
+	for(int i = 0; i < (int)(sizeof(copy_sizes) / sizeof(copy_sizes[0])); i++)
+		bench_memcpy("memcpy", copy_sizes[i]);
+
+	return 0;
+}
+
+/* End */
@@ -0,0 +1,7 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/* Function prototypes */
+int run_bench(int argc, char *argv[]);
+
+#endif /* _BENCH_H_ */
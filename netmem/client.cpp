@@ -10,25 +10,80 @@
 */
 
 #include "shared.h"
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <map>
 using namespace std;
 
 #define DEFAULT_CLIENT_PAGE_SIZE    0x1000
 #define DEFAULT_CLIENT_MEMORY_SIZE  0x10000
+#define CLIENT_RETRY_MS             50      /* First reconnect delay, doubled per attempt */
+#define CLIENT_RETRY_MAX_MS         2000
+#define CLIENT_SHARD_REFRESH_MS     1000    /* Shard map is fetched again this often */
 
 int client_page_mask;
 int client_offs_mask;
-int client_page_size = CLIENT_PAGE_SIZE;
 void *client_region_base;
 size_t client_region_size;
 struct sigaction action;
 int client_socket_fd;
 int sock;
 int seq;
+bool client_writeback = false;
+static char *client_hostname;
+static int client_port;
+static uint64_t client_session = 0;     /* Kept across reconnects */
+
+/*
+    Connections to the server. Lane 0 carries faults; with more than one
+    lane, syncs and write-behind are striped over the others by page so
+    a large sync never queues in front of a fault and bulk transfers get
+    a congestion window per lane. A page always uses the same lane, so
+    its syncs stay in order. Syncs are not acknowledged, so one sent on
+    a bulk lane is followed by an empty read and the kernel only hears
+    back once the server has applied it; a later fault cannot see the
+    old page.
+*/
+static int client_lane_count = 1;
+static int client_lane_fd[CLIENT_LANES_MAX];
+static pthread_mutex_t client_lane_mutex[CLIENT_LANES_MAX];
+
+/*
+    Optional replica for faults. A fault is read from the replica if it
+    is no more than -maxlag behind the primary, and from the primary
+    otherwise. Pages this client synced within that bound (plus the
+    write-behind delay) always come from the primary, so the client
+    reads its own writes.
+*/
+static char client_replica_host[256];
+static int client_replica_port = 0;
+static int client_replica_fd = -1;
+static uint64_t client_replica_retry_ms = 0;    /* Redial no sooner than this */
+static uint64_t client_max_lag_ms = REPLICA_MAX_LAG_MS;
+static uint64_t client_own_write_ms = REPLICA_MAX_LAG_MS;
+static map<uint64_t, uint64_t> client_synced_ms;    /* Page -> when this client last synced it */
+static pthread_mutex_t client_replica_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+    Shard map of a region split over several servers, fetched on every
+    attach and again after CLIENT_SHARD_REFRESH_MS. Faults, syncs and
+    write-behind runs go straight to the page's owner over one connection
+    per node; pages of the node lane 0 is on use the lanes. Faults and
+    syncs that reach the wrong node, through an old map or a lost node
+    connection, are forwarded by the server. Range writes are not: the
+    server refuses them, and write-behind reports it at the next barrier.
+*/
+static struct nm_shard_map client_shard_map;
+static int client_shard_self = -1;      /* Node the lanes are connected to */
+static int client_shard_fd[SHARD_NODES_MAX];
+static uint64_t client_shard_retry_ms[SHARD_NODES_MAX];
+static pthread_mutex_t client_shard_mutex[SHARD_NODES_MAX];
+static pthread_mutex_t client_shard_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t client_shard_fetched_ms = 0;
 
 void page_request_callback(uint64_t page_offset);
 void page_sync_request_callback(uint64_t page_offset, uint8_t *page);
-bool nm_client_request_page(int client_socket_fd, uint64_t value, uint8_t *buffer);
-bool nm_client_request_sync(int client_socket_fd, uint64_t value, uint8_t *buffer);
+void sync_barrier_callback(void);
 
 static struct cb_id cn_nmmap_id = { CN_NETLINK_USERS + 3, 0x456 };
 
@@ -84,6 +139,10 @@ void handle_response(struct cn_msg *msg) {
             recv_data2 = (uint8_t *)calloc(CLIENT_PAGE_SIZE, sizeof(uint8_t));
             memcpy(recv_data2, &msg->data[1 + PAGE_OFFSET_SIZE], CLIENT_PAGE_SIZE);
             page_sync_request_callback(*((uint64_t *)recv_data), recv_data2);
+            break;
+        case REQUEST_SYNC_BARRIER:
+            sync_barrier_callback();
+            break;
     }
 }
 
@@ -94,8 +153,26 @@ void page_sync_request_callback(uint64_t page_offset, uint8_t *page) {
 
     response_data = (uint8_t *)calloc((int)SYNC_RESPONSE_SIZE, sizeof(uint8_t));
 
-    printf("Synchronizing page: %016llX\n", page_offset);
-    ret = nm_client_request_sync(client_socket_fd, page_offset, (uint8_t *)page);
+    printf("Synchronizing page: %016llX\n", (unsigned long long)page_offset);
+    if (client_writeback) {
+        /* Acknowledge once queued; the flusher sends it later */
+        ret = writeback_queue(page_offset, page);
+    } else if (client_shard_request(page_offset, page, true)) {
+        ret = true;
+    } else {
+        int lane = client_lane(page_offset);
+        int socket_fd = client_lane_lock(lane);
+        do {
+            ret = nm_client_request_sync(socket_fd, page_offset, (uint8_t *)page);
+            /* A fault on lane 0 could overtake it; an empty read marks it applied */
+            if (lane != CLIENT_LANE_FAULT) {
+                ret = nm_client_read_range(socket_fd, 0, 0, page);
+            }
+        } while (client_connection_lost(lane));
+        client_lane_unlock(lane);
+    }
+    manifest_update(page_offset, page);
+    client_replica_synced(page_offset);
 
     msg = (struct cn_msg *)calloc(sizeof(struct cn_msg) + SYNC_RESPONSE_SIZE, sizeof(uint8_t));
     msg->id = cn_nmmap_id;
@@ -111,6 +188,23 @@ void page_sync_request_callback(uint64_t page_offset, uint8_t *page) {
     netlink_send(msg);
 }
 
+/* msync(MS_SYNC): reply once every page synced so far is on the server */
+void sync_barrier_callback(void) {
+    struct cn_msg *msg;
+    bool ret = true;
+
+    printf("Sync barrier\n");
+    if (client_writeback) {
+        ret = writeback_barrier();
+    }
+
+    msg = (struct cn_msg *)calloc(sizeof(struct cn_msg) + SYNC_RESPONSE_SIZE, sizeof(uint8_t));
+    msg->id = cn_nmmap_id;
+    msg->len = SYNC_RESPONSE_SIZE;
+    msg->data[0] = ret ? RESPONSE_PAGE_SYNC_OK : RESPONSE_PAGE_SYNC_ERR;
+    netlink_send(msg);
+}
+
 void page_request_callback(uint64_t page_offset) {
     struct cn_msg *msg;
     uint8_t *response_data;
@@ -119,8 +213,18 @@ void page_request_callback(uint64_t page_offset) {
     response_data = (uint8_t *)calloc((int)PAGE_RESPONSE_SIZE, sizeof(uint8_t));
     page = (uint8_t *)calloc((int)CLIENT_PAGE_SIZE, sizeof(uint8_t));
 
-    printf("Recieved request address: %016llX\n", page_offset);
-    nm_client_request_page(client_socket_fd, page_offset, (uint8_t *)page);
+    printf("Recieved request address: %016llX\n", (unsigned long long)page_offset);
+    if ((!client_writeback || !writeback_lookup(page_offset, page)) &&
+        !manifest_lookup(page_offset, page)) {
+        if (!client_replica_read(page_offset, page) && !client_shard_request(page_offset, page, false)) {
+            client_lane_lock(CLIENT_LANE_FAULT);
+            do {
+                nm_client_request_page(client_socket_fd, page_offset, (uint8_t *)page);
+            } while (client_connection_lost(CLIENT_LANE_FAULT));
+            client_lane_unlock(CLIENT_LANE_FAULT);
+        }
+        manifest_record(page_offset, page);
+    }
     response_data[0] = RESPONSE_PAGE_OK;
     memcpy(&response_data[1], page, CLIENT_PAGE_SIZE);
 
@@ -132,94 +236,405 @@ void page_request_callback(uint64_t page_offset) {
     netlink_send(msg);
 }
 
-/* Client-side functions */
+/* Open a connection to a server; -1 if it cannot be reached */
+static int client_dial(const char *hostname, int port) {
+    int socket_fd;
+    struct sockaddr_in server_addr;
+
+    /* Open client socket */
+    printf("- Status: Opening client socket\n");
+    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        die_errno("Error: socket(): ");
+    }
 
-bool nm_client_connect(uint64_t page_size, uint64_t memory_size) {
-    /* Send command and parameters */
-    comms_sendb(client_socket_fd, CLIENT_CONNECT);
-    comms_sendq(client_socket_fd, page_size);
-    comms_sendq(client_socket_fd, memory_size);
+    /* Get server address from IP string */
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, hostname, &server_addr.sin_addr.s_addr);
+    printf("- Connecting to server socket (hostname=%s, port=%d)\n", hostname, port);
 
-    /* Get status */
-    uint8_t status = comms_getb(client_socket_fd);
+    /* Establish connection */
+    if (connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        perror("connect");
+        close(socket_fd);
+        return -1;
+    }
 
-    /* Return status */
-    return (status == NM_RESPONSE_ACK) ? true : false;
+    return socket_fd;
 }
 
-void nm_client_disconnect(void) {
-    comms_sendb(client_socket_fd, CLIENT_DISCONNECT);
+static uint64_t client_now_ms(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
 }
 
-bool nm_client_request_sync(int client_socket_fd, uint64_t value, uint8_t *buffer) {
-    /* Send page request command to server */
-    comms_sendb(client_socket_fd, REQUEST_PAGE_SYNC);
+/* Take the shard map from the lane 0 server; caller holds lane 0 */
+static void client_shard_fetch(void) {
+    struct nm_shard_map *map = new struct nm_shard_map;
 
-    /* Send offset */
-    comms_sendq(client_socket_fd, value);
+    if (nm_client_shard_map(client_socket_fd, map)) {
+        pthread_mutex_lock(&client_shard_map_mutex);
+        if (map->epoch != client_shard_map.epoch || map->node_count != client_shard_map.node_count) {
+            printf("- Shard map epoch %llu, %d node(s)\n", (unsigned long long)map->epoch, map->node_count);
+        }
+        client_shard_map = *map;
+        client_shard_self = -1;
+        for (int i = 0; i < map->node_count; i++) {
+            if (map->nodes[i].port == client_port && !strcmp(map->nodes[i].host, client_hostname)) {
+                client_shard_self = i;
+            }
+        }
+        client_shard_fetched_ms = client_now_ms();
+        pthread_mutex_unlock(&client_shard_map_mutex);
+    }
+    delete map;
+}
+
+/* Start or resume the session, then bring the working set back */
+static bool client_attach(void) {
+    bool resumed = false;
+
+    if (!nm_client_resume(client_socket_fd, &client_session, DEFAULT_CLIENT_PAGE_SIZE,
+                          DEFAULT_CLIENT_MEMORY_SIZE, &resumed) || socket_error_check()) {
+        return false;
+    }
+    printf("- %s session %016llX\n", resumed ? "Resumed" : "Started", (unsigned long long)client_session);
+
+    manifest_warm(client_socket_fd, DEFAULT_CLIENT_MEMORY_SIZE, resumed);
+    client_shard_fetch();
+    return !socket_error_check();
+}
+
+/* Bind a bulk lane to the session; it is scheduled behind faults */
+static bool client_join(int lane) {
+    int socket_fd = client_lane_fd[lane];
 
-    /* Read page from server over network */
-    comms_send(client_socket_fd, buffer, client_page_size);
+    if (!nm_client_join(socket_fd, client_session) || socket_error_check()) {
+        return false;
+    }
+    nm_client_qos_config(socket_fd, QOS_CLASS_BULK, 0);
+    return !socket_error_check();
+}
+
+/* Open a lane again on the same socket number; caller holds the lane */
+static bool client_reconnect(int lane) {
+    int socket_fd = client_dial(client_hostname, client_port);
+
+    if (socket_fd == -1) {
+        return false;
+    }
+    dup2(socket_fd, client_lane_fd[lane]);
+    close(socket_fd);
+
+    if (lane == CLIENT_LANE_FAULT) {
+        return client_attach();
+    }
+    if (client_join(lane)) {
+        return true;
+    }
+
+    /* Session is gone, e.g. the server restarted; make a new one first */
+    client_lane_lock(CLIENT_LANE_FAULT);
+    bool attached = client_reconnect(CLIENT_LANE_FAULT);
+    client_lane_unlock(CLIENT_LANE_FAULT);
+
+    return attached && client_join(lane);
+}
+
+/* Lane a page's syncs and write-behind go on */
+int client_lane(uint64_t page_offset) {
+    if (client_lane_count == 1) {
+        return CLIENT_LANE_FAULT;
+    }
+    return 1 + (int)((page_offset / CLIENT_PAGE_SIZE) % (client_lane_count - 1));
+}
+
+/* Take a lane for a request; returns its socket */
+int client_lane_lock(int lane) {
+    pthread_mutex_lock(&client_lane_mutex[lane]);
+    return client_lane_fd[lane];
+}
+
+void client_lane_unlock(int lane) {
+    pthread_mutex_unlock(&client_lane_mutex[lane]);
+}
+
+/*
+    Call with the lane held after each request. If the request failed
+    because the connection dropped, reconnect on the same socket number
+    and return true so the caller sends the request again.
+*/
+bool client_connection_lost(int lane) {
+    int attempt = 0;
+
+    if (!socket_error_check()) {
+        return false;
+    }
+
+    printf("- Lost connection %d to server, reconnecting\n", lane);
+    while (!client_reconnect(lane)) {
+        usleep(min(CLIENT_RETRY_MAX_MS, CLIENT_RETRY_MS << min(attempt, 6)) * 1000);
+        attempt++;
+    }
 
     return true;
 }
 
-bool nm_client_request_page(int client_socket_fd, uint64_t value, uint8_t *buffer) {
-    uint8 status = NM_RESPONSE_ACK;
+/* Note a page this client wrote; it is read from the primary for a while */
+void client_replica_synced(uint64_t page_offset) {
+    if (!client_replica_port) {
+        return;
+    }
+    pthread_mutex_lock(&client_replica_mutex);
+    client_synced_ms[page_offset] = client_now_ms();
+    pthread_mutex_unlock(&client_replica_mutex);
+}
+
+/* Read a fault from the replica; false if it must go to the primary instead */
+bool client_replica_read(uint64_t page_offset, uint8_t *page) {
+    bool read = false;
+
+    if (!client_replica_port) {
+        return false;
+    }
+
+    pthread_mutex_lock(&client_replica_mutex);
+    uint64_t now = client_now_ms();
+    map<uint64_t, uint64_t>::iterator synced = client_synced_ms.find(page_offset);
+    if (synced != client_synced_ms.end()) {
+        if (now - synced->second < client_own_write_ms) {
+            pthread_mutex_unlock(&client_replica_mutex);
+            return false;
+        }
+        client_synced_ms.erase(synced);
+    }
+
+    /* A lost replica is dialled again after a pause; the primary serves meanwhile */
+    if (client_replica_fd == -1 && now >= client_replica_retry_ms) {
+        client_replica_fd = client_dial(client_replica_host, client_replica_port);
+        if (client_replica_fd != -1 &&
+            (!nm_client_connect(client_replica_fd, DEFAULT_CLIENT_PAGE_SIZE, DEFAULT_CLIENT_MEMORY_SIZE) ||
+             socket_error_check())) {
+            close(client_replica_fd);
+            client_replica_fd = -1;
+        }
+        if (client_replica_fd == -1) {
+            client_replica_retry_ms = now + CLIENT_RETRY_MAX_MS;
+        }
+    }
+
+    if (client_replica_fd != -1) {
+        read = nm_client_request_page_bounded(client_replica_fd, page_offset, client_max_lag_ms, page);
+        if (socket_error_check()) {
+            printf("- Lost replica, reading from the primary\n");
+            close(client_replica_fd);
+            client_replica_fd = -1;
+            client_replica_retry_ms = now + CLIENT_RETRY_MAX_MS;
+            read = false;
+        }
+    }
+    pthread_mutex_unlock(&client_replica_mutex);
+
+    return read;
+}
+
+/* Node to send a page's faults and syncs to, or -1 for the lanes */
+int client_shard_node(uint64_t page_offset) {
+    pthread_mutex_lock(&client_shard_map_mutex);
+    if (!client_shard_map.node_count) {
+        pthread_mutex_unlock(&client_shard_map_mutex);
+        return -1;
+    }
+
+    /* Refresh now and then; one caller does it while the rest use the old map */
+    uint64_t now = client_now_ms();
+    bool refresh = (now - client_shard_fetched_ms >= CLIENT_SHARD_REFRESH_MS);
+    if (refresh) {
+        client_shard_fetched_ms = now;
+    }
+    pthread_mutex_unlock(&client_shard_map_mutex);
+
+    if (refresh) {
+        client_lane_lock(CLIENT_LANE_FAULT);
+        client_shard_fetch();
+        client_connection_lost(CLIENT_LANE_FAULT);
+        client_lane_unlock(CLIENT_LANE_FAULT);
+    }
+
+    pthread_mutex_lock(&client_shard_map_mutex);
+    int node = nm_client_shard_owner(&client_shard_map, page_offset);
+    if (node == client_shard_self) {
+        node = -1;
+    }
+    pthread_mutex_unlock(&client_shard_map_mutex);
+
+    return node;
+}
+
+/* Take the connection to a node, dialling it if need be; -1 while it cannot be reached */
+int client_shard_lock(int node) {
+    pthread_mutex_lock(&client_shard_map_mutex);
+    struct nm_shard_node address = client_shard_map.nodes[node];
+    pthread_mutex_unlock(&client_shard_map_mutex);
+
+    pthread_mutex_lock(&client_shard_mutex[node]);
+    uint64_t now = client_now_ms();
+    if (client_shard_fd[node] == -1 && now >= client_shard_retry_ms[node]) {
+        client_shard_fd[node] = client_dial(address.host, address.port);
+        if (client_shard_fd[node] != -1) {
+            int nodelay = 1;
+            setsockopt(client_shard_fd[node], IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            if (!nm_client_attach(client_shard_fd[node], DEFAULT_CLIENT_PAGE_SIZE, DEFAULT_CLIENT_MEMORY_SIZE) ||
+                socket_error_check()) {
+                close(client_shard_fd[node]);
+                client_shard_fd[node] = -1;
+            }
+        }
+        if (client_shard_fd[node] == -1) {
+            client_shard_retry_ms[node] = now + CLIENT_RETRY_MAX_MS;
+        }
+    }
 
-    /* Send page request command to server */
-    comms_sendb(client_socket_fd, REQUEST_PAGE);
+    return client_shard_fd[node];
+}
 
-    /* Send offset */
-    comms_sendq(client_socket_fd, value);
+void client_shard_unlock(int node) {
+    pthread_mutex_unlock(&client_shard_mutex[node]);
+}
 
-    /* Send page if status is OK */
-    comms_get(client_socket_fd, buffer, client_page_size);
+/* Call with the node held after its requests; true if the connection dropped and was closed */
+bool client_shard_lost(int node) {
+    if (!socket_error_check()) {
+        return false;
+    }
 
+    printf("- Lost shard node %d, using the lanes\n", node);
+    close(client_shard_fd[node]);
+    client_shard_fd[node] = -1;
+    client_shard_retry_ms[node] = client_now_ms() + CLIENT_RETRY_MAX_MS;
     return true;
 }
 
+/* Fault or sync a page on the node that owns it; false to use the lanes */
+bool client_shard_request(uint64_t page_offset, uint8_t *page, bool sync) {
+    bool done = false;
+    int node = client_shard_node(page_offset);
+
+    if (node == -1) {
+        return false;
+    }
+
+    int socket_fd = client_shard_lock(node);
+    if (socket_fd != -1) {
+        if (sync) {
+            done = nm_client_request_sync(socket_fd, page_offset, page);
+        } else {
+            done = nm_client_request_page(socket_fd, page_offset, page);
+        }
+        if (client_shard_lost(node)) {
+            done = false;
+        }
+    }
+    client_shard_unlock(node);
+
+    return done;
+}
 
 int run_client(char *hostname, int port, int argc, char *argv[]) {
     int status;
     int len;
-    struct sockaddr_in server_addr;
-    struct hostent *server;
     struct sockaddr_nl l_local;
     struct nlmsghdr *reply;
     struct cn_msg *data;
     char *buf = (char *)calloc((int)MAX_RECV_SIZE, sizeof(uint8_t));
     bool running = true;
+    int result = 0;
+    int wb_pages = WRITEBACK_MAX_PAGES;
+    int wb_age = WRITEBACK_MAX_AGE;
+    int index;
+
+    /* Write-behind options */
+    client_writeback = (find_option(argc, argv, "-writeback") != -1);
+    if ((index = find_option(argc, argv, "-wbpages")) != -1 && index + 1 < argc) {
+        wb_pages = atoi(argv[index + 1]);
+    }
+    if ((index = find_option(argc, argv, "-wbage")) != -1 && index + 1 < argc) {
+        wb_age = atoi(argv[index + 1]);
+    }
 
-    seq = 0;
+    /* Parallel connections; faults get one to themselves */
+    if ((index = find_option(argc, argv, "-connections")) != -1 && index + 1 < argc) {
+        client_lane_count = max(1, min(atoi(argv[index + 1]), CLIENT_LANES_MAX));
+    }
 
-    /* Open client socket */
-    printf("- Status: Opening client socket\n");
-    client_socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if(client_socket_fd == -1) {
-        die_errno("Error: socket(): ");
+    /* Faults may be read from a replica, writes always go to the primary */
+    if ((index = find_option(argc, argv, "-maxlag")) != -1 && index + 1 < argc) {
+        client_max_lag_ms = strtoull(argv[index + 1], NULL, 0);
     }
+    if ((index = find_option(argc, argv, "-replica")) != -1 && index + 1 < argc) {
+        char *colon = strrchr(argv[index + 1], ':');
+        if (!colon || colon - argv[index + 1] >= (int)sizeof(client_replica_host)) {
+            die("Error: -replica needs host:port.\n");
+        }
+        memcpy(client_replica_host, argv[index + 1], colon - argv[index + 1]);
+        client_replica_port = atoi(colon + 1);
+    }
+    client_own_write_ms = client_max_lag_ms + (client_writeback ? wb_age : 0);
 
-    /* Get server address from IP string */
-    server = gethostbyname(hostname);
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, hostname, &server_addr.sin_addr.s_addr);
-    printf("- Connecting to server socket (hostname=%s, port=%d)\n", hostname, port);
+    /* Record requests for later replay */
+    trace_setup(argc, argv, TRACE_SOURCE_CLIENT);
 
-    /* Establish connection */
-    status = connect(client_socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
-    if (status == -1) {
-        die_errno("Error: connect(): ");
+    /* Hot pages are listed here and fetched in bulk on every connect */
+    if ((index = find_option(argc, argv, "-manifest")) != -1 && index + 1 < argc) {
+        manifest_start(argv[index + 1]);
+    } else {
+        manifest_start(MANIFEST_FILENAME);
     }
 
+    seq = 0;
+    client_hostname = hostname;
+    client_port = port;
 
-    if (!nm_client_connect(DEFAULT_CLIENT_PAGE_SIZE, DEFAULT_CLIENT_MEMORY_SIZE)) {
-        printf("Error: nm_client_connect():\n");
+    /* A dropped connection is noticed by the caller and reconnected */
+    socket_error_mode(SOCKET_ERRORS_RETURN);
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int node = 0; node < SHARD_NODES_MAX; node++) {
+        client_shard_fd[node] = -1;
+        client_shard_retry_ms[node] = 0;
+        pthread_mutex_init(&client_shard_mutex[node], NULL);
+    }
+    for (int lane = 0; lane < client_lane_count; lane++) {
+        pthread_mutex_init(&client_lane_mutex[lane], NULL);
+        client_lane_fd[lane] = client_dial(client_hostname, client_port);
+        if (client_lane_fd[lane] == -1) {
+            die("Error: connect(): Cannot reach server\n");
+        }
+    }
+    client_socket_fd = client_lane_fd[CLIENT_LANE_FAULT];
+
+    if (!client_attach()) {
+        printf("Error: nm_client_resume():\n");
         return -1;
     }
 
+    /* Faults skip Nagle and go ahead of any bulk traffic on the server */
+    if (client_lane_count > 1) {
+        int nodelay = 1;
+        setsockopt(client_socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        nm_client_qos_config(client_socket_fd, QOS_CLASS_DEMAND, 0);
+    }
+    for (int lane = 1; lane < client_lane_count; lane++) {
+        if (!client_join(lane)) {
+            printf("Error: nm_client_join():\n");
+            return -1;
+        }
+    }
+    printf("- Connected with %d lane(s)\n", client_lane_count);
+
     sock = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
     if (sock == -1) {
         perror("socket");
@@ -240,13 +655,18 @@ int run_client(char *hostname, int port, int argc, char *argv[]) {
     // We are now connected to the server and the kernel netlink
     //======================================================================
 
+    /* From here on every exit goes through the drain below */
+    if (client_writeback) {
+        writeback_start(wb_pages, wb_age);
+    }
+
     while (running) {
         memset(buf, 0, MAX_RECV_SIZE);
         len = recv(sock, buf, MAX_RECV_SIZE, 0);
         if (len == -1) {
             perror("recv buf");
-            close(sock);
-            return -1;
+            result = -1;
+            break;
         }
 
         reply = (struct nlmsghdr *)buf;
@@ -267,16 +687,37 @@ int run_client(char *hostname, int port, int argc, char *argv[]) {
     // Finished
     //----------------------------------------------------------------------
 
+    /* Push out anything still queued before leaving */
+    if (client_writeback) {
+        writeback_stop();
+    }
+
     /* Send disconnect command */
-    nm_client_disconnect();
+    for (int node = 0; node < SHARD_NODES_MAX; node++) {
+        if (client_shard_fd[node] != -1) {
+            nm_client_disconnect(client_shard_fd[node]);
+            close(client_shard_fd[node]);
+        }
+    }
+    if (client_replica_fd != -1) {
+        nm_client_disconnect(client_replica_fd);
+        close(client_replica_fd);
+    }
+    for (int lane = client_lane_count - 1; lane >= 0; lane--) {
+        nm_client_disconnect(client_lane_fd[lane]);
+    }
+    trace_close();
+    manifest_save();
 
-    /* Close client socket */
+    /* Close client sockets */
     puts("- Closing client socket");
-    status = close(client_socket_fd);
-    if (status == -1) {
-        die_errno("Error: close(): ");
+    for (int lane = client_lane_count - 1; lane >= 0; lane--) {
+        status = close(client_lane_fd[lane]);
+        if (status == -1) {
+            die_errno("Error: close(): ");
+        }
     }
 
     close(sock);
-    return 0;
+    return result;
 }
@@ -1,8 +1,21 @@
 #ifndef _CLIENT_H_
 #define _CLIENT_H_
 
+#define CLIENT_LANES_MAX    16      /* Connections to the server per client */
+#define CLIENT_LANE_FAULT   0       /* Lane reserved for page faults */
+
 /* Function prototypes */
 int run_client(char *hostname, int port, int argc, char *argv[]);
+int client_lane(uint64_t page_offset);
+int client_lane_lock(int lane);
+void client_lane_unlock(int lane);
+bool client_connection_lost(int lane);
+void client_replica_synced(uint64_t page_offset);
+bool client_replica_read(uint64_t page_offset, uint8_t *page);
+int client_shard_node(uint64_t page_offset);
+int client_shard_lock(int node);
+void client_shard_unlock(int node);
+bool client_shard_lost(int node);
+bool client_shard_request(uint64_t page_offset, uint8_t *page, bool sync);
 
 #endif /* _CLIENT_H_ */
-
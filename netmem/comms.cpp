@@ -27,6 +27,18 @@ void comms_send(int client_socket_fd, uint8 *buffer, int length)
 		);
 }
 
+/* Discard bytes of a request that will not be used */
+void comms_skip(int client_socket_fd, uint64 length)
+{
+	uint8 buffer[0x1000];
+	while(length)
+	{
+		int chunk = MIN(length, sizeof(buffer));
+		comms_get(client_socket_fd, buffer, chunk);
+		length -= chunk;
+	}
+}
+
 /* Send byte */
 void comms_sendb(int client_socket_fd, uint8 value)
 {
@@ -39,7 +51,7 @@ void comms_sendb(int client_socket_fd, uint8 value)
 uint8 comms_getb(int client_socket_fd)
 {
 	int transferred;
-	uint8 buffer[1];
+	uint8 buffer[1] = { 0 };	/* Reads as zero if the socket failed */
 	read_socket_blocking(client_socket_fd, buffer, 1, transferred);
 	return buffer[0];
 }
@@ -59,11 +71,33 @@ void comms_sendq(int client_socket_fd, uint64 value)
 /* Get 64-bit quantity */
 uint64_t comms_getq(int client_socket_fd)
 {
-	uint8 buffer[PTR_SIZE];
+	uint8 buffer[PTR_SIZE] = { 0 };
 	int transferred;
 	read_socket_blocking(client_socket_fd, buffer, PTR_SIZE, transferred);
 
 	return *(uint64 *)&buffer[0];
 }
 
+/* Non-blocking transfers for sockets driven by the reactor */
+
+/* Read what is available; returns bytes read, 0 if none yet, -1 if closed */
+int comms_try_get(int client_socket_fd, uint8 *buffer, int length)
+{
+	int count = read(client_socket_fd, buffer, length);
+
+	if(count == 0)
+		return -1;
+	if(count == -1)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	return count;
+}
+
+/* Send what fits; returns bytes sent, 0 if the socket is full, -1 on error */
+int comms_try_send(int client_socket_fd, uint8 *buffer, int length)
+{
+	int count = send(client_socket_fd, buffer, length, MSG_NOSIGNAL);
 
+	if(count == -1)
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	return count;
+}
@@ -4,6 +4,7 @@
 /* Function prototypes */
 void comms_get(int client_socket_fd, uint8 *buffer, int length);
 void comms_send(int client_socket_fd, uint8 *buffer, int length);
+void comms_skip(int client_socket_fd, uint64 length);
 
 void comms_sendb(int client_socket_fd, uint8 value);
 uint8 comms_getb(int client_socket_fd);
@@ -11,6 +12,9 @@ uint8 comms_getb(int client_socket_fd);
 void comms_sendq(int client_socket_fd, uint64 value);
 uint64_t comms_getq(int client_socket_fd);
 
+int comms_try_get(int client_socket_fd, uint8 *buffer, int length);
+int comms_try_send(int client_socket_fd, uint8 *buffer, int length);
+
 
 #endif /* _UTIL_H_ */
 
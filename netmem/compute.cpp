@@ -0,0 +1,473 @@
+/*
+	File:
+		compute.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Near-data operations on shared memory. Instead of faulting a range
+		in, working on it locally and syncing it back, a client asks the
+		server to fill, move, compare or search the range and only a small
+		result crosses the network.
+
+		The kernels use AVX2 when the CPU has it and fall back to plain
+		code otherwise; both give identical results. Like a range write,
+		an operation spanning pages is not atomic with respect to other
+		clients writing the same range.
+*/
+
+#include "shared.h"
+#include <immintrin.h>
+
+static uint64 compute_count[4];		/* Requests per operation */
+static uint64 compute_bytes[4];		/* Bytes of shared memory they covered */
+
+enum {
+	COMPUTE_FILL,
+	COMPUTE_MOVE,
+	COMPUTE_COMPARE,
+	COMPUTE_FIND
+};
+
+static const char *compute_names[4] = { "fill", "move", "compare", "find" };
+
+static bool compute_avx2(void)
+{
+#if defined(__x86_64__)
+	static int avx2 = -1;
+	if(avx2 == -1)
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return avx2 ? true : false;
+#else
+	return false;
+#endif
+}
+
+static void compute_account(int operation, uint64 length)
+{
+	__atomic_fetch_add(&compute_count[operation], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&compute_bytes[operation], length, __ATOMIC_RELAXED);
+}
+
+/*------------------------------------------------*/
+
+#if defined(__x86_64__)
+/* Pattern length divides 32; store one 32-byte block over and over */
+__attribute__((target("avx2")))
+static uint64 compute_fill_avx2(uint8 *buffer, uint64 length, const uint8 *block)
+{
+	__m256i value = _mm256_loadu_si256((const __m256i *)block);
+	uint64 i = 0;
+
+	for(; i + 32 <= length; i += 32)
+		_mm256_storeu_si256((__m256i *)(buffer + i), value);
+	return i;
+}
+#endif
+
+/*
+	Fill a buffer with a repeating pattern; phase is how far into the
+	pattern the buffer starts.
+*/
+void compute_fill(uint8 *buffer, uint64 length, const uint8 *pattern, uint64 pattern_length, uint64 phase)
+{
+	uint64 done = 0;
+
+	if(pattern_length == 1)
+	{
+		memset(buffer, pattern[0], length);
+		return;
+	}
+
+#if defined(__x86_64__)
+	if(compute_avx2() && !(32 % pattern_length))
+	{
+		uint8 block[32];
+
+		for(int i = 0; i < 32; i++)
+			block[i] = pattern[(phase + i) % pattern_length];
+		done = compute_fill_avx2(buffer, length, block);
+		phase += done;
+	}
+#endif
+
+	/* One period by hand, then copy what is already filled */
+	uint64 period = MIN(length - done, pattern_length);
+	for(uint64 i = 0; i < period; i++)
+		buffer[done + i] = pattern[(phase + i) % pattern_length];
+	for(uint64 filled = period; filled < length - done; filled *= 2)
+		memcpy(buffer + done + filled, buffer + done, MIN(filled, length - done - filled));
+}
+
+/*------------------------------------------------*/
+
+static uint64 compute_mismatch_software(const uint8 *a, const uint8 *b, uint64 i, uint64 length)
+{
+	for(; i + 8 <= length; i += 8)
+	{
+		uint64 diff = *(const uint64 *)(a + i) ^ *(const uint64 *)(b + i);
+		if(diff)
+			return i + __builtin_ctzll(diff) / 8;
+	}
+	for(; i < length; i++)
+	{
+		if(a[i] != b[i])
+			return i;
+	}
+	return length;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static uint64 compute_mismatch_avx2(const uint8 *a, const uint8 *b, uint64 length)
+{
+	uint64 i = 0;
+
+	for(; i + 32 <= length; i += 32)
+	{
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		uint32_t equal = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+
+		if(equal != 0xFFFFFFFF)
+			return i + __builtin_ctz(~equal);
+	}
+	return compute_mismatch_software(a, b, i, length);
+}
+#endif
+
+/* Index of the first byte that differs, or length if the buffers match */
+uint64 compute_mismatch(const uint8 *a, const uint8 *b, uint64 length)
+{
+#if defined(__x86_64__)
+	if(compute_avx2())
+		return compute_mismatch_avx2(a, b, length);
+#endif
+	return compute_mismatch_software(a, b, 0, length);
+}
+
+/*------------------------------------------------*/
+
+static uint64 compute_find_software(const uint8 *data, uint64 from, uint64 starts,
+	const uint8 *pattern, uint64 pattern_length, uint64 *matches, uint64 max)
+{
+	uint64 found = 0;
+
+	while(from < starts && found < max)
+	{
+		const uint8 *next = (const uint8 *)memchr(data + from, pattern[0], starts - from);
+		if(!next)
+			break;
+		from = next - data;
+		if(!memcmp(next, pattern, pattern_length))
+			matches[found++] = from;
+		from++;
+	}
+	return found;
+}
+
+#if defined(__x86_64__)
+/*
+	Compare the first and last byte of the pattern at 32 positions at a
+	time; only positions where both match are checked in full.
+*/
+__attribute__((target("avx2")))
+static uint64 compute_find_avx2(const uint8 *data, uint64 starts,
+	const uint8 *pattern, uint64 pattern_length, uint64 *matches, uint64 max)
+{
+	__m256i first = _mm256_set1_epi8(pattern[0]);
+	__m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+	uint64 found = 0;
+	uint64 i = 0;
+
+	for(; i + 32 <= starts && found < max; i += 32)
+	{
+		__m256i head = _mm256_loadu_si256((const __m256i *)(data + i));
+		__m256i tail = _mm256_loadu_si256((const __m256i *)(data + i + pattern_length - 1));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+
+		while(mask && found < max)
+		{
+			uint64 at = i + __builtin_ctz(mask);
+			if(!memcmp(data + at, pattern, pattern_length))
+				matches[found++] = at;
+			mask &= mask - 1;
+		}
+	}
+	if(found < max)
+		found += compute_find_software(data, i, starts, pattern, pattern_length, &matches[found], max - found);
+	return found;
+}
+#endif
+
+/*
+	Find up to max occurrences of a pattern starting in the first starts
+	bytes of data; data must hold starts + pattern_length - 1 bytes.
+	Returns the number found, their indexes in matches.
+*/
+uint64 compute_find(const uint8 *data, uint64 starts, const uint8 *pattern, uint64 pattern_length, uint64 *matches, uint64 max)
+{
+#if defined(__x86_64__)
+	if(compute_avx2())
+		return compute_find_avx2(data, starts, pattern, pattern_length, matches, max);
+#endif
+	return compute_find_software(data, 0, starts, pattern, pattern_length, matches, max);
+}
+
+/*------------------------------------------------*/
+
+/* Check that a byte range lies entirely within shared memory */
+static bool compute_range_valid(uint64 offset, uint64 length)
+{
+	if(offset > (uint64)shared_memory_size)
+		return false;
+	if(length > (uint64)shared_memory_size - offset)
+		return false;
+	return true;
+}
+
+static void compute_reply(int client_socket_fd, uint64 value)
+{
+	uint8 response[1 + PTR_SIZE];
+
+	response[0] = RESPONSE_COMPUTE_OK;
+	*(uint64 *)&response[1] = value;
+	comms_send(client_socket_fd, response, sizeof(response));
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of first byte
+	qword - number of bytes
+	qword - pattern length (1 to COMPUTE_PATTERN_MAX)
+	bytes - pattern, repeated from the first byte of the range
+	Server responds with
+	byte  - RESPONSE_COMPUTE_OK, qword number of bytes filled
+	or
+	byte  - RESPONSE_COMPUTE_ERR if the range or pattern is invalid, or
+	        another node of a sharded region owns part of the range
+*/
+void command_fill(int client_socket_fd)
+{
+	uint8 pattern[COMPUTE_PATTERN_MAX];
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	uint64 pattern_length = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Range fill request, offset: %016llX, length: %lld, pattern: %lld\n",
+		offset, length, pattern_length);
+	trace_add(client_socket_fd, REQUEST_RANGE_FILL, offset, length);
+
+	if(pattern_length > COMPUTE_PATTERN_MAX)
+	{
+		socket_drop(client_socket_fd, "Pattern too long, dropping client.");
+		return;
+	}
+	if(!pattern_length)
+	{
+		comms_sendb(client_socket_fd, RESPONSE_COMPUTE_ERR);
+		return;
+	}
+	comms_get(client_socket_fd, pattern, pattern_length);
+
+	shard_serve_begin();
+	if(!compute_range_valid(offset, length) || !shard_owns(offset, length))
+	{
+		shard_serve_end();
+		comms_sendb(client_socket_fd, RESPONSE_COMPUTE_ERR);
+		return;
+	}
+
+	region_fill(offset, length, pattern, pattern_length);
+	shard_serve_end();
+	compute_account(COMPUTE_FILL, length);
+	compute_reply(client_socket_fd, length);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - source offset
+	qword - destination offset
+	qword - number of bytes; the ranges may overlap
+	Server responds with
+	byte  - RESPONSE_COMPUTE_OK, qword number of bytes moved
+	or
+	byte  - RESPONSE_COMPUTE_ERR if either range is outside shared memory
+	        or another node of a sharded region owns part of either
+*/
+void command_move(int client_socket_fd)
+{
+	uint8 buffer[COMPUTE_CHUNK];
+	uint64 source = comms_getq(client_socket_fd);
+	uint64 destination = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Range move request, source: %016llX, destination: %016llX, length: %lld\n",
+		source, destination, length);
+	trace_add(client_socket_fd, REQUEST_RANGE_MOVE, destination, length);
+
+	/* The source too; a copy nobody serves may be stale */
+	shard_serve_begin();
+	if(!compute_range_valid(source, length) || !compute_range_valid(destination, length) ||
+		!shard_owns(source, length) || !shard_owns(destination, length))
+	{
+		shard_serve_end();
+		comms_sendb(client_socket_fd, RESPONSE_COMPUTE_ERR);
+		return;
+	}
+
+	/* Copy backwards when the destination overlaps the end of the source */
+	bool backwards = (destination > source && destination < source + length);
+	for(uint64 done = 0; done < length; )
+	{
+		uint64 chunk = MIN(length - done, COMPUTE_CHUNK);
+		uint64 at = backwards ? length - done - chunk : done;
+
+		region_read(source + at, buffer, chunk);
+		region_write(destination + at, buffer, chunk);
+		done += chunk;
+	}
+	shard_serve_end();
+
+	compute_account(COMPUTE_MOVE, length);
+	compute_reply(client_socket_fd, length);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of the first range
+	qword - offset of the second range
+	qword - number of bytes
+	Server responds with
+	byte  - RESPONSE_COMPUTE_OK, qword index of the first byte that
+	        differs, or the number of bytes if the ranges are equal
+	or
+	byte  - RESPONSE_COMPUTE_ERR if either range is outside shared memory
+*/
+void command_compare(int client_socket_fd)
+{
+	uint8 a[COMPUTE_CHUNK];
+	uint8 b[COMPUTE_CHUNK];
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 other = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	uint64 done = 0;
+
+	/* Debug */
+	printf("* Range compare request, offset: %016llX, other: %016llX, length: %lld\n",
+		offset, other, length);
+	trace_add(client_socket_fd, REQUEST_RANGE_COMPARE, offset, length);
+
+	if(!compute_range_valid(offset, length) || !compute_range_valid(other, length))
+	{
+		comms_sendb(client_socket_fd, RESPONSE_COMPUTE_ERR);
+		return;
+	}
+
+	while(done < length)
+	{
+		uint64 chunk = MIN(length - done, COMPUTE_CHUNK);
+
+		region_read(offset + done, a, chunk);
+		region_read(other + done, b, chunk);
+		uint64 same = compute_mismatch(a, b, chunk);
+		done += same;
+		if(same < chunk)
+			break;
+	}
+
+	compute_account(COMPUTE_COMPARE, done);
+	compute_reply(client_socket_fd, done);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of first byte
+	qword - number of bytes to search
+	qword - maximum number of matches (at most COMPUTE_FIND_MAX)
+	qword - pattern length (1 to COMPUTE_PATTERN_MAX)
+	bytes - pattern
+	Server responds with
+	byte  - RESPONSE_COMPUTE_OK, qword number of matches, followed by
+	        the shared memory offset of each match in ascending order
+	or
+	byte  - RESPONSE_COMPUTE_ERR if the range or pattern is invalid
+*/
+void command_find(int client_socket_fd)
+{
+	uint8 pattern[COMPUTE_PATTERN_MAX];
+	uint8 buffer[COMPUTE_CHUNK + COMPUTE_PATTERN_MAX];
+	uint64 matches[COMPUTE_FIND_MAX];
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	uint64 max = comms_getq(client_socket_fd);
+	uint64 pattern_length = comms_getq(client_socket_fd);
+	uint64 found = 0;
+
+	max = MIN(max, COMPUTE_FIND_MAX);
+
+	/* Debug */
+	printf("* Range find request, offset: %016llX, length: %lld, pattern: %lld\n",
+		offset, length, pattern_length);
+	trace_add(client_socket_fd, REQUEST_RANGE_FIND, offset, length);
+
+	if(pattern_length > COMPUTE_PATTERN_MAX)
+	{
+		socket_drop(client_socket_fd, "Pattern too long, dropping client.");
+		return;
+	}
+	if(!pattern_length)
+	{
+		comms_sendb(client_socket_fd, RESPONSE_COMPUTE_ERR);
+		return;
+	}
+	comms_get(client_socket_fd, pattern, pattern_length);
+
+	if(!compute_range_valid(offset, length))
+	{
+		comms_sendb(client_socket_fd, RESPONSE_COMPUTE_ERR);
+		return;
+	}
+
+	/* Chunks overlap by the pattern length so no match is split */
+	uint64 starts = (length >= pattern_length) ? length - pattern_length + 1 : 0;
+	for(uint64 done = 0; done < starts && found < max; )
+	{
+		uint64 chunk = MIN(starts - done, COMPUTE_CHUNK);
+		uint64 first = found;
+
+		region_read(offset + done, buffer, chunk + pattern_length - 1);
+		found += compute_find(buffer, chunk, pattern, pattern_length, &matches[found], max - found);
+		for(uint64 i = first; i < found; i++)
+			matches[i] += offset + done;
+		done += chunk;
+	}
+
+	compute_account(COMPUTE_FIND, length);
+	compute_reply(client_socket_fd, found);
+	if(found)
+		comms_send(client_socket_fd, (uint8 *)matches, found * sizeof(uint64));
+}
+
+/* Print operation counts into text, returns its length */
+int compute_report(char *text, int size)
+{
+	int length = snprintf(text, size, "compute:");
+
+	for(int i = 0; i < 4; i++)
+	{
+		length += snprintf(&text[length], MAX(size - length, 0), " %llu %ss (%llu bytes)%s",
+			__atomic_load_n(&compute_count[i], __ATOMIC_RELAXED), compute_names[i],
+			__atomic_load_n(&compute_bytes[i], __ATOMIC_RELAXED), i < 3 ? "," : "\n");
+	}
+
+	return length;
+}
+
+/* End */
@@ -0,0 +1,16 @@
+#ifndef _COMPUTE_H_
+#define _COMPUTE_H_
+
+#define COMPUTE_CHUNK		0x10000	/* Bytes staged per step of a scan or move */
+
+/* Function prototypes */
+void compute_fill(uint8 *buffer, uint64 length, const uint8 *pattern, uint64 pattern_length, uint64 phase);
+uint64 compute_mismatch(const uint8 *a, const uint8 *b, uint64 length);
+uint64 compute_find(const uint8 *data, uint64 starts, const uint8 *pattern, uint64 pattern_length, uint64 *matches, uint64 max);
+void command_fill(int client_socket_fd);
+void command_move(int client_socket_fd);
+void command_compare(int client_socket_fd);
+void command_find(int client_socket_fd);
+int compute_report(char *text, int size);
+
+#endif /* _COMPUTE_H_ */
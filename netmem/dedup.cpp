@@ -0,0 +1,181 @@
+/*
+	File:
+		dedup.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Content-addressed page frames for the server's shared memory,
+		enabled with -dedup. Every page written or read back from the
+		file is hashed and looked up by content; identical pages share a
+		single refcounted frame. Shared frames are never modified: a write
+		to one first gets a private copy, which is hashed again once the
+		write is done.
+
+		Frames come from here one page at a time, so nothing is allocated
+		for a region until its pages are actually used.
+*/
+
+#include "shared.h"
+#include <unordered_map>
+using namespace std;
+
+bool dedup_enabled = false;
+
+static pthread_mutex_t dedup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unordered_multimap<uint64, uint8 *> dedup_index;	/* Hash -> frame */
+static uint64 dedup_frames = 0;		/* Frames allocated */
+static uint64 dedup_pages = 0;		/* References to frames */
+static uint64 dedup_merges = 0;		/* Pages that found an existing frame */
+static uint64 dedup_copies = 0;		/* Writes that had to unshare a frame */
+
+static struct dedup_frame *dedup_header(uint8 *frame)
+{
+	return (struct dedup_frame *)(frame - DEDUP_FRAME_HEADER);
+}
+
+static void dedup_free(uint8 *frame)
+{
+	free(frame - DEDUP_FRAME_HEADER);
+}
+
+/* New private frame with one reference; contents are undefined */
+uint8 *dedup_alloc(void)
+{
+	void *block = NULL;
+
+	if(posix_memalign(&block, DEDUP_FRAME_HEADER, DEDUP_FRAME_HEADER + shared_page_size) != 0)
+		die("dedup_alloc(): Out of memory.\n");
+
+	struct dedup_frame *header = (struct dedup_frame *)block;
+	header->hash = 0;
+	header->refs = 1;
+	header->indexed = false;
+
+	pthread_mutex_lock(&dedup_mutex);
+	dedup_frames++;
+	dedup_pages++;
+	pthread_mutex_unlock(&dedup_mutex);
+
+	return (uint8 *)block + DEDUP_FRAME_HEADER;
+}
+
+/* Drop the index entry of a frame; caller holds dedup_mutex */
+static void dedup_unindex(uint8 *frame)
+{
+	struct dedup_frame *header = dedup_header(frame);
+	pair<unordered_multimap<uint64, uint8 *>::iterator,
+		unordered_multimap<uint64, uint8 *>::iterator> range;
+
+	range = dedup_index.equal_range(header->hash);
+	for(unordered_multimap<uint64, uint8 *>::iterator it = range.first; it != range.second; ++it)
+	{
+		if(it->second == frame)
+		{
+			dedup_index.erase(it);
+			break;
+		}
+	}
+	header->indexed = false;
+}
+
+/*
+	Look up a private frame by content. Returns an existing frame with the
+	same contents (and frees this one), or indexes and returns this one.
+*/
+uint8 *dedup_merge(uint8 *frame)
+{
+	struct dedup_frame *header = dedup_header(frame);
+	uint64 hash = page_hash64(frame, shared_page_size);
+	pair<unordered_multimap<uint64, uint8 *>::iterator,
+		unordered_multimap<uint64, uint8 *>::iterator> range;
+
+	pthread_mutex_lock(&dedup_mutex);
+	range = dedup_index.equal_range(hash);
+	for(unordered_multimap<uint64, uint8 *>::iterator it = range.first; it != range.second; ++it)
+	{
+		/* Indexed frames never change, so they can be compared here */
+		if(memcmp(it->second, frame, shared_page_size) == 0)
+		{
+			uint8 *match = it->second;
+			dedup_header(match)->refs++;
+			dedup_frames--;
+			dedup_merges++;
+			pthread_mutex_unlock(&dedup_mutex);
+
+			dedup_free(frame);
+			return match;
+		}
+	}
+
+	header->hash = hash;
+	header->indexed = true;
+	dedup_index.insert(make_pair(hash, frame));
+	pthread_mutex_unlock(&dedup_mutex);
+
+	return frame;
+}
+
+/* Frame that may be written in place; copies a frame other pages still use */
+uint8 *dedup_unshare(uint8 *frame)
+{
+	struct dedup_frame *header = dedup_header(frame);
+
+	pthread_mutex_lock(&dedup_mutex);
+	if(header->refs == 1)
+	{
+		if(header->indexed)
+			dedup_unindex(frame);
+		pthread_mutex_unlock(&dedup_mutex);
+		return frame;
+	}
+	header->refs--;
+	dedup_pages--;
+	dedup_copies++;
+	pthread_mutex_unlock(&dedup_mutex);
+
+	uint8 *copy = dedup_alloc();
+	memcpy(copy, frame, shared_page_size);
+	return copy;
+}
+
+/* Drop one page's reference to a frame */
+void dedup_release(uint8 *frame)
+{
+	struct dedup_frame *header = dedup_header(frame);
+
+	pthread_mutex_lock(&dedup_mutex);
+	dedup_pages--;
+	if(--header->refs)
+	{
+		pthread_mutex_unlock(&dedup_mutex);
+		return;
+	}
+	if(header->indexed)
+		dedup_unindex(frame);
+	dedup_frames--;
+	pthread_mutex_unlock(&dedup_mutex);
+
+	dedup_free(frame);
+}
+
+/* Print frame usage into text, returns its length */
+int dedup_report(char *text, int size)
+{
+	if(!dedup_enabled)
+		return snprintf(text, size, "dedup: off\n");
+
+	pthread_mutex_lock(&dedup_mutex);
+	uint64 frames = dedup_frames;
+	uint64 pages = dedup_pages;
+	uint64 merges = dedup_merges;
+	uint64 copies = dedup_copies;
+	pthread_mutex_unlock(&dedup_mutex);
+
+	return snprintf(text, size,
+		"dedup: %llu pages in %llu frames, ratio %.2f, %llu bytes saved, "
+		"%llu merges, %llu copy-on-write\n",
+		pages, frames, frames ? (double)pages / frames : 1.0,
+		(pages - frames) * shared_page_size, merges, copies);
+}
+
+/* End */
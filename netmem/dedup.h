@@ -0,0 +1,22 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#define DEDUP_FRAME_HEADER	64	/* Keeps page data cache line aligned */
+
+/* Bookkeeping stored just before the data of every frame */
+struct dedup_frame {
+	uint64 hash;
+	uint32_t refs;		/* Pages mapped to this frame */
+	bool indexed;		/* Findable by content; contents are frozen */
+};
+
+extern bool dedup_enabled;
+
+/* Function prototypes */
+uint8 *dedup_alloc(void);
+uint8 *dedup_merge(uint8 *frame);
+uint8 *dedup_unshare(uint8 *frame);
+void dedup_release(uint8 *frame);
+int dedup_report(char *text, int size);
+
+#endif /* _DEDUP_H_ */
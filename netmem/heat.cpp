@@ -0,0 +1,523 @@
+/*
+	File:
+		heat.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Access heat of shared memory. One read or write of a page in
+		heat_sample is counted, adding heat_sample, into a pair of 32-bit
+		counters per page kept in one array beside shared_memory. A thread
+		halves every count each HEAT_DECAY_S seconds so the counts follow
+		what is hot now rather than what was hot at startup. The sampled
+		accesses are also charged to the connection that made them, per
+		range of HEAT_CLIENT_RANGE pages.
+
+		With -mrc the server estimates the working set from a miss ratio
+		curve built by spatially hashed sampling: only pages whose hash
+		falls below a threshold are tracked, but every access to those is.
+		The reuse distance of an access, the number of distinct tracked
+		pages touched since the page was last touched, comes from a
+		Fenwick tree over access slots and is scaled up by the sampling
+		rate. An LRU cache of C pages hits every access with a distance
+		below C, so the histogram of distances gives the miss ratio at any
+		cache size.
+
+		REQUEST_HEATMAP returns the decayed counts summed over equal parts
+		of a range.
+
+		Server options:
+		-heatsample <n>	count one access in n (default HEAT_SAMPLE)
+		-mrc		track reuse distances for the miss ratio curve
+*/
+
+#include "shared.h"
+#include <map>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+#define HEAT_MRC_NONE	(~(uint64)0)	/* Slot holds no page */
+
+struct heat_page {
+	uint32_t reads;
+	uint32_t writes;
+};
+
+struct heat_client {
+	int socket_fd;
+	pthread_mutex_t mutex;		/* Owner thread and reports */
+	uint64 reads;
+	uint64 writes;
+	map<uint64, uint64> ranges;	/* Range -> sampled accesses */
+};
+
+static pthread_mutex_t heat_mutex = PTHREAD_MUTEX_INITIALIZER;	/* Array size and client list */
+static struct heat_page *heat_pages = NULL;
+static uint64 heat_page_count = 0;
+static uint32_t heat_sample = HEAT_SAMPLE;
+static uint64 heat_decays = 0;
+static map<int, heat_client *> heat_clients;
+static __thread heat_client *heat_self = NULL;	/* Connection served by this thread */
+
+/* Miss ratio curve, all under heat_mrc_mutex */
+static bool heat_mrc_enabled = false;
+static pthread_mutex_t heat_mrc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64 heat_mrc_threshold = HEAT_MRC_SCALE;	/* Hashes below are tracked */
+static map<uint64, uint32_t> heat_mrc_last;	/* Page -> slot of its last access */
+static uint32_t *heat_mrc_tree = NULL;		/* Fenwick tree, one mark per live slot */
+static uint64 *heat_mrc_slot_page = NULL;	/* Page in each slot */
+static uint32_t heat_mrc_time = 0;		/* Next slot */
+static uint64 heat_mrc_hist[HEAT_MRC_BUCKETS];	/* Reuses by power of two distance */
+static uint64 heat_mrc_cold = 0;		/* First accesses */
+static uint64 heat_mrc_references = 0;		/* Since startup, not decayed */
+
+/*------------------------------------------------*/
+
+static void heat_mrc_add(uint32_t slot, int delta)
+{
+	for(uint32_t i = slot + 1; i <= HEAT_MRC_WINDOW; i += i & -i)
+		heat_mrc_tree[i - 1] += delta;
+}
+
+/* Live marks in slots below slot */
+static uint32_t heat_mrc_prefix(uint32_t slot)
+{
+	uint32_t sum = 0;
+
+	for(uint32_t i = slot; i; i -= i & -i)
+		sum += heat_mrc_tree[i - 1];
+	return sum;
+}
+
+static bool heat_mrc_sampled(uint64 page)
+{
+	return ((page * 0x9E3779B97F4A7C15ULL) >> 40) < heat_mrc_threshold;
+}
+
+/* Distance d is counted in bucket b when 2^(b-1) <= d < 2^b */
+static int heat_mrc_bucket(uint64 distance)
+{
+	int bucket = distance ? 64 - __builtin_clzll(distance) : 0;
+	return MIN(bucket, HEAT_MRC_BUCKETS - 1);
+}
+
+/*
+	Slots run out: renumber the live ones from zero in the same order.
+	If more than half the window is live the oldest pages are forgotten;
+	their next access counts as a first one.
+*/
+static void heat_mrc_compact(void)
+{
+	uint32_t live = heat_mrc_last.size();
+	uint32_t drop = (live > HEAT_MRC_WINDOW / 2) ? live - HEAT_MRC_WINDOW / 2 : 0;
+	uint32_t next = 0;
+
+	memset(heat_mrc_tree, 0, HEAT_MRC_WINDOW * sizeof(uint32_t));
+	for(uint32_t i = 0; i < HEAT_MRC_WINDOW; i++)
+	{
+		uint64 page = heat_mrc_slot_page[i];
+
+		if(page == HEAT_MRC_NONE)
+			continue;
+		heat_mrc_slot_page[i] = HEAT_MRC_NONE;
+		if(drop)
+		{
+			heat_mrc_last.erase(page);
+			drop--;
+			continue;
+		}
+		heat_mrc_slot_page[next] = page;
+		heat_mrc_last[page] = next;
+		heat_mrc_add(next, 1);
+		next++;
+	}
+	heat_mrc_time = next;
+}
+
+static void heat_mrc_reference(uint64 page)
+{
+	pthread_mutex_lock(&heat_mrc_mutex);
+	if(heat_mrc_time == HEAT_MRC_WINDOW)
+		heat_mrc_compact();
+
+	map<uint64, uint32_t>::iterator it = heat_mrc_last.find(page);
+	if(it == heat_mrc_last.end())
+		heat_mrc_cold++;
+	else
+	{
+		/* Every tracked page has one mark, at its last access */
+		uint32_t slot = it->second;
+		uint64 distance = heat_mrc_last.size() - heat_mrc_prefix(slot + 1);
+
+		heat_mrc_hist[heat_mrc_bucket(distance * HEAT_MRC_SCALE / heat_mrc_threshold)]++;
+		heat_mrc_add(slot, -1);
+		heat_mrc_slot_page[slot] = HEAT_MRC_NONE;
+	}
+	heat_mrc_add(heat_mrc_time, 1);
+	heat_mrc_slot_page[heat_mrc_time] = page;
+	heat_mrc_last[page] = heat_mrc_time;
+	heat_mrc_time++;
+	heat_mrc_references++;
+	pthread_mutex_unlock(&heat_mrc_mutex);
+}
+
+/* Start the curve over, tracking about HEAT_MRC_PAGES of the region */
+static void heat_mrc_reset(uint64 page_count)
+{
+	pthread_mutex_lock(&heat_mrc_mutex);
+	if(!heat_mrc_tree)
+	{
+		heat_mrc_tree = (uint32_t *)malloc(HEAT_MRC_WINDOW * sizeof(uint32_t));
+		heat_mrc_slot_page = (uint64 *)malloc(HEAT_MRC_WINDOW * sizeof(uint64));
+		if(!heat_mrc_tree || !heat_mrc_slot_page)
+			die("heat_mrc_reset(): Out of memory.\n");
+	}
+	memset(heat_mrc_tree, 0, HEAT_MRC_WINDOW * sizeof(uint32_t));
+	memset(heat_mrc_slot_page, 0xFF, HEAT_MRC_WINDOW * sizeof(uint64));
+	memset(heat_mrc_hist, 0, sizeof(heat_mrc_hist));
+	heat_mrc_last.clear();
+	heat_mrc_time = 0;
+	heat_mrc_cold = 0;
+
+	heat_mrc_threshold = HEAT_MRC_SCALE;
+	if(page_count > HEAT_MRC_PAGES)
+		heat_mrc_threshold = MAX((uint64)HEAT_MRC_SCALE * HEAT_MRC_PAGES / page_count, 1);
+	pthread_mutex_unlock(&heat_mrc_mutex);
+}
+
+/*------------------------------------------------*/
+
+/* Halve every count; increments racing with this are kept */
+static void heat_decay(void)
+{
+	pthread_mutex_lock(&heat_mutex);
+	for(uint64 i = 0; i < heat_page_count; i++)
+	{
+		uint32_t reads = __atomic_load_n(&heat_pages[i].reads, __ATOMIC_RELAXED);
+		uint32_t writes = __atomic_load_n(&heat_pages[i].writes, __ATOMIC_RELAXED);
+
+		if(reads)
+			__atomic_fetch_sub(&heat_pages[i].reads, reads - reads / 2, __ATOMIC_RELAXED);
+		if(writes)
+			__atomic_fetch_sub(&heat_pages[i].writes, writes - writes / 2, __ATOMIC_RELAXED);
+	}
+
+	for(map<int, heat_client *>::iterator it = heat_clients.begin(); it != heat_clients.end(); ++it)
+	{
+		heat_client *client = it->second;
+
+		pthread_mutex_lock(&client->mutex);
+		client->reads /= 2;
+		client->writes /= 2;
+		for(map<uint64, uint64>::iterator range = client->ranges.begin(); range != client->ranges.end(); )
+		{
+			range->second /= 2;
+			if(!range->second)
+				client->ranges.erase(range++);
+			else
+				++range;
+		}
+		pthread_mutex_unlock(&client->mutex);
+	}
+	heat_decays++;
+	pthread_mutex_unlock(&heat_mutex);
+
+	if(heat_mrc_enabled)
+	{
+		pthread_mutex_lock(&heat_mrc_mutex);
+		for(int i = 0; i < HEAT_MRC_BUCKETS; i++)
+			heat_mrc_hist[i] /= 2;
+		heat_mrc_cold /= 2;
+		pthread_mutex_unlock(&heat_mrc_mutex);
+	}
+}
+
+static void *heat_decay_thread(void *arg)
+{
+	for(;;)
+	{
+		sleep(HEAT_DECAY_S);
+		heat_decay();
+	}
+
+	return NULL;
+}
+
+/* Started with the first connection, once shutdown signals are blocked */
+static void heat_decay_start(void)
+{
+	pthread_t thread;
+
+	if(pthread_create(&thread, NULL, heat_decay_thread, NULL) == 0)
+		pthread_detach(thread);
+}
+
+void heat_setup(int argc, char *argv[])
+{
+	int index;
+
+	if((index = find_option(argc, argv, "-heatsample")) != -1 && index + 1 < argc)
+		heat_sample = MAX(atoi(argv[index + 1]), 1);
+	heat_mrc_enabled = (find_option(argc, argv, "-mrc") != -1);
+}
+
+/* Size the counters for a new region; old counts and ranges no longer apply */
+void heat_alloc(uint64 page_count)
+{
+	pthread_mutex_lock(&heat_mutex);
+	free(heat_pages);
+	heat_pages = (struct heat_page *)calloc(page_count, sizeof(struct heat_page));
+	if(!heat_pages)
+		die("heat_alloc(): Out of memory.\n");
+	heat_page_count = page_count;
+
+	for(map<int, heat_client *>::iterator it = heat_clients.begin(); it != heat_clients.end(); ++it)
+	{
+		pthread_mutex_lock(&it->second->mutex);
+		it->second->ranges.clear();
+		pthread_mutex_unlock(&it->second->mutex);
+	}
+	pthread_mutex_unlock(&heat_mutex);
+
+	if(heat_mrc_enabled)
+		heat_mrc_reset(page_count);
+}
+
+/* A page was read or written */
+void heat_access(uint64 page, bool write)
+{
+	static __thread uint32_t random = 0x2545F491;
+
+	if(heat_mrc_enabled && heat_mrc_sampled(page))
+		heat_mrc_reference(page);
+
+	random ^= random << 13;
+	random ^= random >> 17;
+	random ^= random << 5;
+	if(random % heat_sample)
+		return;
+
+	if(write)
+		__atomic_fetch_add(&heat_pages[page].writes, heat_sample, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&heat_pages[page].reads, heat_sample, __ATOMIC_RELAXED);
+
+	/* Threads that serve no connection are not charged to anyone */
+	heat_client *client = heat_self;
+	if(!client)
+		return;
+
+	uint64 range = page / HEAT_CLIENT_RANGE;
+
+	pthread_mutex_lock(&client->mutex);
+	if(write)
+		client->writes += heat_sample;
+	else
+		client->reads += heat_sample;
+	if(client->ranges.size() < HEAT_CLIENT_RANGES_MAX || client->ranges.count(range))
+		client->ranges[range] += heat_sample;
+	pthread_mutex_unlock(&client->mutex);
+}
+
+/* Called by the thread serving the connection */
+void heat_connect(int client_socket_fd)
+{
+	static pthread_once_t decay_once = PTHREAD_ONCE_INIT;
+	heat_client *client = new heat_client;
+
+	pthread_once(&decay_once, heat_decay_start);
+	client->socket_fd = client_socket_fd;
+	pthread_mutex_init(&client->mutex, NULL);
+	client->reads = 0;
+	client->writes = 0;
+
+	pthread_mutex_lock(&heat_mutex);
+	heat_clients[client_socket_fd] = client;
+	pthread_mutex_unlock(&heat_mutex);
+	heat_self = client;
+}
+
+void heat_disconnect(int client_socket_fd)
+{
+	pthread_mutex_lock(&heat_mutex);
+	map<int, heat_client *>::iterator it = heat_clients.find(client_socket_fd);
+	if(it != heat_clients.end())
+	{
+		heat_client *client = it->second;
+
+		heat_clients.erase(it);
+		if(heat_self == client)
+			heat_self = NULL;
+		pthread_mutex_destroy(&client->mutex);
+		delete client;
+	}
+	pthread_mutex_unlock(&heat_mutex);
+}
+
+/*------------------------------------------------*/
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of first byte
+	qword - number of bytes
+	qword - number of parts to split the range into (1 to HEATMAP_PARTS_MAX)
+	Server responds with
+	byte  - RESPONSE_HEATMAP, qword number of parts, qword pages per
+	        part, then for each part the qword decayed read count and
+	        qword decayed write count of its pages
+	or
+	byte  - RESPONSE_HEATMAP_ERR if the range or part count is invalid
+*/
+void command_heatmap(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	uint64 parts = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Heatmap request, offset: %016llX, length: %lld, parts: %lld\n",
+		offset, length, parts);
+
+	if(!length || !parts || parts > HEATMAP_PARTS_MAX ||
+		offset >= (uint64)shared_memory_size || length > shared_memory_size - offset)
+	{
+		comms_sendb(client_socket_fd, RESPONSE_HEATMAP_ERR);
+		return;
+	}
+
+	/* Parts cover whole pages; fewer are sent if there are fewer pages */
+	uint64 first = offset / shared_page_size;
+	uint64 pages = (offset + length - 1) / shared_page_size - first + 1;
+	uint64 per = (pages + parts - 1) / parts;
+	parts = (pages + per - 1) / per;
+	vector<uint64> counts(2 * parts, 0);
+
+	pthread_mutex_lock(&heat_mutex);
+	for(uint64 i = 0; i < pages && first + i < heat_page_count; i++)
+	{
+		counts[2 * (i / per)] += __atomic_load_n(&heat_pages[first + i].reads, __ATOMIC_RELAXED);
+		counts[2 * (i / per) + 1] += __atomic_load_n(&heat_pages[first + i].writes, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&heat_mutex);
+
+	comms_sendb(client_socket_fd, RESPONSE_HEATMAP);
+	comms_sendq(client_socket_fd, parts);
+	comms_sendq(client_socket_fd, per);
+	comms_send(client_socket_fd, (uint8 *)&counts[0], counts.size() * sizeof(uint64));
+}
+
+/*------------------------------------------------*/
+
+static bool heat_range_hotter(const pair<uint64, uint64> &a, const pair<uint64, uint64> &b)
+{
+	return a.first > b.first;
+}
+
+/*
+	Working set from the miss ratio curve: the smallest power of two
+	cache that 90% and 99% of reuses hit, then the miss ratio of every
+	power of two size up to the region, first accesses included.
+*/
+static int heat_mrc_report(char *text, int size)
+{
+	uint64 reuses = 0;
+	uint64 cached = 0;
+	int hit90 = -1, hit99 = -1;
+	int length;
+
+	pthread_mutex_lock(&heat_mrc_mutex);
+	for(int i = 0; i < HEAT_MRC_BUCKETS; i++)
+		reuses += heat_mrc_hist[i];
+	for(int i = 0; i < HEAT_MRC_BUCKETS; i++)
+	{
+		cached += heat_mrc_hist[i];
+		if(hit90 == -1 && cached * 10 >= reuses * 9)
+			hit90 = i;
+		if(hit99 == -1 && cached * 100 >= reuses * 99)
+			hit99 = i;
+	}
+
+	length = snprintf(text, size,
+		"heat mrc: 1 in %llu pages tracked, %llu references, %llu pages seen, "
+		"90%% of reuses hit in %llu pages, 99%% in %llu\n",
+		HEAT_MRC_SCALE / heat_mrc_threshold, heat_mrc_references,
+		heat_mrc_last.size() * HEAT_MRC_SCALE / heat_mrc_threshold,
+		1ULL << MAX(hit90, 0), 1ULL << MAX(hit99, 0));
+
+	length += snprintf(&text[length], MAX(size - length, 0), "heat mrc misses:");
+	uint64 total = reuses + heat_mrc_cold;
+	uint64 misses = total;
+	for(int i = 0; i < HEAT_MRC_BUCKETS && total; i++)
+	{
+		misses -= heat_mrc_hist[i];
+		length += snprintf(&text[length], MAX(size - length, 0), " %llu:%.1f%%",
+			1ULL << i, 100.0 * misses / total);
+		if((1ULL << i) >= heat_page_count)
+			break;
+	}
+	length += snprintf(&text[length], MAX(size - length, 0), "\n");
+	pthread_mutex_unlock(&heat_mrc_mutex);
+
+	return length;
+}
+
+/* Print heat totals, the hottest ranges of each client and the curve */
+int heat_report(char *text, int size)
+{
+	uint64 reads = 0, writes = 0, hot = 0;
+	uint64 hottest = 0, hottest_count = 0;
+	int length;
+
+	pthread_mutex_lock(&heat_mutex);
+	for(uint64 i = 0; i < heat_page_count; i++)
+	{
+		uint64 page_reads = __atomic_load_n(&heat_pages[i].reads, __ATOMIC_RELAXED);
+		uint64 page_writes = __atomic_load_n(&heat_pages[i].writes, __ATOMIC_RELAXED);
+
+		reads += page_reads;
+		writes += page_writes;
+		if(page_reads + page_writes)
+			hot++;
+		if(page_reads + page_writes > hottest_count)
+		{
+			hottest_count = page_reads + page_writes;
+			hottest = i;
+		}
+	}
+	length = snprintf(text, size,
+		"heat: 1 in %u accesses sampled, %llu reads, %llu writes, %llu pages hot, "
+		"hottest %016llX (%llu), %llu decays\n",
+		heat_sample, reads, writes, hot, hottest * shared_page_size, hottest_count, heat_decays);
+
+	for(map<int, heat_client *>::iterator it = heat_clients.begin(); it != heat_clients.end(); ++it)
+	{
+		heat_client *client = it->second;
+		vector<pair<uint64, uint64> > ranges;
+
+		pthread_mutex_lock(&client->mutex);
+		for(map<uint64, uint64>::iterator range = client->ranges.begin(); range != client->ranges.end(); ++range)
+			ranges.push_back(make_pair(range->second, range->first));
+		length += snprintf(&text[length], MAX(size - length, 0),
+			"heat client %d: %llu reads, %llu writes, hottest ranges",
+			client->socket_fd, client->reads, client->writes);
+		pthread_mutex_unlock(&client->mutex);
+
+		int top = MIN((int)ranges.size(), HEAT_CLIENT_TOP);
+		partial_sort(ranges.begin(), ranges.begin() + top, ranges.end(), heat_range_hotter);
+		for(int i = 0; i < top; i++)
+		{
+			length += snprintf(&text[length], MAX(size - length, 0), " %016llX:%llu",
+				ranges[i].second * HEAT_CLIENT_RANGE * shared_page_size, ranges[i].first);
+		}
+		length += snprintf(&text[length], MAX(size - length, 0), "\n");
+	}
+	pthread_mutex_unlock(&heat_mutex);
+
+	if(heat_mrc_enabled)
+		length += heat_mrc_report(&text[MIN(length, size)], MAX(size - length, 0));
+
+	return length;
+}
+
+/* End */
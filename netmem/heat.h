@@ -0,0 +1,23 @@
+#ifndef _HEAT_H_
+#define _HEAT_H_
+
+#define HEAT_SAMPLE		16	/* Default: one access in this many is counted */
+#define HEAT_DECAY_S		60	/* Counts halve this often */
+#define HEAT_CLIENT_RANGE	64	/* Pages per range in per-client counts */
+#define HEAT_CLIENT_RANGES_MAX	1024	/* Ranges remembered per client */
+#define HEAT_CLIENT_TOP		3	/* Hottest ranges listed per client */
+#define HEAT_MRC_PAGES		16384	/* Pages tracked for the miss ratio curve */
+#define HEAT_MRC_WINDOW		65536	/* Reference slots between compactions */
+#define HEAT_MRC_BUCKETS	48	/* Power of two reuse distances */
+#define HEAT_MRC_SCALE		0x1000000	/* Hash space pages are sampled from */
+
+/* Function prototypes */
+void heat_setup(int argc, char *argv[]);
+void heat_alloc(uint64 page_count);
+void heat_access(uint64 page, bool write);
+void heat_connect(int client_socket_fd);
+void heat_disconnect(int client_socket_fd);
+void command_heatmap(int client_socket_fd);
+int heat_report(char *text, int size);
+
+#endif /* _HEAT_H_ */
@@ -0,0 +1,385 @@
+/*
+	File:
+		locks.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Named locks, barriers and semaphores managed by the server.
+		Each client connection runs in its own thread, so a waiter is
+		parked on a condition variable and only gets its reply once
+		the object is released; clients never poll over the network.
+*/
+
+#include "shared.h"
+#include <map>
+#include <set>
+#include <deque>
+#include <sys/time.h>
+using namespace std;
+
+/* Reader/writer lock with FIFO hand-off */
+struct nm_lock {
+	pthread_cond_t cond;
+	bool exclusive_held;
+	int exclusive_owner;			/* Socket of writer */
+	multiset<int> shared_owners;		/* Sockets of readers */
+	deque<pair<uint64, uint8> > waiters;	/* Ticket and mode, in arrival order */
+	uint64 next_ticket;
+	uint64 version;				/* Bumped by releases that dirty pages */
+	map<uint64, uint64> dirty;		/* Page offset -> version last dirtied */
+	map<int, uint64> seen;			/* Socket -> version at last acquire */
+};
+
+struct nm_barrier {
+	pthread_cond_t cond;
+	uint64 parties;
+	set<int> arrived;			/* Sockets waiting in this phase */
+	uint64 generation;
+};
+
+struct nm_semaphore {
+	pthread_cond_t cond;
+	uint64 count;
+};
+
+static pthread_mutex_t locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<uint64, nm_lock *> locks;
+static map<uint64, nm_barrier *> barriers;
+static map<uint64, nm_semaphore *> semaphores;
+static uint64 locks_clock = 0;			/* Source of lock versions */
+static map<int, uint64> locks_connected;	/* Socket -> clock when it connected */
+
+/*------------------------------------------------*/
+
+/* Find or create a named object; caller holds locks_mutex */
+template <class T>
+static T *locks_lookup(map<uint64, T *> &table, uint64 id)
+{
+	typename map<uint64, T *>::iterator it = table.find(id);
+	if(it != table.end())
+		return it->second;
+
+	T *object = new T();
+	pthread_cond_init(&object->cond, NULL);
+	table[id] = object;
+	return object;
+}
+
+/* Version a client has already seen; a first acquire starts at connect */
+static uint64 lock_seen(nm_lock *lock, int client_socket_fd)
+{
+	map<int, uint64>::iterator it = lock->seen.find(client_socket_fd);
+	if(it != lock->seen.end())
+		return it->second;
+
+	it = locks_connected.find(client_socket_fd);
+	return it != locks_connected.end() ? it->second : 0;
+}
+
+/* Forget dirty pages every connected client has been told about */
+static void lock_prune(nm_lock *lock)
+{
+	uint64 floor = locks_clock;
+	for(map<int, uint64>::iterator it = locks_connected.begin(); it != locks_connected.end(); ++it)
+		floor = MIN(floor, lock_seen(lock, it->first));
+
+	map<uint64, uint64>::iterator it = lock->dirty.begin();
+	while(it != lock->dirty.end())
+	{
+		if(it->second <= floor)
+			lock->dirty.erase(it++);
+		else
+			++it;
+	}
+}
+
+/* Check if the waiter at the head of the queue can take the lock */
+static bool lock_grantable(nm_lock *lock, uint64 ticket, uint8 mode)
+{
+	if(lock->waiters.empty() || lock->waiters.front().first != ticket)
+		return false;
+	if(lock->exclusive_held)
+		return false;
+	if(mode == LOCK_MODE_EXCLUSIVE && !lock->shared_owners.empty())
+		return false;
+	return true;
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - lock id
+	byte  - LOCK_MODE_EXCLUSIVE or LOCK_MODE_SHARED
+	Server responds once the lock is held with
+	byte  - RESPONSE_LOCK_OK
+	qword - number of pages dirtied since this client last held the lock
+	qword - page offset (repeated)
+*/
+void command_lock_acquire(int client_socket_fd)
+{
+	uint64 id = comms_getq(client_socket_fd);
+	uint8 mode = comms_getb(client_socket_fd);
+	uint8 *response;
+	uint64 count = 0;
+
+	/* Debug */
+	printf("* Lock acquire request, id: %016llX, mode: %d\n", id, mode);
+
+	if(mode != LOCK_MODE_EXCLUSIVE && mode != LOCK_MODE_SHARED)
+	{
+		comms_sendb(client_socket_fd, RESPONSE_LOCK_ERR);
+		return;
+	}
+
+	pthread_mutex_lock(&locks_mutex);
+	nm_lock *lock = locks_lookup(locks, id);
+
+	/* Park until we reach the head of the queue and are compatible */
+	uint64 ticket = lock->next_ticket++;
+	lock->waiters.push_back(make_pair(ticket, mode));
+	while(!lock_grantable(lock, ticket, mode))
+		pthread_cond_wait(&lock->cond, &locks_mutex);
+	lock->waiters.pop_front();
+
+	if(mode == LOCK_MODE_EXCLUSIVE)
+	{
+		lock->exclusive_held = true;
+		lock->exclusive_owner = client_socket_fd;
+	}
+	else
+		lock->shared_owners.insert(client_socket_fd);
+
+	/* Collect pages dirtied by other holders since our last acquire */
+	uint64 seen = lock_seen(lock, client_socket_fd);
+	response = new uint8 [1 + PTR_SIZE + lock->dirty.size() * PTR_SIZE];
+	for(map<uint64, uint64>::iterator it = lock->dirty.begin(); it != lock->dirty.end(); ++it)
+	{
+		if(it->second > seen)
+			*(uint64 *)&response[1 + PTR_SIZE + count++ * PTR_SIZE] = it->first;
+	}
+	lock->seen[client_socket_fd] = lock->version;
+	lock_prune(lock);
+
+	/* Let a following shared waiter in alongside us */
+	pthread_cond_broadcast(&lock->cond);
+	pthread_mutex_unlock(&locks_mutex);
+
+	response[0] = RESPONSE_LOCK_OK;
+	*(uint64 *)&response[1] = count;
+	comms_send(client_socket_fd, response, 1 + PTR_SIZE + count * PTR_SIZE);
+	delete []response;
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - lock id
+	qword - number of pages dirtied while holding the lock
+	qword - page offset (repeated)
+	Server responds with
+	byte  - RESPONSE_LOCK_OK, or RESPONSE_LOCK_ERR if the lock was not held
+*/
+void command_lock_release(int client_socket_fd)
+{
+	uint64 id = comms_getq(client_socket_fd);
+	uint64 count = comms_getq(client_socket_fd);
+	uint64 *offsets = NULL;
+	bool held = false;
+
+	/* Debug */
+	printf("* Lock release request, id: %016llX, dirty pages: %lld\n", id, count);
+
+	/* Oversized dirty lists are drained and dropped */
+	if(count)
+	{
+		offsets = new uint64 [MIN(count, LOCK_DIRTY_MAX)];
+		comms_get(client_socket_fd, (uint8 *)offsets, MIN(count, LOCK_DIRTY_MAX) * PTR_SIZE);
+		for(uint64 i = LOCK_DIRTY_MAX; i < count; i++)
+			comms_getq(client_socket_fd);
+	}
+
+	pthread_mutex_lock(&locks_mutex);
+	map<uint64, nm_lock *>::iterator it = locks.find(id);
+	if(it != locks.end())
+	{
+		nm_lock *lock = it->second;
+		multiset<int>::iterator owner = lock->shared_owners.find(client_socket_fd);
+
+		if(lock->exclusive_held && lock->exclusive_owner == client_socket_fd)
+		{
+			lock->exclusive_held = false;
+			held = true;
+		}
+		else
+		if(owner != lock->shared_owners.end())
+		{
+			lock->shared_owners.erase(owner);
+			held = true;
+		}
+
+		if(held && count)
+		{
+			lock->version = ++locks_clock;
+			for(uint64 i = 0; i < MIN(count, LOCK_DIRTY_MAX); i++)
+				lock->dirty[offsets[i]] = lock->version;
+
+			/* The releaser already has its own writes */
+			lock->seen[client_socket_fd] = lock->version;
+			lock_prune(lock);
+		}
+
+		if(held)
+			pthread_cond_broadcast(&lock->cond);
+	}
+	pthread_mutex_unlock(&locks_mutex);
+
+	delete []offsets;
+	comms_sendb(client_socket_fd, held ? RESPONSE_LOCK_OK : RESPONSE_LOCK_ERR);
+}
+
+/* True if a parked client has hung up; pipelined requests are left unread */
+static bool locks_client_gone(int client_socket_fd)
+{
+	uint8 byte;
+	ssize_t count = recv(client_socket_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	return count == 0 || (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - barrier id
+	qword - number of parties (taken from the first arrival of a phase)
+	Server responds once every party has arrived with
+	byte  - RESPONSE_LOCK_OK
+	A party that disconnects while it waits no longer counts as arrived.
+*/
+void command_barrier_wait(int client_socket_fd)
+{
+	uint64 id = comms_getq(client_socket_fd);
+	uint64 parties = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Barrier wait request, id: %016llX, parties: %lld\n", id, parties);
+
+	pthread_mutex_lock(&locks_mutex);
+	nm_barrier *barrier = locks_lookup(barriers, id);
+	if(barrier->arrived.empty())
+		barrier->parties = parties;
+
+	uint64 generation = barrier->generation;
+	barrier->arrived.insert(client_socket_fd);
+	if(barrier->arrived.size() >= barrier->parties)
+	{
+		/* Last arrival releases the whole phase */
+		barrier->arrived.clear();
+		barrier->generation++;
+		pthread_cond_broadcast(&barrier->cond);
+	}
+	else
+	{
+		while(generation == barrier->generation)
+		{
+			struct timeval now;
+			struct timespec until;
+
+			gettimeofday(&now, NULL);
+			uint64 deadline = now.tv_sec * 1000000ULL + now.tv_usec + LOCK_POLL_MS * 1000;
+			until.tv_sec = deadline / 1000000;
+			until.tv_nsec = (deadline % 1000000) * 1000;
+			pthread_cond_timedwait(&barrier->cond, &locks_mutex, &until);
+
+			if(generation == barrier->generation && locks_client_gone(client_socket_fd))
+			{
+				barrier->arrived.erase(client_socket_fd);
+				pthread_mutex_unlock(&locks_mutex);
+				socket_drop(client_socket_fd, "Client left a barrier, dropping client.");
+				return;
+			}
+		}
+	}
+	pthread_mutex_unlock(&locks_mutex);
+
+	comms_sendb(client_socket_fd, RESPONSE_LOCK_OK);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - semaphore id
+	Server responds once the count could be decremented with
+	byte  - RESPONSE_LOCK_OK
+*/
+void command_sem_wait(int client_socket_fd)
+{
+	uint64 id = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Semaphore wait request, id: %016llX\n", id);
+
+	pthread_mutex_lock(&locks_mutex);
+	nm_semaphore *semaphore = locks_lookup(semaphores, id);
+	while(semaphore->count == 0)
+		pthread_cond_wait(&semaphore->cond, &locks_mutex);
+	semaphore->count--;
+	pthread_mutex_unlock(&locks_mutex);
+
+	comms_sendb(client_socket_fd, RESPONSE_LOCK_OK);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - semaphore id
+	qword - amount to add to the count
+	Server responds with
+	byte  - RESPONSE_LOCK_OK
+*/
+void command_sem_post(int client_socket_fd)
+{
+	uint64 id = comms_getq(client_socket_fd);
+	uint64 count = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Semaphore post request, id: %016llX, count: %lld\n", id, count);
+
+	pthread_mutex_lock(&locks_mutex);
+	nm_semaphore *semaphore = locks_lookup(semaphores, id);
+	semaphore->count += count;
+	pthread_cond_broadcast(&semaphore->cond);
+	pthread_mutex_unlock(&locks_mutex);
+
+	comms_sendb(client_socket_fd, RESPONSE_LOCK_OK);
+}
+
+/* Start tracking a client from the current lock versions */
+void locks_connect(int client_socket_fd)
+{
+	pthread_mutex_lock(&locks_mutex);
+	locks_connected[client_socket_fd] = locks_clock;
+	pthread_mutex_unlock(&locks_mutex);
+}
+
+/* Drop everything a disconnecting client still holds */
+void locks_disconnect(int client_socket_fd)
+{
+	pthread_mutex_lock(&locks_mutex);
+	locks_connected.erase(client_socket_fd);
+	for(map<uint64, nm_lock *>::iterator it = locks.begin(); it != locks.end(); ++it)
+	{
+		nm_lock *lock = it->second;
+
+		if(lock->exclusive_held && lock->exclusive_owner == client_socket_fd)
+			lock->exclusive_held = false;
+		lock->shared_owners.erase(client_socket_fd);
+		lock->seen.erase(client_socket_fd);
+		lock_prune(lock);
+		pthread_cond_broadcast(&lock->cond);
+	}
+	for(map<uint64, nm_barrier *>::iterator it = barriers.begin(); it != barriers.end(); ++it)
+		it->second->arrived.erase(client_socket_fd);
+	pthread_mutex_unlock(&locks_mutex);
+}
+
+/* End */
@@ -0,0 +1,13 @@
+#ifndef _LOCKS_H_
+#define _LOCKS_H_
+
+/* Function prototypes */
+void command_lock_acquire(int client_socket_fd);
+void command_lock_release(int client_socket_fd);
+void command_barrier_wait(int client_socket_fd);
+void command_sem_wait(int client_socket_fd);
+void command_sem_post(int client_socket_fd);
+void locks_connect(int client_socket_fd);
+void locks_disconnect(int client_socket_fd);
+
+#endif /* _LOCKS_H_ */
@@ -16,7 +16,12 @@ using namespace std;
 enum {
 	PGM_UNDEF,	/* Undefined program type */
 	PGM_SERVER,	/* Act as server */
-	PGM_CLIENT	/* Act as client */
+	PGM_CLIENT,	/* Act as client */
+	PGM_VERIFY,	/* Check shared.bin integrity */
+	PGM_PLACEMENT,	/* Benchmark NUMA placement */
+	PGM_REPLAY,	/* Re-drive a request trace */
+	PGM_SHARD,	/* Show or change a shard map */
+	PGM_BENCH	/* Microbenchmarks of the internals */
 };
 
 
@@ -35,6 +40,18 @@ int main (int argc, char *argv[])
 	if(argc < 2)
 	{
 		printf("usage %s <s|c> [-p port] [-h hostname]\n", argv[0]);
+		printf("Server options: [-fresh] [-prefetch] [-dedup] [-tier frames] [-numa interleave|shard|node]\n");
+		printf("                [-pin] [-hugepages] [-hugetlb] [-slots count] [-bwcap bytes/s]\n");
+		printf("                [-trace file] [-tracesize records] [-heatsample n] [-mrc]\n");
+		printf("                [-replicaof host:port] [-maxlag ms] [-shards host:port,... -shardid n]\n");
+		printf("Client options: [-writeback] [-wbpages pages] [-wbage ms] [-trace file]\n");
+		printf("                [-manifest file] [-connections n] [-replica host:port] [-maxlag ms]\n");
+		printf("usage %s v [-f file] [-t threads] [-repair] [-source snapshot] [-accept]\n", argv[0]);
+		printf("usage %s n [-m megabytes] [-passes count] [-hugepages] [-hugetlb]\n", argv[0]);
+		printf("usage %s r [-p port] [-h hostname] [-f trace] [-speed factor] [-m bytes] [-readonly]\n", argv[0]);
+		printf("                [-replica host:port[,host:port...]] [-maxlag ms] [-sharded]\n");
+		printf("usage %s b [-ops count] [-only name]\n", argv[0]);
+		printf("usage %s m [-p port] [-h hostname] [-m bytes] [-move offset length node]\n", argv[0]);
 		printf("Default hostname: %s\n", hostname);
 		printf("Default port: %d\n", port);
 		return 1;
@@ -50,6 +67,21 @@ int main (int argc, char *argv[])
 		case 's':
 			pgm_type = PGM_SERVER;
 			break;
+		case 'v':
+			pgm_type = PGM_VERIFY;
+			break;
+		case 'n':
+			pgm_type = PGM_PLACEMENT;
+			break;
+		case 'r':
+			pgm_type = PGM_REPLAY;
+			break;
+		case 'm':
+			pgm_type = PGM_SHARD;
+			break;
+		case 'b':
+			pgm_type = PGM_BENCH;
+			break;
 		default:
 			pgm_type = PGM_UNDEF;
 			break;
@@ -58,6 +90,14 @@ int main (int argc, char *argv[])
 	/* Abort if invalid program type was specified */
 	if(pgm_type == PGM_UNDEF)
 		die("Error: Unknown program type '%c' specified.\n", user_type);
+
+	/* Offline tools do not use the network settings */
+	if(pgm_type == PGM_VERIFY)
+		return run_verify(argc, argv);
+	if(pgm_type == PGM_PLACEMENT)
+		return run_placement_bench(argc, argv);
+	if(pgm_type == PGM_BENCH)
+		return run_bench(argc, argv);
 		
 	/* Scan for command-line parameters */
 	for(int i = 0; i < argc; i++)
@@ -88,7 +128,8 @@ int main (int argc, char *argv[])
 		die("Error: Port must be within 0 to 65535.\n");
 
 	/* Print settings that are being used */
-	printf("Program type:   %s\n", pgm_type == PGM_SERVER ? "Server" : "Client");
+	printf("Program type:   %s\n", pgm_type == PGM_SERVER ? "Server" :
+		pgm_type == PGM_REPLAY ? "Replay" : pgm_type == PGM_SHARD ? "Shard" : "Client");
 	printf("Using hostname: %s\n", hostname);
 	printf("Using port:     %d\n", port);
 	
@@ -102,6 +143,12 @@ int main (int argc, char *argv[])
 		case PGM_CLIENT:
 			run_client(hostname, port, argc, argv);
 			break;
+
+		case PGM_REPLAY:
+			return run_replay(hostname, port, argc, argv);
+
+		case PGM_SHARD:
+			return run_shard(hostname, port, argc, argv);
 	}
 	
 	return 0;
@@ -0,0 +1,229 @@
+/*
+    File:
+        manifest.cpp
+    Author:
+        Ryan Gordon
+    Notes:
+        Working set of the client. Every page fetched for the kernel is
+        counted and a copy is held, up to MANIFEST_MAX_PAGES of the most
+        used pages. The offsets are saved hottest first to a manifest file
+        so a restarted client knows what it will need.
+
+        After every connect or reconnect the working set is warmed:
+        held copies are revalidated against the server in one request
+        when the session was resumed, and every page still missing is
+        fetched with pipelined page requests. A warmed copy is handed to
+        the kernel once; later faults of the page go to the server again.
+*/
+
+#include "shared.h"
+#include <map>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+struct manifest_page {
+    uint32_t hits;
+    bool valid;                 /* Warmed and not yet handed out */
+    vector<uint8_t> data;       /* Empty if no copy is held */
+};
+
+typedef map<uint64_t, manifest_page> manifest_map;
+
+static pthread_mutex_t manifest_mutex = PTHREAD_MUTEX_INITIALIZER;
+static manifest_map manifest_pages;
+static const char *manifest_filename = NULL;
+static uint64_t manifest_faults = 0;
+
+static bool manifest_hotter(const pair<uint32_t, uint64_t> &a, const pair<uint32_t, uint64_t> &b) {
+    return a.first > b.first;
+}
+
+/* Make room for one more page by forgetting the least used; caller holds the mutex */
+static void manifest_trim(void) {
+    if (manifest_pages.size() < MANIFEST_MAX_PAGES) {
+        return;
+    }
+
+    manifest_map::iterator coldest = manifest_pages.begin();
+    for (manifest_map::iterator it = manifest_pages.begin(); it != manifest_pages.end(); ++it) {
+        if (it->second.hits < coldest->second.hits) {
+            coldest = it;
+        }
+    }
+    manifest_pages.erase(coldest);
+}
+
+/* Pages listed in the manifest file join the working set */
+static void manifest_load(void) {
+    FILE *fd = fopen(manifest_filename, "rb");
+    uint64_t page_offset;
+    uint32_t rank = MANIFEST_MAX_PAGES;
+
+    if (!fd) {
+        return;
+    }
+
+    while (rank && fread(&page_offset, sizeof(uint64_t), 1, fd) == 1) {
+        if (!manifest_pages.count(page_offset)) {
+            manifest_trim();
+            manifest_pages[page_offset].hits = rank;
+            manifest_pages[page_offset].valid = false;
+        }
+        rank--;
+    }
+    fclose(fd);
+}
+
+void manifest_start(const char *filename) {
+    manifest_filename = filename;
+}
+
+/* A page was fetched from the server for the kernel */
+void manifest_record(uint64_t page_offset, const uint8_t *page) {
+    bool save;
+
+    pthread_mutex_lock(&manifest_mutex);
+    if (!manifest_pages.count(page_offset)) {
+        manifest_trim();
+        manifest_pages[page_offset].hits = 0;
+    }
+    manifest_page &entry = manifest_pages[page_offset];
+    entry.hits++;
+    entry.valid = false;
+    entry.data.assign(page, page + CLIENT_PAGE_SIZE);
+    save = (++manifest_faults % MANIFEST_SAVE_INTERVAL) == 0;
+    pthread_mutex_unlock(&manifest_mutex);
+
+    if (save) {
+        manifest_save();
+    }
+}
+
+/* The kernel synced a page; a held copy now matches the server */
+void manifest_update(uint64_t page_offset, const uint8_t *page) {
+    pthread_mutex_lock(&manifest_mutex);
+    manifest_map::iterator it = manifest_pages.find(page_offset);
+    if (it != manifest_pages.end() && !it->second.data.empty()) {
+        it->second.data.assign(page, page + CLIENT_PAGE_SIZE);
+    }
+    pthread_mutex_unlock(&manifest_mutex);
+}
+
+/* Hand out a warmed page once */
+bool manifest_lookup(uint64_t page_offset, uint8_t *page) {
+    bool found = false;
+
+    pthread_mutex_lock(&manifest_mutex);
+    manifest_map::iterator it = manifest_pages.find(page_offset);
+    if (it != manifest_pages.end() && it->second.valid) {
+        memcpy(page, &it->second.data[0], CLIENT_PAGE_SIZE);
+        it->second.valid = false;
+        it->second.hits++;
+        found = true;
+    }
+    pthread_mutex_unlock(&manifest_mutex);
+
+    return found;
+}
+
+/* Write the working set out, hottest page first */
+void manifest_save(void) {
+    vector<pair<uint32_t, uint64_t> > hot;
+    FILE *fd;
+
+    if (!manifest_filename) {
+        return;
+    }
+
+    pthread_mutex_lock(&manifest_mutex);
+    for (manifest_map::iterator it = manifest_pages.begin(); it != manifest_pages.end(); ++it) {
+        hot.push_back(make_pair(it->second.hits, it->first));
+    }
+    pthread_mutex_unlock(&manifest_mutex);
+    stable_sort(hot.begin(), hot.end(), manifest_hotter);
+
+    fd = fopen(manifest_filename, "wb");
+    if (!fd) {
+        perror("manifest_save(): fopen(): ");
+        return;
+    }
+    for (size_t i = 0; i < hot.size(); i++) {
+        fwrite(&hot[i].second, sizeof(uint64_t), 1, fd);
+    }
+    fclose(fd);
+}
+
+/*
+    Bring the working set back after connecting; the caller holds the
+    socket. Held copies are only trusted if the session was resumed.
+*/
+void manifest_warm(int client_socket_fd, uint64_t memory_size, bool resumed) {
+    vector<uint64_t> offsets;
+    vector<uint32_t> crcs;
+    vector<uint64_t> missing;
+    int stale = 0;
+    int batches = 0;
+
+    if (!manifest_filename) {
+        return;
+    }
+
+    pthread_mutex_lock(&manifest_mutex);
+    manifest_load();
+
+    for (manifest_map::iterator it = manifest_pages.begin(); it != manifest_pages.end(); ++it) {
+        it->second.valid = false;
+        if (!resumed) {
+            it->second.data.clear();
+        }
+        if (!it->second.data.empty()) {
+            offsets.push_back(it->first);
+            crcs.push_back(crc32c(&it->second.data[0], CLIENT_PAGE_SIZE));
+        }
+    }
+
+    /* One request checks every held copy */
+    if (!offsets.empty()) {
+        vector<uint64_t> changed(offsets.size());
+        stale = nm_client_revalidate(client_socket_fd, &offsets[0], &crcs[0], (int)offsets.size(), &changed[0]);
+        if (stale < 0) {
+            changed.assign(offsets.begin(), offsets.end());
+            stale = (int)offsets.size();
+        }
+        for (int i = 0; i < stale; i++) {
+            manifest_map::iterator it = manifest_pages.find(changed[i]);
+            if (it != manifest_pages.end()) {
+                it->second.data.clear();
+            }
+        }
+    }
+
+    for (manifest_map::iterator it = manifest_pages.begin(); it != manifest_pages.end(); ++it) {
+        if (!it->second.data.empty()) {
+            it->second.valid = true;
+        } else if (it->first + CLIENT_PAGE_SIZE <= memory_size && !(it->first % CLIENT_PAGE_SIZE)) {
+            missing.push_back(it->first);
+        }
+    }
+
+    /* Everything else comes back in a few pipelined batches */
+    vector<uint8_t> pages(MANIFEST_BATCH * CLIENT_PAGE_SIZE);
+    for (size_t first = 0; first < missing.size(); first += MANIFEST_BATCH) {
+        int count = (int)min(missing.size() - first, (size_t)MANIFEST_BATCH);
+
+        nm_client_request_pages(client_socket_fd, &missing[first], count, &pages[0]);
+        for (int i = 0; i < count; i++) {
+            manifest_page &entry = manifest_pages[missing[first + i]];
+            entry.data.assign(&pages[i * CLIENT_PAGE_SIZE], &pages[(i + 1) * CLIENT_PAGE_SIZE]);
+            entry.valid = true;
+        }
+        batches++;
+    }
+    pthread_mutex_unlock(&manifest_mutex);
+
+    printf("- Working set: %d pages revalidated (%d stale), %d fetched in %d batches\n",
+           (int)offsets.size(), stale, (int)missing.size(), batches);
+}
+
+/* End */
@@ -0,0 +1,17 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#define MANIFEST_FILENAME	"netmem.manifest"
+#define MANIFEST_MAX_PAGES	1024	/* Pages held and listed */
+#define MANIFEST_BATCH		256	/* Page requests sent per write */
+#define MANIFEST_SAVE_INTERVAL	1024	/* Faults between saves */
+
+/* Function prototypes */
+void manifest_start(const char *filename);
+void manifest_record(uint64_t page_offset, const uint8_t *page);
+void manifest_update(uint64_t page_offset, const uint8_t *page);
+bool manifest_lookup(uint64_t page_offset, uint8_t *page);
+void manifest_save(void);
+void manifest_warm(int client_socket_fd, uint64_t memory_size, bool resumed);
+
+#endif /* _MANIFEST_H_ */
@@ -0,0 +1,424 @@
+/*
+    File:
+        netmem.cpp
+    Author:
+        Ryan Gordon
+    Notes:
+        Region class of libnetmem. Pages are read with REQUEST_PAGE and
+        written with REQUEST_PAGE_SYNC. A sync has no response of its own,
+        so each put is followed by a zero-length range read whose reply
+        tells us the server has applied it; that way every request gets
+        exactly one reply and replies can be matched up in order.
+
+        Streams use REQUEST_STREAM_RANGE, which sends a whole range in
+        one reply, so loading a region costs one round trip.
+
+        Socket errors never reach die(): the receiver runs with
+        SOCKET_ERRORS_RETURN, requests go out with MSG_NOSIGNAL, and a
+        dropped connection fails whatever is in flight.
+*/
+
+#include "shared.h"
+#include "netmem.h"
+#include <netinet/tcp.h>
+using namespace std;
+
+namespace netmem {
+
+/* Send all of a request; false if the connection is gone */
+static bool region_send(int socket_fd, uint8_t *buffer, int length) {
+    while (length > 0) {
+        int count = comms_try_send(socket_fd, buffer, length);
+        if (count < 0) {
+            return false;
+        }
+        buffer += count;
+        length -= count;
+    }
+    return true;
+}
+
+Region::Region() : socket_fd(-1), region_size(0), running(false), failed(false), dropped(false) {
+    pthread_mutex_init(&send_mutex, NULL);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+Region::~Region() {
+    close();
+    pthread_mutex_destroy(&send_mutex);
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+/* Connect to a server; size must match the region other clients use */
+bool Region::open(const char *hostname, int port, uint64_t size) {
+    struct sockaddr_in server_addr;
+    int nodelay = 1;
+
+    if (socket_fd != -1) {
+        return false;
+    }
+
+    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        return false;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, hostname, &server_addr.sin_addr.s_addr);
+
+    /* Requests are small and pipelined; do not hold them back */
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    /* A server that drops us during the handshake is just a failed open */
+    bool connected = connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0;
+    if (connected) {
+        int mode = socket_error_mode(SOCKET_ERRORS_RETURN);
+        connected = nm_client_connect(socket_fd, NETMEM_PAGE_SIZE, size) && !socket_error_check();
+        socket_error_mode(mode);
+    }
+
+    region_size = size;
+    running = true;
+    failed = false;
+    dropped = false;
+    if (!connected || pthread_create(&receiver, NULL, receive_thread, this) != 0) {
+        ::close(socket_fd);
+        socket_fd = -1;
+        running = false;
+        return false;
+    }
+
+    return true;
+}
+
+void Region::close() {
+    if (socket_fd == -1) {
+        return;
+    }
+
+    flush();
+
+    pthread_mutex_lock(&mutex);
+    running = false;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(receiver, NULL);
+
+    for (map<uint64_t, Prefetch *>::iterator it = prefetched.begin(); it != prefetched.end(); ++it) {
+        delete it->second;
+    }
+    prefetched.clear();
+
+    if (!dropped) {
+        uint8_t opcode = CLIENT_DISCONNECT;
+        region_send(socket_fd, &opcode, 1);
+    }
+    ::close(socket_fd);
+    socket_fd = -1;
+}
+
+/* Queue a request and send it; blocks while the window is full */
+void Region::submit(uint8_t opcode, uint64_t offset, uint64_t bytes, uint8_t *page, Callback done) {
+    uint8_t request[2 * (1 + 2 * PTR_SIZE) + NETMEM_PAGE_SIZE];
+    int length = 0;
+    bool valid;
+
+    if (opcode == REQUEST_STREAM_RANGE) {
+        valid = (offset <= region_size && bytes <= region_size - offset);
+    } else {
+        valid = !(offset & (NETMEM_PAGE_SIZE - 1)) && offset < region_size;
+    }
+    if (socket_fd == -1 || !valid || lost()) {
+        done(false);
+        return;
+    }
+
+    /* Encode the whole request so it goes out in one write */
+    request[length++] = opcode;
+    *(uint64_t *)&request[length] = offset;
+    length += PTR_SIZE;
+    if (opcode == REQUEST_STREAM_RANGE) {
+        *(uint64_t *)&request[length] = bytes;
+        length += PTR_SIZE;
+    }
+    if (opcode == REQUEST_PAGE_SYNC) {
+        memcpy(&request[length], page, NETMEM_PAGE_SIZE);
+        length += NETMEM_PAGE_SIZE;
+
+        /* Acknowledgement probe */
+        request[length++] = REQUEST_READ_RANGE;
+        *(uint64_t *)&request[length] = offset;
+        *(uint64_t *)&request[length + PTR_SIZE] = 0;
+        length += 2 * PTR_SIZE;
+    }
+
+    Request entry;
+    entry.opcode = opcode;
+    entry.length = bytes;
+    entry.page = page;
+    entry.done = done;
+
+    pthread_mutex_lock(&send_mutex);
+    pthread_mutex_lock(&mutex);
+    while (inflight.size() >= NETMEM_MAX_INFLIGHT && !dropped) {
+        pthread_cond_wait(&cond, &mutex);
+    }
+    if (dropped) {
+        pthread_mutex_unlock(&mutex);
+        pthread_mutex_unlock(&send_mutex);
+        done(false);
+        return;
+    }
+    inflight.push_back(entry);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    /* The receiver sees the shutdown and fails this request with the rest */
+    if (!region_send(socket_fd, request, length)) {
+        shutdown(socket_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&send_mutex);
+}
+
+void *Region::receive_thread(void *arg) {
+    /* A dropped server fails the requests, it must not exit the host */
+    socket_error_mode(SOCKET_ERRORS_RETURN);
+    ((Region *)arg)->receive();
+    return NULL;
+}
+
+/* Connection dropped: complete everything in flight as failed */
+void Region::fail_all() {
+    pthread_mutex_lock(&mutex);
+    std::deque<Request> pending;
+    pending.swap(inflight);
+    dropped = true;
+    failed = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        pending[i].done(false);
+    }
+}
+
+bool Region::lost() {
+    pthread_mutex_lock(&mutex);
+    bool result = dropped;
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+/* Complete requests in the order they were sent */
+void Region::receive() {
+    while (true) {
+        pthread_mutex_lock(&mutex);
+        while (running && inflight.empty()) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        if (inflight.empty()) {
+            pthread_mutex_unlock(&mutex);
+            break;
+        }
+        Request entry = inflight.front();
+        pthread_mutex_unlock(&mutex);
+
+        bool ok = true;
+        if (entry.opcode == REQUEST_PAGE) {
+            comms_get(socket_fd, entry.page, NETMEM_PAGE_SIZE);
+        } else if (entry.opcode == REQUEST_STREAM_RANGE) {
+            ok = (comms_getb(socket_fd) == RESPONSE_RANGE_OK);
+            for (uint64_t done = 0; ok && done < entry.length; ) {
+                int chunk = (int)std::min(entry.length - done, (uint64_t)REGION_STREAM_CHUNK);
+                comms_get(socket_fd, entry.page + done, chunk);
+                done += chunk;
+            }
+        } else {
+            ok = (comms_getb(socket_fd) == RESPONSE_RANGE_OK);
+        }
+
+        if (socket_error_check()) {
+            fail_all();
+            break;
+        }
+
+        pthread_mutex_lock(&mutex);
+        inflight.pop_front();
+        if (!ok) {
+            failed = true;
+        }
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+
+        entry.done(ok);
+    }
+}
+
+void Region::get_async(uint64_t offset, uint8_t *page, Callback done) {
+    submit(REQUEST_PAGE, offset, NETMEM_PAGE_SIZE, page, done);
+}
+
+void Region::put_async(uint64_t offset, const uint8_t *page, Callback done) {
+    /* Anything prefetched for this page is now out of date */
+    pthread_mutex_lock(&mutex);
+    map<uint64_t, Prefetch *>::iterator it = prefetched.find(offset);
+    if (it != prefetched.end()) {
+        if (it->second->ready) {
+            delete it->second;
+        } else {
+            it->second->stale = true;
+        }
+        prefetched.erase(it);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    submit(REQUEST_PAGE_SYNC, offset, NETMEM_PAGE_SIZE, (uint8_t *)page, done);
+}
+
+std::future<bool> Region::get_async(uint64_t offset, uint8_t *page) {
+    std::shared_ptr<std::promise<bool> > result = std::make_shared<std::promise<bool> >();
+    std::future<bool> future = result->get_future();
+
+    get_async(offset, page, [result](bool ok) { result->set_value(ok); });
+    return future;
+}
+
+std::future<bool> Region::put_async(uint64_t offset, const uint8_t *page) {
+    std::shared_ptr<std::promise<bool> > result = std::make_shared<std::promise<bool> >();
+    std::future<bool> future = result->get_future();
+
+    put_async(offset, page, [result](bool ok) { result->set_value(ok); });
+    return future;
+}
+
+bool Region::get(uint64_t offset, uint8_t *page) {
+    pthread_mutex_lock(&mutex);
+    map<uint64_t, Prefetch *>::iterator it = prefetched.find(offset);
+    if (it != prefetched.end()) {
+        Prefetch *entry = it->second;
+        prefetched.erase(it);
+
+        /* Entry left the map, so completion will not touch it again */
+        while (!entry->ready) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+
+        bool ok = entry->ok;
+        if (ok) {
+            memcpy(page, &entry->data[0], NETMEM_PAGE_SIZE);
+        }
+        delete entry;
+        if (ok) {
+            return true;
+        }
+    } else {
+        pthread_mutex_unlock(&mutex);
+    }
+
+    return get_async(offset, page).get();
+}
+
+bool Region::put(uint64_t offset, const uint8_t *page) {
+    return put_async(offset, page).get();
+}
+
+void Region::prefetch_done(Prefetch *entry, bool ok) {
+    pthread_mutex_lock(&mutex);
+    entry->ok = ok;
+    entry->ready = true;
+    bool stale = entry->stale;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    if (stale) {
+        delete entry;
+    }
+}
+
+void Region::prefetch(uint64_t offset, uint64_t length) {
+    uint64_t first = offset & ~(uint64_t)(NETMEM_PAGE_SIZE - 1);
+    uint64_t end = std::min(offset + length, region_size);
+
+    for (uint64_t page = first; page < end; page += NETMEM_PAGE_SIZE) {
+        pthread_mutex_lock(&mutex);
+        if (prefetched.count(page)) {
+            pthread_mutex_unlock(&mutex);
+            continue;
+        }
+        Prefetch *entry = new Prefetch;
+        entry->data.resize(NETMEM_PAGE_SIZE);
+        entry->ready = false;
+        entry->ok = false;
+        entry->stale = false;
+        prefetched[page] = entry;
+        pthread_mutex_unlock(&mutex);
+
+        get_async(page, &entry->data[0], [this, entry](bool ok) { prefetch_done(entry, ok); });
+    }
+}
+
+void Region::stream_async(uint64_t offset, uint64_t length, uint8_t *buffer, Callback done) {
+    submit(REQUEST_STREAM_RANGE, offset, length, buffer, done);
+}
+
+std::future<bool> Region::stream_async(uint64_t offset, uint64_t length, uint8_t *buffer) {
+    std::shared_ptr<std::promise<bool> > result = std::make_shared<std::promise<bool> >();
+    std::future<bool> future = result->get_future();
+
+    stream_async(offset, length, buffer, [result](bool ok) { result->set_value(ok); });
+    return future;
+}
+
+bool Region::stream(uint64_t offset, uint64_t length, uint8_t *buffer) {
+    return stream_async(offset, length, buffer).get();
+}
+
+bool Region::load(uint64_t offset, uint64_t length) {
+    uint64_t first = offset & ~(uint64_t)(NETMEM_PAGE_SIZE - 1);
+    uint64_t end = std::min(offset + length, region_size);
+    if (first >= end) {
+        return true;
+    }
+    end = (end + NETMEM_PAGE_SIZE - 1) & ~(uint64_t)(NETMEM_PAGE_SIZE - 1);
+
+    std::vector<uint8_t> data(end - first);
+    if (!stream(first, end - first, &data[0])) {
+        return false;
+    }
+
+    /* Pages already cached or being fetched are left alone */
+    pthread_mutex_lock(&mutex);
+    for (uint64_t page = first; page < end; page += NETMEM_PAGE_SIZE) {
+        if (prefetched.count(page)) {
+            continue;
+        }
+        Prefetch *entry = new Prefetch;
+        entry->data.assign(data.begin() + (page - first), data.begin() + (page - first) + NETMEM_PAGE_SIZE);
+        entry->ready = true;
+        entry->ok = true;
+        entry->stale = false;
+        prefetched[page] = entry;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+}
+
+bool Region::flush() {
+    pthread_mutex_lock(&mutex);
+    while (!inflight.empty()) {
+        pthread_cond_wait(&cond, &mutex);
+    }
+    bool ok = !failed;
+    failed = false;
+    pthread_mutex_unlock(&mutex);
+
+    return ok;
+}
+
+}
@@ -0,0 +1,105 @@
+#ifndef _NETMEM_H_
+#define _NETMEM_H_
+
+/*
+ * libnetmem: in-process access to a netmem server without the kernel
+ * module. Requests are pipelined on one connection; a receiver thread
+ * matches responses to requests in order and completes them.
+ *
+ * Callbacks run on the receiver thread and must not wait on other
+ * requests of the same Region.
+ *
+ * The library never exits its host: if the server goes away, every
+ * request in flight completes with ok false, the Region is marked lost
+ * and later requests fail at once until it is closed and opened again.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <map>
+#include <vector>
+#include <future>
+#include <functional>
+
+#define NETMEM_PAGE_SIZE        0x1000
+#define NETMEM_MAX_INFLIGHT     256     /* Requests sent but not yet answered */
+
+namespace netmem {
+
+/* Completion callback; ok is false if the request failed */
+typedef std::function<void(bool ok)> Callback;
+
+class Region {
+public:
+    Region();
+    ~Region();
+
+    bool open(const char *hostname, int port, uint64_t size);
+    void close();
+    uint64_t size() const { return region_size; }
+
+    /* Blocking; offsets are page aligned and buffers hold one page */
+    bool get(uint64_t offset, uint8_t *page);
+    bool put(uint64_t offset, const uint8_t *page);
+
+    /* Asynchronous; page must stay valid until completion */
+    std::future<bool> get_async(uint64_t offset, uint8_t *page);
+    std::future<bool> put_async(uint64_t offset, const uint8_t *page);
+    void get_async(uint64_t offset, uint8_t *page, Callback done);
+    void put_async(uint64_t offset, const uint8_t *page, Callback done);
+
+    /* Fetch pages ahead of time; the next get() of each is served locally */
+    void prefetch(uint64_t offset, uint64_t length);
+
+    /* Bulk transfer of a whole range in one request, e.g. at startup */
+    bool stream(uint64_t offset, uint64_t length, uint8_t *buffer);
+    std::future<bool> stream_async(uint64_t offset, uint64_t length, uint8_t *buffer);
+    void stream_async(uint64_t offset, uint64_t length, uint8_t *buffer, Callback done);
+
+    /* Stream a range into the prefetch cache */
+    bool load(uint64_t offset, uint64_t length);
+
+    /* Wait for every outstanding request; false if any put failed */
+    bool flush();
+
+    /* True once the connection to the server has dropped */
+    bool lost();
+
+private:
+    struct Request {
+        uint8_t opcode;
+        uint64_t length;    /* Bytes expected for a stream */
+        uint8_t *page;
+        Callback done;
+    };
+
+    struct Prefetch {
+        std::vector<uint8_t> data;
+        bool ready;
+        bool ok;
+        bool stale;     /* Overwritten by a put; freed on completion */
+    };
+
+    void submit(uint8_t opcode, uint64_t offset, uint64_t length, uint8_t *page, Callback done);
+    void prefetch_done(Prefetch *entry, bool ok);
+    void receive();
+    void fail_all();
+    static void *receive_thread(void *arg);
+
+    int socket_fd;
+    uint64_t region_size;
+    bool running;
+    bool failed;
+    bool dropped;                   /* Connection lost; requests fail at once */
+    pthread_t receiver;
+    pthread_mutex_t send_mutex;     /* Keeps requests whole and in queue order */
+    pthread_mutex_t mutex;          /* Guards everything below */
+    pthread_cond_t cond;
+    std::deque<Request> inflight;
+    std::map<uint64_t, Prefetch *> prefetched;
+};
+
+}
+
+#endif /* _NETMEM_H_ */
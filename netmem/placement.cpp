@@ -0,0 +1,362 @@
+/*
+	File:
+		placement.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		NUMA placement of the shared memory slab and pinning of dispatch
+		threads. The node layout is read from sysfs and memory policy is
+		set with the mbind() system call directly, so no extra library is
+		needed; on a machine with one node everything here is a no-op.
+
+		Server options:
+		-numa interleave|shard|<node>	where region pages live
+		-pin				run dispatch threads on the node
+						owning the pages they use most
+		-hugepages			ask for transparent huge pages
+		-hugetlb			use explicit 2M huge pages
+*/
+
+#include "shared.h"
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sched.h>
+#include <map>
+using namespace std;
+
+static int placement_policy = PLACEMENT_FIRST_TOUCH;
+static int placement_target = 0;	/* Node for PLACEMENT_NODE */
+static bool placement_pin = false;
+static bool placement_thp = false;
+static bool placement_hugetlb = false;
+static int placement_node_count = 0;
+static cpu_set_t placement_node_cpus[PLACEMENT_MAX_NODES];
+static uint64 placement_slice = 0;	/* Bytes per node for PLACEMENT_SHARD */
+static pthread_mutex_t placement_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<uint8 *, uint64> placement_mappings;	/* Address -> mapped length */
+static const char *placement_names[] = { "first-touch", "interleave", "shard", "node" };
+
+/* Per-thread page accesses by node, used to choose where to pin */
+static __thread uint32_t placement_thread_hits[PLACEMENT_MAX_NODES];
+static __thread uint32_t placement_thread_count = 0;
+static __thread int placement_thread_node = -1;
+
+/* Parse a sysfs list such as "0-3,8-11" and call back for each entry */
+static void placement_parse_list(const char *text, void (*callback)(int, void *), void *arg)
+{
+	while(*text && *text != '\n')
+	{
+		char *end;
+		int first = strtol(text, &end, 10);
+		int last = first;
+
+		if(end == text)
+			break;
+		if(*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for(int i = first; i <= last; i++)
+			callback(i, arg);
+
+		text = (*end == ',') ? end + 1 : end;
+	}
+}
+
+static void placement_count_node(int node, void *arg)
+{
+	if(node < PLACEMENT_MAX_NODES)
+		placement_node_count = MAX(placement_node_count, node + 1);
+}
+
+static void placement_add_cpu(int cpu, void *arg)
+{
+	CPU_SET(cpu, (cpu_set_t *)arg);
+}
+
+/* Read a small sysfs file; returns false if it does not exist */
+static bool placement_read_sysfs(const char *path, char *text, int size)
+{
+	FILE *fd = fopen(path, "r");
+
+	if(!fd)
+		return false;
+	if(!fgets(text, size, fd))
+		text[0] = '\0';
+	fclose(fd);
+	return true;
+}
+
+/* Find the NUMA nodes and the CPUs on each */
+static void placement_topology(void)
+{
+	char text[4096], path[128];
+
+	if(placement_node_count)
+		return;
+
+	if(!placement_read_sysfs("/sys/devices/system/node/online", text, sizeof(text)))
+		strcpy(text, "0");
+	placement_parse_list(text, placement_count_node, NULL);
+	if(!placement_node_count)
+		placement_node_count = 1;
+
+	for(int i = 0; i < placement_node_count; i++)
+	{
+		CPU_ZERO(&placement_node_cpus[i]);
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", i);
+		if(placement_read_sysfs(path, text, sizeof(text)))
+			placement_parse_list(text, placement_add_cpu, &placement_node_cpus[i]);
+	}
+}
+
+/* Apply a memory policy to a range; nodes is a bitmask */
+static void placement_bind(uint8 *memory, uint64 size, int mode, unsigned long nodes)
+{
+	if(syscall(SYS_mbind, memory, size, mode, &nodes, PLACEMENT_MAX_NODES + 1, 0) == -1)
+		perror("placement_bind(): mbind(): ");
+}
+
+/* Read the -numa, -pin and huge page options */
+void placement_setup(int argc, char *argv[])
+{
+	int index;
+
+	placement_topology();
+
+	if((index = find_option(argc, argv, "-numa")) != -1 && index + 1 < argc)
+	{
+		char *mode = argv[index + 1];
+
+		if(strcmp(mode, "interleave") == 0)
+			placement_policy = PLACEMENT_INTERLEAVE;
+		else if(strcmp(mode, "shard") == 0)
+			placement_policy = PLACEMENT_SHARD;
+		else
+		{
+			placement_policy = PLACEMENT_NODE;
+			placement_target = atoi(mode);
+			if(placement_target < 0 || placement_target >= placement_node_count)
+				die("Error: NUMA node %d does not exist.\n", placement_target);
+		}
+	}
+	placement_pin = (find_option(argc, argv, "-pin") != -1);
+	placement_thp = (find_option(argc, argv, "-hugepages") != -1);
+	placement_hugetlb = (find_option(argc, argv, "-hugetlb") != -1);
+
+	printf("Server: %d NUMA node(s), %s placement%s%s.\n", placement_node_count,
+		placement_names[placement_policy], placement_pin ? ", pinned dispatch" : "",
+		placement_hugetlb ? ", huge pages" : placement_thp ? ", transparent huge pages" : "");
+}
+
+/* Allocate a slab for shared memory with the chosen placement; NULL on failure */
+uint8 *placement_alloc(uint64 size)
+{
+	uint64 length = size;
+	void *memory = MAP_FAILED;
+
+	/* Sizes can come from a client, so a bad one is refused rather than fatal */
+	if(!region_size_valid(size))
+		return NULL;
+
+	placement_topology();
+
+	if(placement_hugetlb)
+	{
+		length = (size + PLACEMENT_HUGE_SIZE - 1) & ~(uint64)(PLACEMENT_HUGE_SIZE - 1);
+		memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(memory == MAP_FAILED)
+			printf("Warning: No huge pages reserved for %llu bytes, using normal pages.\n", size);
+	}
+	if(memory == MAP_FAILED)
+	{
+		length = size;
+		memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(memory == MAP_FAILED)
+		{
+			perror("Error: mmap(): shared memory: ");
+			return NULL;
+		}
+		if(placement_thp)
+			madvise(memory, length, MADV_HUGEPAGE);
+	}
+
+	/* Policy must be set before the pages are first touched */
+	uint8 *base = (uint8 *)memory;
+	unsigned long all = (placement_node_count >= 64) ? ~0UL : (1UL << placement_node_count) - 1;
+
+	switch(placement_policy)
+	{
+		case PLACEMENT_INTERLEAVE:
+			placement_bind(base, length, MPOL_INTERLEAVE, all);
+			break;
+
+		case PLACEMENT_SHARD:
+			/* Slices are whole pages so a page never straddles two nodes */
+			placement_slice = (size / placement_node_count + shared_page_size - 1) &
+				~(uint64)(shared_page_size - 1);
+			for(int i = 0; i < placement_node_count && i * placement_slice < length; i++)
+				placement_bind(base + i * placement_slice,
+					MIN(placement_slice, length - i * placement_slice), MPOL_BIND, 1UL << i);
+			break;
+
+		case PLACEMENT_NODE:
+			placement_bind(base, length, MPOL_BIND, 1UL << placement_target);
+			break;
+	}
+
+	pthread_mutex_lock(&placement_mutex);
+	placement_mappings[base] = length;
+	pthread_mutex_unlock(&placement_mutex);
+
+	return base;
+}
+
+void placement_free(uint8 *memory, uint64 size)
+{
+	if(!memory)
+		return;
+
+	pthread_mutex_lock(&placement_mutex);
+	map<uint8 *, uint64>::iterator it = placement_mappings.find(memory);
+	uint64 length = (it != placement_mappings.end()) ? it->second : size;
+	if(it != placement_mappings.end())
+		placement_mappings.erase(it);
+	pthread_mutex_unlock(&placement_mutex);
+
+	munmap(memory, length);
+}
+
+/* Node that holds a byte of shared memory, or -1 if not fixed by policy */
+int placement_node(uint64 offset)
+{
+	switch(placement_policy)
+	{
+		case PLACEMENT_SHARD:
+			return placement_slice ? MIN(offset / placement_slice, (uint64)placement_node_count - 1) : 0;
+
+		case PLACEMENT_NODE:
+			return placement_target;
+	}
+	return -1;
+}
+
+/*
+	Count a page access by the calling dispatch thread. Every so often
+	the thread moves to the node holding most of the pages it used.
+*/
+void placement_touch(uint64 offset)
+{
+	if(!placement_pin || placement_node_count < 2)
+		return;
+
+	int node = placement_node(offset);
+	if(node < 0)
+		return;
+
+	placement_thread_hits[node]++;
+	if(++placement_thread_count < PLACEMENT_REPIN_INTERVAL)
+		return;
+
+	int best = 0;
+	for(int i = 1; i < placement_node_count; i++)
+	{
+		if(placement_thread_hits[i] > placement_thread_hits[best])
+			best = i;
+	}
+
+	/* Halve the history so the choice follows the current working set */
+	for(int i = 0; i < placement_node_count; i++)
+		placement_thread_hits[i] /= 2;
+	placement_thread_count = 0;
+
+	if(best != placement_thread_node && CPU_COUNT(&placement_node_cpus[best]))
+	{
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement_node_cpus[best]) == 0)
+			placement_thread_node = best;
+	}
+}
+
+/*------------------------------------------------*/
+
+/* Random page copies out of a buffer, returns nanoseconds per page */
+static double placement_bench_copy(uint8 *memory, uint64 size, int passes)
+{
+	uint64 pages = size / shared_page_size;
+	uint64 seed = 0x9E3779B97F4A7C15ULL;
+	uint8 *page = new uint8 [shared_page_size];
+	struct timeval start, stop;
+
+	gettimeofday(&start, NULL);
+	for(uint64 i = 0; i < pages * passes; i++)
+	{
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		memcpy(page, memory + ((seed >> 33) % pages) * shared_page_size, shared_page_size);
+	}
+	gettimeofday(&stop, NULL);
+
+	/* Keep the copies from being optimised away */
+	if(page[0] == 0xFF && page[1] == 0xFE)
+		printf(" ");
+	delete []page;
+
+	double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+	return seconds * 1e9 / (pages * passes);
+}
+
+/* Allocate, fault in and time one placement */
+static void placement_bench_case(const char *name, int policy, int node, uint64 size, int passes)
+{
+	placement_policy = policy;
+	placement_target = node;
+
+	uint8 *memory = placement_alloc(size);
+	if(!memory)
+		die("Error: Cannot allocate %llu bytes.\n", size);
+	memset(memory, 0x5A, size);
+
+	double ns = placement_bench_copy(memory, size, passes);
+	printf("%-12s %10.1f ns/page %10.1f MB/s\n", name, ns,
+		shared_page_size / ns * 1e3);
+
+	placement_free(memory, size);
+}
+
+/*
+	Usage: n [-m megabytes] [-passes count] [-hugepages] [-hugetlb]
+	Compares page copy speed from memory on the local node, a remote
+	node and interleaved over all nodes, running on node 0.
+*/
+int run_placement_bench(int argc, char *argv[])
+{
+	uint64 size = 256ULL << 20;
+	int passes = 4;
+	int index;
+
+	if((index = find_option(argc, argv, "-m")) != -1 && index + 1 < argc)
+		size = (uint64)atoi(argv[index + 1]) << 20;
+	if((index = find_option(argc, argv, "-passes")) != -1 && index + 1 < argc)
+		passes = MAX(atoi(argv[index + 1]), 1);
+	placement_thp = (find_option(argc, argv, "-hugepages") != -1);
+	placement_hugetlb = (find_option(argc, argv, "-hugetlb") != -1);
+
+	placement_topology();
+	if(CPU_COUNT(&placement_node_cpus[0]))
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &placement_node_cpus[0]);
+
+	printf("%d NUMA node(s), %llu MB buffer, %d passes, running on node 0\n",
+		placement_node_count, size >> 20, passes);
+
+	placement_bench_case("local", PLACEMENT_NODE, 0, size, passes);
+	if(placement_node_count > 1)
+		placement_bench_case("remote", PLACEMENT_NODE, placement_node_count - 1, size, passes);
+	else
+		printf("%-12s skipped, only one node\n", "remote");
+	placement_bench_case("interleave", PLACEMENT_INTERLEAVE, 0, size, passes);
+	placement_bench_case("first-touch", PLACEMENT_FIRST_TOUCH, 0, size, passes);
+
+	return 0;
+}
+
+/* End */
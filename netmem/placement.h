@@ -0,0 +1,23 @@
+#ifndef _PLACEMENT_H_
+#define _PLACEMENT_H_
+
+#define PLACEMENT_MAX_NODES	64
+#define PLACEMENT_REPIN_INTERVAL	256	/* Page accesses between pinning checks */
+#define PLACEMENT_HUGE_SIZE	0x200000	/* Explicit huge page size */
+
+enum {
+	PLACEMENT_FIRST_TOUCH,	/* Kernel default, node of the first writer */
+	PLACEMENT_INTERLEAVE,	/* Pages spread round-robin over all nodes */
+	PLACEMENT_SHARD,	/* One contiguous slice of the region per node */
+	PLACEMENT_NODE		/* Whole region on one node */
+};
+
+/* Function prototypes */
+void placement_setup(int argc, char *argv[]);
+uint8 *placement_alloc(uint64 size);
+void placement_free(uint8 *memory, uint64 size);
+int placement_node(uint64 offset);
+void placement_touch(uint64 offset);
+int run_placement_bench(int argc, char *argv[]);
+
+#endif /* _PLACEMENT_H_ */
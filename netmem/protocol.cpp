@@ -0,0 +1,767 @@
+/*
+    File:
+        protocol.cpp
+    Author:
+        Charles MacDonald
+        Ryan Gordon
+        Britto Thomas
+    Notes:
+        Client side of the wire protocol, one blocking call per request.
+        Split out of client.cpp so it can be linked into libnetmem as well
+        as the kernel module bridge.
+*/
+
+#include "shared.h"
+using namespace std;
+
+bool nm_client_connect(int client_socket_fd, uint64_t page_size, uint64_t memory_size) {
+    trace_connect(client_socket_fd);
+
+    /* Send command and parameters */
+    comms_sendb(client_socket_fd, CLIENT_CONNECT);
+    comms_sendq(client_socket_fd, page_size);
+    comms_sendq(client_socket_fd, memory_size);
+
+    /* Get status */
+    uint8_t status = comms_getb(client_socket_fd);
+
+    /* Return status */
+    return (status == NM_RESPONSE_ACK) ? true : false;
+}
+
+/* Connect to a region of exactly this size; unlike nm_client_connect() it never resizes it */
+bool nm_client_attach(int client_socket_fd, uint64_t page_size, uint64_t memory_size) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+
+    trace_connect(client_socket_fd);
+
+    request[0] = CLIENT_ATTACH;
+    *(uint64_t *)&request[1] = page_size;
+    *(uint64_t *)&request[1 + PTR_SIZE] = memory_size;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    return (comms_getb(client_socket_fd) == NM_RESPONSE_ACK) ? true : false;
+}
+
+/* Connect, reattaching to a session if it is still known; *session is 0 for a new one */
+bool nm_client_resume(int client_socket_fd, uint64_t *session, uint64_t page_size, uint64_t memory_size, bool *resumed) {
+    uint8_t request[1 + 3 * PTR_SIZE];
+    uint8_t response[PTR_SIZE + 1];
+
+    trace_connect(client_socket_fd);
+
+    request[0] = CLIENT_RESUME;
+    *(uint64_t *)&request[1] = *session;
+    *(uint64_t *)&request[1 + PTR_SIZE] = page_size;
+    *(uint64_t *)&request[1 + 2 * PTR_SIZE] = memory_size;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    if (comms_getb(client_socket_fd) != NM_RESPONSE_ACK) {
+        return false;
+    }
+    comms_get(client_socket_fd, response, sizeof(response));
+    *session = *(uint64_t *)&response[0];
+    *resumed = response[PTR_SIZE] ? true : false;
+
+    return true;
+}
+
+/* Bind another connection to an attached session as an extra lane */
+bool nm_client_join(int client_socket_fd, uint64_t session) {
+    uint8_t request[1 + PTR_SIZE];
+
+    trace_connect(client_socket_fd);
+
+    request[0] = CLIENT_JOIN;
+    *(uint64_t *)&request[1] = session;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    return (comms_getb(client_socket_fd) == NM_RESPONSE_ACK) ? true : false;
+}
+
+void nm_client_disconnect(int client_socket_fd) {
+    comms_sendb(client_socket_fd, CLIENT_DISCONNECT);
+}
+
+bool nm_client_request_sync(int client_socket_fd, uint64_t value, uint8_t *buffer) {
+    uint8_t request[SYNC_REQUEST_SIZE];
+
+    /* Send command, offset and page in one write so Nagle cannot stall it */
+    trace_add(client_socket_fd, REQUEST_PAGE_SYNC, value, CLIENT_PAGE_SIZE);
+    request[0] = REQUEST_PAGE_SYNC;
+    *(uint64_t *)&request[1] = value;
+    memcpy(&request[1 + PAGE_OFFSET_SIZE], buffer, CLIENT_PAGE_SIZE);
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    return true;
+}
+
+bool nm_client_request_page(int client_socket_fd, uint64_t value, uint8_t *buffer) {
+    uint8_t request[PAGE_REQUEST_SIZE];
+
+    trace_add(client_socket_fd, REQUEST_PAGE, value, CLIENT_PAGE_SIZE);
+
+    /* Send page request command and offset together */
+    request[0] = REQUEST_PAGE;
+    *(uint64_t *)&request[1] = value;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    /* Send page if status is OK */
+    comms_get(client_socket_fd, buffer, CLIENT_PAGE_SIZE);
+
+    return true;
+}
+
+/* A page from a server at most max_ms behind the primary; false if it is further behind */
+bool nm_client_request_page_bounded(int client_socket_fd, uint64_t value, uint64_t max_ms, uint8_t *buffer) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+
+    trace_add(client_socket_fd, REQUEST_PAGE_BOUNDED, value, CLIENT_PAGE_SIZE);
+    request[0] = REQUEST_PAGE_BOUNDED;
+    *(uint64_t *)&request[1] = value;
+    *(uint64_t *)&request[1 + PTR_SIZE] = max_ms;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    if (comms_getb(client_socket_fd) != RESPONSE_PAGE_OK)
+        return false;
+    comms_get(client_socket_fd, buffer, CLIENT_PAGE_SIZE);
+
+    return true;
+}
+
+/* Several pages with one write; replies are read back in order */
+bool nm_client_request_pages(int client_socket_fd, const uint64_t *offsets, int count, uint8_t *buffer) {
+    uint8_t *request = (uint8_t *)malloc(count * PAGE_REQUEST_SIZE);
+
+    for (int i = 0; i < count; i++) {
+        trace_add(client_socket_fd, REQUEST_PAGE, offsets[i], CLIENT_PAGE_SIZE);
+        request[i * PAGE_REQUEST_SIZE] = REQUEST_PAGE;
+        *(uint64_t *)&request[i * PAGE_REQUEST_SIZE + 1] = offsets[i];
+    }
+    comms_send(client_socket_fd, request, count * PAGE_REQUEST_SIZE);
+    free(request);
+
+    for (int i = 0; i < count; i++) {
+        comms_get(client_socket_fd, &buffer[i * CLIENT_PAGE_SIZE], CLIENT_PAGE_SIZE);
+    }
+
+    return true;
+}
+
+/* Check cached pages by CRC32C; returns how many are stale, listed in stale */
+int nm_client_revalidate(int client_socket_fd, const uint64_t *offsets, const uint32_t *crcs, int count, uint64_t *stale) {
+    uint8_t *request = (uint8_t *)malloc(1 + PTR_SIZE + count * REVALIDATE_ENTRY_SIZE);
+
+    request[0] = REQUEST_REVALIDATE;
+    *(uint64_t *)&request[1] = count;
+    for (int i = 0; i < count; i++) {
+        uint8_t *entry = &request[1 + PTR_SIZE + i * REVALIDATE_ENTRY_SIZE];
+        *(uint64_t *)&entry[0] = offsets[i];
+        *(uint32_t *)&entry[PTR_SIZE] = crcs[i];
+    }
+    comms_send(client_socket_fd, request, 1 + PTR_SIZE + count * REVALIDATE_ENTRY_SIZE);
+    free(request);
+
+    if (comms_getb(client_socket_fd) != RESPONSE_REVALIDATE) {
+        return -1;
+    }
+    uint64_t found = comms_getq(client_socket_fd);
+    if (found > (uint64_t)count) {
+        return -1;
+    }
+    comms_get(client_socket_fd, (uint8_t *)stale, found * sizeof(uint64_t));
+
+    return (int)found;
+}
+
+/* Byte-range access for records smaller than a page */
+
+bool nm_client_read_range(int client_socket_fd, uint64_t offset, uint64_t length, uint8_t *buffer) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+
+    trace_add(client_socket_fd, REQUEST_READ_RANGE, offset, length);
+
+    /* Send opcode, offset and length in one write */
+    request[0] = REQUEST_READ_RANGE;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[1 + PTR_SIZE] = length;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    /* Data follows only if the range was accepted */
+    if (comms_getb(client_socket_fd) != RESPONSE_RANGE_OK) {
+        return false;
+    }
+    comms_get(client_socket_fd, buffer, length);
+
+    return true;
+}
+
+/* Send a range write without waiting; replies come back in order */
+void nm_client_write_range_send(int client_socket_fd, uint64_t offset, uint64_t length, const uint8_t *buffer) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+
+    trace_add(client_socket_fd, REQUEST_WRITE_RANGE, offset, length);
+    request[0] = REQUEST_WRITE_RANGE;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[1 + PTR_SIZE] = length;
+    comms_send(client_socket_fd, request, sizeof(request));
+    comms_send(client_socket_fd, (uint8_t *)buffer, length);
+}
+
+bool nm_client_write_range_wait(int client_socket_fd) {
+    return (comms_getb(client_socket_fd) == RESPONSE_RANGE_OK) ? true : false;
+}
+
+bool nm_client_write_range(int client_socket_fd, uint64_t offset, uint64_t length, const uint8_t *buffer) {
+    nm_client_write_range_send(client_socket_fd, offset, length, buffer);
+    return nm_client_write_range_wait(client_socket_fd);
+}
+
+/* Whole range back-to-back, e.g. straight into the mapped region at startup */
+bool nm_client_stream_range(int client_socket_fd, uint64_t offset, uint64_t length, uint8_t *buffer) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+
+    trace_add(client_socket_fd, REQUEST_STREAM_RANGE, offset, length);
+    request[0] = REQUEST_STREAM_RANGE;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[1 + PTR_SIZE] = length;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    if (comms_getb(client_socket_fd) != RESPONSE_RANGE_OK) {
+        return false;
+    }
+
+    /* comms_get() takes an int length; large ranges come in pieces */
+    while (length) {
+        int chunk = (int)std::min(length, (uint64_t)REGION_STREAM_CHUNK);
+        comms_get(client_socket_fd, buffer, chunk);
+        buffer += chunk;
+        length -= chunk;
+    }
+
+    return true;
+}
+
+/* Near-data operations; only the result comes back */
+
+static bool nm_client_compute(int client_socket_fd, uint8_t opcode, const uint64_t *args, int count,
+                              const uint8_t *pattern, uint64_t pattern_length, uint64_t *result) {
+    uint8_t request[1 + 4 * PTR_SIZE + COMPUTE_PATTERN_MAX];
+    uint64_t size = 1 + count * PTR_SIZE;
+
+    if (pattern && (!pattern_length || pattern_length > COMPUTE_PATTERN_MAX)) {
+        return false;
+    }
+
+    /* Send opcode, arguments and pattern in one write */
+    request[0] = opcode;
+    memcpy(&request[1], args, count * PTR_SIZE);
+    if (pattern) {
+        *(uint64_t *)&request[size] = pattern_length;
+        memcpy(&request[size + PTR_SIZE], pattern, pattern_length);
+        size += PTR_SIZE + pattern_length;
+    }
+    comms_send(client_socket_fd, request, size);
+
+    if (comms_getb(client_socket_fd) != RESPONSE_COMPUTE_OK) {
+        return false;
+    }
+    uint64_t value = comms_getq(client_socket_fd);
+    if (result) {
+        *result = value;
+    }
+
+    return true;
+}
+
+/* Fill a range with a repeating pattern of up to COMPUTE_PATTERN_MAX bytes */
+bool nm_client_fill(int client_socket_fd, uint64_t offset, uint64_t length, const uint8_t *pattern, uint64_t pattern_length) {
+    uint64_t args[2] = { offset, length };
+    uint64_t filled;
+
+    trace_add(client_socket_fd, REQUEST_RANGE_FILL, offset, length);
+    return nm_client_compute(client_socket_fd, REQUEST_RANGE_FILL, args, 2, pattern, pattern_length, &filled);
+}
+
+/* Copy a range within shared memory; the ranges may overlap */
+bool nm_client_move(int client_socket_fd, uint64_t source, uint64_t destination, uint64_t length) {
+    uint64_t args[3] = { source, destination, length };
+    uint64_t moved;
+
+    trace_add(client_socket_fd, REQUEST_RANGE_MOVE, destination, length);
+    return nm_client_compute(client_socket_fd, REQUEST_RANGE_MOVE, args, 3, NULL, 0, &moved);
+}
+
+/* *difference, if given, is the index of the first byte that differs, or length if equal */
+bool nm_client_compare(int client_socket_fd, uint64_t offset, uint64_t other, uint64_t length, uint64_t *difference) {
+    uint64_t args[3] = { offset, other, length };
+
+    trace_add(client_socket_fd, REQUEST_RANGE_COMPARE, offset, length);
+    return nm_client_compute(client_socket_fd, REQUEST_RANGE_COMPARE, args, 3, NULL, 0, difference);
+}
+
+/* Offsets of up to max occurrences of a pattern; returns how many, or -1 on error */
+int nm_client_find(int client_socket_fd, uint64_t offset, uint64_t length, const uint8_t *pattern,
+                   uint64_t pattern_length, uint64_t *matches, int max) {
+    uint64_t args[3] = { offset, length, (uint64_t)std::min(std::max(max, 0), COMPUTE_FIND_MAX) };
+    uint64_t found;
+
+    trace_add(client_socket_fd, REQUEST_RANGE_FIND, offset, length);
+    if (!nm_client_compute(client_socket_fd, REQUEST_RANGE_FIND, args, 3, pattern, pattern_length, &found)) {
+        return -1;
+    }
+    if (found > args[2]) {
+        return -1;
+    }
+    comms_get(client_socket_fd, (uint8_t *)matches, found * sizeof(uint64_t));
+
+    return (int)found;
+}
+
+/* Atomic operations; the server returns the old value of the word */
+
+static bool nm_client_atomic(int client_socket_fd, uint8_t opcode, uint64_t offset, uint64_t arg1, uint64_t arg2, int args, uint64_t *old) {
+    uint8_t request[1 + 3 * ATOMIC_WORD_SIZE];
+    uint8_t response[1 + ATOMIC_WORD_SIZE];
+
+    trace_add(client_socket_fd, opcode, offset, ATOMIC_WORD_SIZE);
+
+    /* Send opcode, offset and arguments in one write */
+    request[0] = opcode;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[9] = arg1;
+    *(uint64_t *)&request[17] = arg2;
+    comms_send(client_socket_fd, request, 1 + args * ATOMIC_WORD_SIZE);
+
+    /* Get status and old value */
+    comms_get(client_socket_fd, response, sizeof(response));
+    if (old) {
+        *old = *(uint64_t *)&response[1];
+    }
+
+    return (response[0] == RESPONSE_ATOMIC_OK) ? true : false;
+}
+
+bool nm_client_atomic_cas(int client_socket_fd, uint64_t offset, uint64_t expected, uint64_t desired, uint64_t *old) {
+    return nm_client_atomic(client_socket_fd, REQUEST_ATOMIC_CAS, offset, expected, desired, 3, old);
+}
+
+bool nm_client_atomic_fetch_add(int client_socket_fd, uint64_t offset, uint64_t addend, uint64_t *old) {
+    return nm_client_atomic(client_socket_fd, REQUEST_ATOMIC_FADD, offset, addend, 0, 2, old);
+}
+
+bool nm_client_atomic_exchange(int client_socket_fd, uint64_t offset, uint64_t value, uint64_t *old) {
+    return nm_client_atomic(client_socket_fd, REQUEST_ATOMIC_XCHG, offset, value, 0, 2, old);
+}
+
+bool nm_client_atomic_batch(int client_socket_fd, struct nm_atomic_op *ops, int count) {
+    uint8_t *request;
+    uint8_t *results;
+    int i;
+
+    if (count < 0 || count > ATOMIC_BATCH_MAX) {
+        return false;
+    }
+
+    /* Encode all entries into a single request */
+    request = (uint8_t *)calloc(1 + PTR_SIZE + count * ATOMIC_ENTRY_SIZE, sizeof(uint8_t));
+    request[0] = REQUEST_ATOMIC_BATCH;
+    *(uint64_t *)&request[1] = count;
+    for (i = 0; i < count; i++) {
+        uint8_t *entry = &request[1 + PTR_SIZE + i * ATOMIC_ENTRY_SIZE];
+        entry[0] = ops[i].opcode;
+        *(uint64_t *)&entry[1] = ops[i].offset;
+        *(uint64_t *)&entry[9] = ops[i].arg1;
+        *(uint64_t *)&entry[17] = ops[i].arg2;
+    }
+    comms_send(client_socket_fd, request, 1 + PTR_SIZE + count * ATOMIC_ENTRY_SIZE);
+    free(request);
+
+    /* Whole batch is rejected if any entry was invalid */
+    if (comms_getb(client_socket_fd) != RESPONSE_ATOMIC_OK) {
+        return false;
+    }
+
+    results = (uint8_t *)calloc(count, ATOMIC_WORD_SIZE);
+    comms_get(client_socket_fd, results, count * ATOMIC_WORD_SIZE);
+    for (i = 0; i < count; i++) {
+        ops[i].result = *(uint64_t *)&results[i * ATOMIC_WORD_SIZE];
+    }
+    free(results);
+
+    return true;
+}
+
+/*
+ * Optimistic transactions. Pages are read along with their version; a
+ * commit applies all of its writes only if every page read is still at
+ * the version that was seen, otherwise the caller reads again and retries.
+ */
+
+bool nm_client_tx_read(int client_socket_fd, uint64_t offset, int pages, uint8_t *buffer, uint64_t *versions) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+    int i;
+
+    if (pages <= 0 || pages > TX_PAGES_MAX) {
+        return false;
+    }
+
+    trace_add(client_socket_fd, REQUEST_TX_READ, offset, (uint64_t)pages * CLIENT_PAGE_SIZE);
+    request[0] = REQUEST_TX_READ;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[1 + PTR_SIZE] = pages;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    if (comms_getb(client_socket_fd) != RESPONSE_TX_READ) {
+        return false;
+    }
+    for (i = 0; i < pages; i++) {
+        versions[i] = comms_getq(client_socket_fd);
+        comms_get(client_socket_fd, &buffer[i * CLIENT_PAGE_SIZE], CLIENT_PAGE_SIZE);
+    }
+
+    return true;
+}
+
+/* Returns 1 if committed, 0 if aborted because the page at *conflict changed, -1 on error */
+int nm_client_tx_commit(int client_socket_fd, const struct nm_tx_read *reads, int read_count,
+                        const struct nm_tx_write *writes, int write_count, uint64_t *conflict) {
+    uint64_t size = 1 + 2 * PTR_SIZE + read_count * 2 * PTR_SIZE;
+    uint64_t low = ~0ULL, high = 0;
+    uint8_t *request;
+    uint8_t *entry;
+    int i;
+
+    if (read_count < 0 || write_count < 0) {
+        return -1;
+    }
+    for (i = 0; i < write_count; i++) {
+        size += 2 * PTR_SIZE + writes[i].length;
+        low = std::min(low, writes[i].offset);
+        high = std::max(high, writes[i].offset + writes[i].length);
+    }
+    trace_add(client_socket_fd, REQUEST_TX_COMMIT, write_count ? low : 0, write_count ? high - low : 0);
+
+    /* Encode the read set and the writes into a single request */
+    request = (uint8_t *)malloc(size);
+    request[0] = REQUEST_TX_COMMIT;
+    *(uint64_t *)&request[1] = read_count;
+    *(uint64_t *)&request[1 + PTR_SIZE] = write_count;
+    entry = &request[1 + 2 * PTR_SIZE];
+    for (i = 0; i < read_count; i++) {
+        *(uint64_t *)&entry[0] = reads[i].offset;
+        *(uint64_t *)&entry[PTR_SIZE] = reads[i].version;
+        entry += 2 * PTR_SIZE;
+    }
+    for (i = 0; i < write_count; i++) {
+        *(uint64_t *)&entry[0] = writes[i].offset;
+        *(uint64_t *)&entry[PTR_SIZE] = writes[i].length;
+        memcpy(&entry[2 * PTR_SIZE], writes[i].data, writes[i].length);
+        entry += 2 * PTR_SIZE + writes[i].length;
+    }
+    comms_send(client_socket_fd, request, size);
+    free(request);
+
+    uint8_t status = comms_getb(client_socket_fd);
+    if (status == RESPONSE_TX_COMMITTED) {
+        return 1;
+    }
+    if (status != RESPONSE_TX_ABORTED) {
+        return -1;
+    }
+    uint64_t offset = comms_getq(client_socket_fd);
+    if (conflict) {
+        *conflict = offset;
+    }
+    return 0;
+}
+
+
+/*
+ * Page subscriptions. After the first subscribe the connection only carries
+ * framed messages, so acknowledgements are read with nm_client_get_push()
+ * in order with the pushed updates. The server closes a subscribed
+ * connection that sends anything but subscribe, unsubscribe or disconnect.
+ */
+
+void nm_client_subscribe(int client_socket_fd, uint64_t offset, uint64_t length, uint64_t interval) {
+    uint8_t request[1 + 3 * PTR_SIZE];
+
+    request[0] = REQUEST_SUBSCRIBE;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[1 + PTR_SIZE] = length;
+    *(uint64_t *)&request[1 + 2 * PTR_SIZE] = interval;
+    comms_send(client_socket_fd, request, sizeof(request));
+}
+
+void nm_client_unsubscribe(int client_socket_fd, uint64_t offset, uint64_t length) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+
+    request[0] = REQUEST_UNSUBSCRIBE;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[1 + PTR_SIZE] = length;
+    comms_send(client_socket_fd, request, sizeof(request));
+}
+
+/* Wait for the next message; buffer must hold a page for PUSH_PAGE_UPDATE */
+uint8_t nm_client_get_push(int client_socket_fd, uint64_t *offset, uint64_t *length, uint8_t *buffer) {
+    uint8_t opcode = comms_getb(client_socket_fd);
+
+    if (opcode == PUSH_PAGE_UPDATE) {
+        *offset = comms_getq(client_socket_fd);
+        *length = comms_getq(client_socket_fd);
+        comms_get(client_socket_fd, buffer, *length);
+    }
+
+    return opcode;
+}
+
+/* Server statistics; returns the length of the report stored in text */
+int nm_client_stats(int client_socket_fd, char *text, int size) {
+    comms_sendb(client_socket_fd, REQUEST_STATS);
+
+    if (comms_getb(client_socket_fd) != RESPONSE_STATS) {
+        return -1;
+    }
+    uint64_t length = comms_getq(client_socket_fd);
+    uint64_t kept = std::min(length, (uint64_t)(size - 1));
+
+    comms_get(client_socket_fd, (uint8_t *)text, kept);
+    comms_skip(client_socket_fd, length - kept);
+    text[kept] = '\0';
+
+    return (int)kept;
+}
+
+/* Fetch the shard map; false if the reply was not one */
+bool nm_client_shard_map(int client_socket_fd, struct nm_shard_map *map) {
+    uint64_t count;
+
+    comms_sendb(client_socket_fd, REQUEST_SHARD_MAP);
+    if (comms_getb(client_socket_fd) != RESPONSE_SHARD_MAP) {
+        return false;
+    }
+
+    map->epoch = comms_getq(client_socket_fd);
+    count = comms_getq(client_socket_fd);
+    map->node_count = (int)std::min(count, (uint64_t)SHARD_NODES_MAX);
+    for (uint64_t i = 0; i < count; i++) {
+        struct nm_shard_node node;
+        node.port = (int)comms_getq(client_socket_fd);
+        comms_get(client_socket_fd, (uint8_t *)node.host, SHARD_HOST_MAX);
+        node.host[SHARD_HOST_MAX - 1] = '\0';
+        if (i < SHARD_NODES_MAX) {
+            map->nodes[i] = node;
+        }
+    }
+
+    count = comms_getq(client_socket_fd);
+    map->range_count = (int)std::min(count, (uint64_t)SHARD_RANGES_MAX);
+    for (uint64_t i = 0; i < count; i++) {
+        struct nm_shard_range range;
+        range.offset = comms_getq(client_socket_fd);
+        range.length = comms_getq(client_socket_fd);
+        range.node = (int)comms_getq(client_socket_fd);
+        if (i < SHARD_RANGES_MAX) {
+            map->ranges[i] = range;
+        }
+    }
+
+    return count <= SHARD_RANGES_MAX;
+}
+
+/* Node owning a page, or -1 if the map does not cover it */
+int nm_client_shard_owner(const struct nm_shard_map *map, uint64_t offset) {
+    int low = 0, high = map->range_count - 1;
+
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        const struct nm_shard_range *range = &map->ranges[middle];
+
+        if (offset < range->offset) {
+            high = middle - 1;
+        } else if (offset >= range->offset + range->length) {
+            low = middle + 1;
+        } else {
+            return (range->node < map->node_count) ? range->node : -1;
+        }
+    }
+    return -1;
+}
+
+/* Ask the owner of a page range to hand it to another node */
+bool nm_client_shard_move(int client_socket_fd, uint64_t offset, uint64_t length, int node) {
+    uint8_t request[1 + 3 * PTR_SIZE];
+
+    request[0] = REQUEST_SHARD_MOVE;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[1 + PTR_SIZE] = length;
+    *(uint64_t *)&request[1 + 2 * PTR_SIZE] = node;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    return comms_getb(client_socket_fd) == RESPONSE_SHARD_OK;
+}
+
+/*
+    Decayed read and write counts of a range split into at most parts
+    equal runs of pages; returns the number of parts filled or -1.
+*/
+int nm_client_heatmap(int client_socket_fd, uint64_t offset, uint64_t length, int parts,
+                      uint64_t *reads, uint64_t *writes, uint64_t *part_pages) {
+    uint8_t request[1 + 3 * PTR_SIZE];
+
+    request[0] = REQUEST_HEATMAP;
+    *(uint64_t *)&request[1] = offset;
+    *(uint64_t *)&request[9] = length;
+    *(uint64_t *)&request[17] = (uint64_t)std::max(parts, 0);
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    if (comms_getb(client_socket_fd) != RESPONSE_HEATMAP) {
+        return -1;
+    }
+    uint64_t count = comms_getq(client_socket_fd);
+    uint64_t pages = comms_getq(client_socket_fd);
+    if (count > (uint64_t)parts) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        reads[i] = comms_getq(client_socket_fd);
+        writes[i] = comms_getq(client_socket_fd);
+    }
+    if (part_pages) {
+        *part_pages = pages;
+    }
+
+    return (int)count;
+}
+
+/* Pick a scheduling class for this connection and cap its bandwidth (0 for none) */
+bool nm_client_qos_config(int client_socket_fd, uint8_t qos_class, uint64_t cap) {
+    uint8_t request[2 + PTR_SIZE];
+
+    request[0] = REQUEST_QOS_CONFIG;
+    request[1] = qos_class;
+    *(uint64_t *)&request[2] = cap;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    return (comms_getb(client_socket_fd) == RESPONSE_QOS_OK) ? true : false;
+}
+
+/* Background snapshots of the server's shared memory */
+
+bool nm_client_snapshot(int client_socket_fd, uint64_t *generation) {
+    comms_sendb(client_socket_fd, REQUEST_SNAPSHOT);
+
+    if (comms_getb(client_socket_fd) != RESPONSE_SNAPSHOT_OK) {
+        return false;
+    }
+    *generation = comms_getq(client_socket_fd);
+
+    return true;
+}
+
+bool nm_client_snapshot_status(int client_socket_fd, uint64_t generation, uint64_t *pages_left) {
+    uint8_t request[1 + PTR_SIZE];
+
+    request[0] = REQUEST_SNAPSHOT_STATUS;
+    *(uint64_t *)&request[1] = generation;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    if (comms_getb(client_socket_fd) != RESPONSE_SNAPSHOT_OK) {
+        return false;
+    }
+    *pages_left = comms_getq(client_socket_fd);
+
+    return true;
+}
+
+/* Lock, barrier and semaphore service */
+
+/* Map an object name to the 64-bit id used on the wire (FNV-1a) */
+uint64_t nm_client_name_id(const char *name) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Blocks until the lock is held. Returns the number of pages other holders
+ * dirtied since this client last held the lock (the first dirty_max offsets
+ * are stored in dirty), or -1 on error.
+ */
+int nm_client_lock_acquire(int client_socket_fd, uint64_t id, uint8_t mode, uint64_t *dirty, int dirty_max) {
+    uint8_t request[1 + PTR_SIZE + 1];
+    uint64_t count;
+    uint64_t i;
+
+    request[0] = REQUEST_LOCK_ACQUIRE;
+    *(uint64_t *)&request[1] = id;
+    request[1 + PTR_SIZE] = mode;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    if (comms_getb(client_socket_fd) != RESPONSE_LOCK_OK) {
+        return -1;
+    }
+
+    count = comms_getq(client_socket_fd);
+    for (i = 0; i < count; i++) {
+        uint64_t offset = comms_getq(client_socket_fd);
+        if (dirty && i < (uint64_t)dirty_max) {
+            dirty[i] = offset;
+        }
+    }
+
+    return (int)count;
+}
+
+bool nm_client_lock_release(int client_socket_fd, uint64_t id, const uint64_t *dirty, int count) {
+    uint8_t *request;
+    int length = 1 + 2 * PTR_SIZE + count * PTR_SIZE;
+
+    request = (uint8_t *)calloc(length, sizeof(uint8_t));
+    request[0] = REQUEST_LOCK_RELEASE;
+    *(uint64_t *)&request[1] = id;
+    *(uint64_t *)&request[1 + PTR_SIZE] = count;
+    if (count) {
+        memcpy(&request[1 + 2 * PTR_SIZE], dirty, count * PTR_SIZE);
+    }
+    comms_send(client_socket_fd, request, length);
+    free(request);
+
+    return (comms_getb(client_socket_fd) == RESPONSE_LOCK_OK) ? true : false;
+}
+
+bool nm_client_barrier_wait(int client_socket_fd, uint64_t id, uint64_t parties) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+
+    request[0] = REQUEST_BARRIER_WAIT;
+    *(uint64_t *)&request[1] = id;
+    *(uint64_t *)&request[1 + PTR_SIZE] = parties;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    return (comms_getb(client_socket_fd) == RESPONSE_LOCK_OK) ? true : false;
+}
+
+bool nm_client_sem_wait(int client_socket_fd, uint64_t id) {
+    uint8_t request[1 + PTR_SIZE];
+
+    request[0] = REQUEST_SEM_WAIT;
+    *(uint64_t *)&request[1] = id;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    return (comms_getb(client_socket_fd) == RESPONSE_LOCK_OK) ? true : false;
+}
+
+bool nm_client_sem_post(int client_socket_fd, uint64_t id, uint64_t count) {
+    uint8_t request[1 + 2 * PTR_SIZE];
+
+    request[0] = REQUEST_SEM_POST;
+    *(uint64_t *)&request[1] = id;
+    *(uint64_t *)&request[1 + PTR_SIZE] = count;
+    comms_send(client_socket_fd, request, sizeof(request));
+
+    return (comms_getb(client_socket_fd) == RESPONSE_LOCK_OK) ? true : false;
+}
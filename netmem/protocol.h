@@ -0,0 +1,102 @@
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+/* One entry of an atomic batch; result holds the old value on return */
+struct nm_atomic_op {
+    uint8_t opcode;     /* REQUEST_ATOMIC_CAS, _FADD or _XCHG */
+    uint64_t offset;
+    uint64_t arg1;
+    uint64_t arg2;
+    uint64_t result;
+};
+
+/* Page a transaction read, and the version nm_client_tx_read() returned for it */
+struct nm_tx_read {
+    uint64_t offset;
+    uint64_t version;
+};
+
+/* Bytes a transaction writes; may span pages */
+struct nm_tx_write {
+    uint64_t offset;
+    uint64_t length;
+    const uint8_t *data;
+};
+
+/* Server process of a sharded region */
+struct nm_shard_node {
+    char host[SHARD_HOST_MAX];
+    int port;
+};
+
+/* Pages owned by one node */
+struct nm_shard_range {
+    uint64_t offset;
+    uint64_t length;
+    int node;
+};
+
+/* Which node owns each page; node_count is 0 if the region is not sharded */
+struct nm_shard_map {
+    uint64_t epoch;
+    int node_count;
+    int range_count;
+    struct nm_shard_node nodes[SHARD_NODES_MAX];
+    struct nm_shard_range ranges[SHARD_RANGES_MAX];
+};
+
+/* Function prototypes */
+bool nm_client_connect(int client_socket_fd, uint64_t page_size, uint64_t memory_size);
+bool nm_client_attach(int client_socket_fd, uint64_t page_size, uint64_t memory_size);
+bool nm_client_resume(int client_socket_fd, uint64_t *session, uint64_t page_size, uint64_t memory_size, bool *resumed);
+bool nm_client_join(int client_socket_fd, uint64_t session);
+void nm_client_disconnect(int client_socket_fd);
+bool nm_client_request_page(int client_socket_fd, uint64_t value, uint8_t *buffer);
+bool nm_client_request_page_bounded(int client_socket_fd, uint64_t value, uint64_t max_ms, uint8_t *buffer);
+bool nm_client_request_pages(int client_socket_fd, const uint64_t *offsets, int count, uint8_t *buffer);
+int nm_client_revalidate(int client_socket_fd, const uint64_t *offsets, const uint32_t *crcs, int count, uint64_t *stale);
+bool nm_client_request_sync(int client_socket_fd, uint64_t value, uint8_t *buffer);
+bool nm_client_read_range(int client_socket_fd, uint64_t offset, uint64_t length, uint8_t *buffer);
+bool nm_client_write_range(int client_socket_fd, uint64_t offset, uint64_t length, const uint8_t *buffer);
+void nm_client_write_range_send(int client_socket_fd, uint64_t offset, uint64_t length, const uint8_t *buffer);
+bool nm_client_write_range_wait(int client_socket_fd);
+bool nm_client_stream_range(int client_socket_fd, uint64_t offset, uint64_t length, uint8_t *buffer);
+
+bool nm_client_fill(int client_socket_fd, uint64_t offset, uint64_t length, const uint8_t *pattern, uint64_t pattern_length);
+bool nm_client_move(int client_socket_fd, uint64_t source, uint64_t destination, uint64_t length);
+bool nm_client_compare(int client_socket_fd, uint64_t offset, uint64_t other, uint64_t length, uint64_t *difference);
+int nm_client_find(int client_socket_fd, uint64_t offset, uint64_t length, const uint8_t *pattern,
+                   uint64_t pattern_length, uint64_t *matches, int max);
+
+bool nm_client_atomic_cas(int client_socket_fd, uint64_t offset, uint64_t expected, uint64_t desired, uint64_t *old);
+bool nm_client_atomic_fetch_add(int client_socket_fd, uint64_t offset, uint64_t addend, uint64_t *old);
+bool nm_client_atomic_exchange(int client_socket_fd, uint64_t offset, uint64_t value, uint64_t *old);
+bool nm_client_atomic_batch(int client_socket_fd, struct nm_atomic_op *ops, int count);
+
+bool nm_client_tx_read(int client_socket_fd, uint64_t offset, int pages, uint8_t *buffer, uint64_t *versions);
+int nm_client_tx_commit(int client_socket_fd, const struct nm_tx_read *reads, int read_count,
+                        const struct nm_tx_write *writes, int write_count, uint64_t *conflict);
+
+void nm_client_subscribe(int client_socket_fd, uint64_t offset, uint64_t length, uint64_t interval);
+void nm_client_unsubscribe(int client_socket_fd, uint64_t offset, uint64_t length);
+uint8_t nm_client_get_push(int client_socket_fd, uint64_t *offset, uint64_t *length, uint8_t *buffer);
+
+bool nm_client_snapshot(int client_socket_fd, uint64_t *generation);
+bool nm_client_snapshot_status(int client_socket_fd, uint64_t generation, uint64_t *pages_left);
+
+int nm_client_stats(int client_socket_fd, char *text, int size);
+int nm_client_heatmap(int client_socket_fd, uint64_t offset, uint64_t length, int parts,
+                      uint64_t *reads, uint64_t *writes, uint64_t *part_pages);
+bool nm_client_shard_map(int client_socket_fd, struct nm_shard_map *map);
+int nm_client_shard_owner(const struct nm_shard_map *map, uint64_t offset);
+bool nm_client_shard_move(int client_socket_fd, uint64_t offset, uint64_t length, int node);
+bool nm_client_qos_config(int client_socket_fd, uint8_t qos_class, uint64_t cap);
+
+uint64_t nm_client_name_id(const char *name);
+int nm_client_lock_acquire(int client_socket_fd, uint64_t id, uint8_t mode, uint64_t *dirty, int dirty_max);
+bool nm_client_lock_release(int client_socket_fd, uint64_t id, const uint64_t *dirty, int count);
+bool nm_client_barrier_wait(int client_socket_fd, uint64_t id, uint64_t parties);
+bool nm_client_sem_wait(int client_socket_fd, uint64_t id);
+bool nm_client_sem_post(int client_socket_fd, uint64_t id, uint64_t count);
+
+#endif /* _PROTOCOL_H_ */
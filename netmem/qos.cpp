@@ -0,0 +1,388 @@
+/*
+	File:
+		qos.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Fair scheduling of client requests. Each connection thread asks
+		for one of a fixed number of execution slots before running a
+		data request and gives it back afterwards. While slots are free
+		requests run straight away; once they are all busy, waiting
+		connections are served by priority class and, within a class,
+		by deficit round-robin on the bytes each request moves, so a
+		client streaming syncs cannot starve another client's faults.
+
+		A connection may also be capped to a number of bytes per second.
+		A capped connection sleeps before its request is admitted and
+		stops reading its socket meanwhile, which pushes back on the
+		client through TCP flow control.
+
+		Server options:
+		-slots <n>	requests executing at once (default 2 per CPU)
+		-bwcap <n>	bytes per second allowed to each client
+*/
+
+#include "shared.h"
+#include <map>
+#include <deque>
+#include <sys/time.h>
+using namespace std;
+
+struct qos_client {
+	int socket_fd;
+	pthread_cond_t cond;
+	bool granted;
+	bool running;		/* Holds a slot until qos_end() */
+	uint8 class_override;	/* QOS_CLASS_AUTO or a fixed class */
+	uint64 cost;		/* Bytes of the waiting request */
+	uint64 deficit;
+	uint64 cap;		/* Bytes per second, 0 for none */
+	double tokens;
+	uint64 refill_us;	/* Time tokens were last topped up */
+};
+
+struct qos_stats {
+	uint64 requests;
+	uint64 queued;		/* Requests that had to wait for a slot */
+	uint64 wait_us;
+	uint64 wait_max_us;
+	uint64 bytes;
+};
+
+static pthread_mutex_t qos_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<int, qos_client *> qos_clients;
+static deque<qos_client *> qos_active[QOS_CLASSES];	/* Waiting, in round order */
+static int qos_slots = 4;
+static int qos_running = 0;
+static uint64 qos_default_cap = 0;
+static struct qos_stats qos_class_stats[QOS_CLASSES];
+static uint64 qos_throttle_us = 0;
+static const char *qos_class_names[QOS_CLASSES] = { "demand", "bulk" };
+
+static void qos_grant(void);
+
+static uint64 qos_now(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+/* Read the -slots and -bwcap options */
+void qos_setup(int argc, char *argv[])
+{
+	int index;
+
+	qos_slots = MAX(2 * sysconf(_SC_NPROCESSORS_ONLN), 4);
+	if((index = find_option(argc, argv, "-slots")) != -1 && index + 1 < argc)
+		qos_slots = MAX(atoi(argv[index + 1]), 1);
+	if((index = find_option(argc, argv, "-bwcap")) != -1 && index + 1 < argc)
+		qos_default_cap = strtoull(argv[index + 1], NULL, 0);
+}
+
+void qos_connect(int client_socket_fd)
+{
+	qos_client *client = new qos_client;
+
+	client->socket_fd = client_socket_fd;
+	pthread_cond_init(&client->cond, NULL);
+	client->granted = false;
+	client->running = false;
+	client->class_override = QOS_CLASS_AUTO;
+	client->cost = 0;
+	client->deficit = 0;
+	client->cap = qos_default_cap;
+	client->tokens = 0;
+	client->refill_us = qos_now();
+
+	pthread_mutex_lock(&qos_mutex);
+	qos_clients[client_socket_fd] = client;
+	pthread_mutex_unlock(&qos_mutex);
+}
+
+void qos_disconnect(int client_socket_fd)
+{
+	pthread_mutex_lock(&qos_mutex);
+	map<int, qos_client *>::iterator it = qos_clients.find(client_socket_fd);
+	if(it != qos_clients.end())
+	{
+		/* Connection dropped in the middle of a request */
+		if(it->second->running)
+		{
+			qos_running--;
+			qos_grant();
+		}
+		pthread_cond_destroy(&it->second->cond);
+		delete it->second;
+		qos_clients.erase(it);
+	}
+	pthread_mutex_unlock(&qos_mutex);
+}
+
+/* Class of a request, or -1 for control requests that are never queued */
+static int qos_class(uint8 opcode)
+{
+	switch(opcode)
+	{
+		case REQUEST_PAGE:
+		case REQUEST_PAGE_BOUNDED:
+		case REQUEST_READ_RANGE:
+		case REQUEST_ATOMIC_CAS:
+		case REQUEST_ATOMIC_FADD:
+		case REQUEST_ATOMIC_XCHG:
+		case REQUEST_ATOMIC_BATCH:
+		case REQUEST_TX_READ:
+		case REQUEST_TX_COMMIT:
+			return QOS_CLASS_DEMAND;
+
+		case REQUEST_PAGE_SYNC:
+		case REQUEST_WRITE_RANGE:
+		case REQUEST_STREAM_RANGE:
+		case REQUEST_RANGE_FILL:
+		case REQUEST_RANGE_MOVE:
+		case REQUEST_RANGE_COMPARE:
+		case REQUEST_RANGE_FIND:
+			return QOS_CLASS_BULK;
+	}
+
+	/* Locks and barriers may park; they must not hold a slot */
+	return -1;
+}
+
+/* A peeked length is untrusted; no request moves more than the region */
+static uint64 qos_length(const uint8 *field)
+{
+	uint64 length = *(uint64 *)field;
+	uint64 limit = (uint64)shared_memory_size;
+
+	return MIN(MAX(length, 1), limit);
+}
+
+/* Bytes a request will move, peeking at its length field if it has one */
+static uint64 qos_cost(int client_socket_fd, uint8 opcode)
+{
+	uint8 header[3 * PTR_SIZE];
+
+	switch(opcode)
+	{
+		case REQUEST_READ_RANGE:
+		case REQUEST_WRITE_RANGE:
+		case REQUEST_STREAM_RANGE:
+		case REQUEST_RANGE_FILL:
+		case REQUEST_RANGE_FIND:
+			if(recv(client_socket_fd, header, 2 * PTR_SIZE, MSG_PEEK | MSG_WAITALL) != 2 * PTR_SIZE)
+				return shared_page_size;
+			return qos_length(&header[PTR_SIZE]);
+
+		/* Near-data work is charged by the bytes it touches on the server */
+		case REQUEST_RANGE_MOVE:
+		case REQUEST_RANGE_COMPARE:
+			if(recv(client_socket_fd, header, 3 * PTR_SIZE, MSG_PEEK | MSG_WAITALL) != 3 * PTR_SIZE)
+				return shared_page_size;
+			return qos_length(&header[2 * PTR_SIZE]);
+
+		case REQUEST_TX_READ:
+			if(recv(client_socket_fd, header, 2 * PTR_SIZE, MSG_PEEK | MSG_WAITALL) != 2 * PTR_SIZE)
+				return shared_page_size;
+			return MIN(MAX(*(uint64 *)&header[PTR_SIZE], 1), TX_PAGES_MAX) * shared_page_size;
+
+		case REQUEST_ATOMIC_BATCH:
+			if(recv(client_socket_fd, header, PTR_SIZE, MSG_PEEK | MSG_WAITALL) != PTR_SIZE)
+				return ATOMIC_WORD_SIZE;
+			return MIN(*(uint64 *)&header[0], ATOMIC_BATCH_MAX) * ATOMIC_WORD_SIZE;
+
+		case REQUEST_ATOMIC_CAS:
+		case REQUEST_ATOMIC_FADD:
+		case REQUEST_ATOMIC_XCHG:
+			return ATOMIC_WORD_SIZE;
+	}
+	return shared_page_size;
+}
+
+/* Sleep until a capped client has enough tokens for a request */
+static void qos_throttle(qos_client *client, uint64 cap, uint64 cost)
+{
+	uint64 now = qos_now();
+	double burst = MAX(cap * QOS_BURST_MS / 1000.0, (double)cost);
+
+	client->tokens = MIN(burst, client->tokens + (now - client->refill_us) * cap / 1e6);
+	client->refill_us = now;
+	if(client->tokens < cost)
+	{
+		uint64 delay = (cost - client->tokens) * 1e6 / cap;
+		usleep(delay);
+
+		client->tokens += delay * cap / 1e6;
+		client->refill_us = qos_now();
+
+		pthread_mutex_lock(&qos_mutex);
+		qos_throttle_us += delay;
+		pthread_mutex_unlock(&qos_mutex);
+	}
+	client->tokens -= cost;
+}
+
+/* Hand free slots to waiting clients; caller holds qos_mutex */
+static void qos_grant(void)
+{
+	for(int c = 0; c < QOS_CLASSES && qos_running < qos_slots; c++)
+	{
+		deque<qos_client *> &active = qos_active[c];
+
+		while(!active.empty() && qos_running < qos_slots)
+		{
+			qos_client *client = active.front();
+			active.pop_front();
+
+			/* Not enough credit this round; top up and go to the back */
+			if(client->deficit < client->cost)
+			{
+				client->deficit += QOS_QUANTUM;
+				active.push_back(client);
+				continue;
+			}
+
+			client->deficit -= client->cost;
+			client->granted = true;
+			qos_running++;
+			pthread_cond_signal(&client->cond);
+		}
+	}
+}
+
+/*
+	Wait for a slot before running a request whose opcode has just been
+	read. Returns false for requests that are not scheduled; otherwise
+	qos_end() must be called once the request is done.
+*/
+bool qos_begin(int client_socket_fd, uint8 opcode)
+{
+	int type = qos_class(opcode);
+	if(type < 0)
+		return false;
+
+	uint64 cost = qos_cost(client_socket_fd, opcode);
+	bool queued = false;
+
+	pthread_mutex_lock(&qos_mutex);
+	map<int, qos_client *>::iterator it = qos_clients.find(client_socket_fd);
+	qos_client *client = (it != qos_clients.end()) ? it->second : NULL;
+	uint8 class_override = client ? client->class_override : QOS_CLASS_AUTO;
+	uint64 cap = client ? client->cap : 0;
+	pthread_mutex_unlock(&qos_mutex);
+	if(!client)
+		return false;
+
+	if(class_override != QOS_CLASS_AUTO)
+		type = class_override;
+	if(cap)
+		qos_throttle(client, cap, cost);
+
+	uint64 start = qos_now();
+	pthread_mutex_lock(&qos_mutex);
+	bool idle = true;
+	for(int c = 0; c < QOS_CLASSES; c++)
+		idle = idle && qos_active[c].empty();
+
+	if(idle && qos_running < qos_slots)
+		qos_running++;
+	else
+	{
+		queued = true;
+		client->cost = cost;
+		client->deficit = MIN(client->deficit, QOS_QUANTUM);
+		client->granted = false;
+		qos_active[type].push_back(client);
+		qos_grant();
+		while(!client->granted)
+			pthread_cond_wait(&client->cond, &qos_mutex);
+	}
+
+	client->running = true;
+
+	uint64 wait = qos_now() - start;
+	struct qos_stats *stats = &qos_class_stats[type];
+	stats->requests++;
+	stats->queued += queued;
+	stats->wait_us += wait;
+	stats->wait_max_us = MAX(stats->wait_max_us, wait);
+	stats->bytes += cost;
+	pthread_mutex_unlock(&qos_mutex);
+
+	return true;
+}
+
+void qos_end(int client_socket_fd)
+{
+	pthread_mutex_lock(&qos_mutex);
+	map<int, qos_client *>::iterator it = qos_clients.find(client_socket_fd);
+	if(it != qos_clients.end())
+		it->second->running = false;
+	qos_running--;
+	qos_grant();
+	pthread_mutex_unlock(&qos_mutex);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	byte  - class for all of its requests (QOS_CLASS_AUTO for per opcode)
+	qword - bandwidth cap in bytes per second (0 for the server default)
+	Server responds with
+	byte  - RESPONSE_QOS_OK or RESPONSE_QOS_ERR for an unknown class
+*/
+void command_qos_config(int client_socket_fd)
+{
+	uint8 request[1 + PTR_SIZE];
+	bool valid;
+
+	comms_get(client_socket_fd, request, sizeof(request));
+	uint8 type = request[0];
+	uint64 cap = *(uint64 *)&request[1];
+
+	/* Debug */
+	printf("* QoS config request, class: %02X, cap: %lld\n", type, cap);
+
+	valid = (type < QOS_CLASSES || type == QOS_CLASS_AUTO);
+
+	pthread_mutex_lock(&qos_mutex);
+	map<int, qos_client *>::iterator it = qos_clients.find(client_socket_fd);
+	if(valid && it != qos_clients.end())
+	{
+		/* A client may lower the server's cap but not lift it */
+		if(!cap || (qos_default_cap && cap > qos_default_cap))
+			cap = qos_default_cap;
+		it->second->class_override = type;
+		it->second->cap = cap;
+		it->second->tokens = 0;
+	}
+	pthread_mutex_unlock(&qos_mutex);
+
+	comms_sendb(client_socket_fd, valid ? RESPONSE_QOS_OK : RESPONSE_QOS_ERR);
+}
+
+/* Print queueing delay per class into text, returns its length */
+int qos_report(char *text, int size)
+{
+	int length = 0;
+
+	pthread_mutex_lock(&qos_mutex);
+	length += snprintf(&text[length], MAX(size - length, 0),
+		"qos: %d slots, %d running, %llu us throttled\n",
+		qos_slots, qos_running, qos_throttle_us);
+	for(int c = 0; c < QOS_CLASSES; c++)
+	{
+		struct qos_stats *stats = &qos_class_stats[c];
+
+		length += snprintf(&text[length], MAX(size - length, 0),
+			"qos %s: %llu requests, %llu queued, avg wait %.1f us, max wait %llu us, %llu bytes\n",
+			qos_class_names[c], stats->requests, stats->queued,
+			stats->requests ? (double)stats->wait_us / stats->requests : 0.0,
+			stats->wait_max_us, stats->bytes);
+	}
+	pthread_mutex_unlock(&qos_mutex);
+
+	return length;
+}
+
+/* End */
@@ -0,0 +1,21 @@
+#ifndef _QOS_H_
+#define _QOS_H_
+
+#define QOS_CLASS_DEMAND	0	/* Page faults, reads, atomics, transactions */
+#define QOS_CLASS_BULK	1	/* Syncs, range writes, prefetch */
+#define QOS_CLASSES		2
+#define QOS_CLASS_AUTO	0xFF	/* Class chosen per opcode */
+
+#define QOS_QUANTUM		0x10000	/* Bytes a client may move per round */
+#define QOS_BURST_MS		100	/* Bandwidth cap burst allowance */
+
+/* Function prototypes */
+void qos_setup(int argc, char *argv[]);
+void qos_connect(int client_socket_fd);
+void qos_disconnect(int client_socket_fd);
+bool qos_begin(int client_socket_fd, uint8 opcode);
+void qos_end(int client_socket_fd);
+void command_qos_config(int client_socket_fd);
+int qos_report(char *text, int size);
+
+#endif /* _QOS_H_ */
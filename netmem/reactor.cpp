@@ -0,0 +1,256 @@
+/*
+    File:
+        reactor.cpp
+    Author:
+        Ryan Gordon
+    Notes:
+        Non-blocking reactor behind the coroutine API. Each AsyncRegion
+        owns one non-blocking connection registered with the reactor's
+        epoll set. Requests are encoded into an output buffer and sent as
+        the socket allows; replies arrive in request order, so they are
+        matched against a FIFO of waiting operations and the coroutine
+        behind each one is resumed on whichever thread read the reply.
+
+        Page writes use the same sync plus zero-length range read pair as
+        netmem.cpp so that every request has exactly one reply.
+*/
+
+#include "shared.h"
+#include "reactor.h"
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+using namespace std;
+
+namespace netmem {
+
+Reactor::Reactor() : pending(0) {
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        die_errno("Reactor(): epoll_create1(): ");
+    }
+}
+
+Reactor::~Reactor() {
+    close(epoll_fd);
+}
+
+void Reactor::run() {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    vector<AsyncOp *> done;
+
+    while (pending.load() > 0) {
+        int count = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, REACTOR_IDLE_WAIT);
+
+        for (int i = 0; i < count; i++) {
+            AsyncRegion *region = (AsyncRegion *)events[i].data.ptr;
+
+            done.clear();
+            region->handle(done);
+
+            /* Resumed tasks may queue more work before pending drops */
+            for (size_t j = 0; j < done.size(); j++) {
+                done[j]->waiter.resume();
+            }
+            pending -= done.size();
+        }
+    }
+}
+
+/*------------------------------------------------*/
+
+AsyncRegion::AsyncRegion() : reactor(NULL), socket_fd(-1), region_size(0), broken(false) {
+    pthread_mutex_init(&mutex, NULL);
+}
+
+AsyncRegion::~AsyncRegion() {
+    close();
+    pthread_mutex_destroy(&mutex);
+}
+
+/* Connect with blocking calls, then hand the socket to the reactor */
+bool AsyncRegion::open(Reactor *owner, const char *hostname, int port, uint64_t size) {
+    struct sockaddr_in server_addr;
+    struct epoll_event event;
+    int nodelay = 1;
+
+    if (socket_fd != -1) {
+        return false;
+    }
+
+    socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd == -1) {
+        return false;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, hostname, &server_addr.sin_addr.s_addr);
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    if (connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+        !nm_client_connect(socket_fd, CLIENT_PAGE_SIZE, size)) {
+        ::close(socket_fd);
+        socket_fd = -1;
+        return false;
+    }
+
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+
+    reactor = owner;
+    region_size = size;
+    broken = false;
+
+    /* One-shot so only one thread handles a connection at a time */
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = this;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == -1) {
+        die_errno("AsyncRegion::open(): epoll_ctl(): ");
+    }
+
+    return true;
+}
+
+/* Call once no request is outstanding */
+void AsyncRegion::close() {
+    if (socket_fd == -1) {
+        return;
+    }
+
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, socket_fd, NULL);
+    if (!broken) {
+        fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+        nm_client_disconnect(socket_fd);
+    }
+    ::close(socket_fd);
+    socket_fd = -1;
+}
+
+/* Re-enable events; caller holds mutex */
+void AsyncRegion::rearm() {
+    struct epoll_event event;
+
+    event.events = EPOLLIN | EPOLLONESHOT | (output.empty() ? 0 : EPOLLOUT);
+    event.data.ptr = this;
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, socket_fd, &event);
+}
+
+/* Send as much queued output as the socket takes; caller holds mutex */
+void AsyncRegion::flush_output() {
+    if (output.empty()) {
+        return;
+    }
+
+    int count = comms_try_send(socket_fd, &output[0], output.size());
+    if (count > 0) {
+        output.erase(output.begin(), output.begin() + count);
+    }
+}
+
+/* Queue a request; false if it was rejected without being sent */
+bool AsyncRegion::submit(AsyncOp *op, uint64_t offset, const uint8_t *page) {
+    uint8_t request[2 * (1 + 2 * PTR_SIZE) + CLIENT_PAGE_SIZE];
+    int length = 0;
+
+    op->ok = false;
+    if (socket_fd == -1 || (offset & (CLIENT_PAGE_SIZE - 1)) || offset >= region_size) {
+        return false;
+    }
+
+    request[length++] = op->opcode;
+    *(uint64_t *)&request[length] = offset;
+    length += PTR_SIZE;
+    if (op->opcode == REQUEST_PAGE_SYNC) {
+        memcpy(&request[length], page, CLIENT_PAGE_SIZE);
+        length += CLIENT_PAGE_SIZE;
+
+        /* Acknowledgement probe */
+        request[length++] = REQUEST_READ_RANGE;
+        *(uint64_t *)&request[length] = offset;
+        *(uint64_t *)&request[length + PTR_SIZE] = 0;
+        length += 2 * PTR_SIZE;
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (broken) {
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+    reactor->pending++;
+    output.insert(output.end(), request, request + length);
+    waiting.push_back(op);
+
+    /* The op may complete on another thread as soon as this is sent */
+    flush_output();
+    rearm();
+    pthread_mutex_unlock(&mutex);
+
+    return true;
+}
+
+/* Move data both ways and collect completed operations */
+void AsyncRegion::handle(vector<AsyncOp *> &done) {
+    uint8_t buffer[0x10000];
+    size_t used = 0;
+
+    pthread_mutex_lock(&mutex);
+    flush_output();
+
+    while (!broken) {
+        int count = comms_try_get(socket_fd, buffer, sizeof(buffer));
+        if (count == 0) {
+            break;
+        }
+        if (count < 0) {
+            broken = true;
+            break;
+        }
+        input.insert(input.end(), buffer, buffer + count);
+    }
+
+    /* Replies come back in the order requests were sent */
+    while (!waiting.empty()) {
+        AsyncOp *op = waiting.front();
+        size_t need = (op->opcode == REQUEST_PAGE) ? CLIENT_PAGE_SIZE : 1;
+
+        if (input.size() - used < need) {
+            break;
+        }
+        if (op->opcode == REQUEST_PAGE) {
+            op->data.assign(input.begin() + used, input.begin() + used + need);
+            op->ok = true;
+        } else {
+            op->ok = (input[used] == RESPONSE_RANGE_OK);
+        }
+        used += need;
+        waiting.pop_front();
+        done.push_back(op);
+    }
+    input.erase(input.begin(), input.begin() + used);
+
+    /* Nothing more will arrive; fail whatever is left */
+    if (broken) {
+        while (!waiting.empty()) {
+            waiting.front()->ok = false;
+            done.push_back(waiting.front());
+            waiting.pop_front();
+        }
+    } else {
+        rearm();
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+bool AsyncRegion::ReadAwaiter::await_suspend(coroutine_handle<> handle) {
+    op.opcode = REQUEST_PAGE;
+    op.waiter = handle;
+    return region->submit(&op, offset, NULL);
+}
+
+bool AsyncRegion::SyncAwaiter::await_suspend(coroutine_handle<> handle) {
+    op.opcode = REQUEST_PAGE_SYNC;
+    op.waiter = handle;
+    return region->submit(&op, offset, page);
+}
+
+}
@@ -0,0 +1,120 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+/*
+ * Coroutine interface to libnetmem (C++20). Tasks await remote pages with
+ *
+ *     std::vector<uint8_t> page = co_await region.read_page(offset);
+ *     bool ok = co_await region.sync_page(offset, buffer);
+ *
+ * A suspended task holds no thread: its request sits in the connection's
+ * queue until the reactor sees the reply and resumes it. Any number of
+ * threads may call Reactor::run() to share the work.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <vector>
+
+#define REACTOR_MAX_EVENTS      64
+#define REACTOR_IDLE_WAIT       10      /* ms between checks for no pending work */
+
+namespace netmem {
+
+class AsyncRegion;
+
+/* Fire-and-forget coroutine; runs until its first co_await straight away */
+struct Task {
+    struct promise_type {
+        Task get_return_object() { return Task(); }
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+class Reactor {
+public:
+    Reactor();
+    ~Reactor();
+
+    /* Process replies and resume tasks until no request is outstanding */
+    void run();
+
+private:
+    friend class AsyncRegion;
+
+    int epoll_fd;
+    std::atomic<uint64_t> pending;      /* Requests awaiting a reply */
+};
+
+/* A request on the wire and the task waiting for it */
+struct AsyncOp {
+    uint8_t opcode;
+    std::vector<uint8_t> data;      /* Page read, or unused */
+    bool ok;
+    std::coroutine_handle<> waiter;
+};
+
+class AsyncRegion {
+public:
+    AsyncRegion();
+    ~AsyncRegion();
+
+    bool open(Reactor *reactor, const char *hostname, int port, uint64_t size);
+    void close();
+    uint64_t size() const { return region_size; }
+
+    struct ReadAwaiter {
+        AsyncRegion *region;
+        uint64_t offset;
+        AsyncOp op;
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> waiter);
+        std::vector<uint8_t> await_resume() { return op.ok ? std::move(op.data) : std::vector<uint8_t>(); }
+    };
+
+    struct SyncAwaiter {
+        AsyncRegion *region;
+        uint64_t offset;
+        const uint8_t *page;
+        AsyncOp op;
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> waiter);
+        bool await_resume() { return op.ok; }
+    };
+
+    /* Page contents, or an empty vector on error */
+    ReadAwaiter read_page(uint64_t offset) { return ReadAwaiter{this, offset, AsyncOp()}; }
+
+    /* Write one page; true once the server has applied it */
+    SyncAwaiter sync_page(uint64_t offset, const uint8_t *page) { return SyncAwaiter{this, offset, page, AsyncOp()}; }
+
+private:
+    friend class Reactor;
+
+    bool submit(AsyncOp *op, uint64_t offset, const uint8_t *page);
+    void handle(std::vector<AsyncOp *> &done);
+    void flush_output();
+    void rearm();
+
+    Reactor *reactor;
+    int socket_fd;
+    uint64_t region_size;
+    bool broken;                    /* Connection lost; requests fail */
+    pthread_mutex_t mutex;          /* Guards the buffers and queue below */
+    std::vector<uint8_t> output;    /* Encoded requests not yet sent */
+    std::vector<uint8_t> input;     /* Bytes of replies not yet matched */
+    std::deque<AsyncOp *> waiting;  /* Sent requests, oldest first */
+};
+
+}
+
+#endif /* _REACTOR_H_ */
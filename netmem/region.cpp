@@ -0,0 +1,1228 @@
+/*
+	File:
+		region.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Backing store for the server's shared memory. shared.bin always
+		holds the current contents: writes go through to the file page by
+		page. On restart the file is reopened and pages are read back in
+		lazily the first time a request touches them, so the server can
+		accept clients straight away no matter how large the region is.
+
+		The file starts with a header describing the region and ends with
+		a CRC32C per page. The CRC table is mapped into memory, is updated
+		on every write and is checked whenever a page is read back in.
+
+		Pages are reached through region_pages. Normally it points into
+		one shared_memory allocation; with -dedup each entry is a frame
+		from dedup.cpp that may be shared with identical pages; with -tier
+		it is a frame from the fixed pool in tier.cpp and a cold page may
+		be dropped again. Either way a page's entry only changes under its
+		stripe mutex.
+
+		Reading a page in only blocks requests for that page: the page is
+		claimed under region_mutex, read without it, then published.
+
+		Readers of a page in the single allocation take no lock. Every
+		page has a sequence count in its own cache line that writers make
+		odd while they modify the page; a reader copies the page and tries
+		again if the count was odd or changed meanwhile. Reads of pages
+		nobody writes therefore only ever load shared cache lines. Frames
+		can be swapped or freed, so with -dedup or -tier readers still take
+		the stripe mutex.
+
+		A resize frees the page arrays out from under all of this, so every
+		entry point marks a per-thread slot while it is inside the region.
+		The resizer raises region_resizing, waits for every slot to clear,
+		and only then reallocates; threads arriving meanwhile wait for it
+		to finish. A range checked against the old size is checked again
+		once inside and dropped if the region has shrunk since.
+*/
+
+#include "shared.h"
+#include <sys/sendfile.h>
+#include <vector>
+#include <algorithm>
+using namespace std;
+
+static int region_fd = -1;
+static pthread_mutex_t region_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t region_loaded_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t region_stripe_mutex[REGION_LOCK_STRIPES];
+static uint8 **region_pages = NULL;		/* Data of each page */
+static uint8 *region_page_loaded = NULL;	/* REGION_PAGE_xxx state */
+static uint32_t *region_page_hits = NULL;	/* Accesses since startup */
+static uint8 *region_page_writing = NULL;	/* Memory is ahead of the file */
+static struct region_seq *region_page_seq = NULL;	/* Cache line aligned */
+static void *region_page_seq_block = NULL;	/* Allocation holding it */
+static uint32_t *region_crc_table = NULL;	/* Mapped from the end of the file */
+static uint64 region_crc_length = 0;		/* Bytes of the table mapping */
+static uint64 region_page_count = 0;
+static uint64 region_generation = 0;
+static uint64 region_crc_errors = 0;
+
+/* Sequence count of a page, odd while a writer modifies it */
+struct region_seq {
+	uint64 seq;
+	uint8 pad[REGION_CACHE_LINE - sizeof(uint64)];
+};
+
+/* Marks a thread inside the region; each is written by its owner only */
+struct region_reader {
+	uint64 depth;		/* Nested entry points, zero when outside */
+	bool used;		/* Claimed by a live thread */
+	uint8 pad[REGION_CACHE_LINE - sizeof(uint64) - sizeof(bool)];
+};
+
+static pthread_mutex_t region_reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<struct region_reader *> region_readers;	/* Never freed, only reused */
+static pthread_once_t region_reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t region_reader_key;
+static __thread struct region_reader *region_reader_self = NULL;
+static uint64 region_resizing = 0;
+
+#define REGION_PAGE_ABSENT	0	/* Only in the file */
+#define REGION_PAGE_LOADED	1
+#define REGION_PAGE_LOADING	2	/* Being read in by one thread */
+
+/* Pages live in frames that can be swapped rather than one allocation */
+static bool region_framed(void)
+{
+	return dedup_enabled || tier_enabled;
+}
+
+/* Give a thread's slot back when it exits */
+static void region_reader_release(void *arg)
+{
+	pthread_mutex_lock(&region_reader_mutex);
+	((struct region_reader *)arg)->used = false;
+	pthread_mutex_unlock(&region_reader_mutex);
+}
+
+static void region_reader_key_create(void)
+{
+	pthread_key_create(&region_reader_key, region_reader_release);
+}
+
+static struct region_reader *region_reader_claim(void)
+{
+	struct region_reader *reader = NULL;
+
+	pthread_once(&region_reader_once, region_reader_key_create);
+	pthread_mutex_lock(&region_reader_mutex);
+	for(size_t i = 0; i < region_readers.size() && !reader; i++)
+	{
+		if(!region_readers[i]->used)
+			reader = region_readers[i];
+	}
+	if(!reader)
+	{
+		if(posix_memalign((void **)&reader, REGION_CACHE_LINE, sizeof(*reader)) != 0)
+			die("region_reader_claim(): Out of memory.\n");
+		memset(reader, 0, sizeof(*reader));
+		region_readers.push_back(reader);
+	}
+	reader->used = true;
+	pthread_mutex_unlock(&region_reader_mutex);
+
+	pthread_setspecific(region_reader_key, reader);
+	region_reader_self = reader;
+	return reader;
+}
+
+/* Start using the page arrays; waits while a resize replaces them */
+static void region_enter(void)
+{
+	struct region_reader *reader = region_reader_self;
+
+	if(!reader)
+		reader = region_reader_claim();
+	if(reader->depth)
+	{
+		__atomic_store_n(&reader->depth, reader->depth + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	while(true)
+	{
+		/* Publish the slot before looking at the flag; the resizer does the reverse */
+		__atomic_store_n(&reader->depth, 1, __ATOMIC_SEQ_CST);
+		if(!__atomic_load_n(&region_resizing, __ATOMIC_SEQ_CST))
+			return;
+		__atomic_store_n(&reader->depth, 0, __ATOMIC_RELEASE);
+		while(__atomic_load_n(&region_resizing, __ATOMIC_ACQUIRE))
+			usleep(REGION_RESIZE_POLL_US);
+	}
+}
+
+static void region_leave(void)
+{
+	struct region_reader *reader = region_reader_self;
+
+	__atomic_store_n(&reader->depth, reader->depth - 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until no other thread is inside the region; region_resizing is set */
+static void region_quiesce(void)
+{
+	__atomic_store_n(&region_resizing, 1, __ATOMIC_SEQ_CST);
+
+	/* A slot claimed after this copy sees the flag before it gets in */
+	pthread_mutex_lock(&region_reader_mutex);
+	vector<struct region_reader *> readers = region_readers;
+	pthread_mutex_unlock(&region_reader_mutex);
+
+	for(size_t i = 0; i < readers.size(); i++)
+	{
+		if(readers[i] == region_reader_self)
+			continue;
+		while(__atomic_load_n(&readers[i]->depth, __ATOMIC_SEQ_CST))
+			usleep(REGION_RESIZE_POLL_US);
+	}
+}
+
+/* True if a range checked against an older size still fits; caller is inside */
+static bool region_within(uint64 offset, uint64 length)
+{
+	uint64 size = (uint64)shared_memory_size;
+
+	return offset <= size && length <= size - offset;
+}
+
+/* Check the magic, version and checksum of a file header */
+bool region_read_header(int fd, struct region_header *header)
+{
+	if(pread(fd, header, sizeof(*header), 0) != sizeof(*header))
+		return false;
+	if(memcmp(header->magic, REGION_MAGIC, sizeof(header->magic)) != 0)
+		return false;
+	if(header->version != REGION_VERSION)
+		return false;
+	if(header->header_crc != crc32c((uint8 *)header, offsetof(struct region_header, header_crc)))
+		return false;
+	return true;
+}
+
+static void region_write_header(void)
+{
+	uint8 block[REGION_HEADER_SIZE];
+	struct region_header *header = (struct region_header *)block;
+
+	memset(block, 0, sizeof(block));
+	memcpy(header->magic, REGION_MAGIC, sizeof(header->magic));
+	header->version = REGION_VERSION;
+	header->page_size = shared_page_size;
+	header->region_size = shared_memory_size;
+	header->generation = region_generation;
+	header->header_crc = crc32c(block, offsetof(struct region_header, header_crc));
+
+	if(pwrite(region_fd, block, sizeof(block), 0) != sizeof(block))
+		die_errno("Error: pwrite(): %s: ", REGION_FILENAME);
+}
+
+/* Map the CRC table that follows the data */
+static void region_map_table(void)
+{
+	uint64 length = region_page_count * sizeof(uint32_t);
+
+	if(region_crc_table)
+		munmap(region_crc_table, region_crc_length);
+
+	region_crc_table = (uint32_t *)mmap(NULL, length, PROT_READ | PROT_WRITE,
+		MAP_SHARED, region_fd, REGION_TABLE_OFFSET(shared_memory_size));
+	if(region_crc_table == MAP_FAILED)
+		die_errno("Error: mmap(): %s: ", REGION_FILENAME);
+	region_crc_length = length;
+}
+
+/* Write the whole region from memory in the current format */
+static void region_format(void)
+{
+	region_write_header();
+	if(ftruncate(region_fd, REGION_FILE_SIZE(shared_memory_size, shared_page_size)) == -1)
+		die_errno("Error: ftruncate(): %s: ", REGION_FILENAME);
+	if(pwrite(region_fd, shared_memory, shared_memory_size, REGION_HEADER_SIZE) != shared_memory_size)
+		die_errno("Error: pwrite(): %s: ", REGION_FILENAME);
+
+	region_map_table();
+	for(uint64 i = 0; i < region_page_count; i++)
+		region_crc_table[i] = crc32c(&shared_memory[i * shared_page_size], shared_page_size);
+
+	/* Frames are built as pages are read back in */
+	if(region_framed())
+	{
+		placement_free(shared_memory, shared_memory_size);
+		shared_memory = NULL;
+		memset(region_page_loaded, 0, region_page_count);
+	}
+}
+
+/* Release the memory behind every page */
+static void region_free(void)
+{
+	if(dedup_enabled)
+	{
+		for(uint64 i = 0; i < region_page_count; i++)
+		{
+			if(region_pages[i])
+				dedup_release(region_pages[i]);
+		}
+	}
+	if(tier_enabled)
+	{
+		for(uint64 i = 0; i < region_page_count; i++)
+		{
+			if(region_pages[i])
+				tier_free(region_pages[i]);
+		}
+	}
+	placement_free(shared_memory, shared_memory_size);
+	shared_memory = NULL;
+}
+
+/*
+	Allocate page state; calloc keeps this lazy for large regions. When
+	loaded is set the caller fills shared_memory and formats the file from
+	it; with frames that buffer only lives until region_format(). Returns
+	false, leaving the old region in place, if the memory cannot be had.
+*/
+static bool region_alloc(uint64 memory_size, bool loaded)
+{
+	uint8 *memory = NULL;
+
+	/* Nothing is torn down until the new memory is in hand */
+	if(!region_framed() || loaded)
+	{
+		memory = placement_alloc(memory_size);
+		if(!memory)
+			return false;
+	}
+
+	/* Table mapping depends on the old size, unmap it first */
+	if(region_crc_table)
+	{
+		munmap(region_crc_table, region_crc_length);
+		region_crc_table = NULL;
+	}
+
+	region_free();
+	region_page_count = memory_size / shared_page_size;
+
+	free(region_pages);
+	free(region_page_loaded);
+	free(region_page_hits);
+	free(region_page_writing);
+	free(region_page_seq_block);
+	region_pages = (uint8 **)calloc(region_page_count, sizeof(uint8 *));
+	region_page_loaded = (uint8 *)calloc(region_page_count, sizeof(uint8));
+	region_page_hits = (uint32_t *)calloc(region_page_count, sizeof(uint32_t));
+	region_page_writing = (uint8 *)calloc(region_page_count, sizeof(uint8));
+	region_page_seq_block = calloc(region_page_count + 1, sizeof(struct region_seq));
+	if(!region_pages || !region_page_loaded || !region_page_hits || !region_page_writing ||
+		!region_page_seq_block)
+		die("region_alloc(): Out of memory.\n");
+	heat_alloc(region_page_count);
+
+	/* One spare entry so the array can start on a cache line */
+	region_page_seq = (struct region_seq *)(((uintptr_t)region_page_seq_block +
+		REGION_CACHE_LINE - 1) & ~(uintptr_t)(REGION_CACHE_LINE - 1));
+
+	if(loaded)
+		memset(region_page_loaded, REGION_PAGE_LOADED, region_page_count);
+
+	if(memory)
+		shared_memory = memory;
+	if(!region_framed())
+	{
+		for(uint64 i = 0; i < region_page_count; i++)
+			region_pages[i] = &shared_memory[i * shared_page_size];
+	}
+	shared_memory_size = memory_size;
+	return true;
+}
+
+/* Startup sizes come from the file or the defaults, not a client */
+static void region_alloc_or_die(uint64 memory_size, bool loaded)
+{
+	if(!region_alloc(memory_size, loaded))
+		die("Error: Cannot allocate %llu bytes of network-shared memory.\n", memory_size);
+}
+
+/* Sizes a client may ask for: a whole number of pages, at least one */
+bool region_size_valid(uint64 memory_size)
+{
+	return memory_size != 0 && memory_size % shared_page_size == 0;
+}
+
+/* Open shared.bin, reusing its contents unless a fresh region is wanted */
+void region_open(bool fresh)
+{
+	struct region_header header;
+	struct stat info;
+
+	for(int i = 0; i < REGION_LOCK_STRIPES; i++)
+		pthread_mutex_init(&region_stripe_mutex[i], NULL);
+
+	region_fd = open(REGION_FILENAME, O_RDWR | O_CREAT, 0644);
+	if(region_fd == -1)
+		die_errno("Error: open(): %s: ", REGION_FILENAME);
+
+	if(fstat(region_fd, &info) == -1)
+		die_errno("Error: fstat(): %s: ", REGION_FILENAME);
+
+	/* Warm restart: pages are read from the file on first access */
+	if(!fresh && region_read_header(region_fd, &header))
+	{
+		if(header.page_size != (uint32_t)shared_page_size)
+			die("Error: %s has page size %X, expected %X.\n",
+				REGION_FILENAME, header.page_size, shared_page_size);
+		if((uint64)info.st_size < REGION_FILE_SIZE(header.region_size, header.page_size))
+			die("Error: %s is truncated; run the verify tool with -repair -accept to keep what is left.\n",
+				REGION_FILENAME);
+
+		region_alloc_or_die(header.region_size, false);
+		region_generation = header.generation + 1;
+		region_write_header();
+		region_map_table();
+
+		printf("Server: Reopened %08X bytes of network-shared memory from %s (generation %llu).\n",
+			shared_memory_size, REGION_FILENAME, region_generation);
+		return;
+	}
+
+	/* Headerless dump from an older server; convert it once */
+	if(!fresh && info.st_size > 0 && (info.st_size % shared_page_size) == 0)
+	{
+		region_alloc_or_die(info.st_size, true);
+		if(pread(region_fd, shared_memory, shared_memory_size, 0) != shared_memory_size)
+			die_errno("Error: pread(): %s: ", REGION_FILENAME);
+		region_format();
+
+		printf("Server: Converted %08X bytes of network-shared memory in %s.\n",
+			shared_memory_size, REGION_FILENAME);
+		return;
+	}
+
+	region_alloc_or_die(shared_memory_size, true);
+	memset(shared_memory, 0x20, shared_memory_size);
+	strcpy((char *)shared_memory, "HELLO THIS IS US. WE ARE SPARTA: RYAN, CHARLES, BRITTO, ANDREW, EDWIN\n\x00");
+	region_format();
+
+	printf("Server: Allocated %08X bytes of network-shared memory.\n", shared_memory_size);
+}
+
+/* Replace the region with a zero-filled one of a new size; false if it cannot be allocated */
+bool region_resize(uint64 memory_size)
+{
+	region_quiesce();
+	pthread_mutex_lock(&region_mutex);
+
+	/* Zeros are paged in lazily from the truncated file */
+	if(!region_alloc(memory_size, false))
+	{
+		pthread_mutex_unlock(&region_mutex);
+		__atomic_store_n(&region_resizing, 0, __ATOMIC_SEQ_CST);
+		return false;
+	}
+	snapshot_region_changed();
+	region_write_header();
+	if(ftruncate(region_fd, REGION_HEADER_SIZE) == -1 ||
+		ftruncate(region_fd, REGION_FILE_SIZE(memory_size, shared_page_size)) == -1)
+		die_errno("Error: ftruncate(): %s: ", REGION_FILENAME);
+	region_map_table();
+
+	uint8 *zero = new uint8 [shared_page_size];
+	memset(zero, 0, shared_page_size);
+	uint32_t zero_crc = crc32c(zero, shared_page_size);
+	for(uint64 i = 0; i < region_page_count; i++)
+		region_crc_table[i] = zero_crc;
+	delete []zero;
+	pthread_mutex_unlock(&region_mutex);
+	__atomic_store_n(&region_resizing, 0, __ATOMIC_SEQ_CST);
+	return true;
+}
+
+/* Remember the hottest pages so the next startup can prefetch them */
+void region_close(void)
+{
+	vector<pair<uint32_t, uint64> > hot;
+	FILE *fd;
+
+	for(uint64 i = 0; i < region_page_count; i++)
+	{
+		if(region_page_hits[i])
+			hot.push_back(make_pair(region_page_hits[i], i));
+	}
+	sort(hot.rbegin(), hot.rend());
+	if(hot.size() > REGION_HOT_MAX)
+		hot.resize(REGION_HOT_MAX);
+
+	fd = fopen(REGION_HOT_FILENAME, "wb");
+	if(fd)
+	{
+		for(size_t i = 0; i < hot.size(); i++)
+			fwrite(&hot[i].second, sizeof(uint64), 1, fd);
+		fclose(fd);
+	}
+
+	if(region_crc_table)
+		msync(region_crc_table, region_crc_length, MS_SYNC);
+
+	if(dedup_enabled)
+	{
+		char text[256];
+		dedup_report(text, sizeof(text));
+		printf("Server: %s", text);
+	}
+
+	if(tier_enabled)
+	{
+		char text[256];
+		tier_report(text, sizeof(text));
+		printf("Server: %s", text);
+	}
+
+	if(region_crc_errors)
+		printf("Server: %llu pages failed their CRC check when read from %s.\n",
+			region_crc_errors, REGION_FILENAME);
+
+	if(region_fd != -1)
+	{
+		fsync(region_fd);
+		close(region_fd);
+		region_fd = -1;
+	}
+
+	printf("Server: Saved %d hot pages to %s.\n", (int)hot.size(), REGION_HOT_FILENAME);
+}
+
+/*------------------------------------------------*/
+
+/* Drop the coldest resident page; it is clean, so nothing is written */
+static void region_evict(void)
+{
+	uint64 page;
+	uint8 *frame;
+	bool done = false;
+
+	if(tier_victim(&page, &frame))
+	{
+		/* A page in use is skipped rather than waited for */
+		pthread_mutex_t *stripe = &region_stripe_mutex[page % REGION_LOCK_STRIPES];
+		if(pthread_mutex_trylock(stripe) == 0)
+		{
+			if(region_page_loaded[page] == REGION_PAGE_LOADED && region_pages[page] == frame)
+			{
+				__atomic_store_n(&region_page_loaded[page], REGION_PAGE_ABSENT, __ATOMIC_RELEASE);
+				region_pages[page] = NULL;
+				done = true;
+			}
+			pthread_mutex_unlock(stripe);
+		}
+		tier_evicted(done);
+	}
+
+	if(done)
+		tier_free(frame);
+	else
+		sched_yield();
+}
+
+/* Memory for a page about to be read in */
+static uint8 *region_frame_alloc(uint64 page)
+{
+	uint8 *frame;
+
+	if(dedup_enabled)
+		return dedup_alloc();
+	if(!tier_enabled)
+		return region_pages[page];
+
+	while(!(frame = tier_alloc(page)))
+		region_evict();
+	return frame;
+}
+
+/* Read one page from the file into memory */
+static void region_load(uint64 page)
+{
+	uint8 *frame = region_frame_alloc(page);
+	ssize_t count = pread(region_fd, frame, shared_page_size,
+		REGION_HEADER_SIZE + page * shared_page_size);
+
+	/* Anything past the end of the file reads as zero */
+	if(count < 0)
+		die_errno("Error: pread(): %s: ", REGION_FILENAME);
+	memset(frame + count, 0, shared_page_size - count);
+
+	/* Torn or corrupted page; serve it anyway but report it */
+	if(crc32c(frame, shared_page_size) != region_crc_table[page])
+	{
+		printf("Warning: Page %016llX of %s failed its CRC check.\n",
+			page * shared_page_size, REGION_FILENAME);
+		__atomic_fetch_add(&region_crc_errors, 1, __ATOMIC_RELAXED);
+	}
+
+	if(dedup_enabled)
+		frame = dedup_merge(frame);
+	region_pages[page] = frame;
+}
+
+/* Make sure every page of a range has been read in from the file */
+void region_fault(uint64 offset, uint64 length)
+{
+	if(!length)
+		return;
+
+	uint64 first = offset / shared_page_size;
+	uint64 last = (offset + length - 1) / shared_page_size;
+
+	region_enter();
+	for(uint64 i = first; i <= last && i < region_page_count; i++)
+	{
+		if(__atomic_load_n(&region_page_loaded[i], __ATOMIC_ACQUIRE) == REGION_PAGE_LOADED)
+		{
+			tier_count(true);
+			continue;
+		}
+
+		/* Claim the page; a miss only holds up requests for the same page */
+		pthread_mutex_lock(&region_mutex);
+		while(region_page_loaded[i] == REGION_PAGE_LOADING)
+			pthread_cond_wait(&region_loaded_cond, &region_mutex);
+		if(region_page_loaded[i] == REGION_PAGE_LOADED)
+		{
+			pthread_mutex_unlock(&region_mutex);
+			continue;
+		}
+		region_page_loaded[i] = REGION_PAGE_LOADING;
+		pthread_mutex_unlock(&region_mutex);
+
+		region_load(i);
+		tier_count(false);
+
+		pthread_mutex_lock(&region_mutex);
+		__atomic_store_n(&region_page_loaded[i], REGION_PAGE_LOADED, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&region_loaded_cond);
+		pthread_mutex_unlock(&region_mutex);
+	}
+	region_leave();
+}
+
+/*
+	Count an access to a page. Counts are exact up to REGION_HITS_EXACT;
+	past that a page with n hits is only written about once every
+	n / REGION_HITS_EXACT accesses, adding that much, so the count stays
+	right on average while hot pages are seldom written.
+*/
+static void region_count_hit(uint64 page)
+{
+	static __thread uint32_t random = 0x9E3779B9;
+	uint32_t hits = __atomic_load_n(&region_page_hits[page], __ATOMIC_RELAXED);
+	uint32_t step = hits / REGION_HITS_EXACT;
+
+	if(step)
+	{
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		if(random % step)
+			return;
+	}
+	__atomic_fetch_add(&region_page_hits[page], MAX(step, 1), __ATOMIC_RELAXED);
+}
+
+/* Count accesses per page; used to pick pages to prefetch next time */
+static void region_touch(uint64 offset, uint64 length, bool write)
+{
+	if(!length)
+		return;
+
+	uint64 first = offset / shared_page_size;
+	uint64 last = (offset + length - 1) / shared_page_size;
+
+	for(uint64 i = first; i <= last && i < region_page_count; i++)
+	{
+		region_count_hit(i);
+		heat_access(i, write);
+		placement_touch(i * shared_page_size);
+
+		/* A stale frame only warms whichever page now owns it */
+		if(tier_enabled)
+		{
+			uint8 *frame = __atomic_load_n(&region_pages[i], __ATOMIC_RELAXED);
+			if(frame)
+				tier_touch(frame);
+		}
+	}
+}
+
+/* Lock the slot of a page, reading it back in if it was evicted */
+static pthread_mutex_t *region_lock_page(uint64 page)
+{
+	pthread_mutex_t *stripe = &region_stripe_mutex[page % REGION_LOCK_STRIPES];
+
+	pthread_mutex_lock(stripe);
+	while(__atomic_load_n(&region_page_loaded[page], __ATOMIC_ACQUIRE) != REGION_PAGE_LOADED)
+	{
+		pthread_mutex_unlock(stripe);
+		region_fault(page * shared_page_size, shared_page_size);
+		pthread_mutex_lock(stripe);
+	}
+	return stripe;
+}
+
+/*
+	Copy part of a page without locking, retrying if a writer got in the
+	way. Returns the sequence count the copy was taken at.
+*/
+static uint64 region_copy_page(uint64 page, uint8 *buffer, uint64 offset, uint64 length)
+{
+	uint64 *seq = &region_page_seq[page].seq;
+
+	while(true)
+	{
+		uint64 before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		if(!(before & 1))
+		{
+			memcpy(buffer, region_pages[page] + (offset - page * shared_page_size), length);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if(__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+				return before;
+		}
+#if defined(__x86_64__)
+		__builtin_ia32_pause();
+#endif
+	}
+}
+
+/* Hand a page to the snapshot dump under its stripe, so no write is half done */
+bool region_snapshot_page(uint64 page, uint8 *buffer)
+{
+	bool preserved = false;
+
+	region_enter();
+	if(page < region_page_count)
+	{
+		pthread_mutex_t *stripe = region_lock_page(page);
+		preserved = snapshot_capture(page, region_pages[page], buffer);
+		pthread_mutex_unlock(stripe);
+	}
+	region_leave();
+	return preserved;
+}
+
+/* Copy shared memory out without counting it as an access */
+void region_copy(uint64 offset, uint8 *buffer, uint64 length)
+{
+	uint64 end = offset + length;
+
+	region_enter();
+	if(!region_within(offset, length))
+	{
+		/* Resized meanwhile; the new region is all zeros */
+		memset(buffer, 0, length);
+		region_leave();
+		return;
+	}
+	region_fault(offset, length);
+	while(offset < end)
+	{
+		uint64 page = offset / shared_page_size;
+		uint64 chunk = MIN(end, (page + 1) * shared_page_size) - offset;
+
+		if(region_framed())
+		{
+			pthread_mutex_t *stripe = region_lock_page(page);
+			memcpy(buffer, region_pages[page] + (offset - page * shared_page_size), chunk);
+			pthread_mutex_unlock(stripe);
+		}
+		else
+			region_copy_page(page, buffer, offset, chunk);
+
+		buffer += chunk;
+		offset += chunk;
+	}
+	region_leave();
+}
+
+/* Copy shared memory out for a client */
+void region_read(uint64 offset, uint8 *buffer, uint64 length)
+{
+	region_enter();
+	region_copy(offset, buffer, length);
+	region_touch(offset, length, false);
+	region_leave();
+}
+
+/* Frame of a page that may be modified in place; caller holds its stripe */
+static uint8 *region_modify_begin(uint64 page)
+{
+	snapshot_preserve(page, region_pages[page]);
+	__atomic_store_n(&region_page_writing[page], 1, __ATOMIC_RELEASE);
+	if(dedup_enabled)
+		region_pages[page] = dedup_unshare(region_pages[page]);
+
+	/* Odd count sends lock-free readers round again */
+	__atomic_store_n(&region_page_seq[page].seq, region_page_seq[page].seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return region_pages[page];
+}
+
+/* Write modified bytes of a page through to the file and update its CRC */
+static void region_modify_end(uint64 page, uint64 offset, uint64 length)
+{
+	uint8 *frame = region_pages[page];
+
+	/* Memory is consistent again before the slower write to the file */
+	__atomic_store_n(&region_page_seq[page].seq, region_page_seq[page].seq + 1, __ATOMIC_RELEASE);
+
+	/* Still under the stripe, so replicas see writes to a page in order */
+	replica_log(offset, frame + (offset - page * shared_page_size), length);
+
+	if(pwrite(region_fd, frame + (offset - page * shared_page_size), length,
+		REGION_HEADER_SIZE + offset) != (ssize_t)length)
+		perror("region_modify_end(): pwrite(): ");
+	region_crc_table[page] = crc32c(frame, shared_page_size);
+	__atomic_store_n(&region_page_writing[page], 0, __ATOMIC_RELEASE);
+
+	if(dedup_enabled)
+		region_pages[page] = dedup_merge(frame);
+}
+
+/* Modify shared memory; the range is written through to the file */
+void region_write(uint64 offset, const uint8 *buffer, uint64 length)
+{
+	uint64 start = offset;
+	uint64 end = offset + length;
+
+	region_enter();
+	if(!region_within(offset, length))
+	{
+		region_leave();
+		return;
+	}
+	region_fault(offset, length);
+	region_touch(offset, length, true);
+
+	/* Data and checksum of each page are updated together */
+	while(offset < end)
+	{
+		uint64 page = offset / shared_page_size;
+		uint64 chunk = MIN(end, (page + 1) * shared_page_size) - offset;
+		pthread_mutex_t *stripe = region_lock_page(page);
+		uint8 *frame = region_modify_begin(page);
+		memcpy(frame + (offset - page * shared_page_size), buffer, chunk);
+		region_modify_end(page, offset, chunk);
+		pthread_mutex_unlock(stripe);
+
+		buffer += chunk;
+		offset += chunk;
+	}
+	region_leave();
+
+	subscribe_notify(start, length);
+}
+
+/* Fill a range in place with a repeating pattern, which starts at offset */
+void region_fill(uint64 offset, uint64 length, const uint8 *pattern, uint64 pattern_length)
+{
+	uint64 start = offset;
+	uint64 end = offset + length;
+
+	region_enter();
+	if(!region_within(offset, length))
+	{
+		region_leave();
+		return;
+	}
+	region_fault(offset, length);
+	region_touch(offset, length, true);
+
+	while(offset < end)
+	{
+		uint64 page = offset / shared_page_size;
+		uint64 chunk = MIN(end, (page + 1) * shared_page_size) - offset;
+		pthread_mutex_t *stripe = region_lock_page(page);
+		uint8 *frame = region_modify_begin(page);
+		compute_fill(frame + (offset - page * shared_page_size), chunk,
+			pattern, pattern_length, (offset - start) % pattern_length);
+		region_modify_end(page, offset, chunk);
+		pthread_mutex_unlock(stripe);
+
+		offset += chunk;
+	}
+	region_leave();
+
+	subscribe_notify(start, length);
+}
+
+/* Perform one atomic operation on an aligned word, returning the old value */
+uint64 region_atomic(uint8 opcode, uint64 offset, uint64 arg1, uint64 arg2)
+{
+	uint64 page = offset / shared_page_size;
+	uint64 old = 0;
+
+	region_enter();
+	if(!region_within(offset, ATOMIC_WORD_SIZE))
+	{
+		region_leave();
+		return old;
+	}
+	region_fault(offset, ATOMIC_WORD_SIZE);
+	region_touch(offset, ATOMIC_WORD_SIZE, true);
+
+	pthread_mutex_t *stripe = region_lock_page(page);
+	uint8 *frame = region_modify_begin(page);
+	uint64 *word = (uint64 *)(frame + (offset - page * shared_page_size));
+
+	switch(opcode)
+	{
+		case REQUEST_ATOMIC_CAS: /* arg1 = expected, arg2 = desired */
+			old = arg1;
+			__atomic_compare_exchange_n(word, &old, arg2, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			break;
+
+		case REQUEST_ATOMIC_FADD: /* arg1 = addend */
+			old = __atomic_fetch_add(word, arg1, __ATOMIC_SEQ_CST);
+			break;
+
+		case REQUEST_ATOMIC_XCHG: /* arg1 = new value */
+			old = __atomic_exchange_n(word, arg1, __ATOMIC_SEQ_CST);
+			break;
+	}
+
+	region_modify_end(page, offset, ATOMIC_WORD_SIZE);
+	pthread_mutex_unlock(stripe);
+	region_leave();
+
+	subscribe_notify(offset, ATOMIC_WORD_SIZE);
+	return old;
+}
+
+/*------------------------------------------------*/
+
+/*
+	Copy a whole page out with its version for the read set of a
+	transaction. The version is half the sequence count, so it goes up
+	by one with every modification of the page.
+*/
+uint64 region_read_version(uint64 offset, uint8 *buffer)
+{
+	uint64 page = offset / shared_page_size;
+	uint64 seq;
+
+	region_enter();
+	if(!region_within(offset, shared_page_size))
+	{
+		memset(buffer, 0, shared_page_size);
+		region_leave();
+		return 0;
+	}
+	region_fault(offset, shared_page_size);
+	if(region_framed())
+	{
+		pthread_mutex_t *stripe = region_lock_page(page);
+		memcpy(buffer, region_pages[page], shared_page_size);
+		seq = region_page_seq[page].seq;
+		pthread_mutex_unlock(stripe);
+	}
+	else
+		seq = region_copy_page(page, buffer, offset, shared_page_size);
+
+	region_touch(offset, shared_page_size, false);
+	region_leave();
+	return seq / 2;
+}
+
+/* Hold every stripe, so no page is part way through a write */
+void region_lock_all(void)
+{
+	region_enter();
+	for(int i = 0; i < REGION_LOCK_STRIPES; i++)
+		pthread_mutex_lock(&region_stripe_mutex[i]);
+}
+
+void region_unlock_all(void)
+{
+	for(int i = REGION_LOCK_STRIPES - 1; i >= 0; i--)
+		pthread_mutex_unlock(&region_stripe_mutex[i]);
+	region_leave();
+}
+
+/* Lock the stripes of a set of pages in ascending order, once each */
+static void region_lock_stripes(const bool *stripes)
+{
+	for(int i = 0; i < REGION_LOCK_STRIPES; i++)
+	{
+		if(stripes[i])
+			pthread_mutex_lock(&region_stripe_mutex[i]);
+	}
+}
+
+static void region_unlock_stripes(const bool *stripes)
+{
+	for(int i = REGION_LOCK_STRIPES - 1; i >= 0; i--)
+	{
+		if(stripes[i])
+			pthread_mutex_unlock(&region_stripe_mutex[i]);
+	}
+}
+
+/*
+	Commit a transaction. The stripes of every page it reads or writes
+	are locked in ascending order, so transactions cannot deadlock and
+	ones on other stripes commit in parallel. Every page read must still
+	be at the version the client saw; then either all writes are applied
+	or none is. A reader of one page sees it from before or after the
+	transaction; several pages are only seen consistently by validating
+	them in a transaction of their own. Returns REGION_TX_COMMITTED, or the offset of the first page read
+	that has changed since.
+*/
+uint64 region_commit(const struct region_tx_read *reads, int read_count,
+	const struct region_tx_write *writes, int write_count)
+{
+	vector<uint64> pages;		/* Read or written, ascending */
+	vector<uint64> written;		/* Written, ascending */
+	bool stripes[REGION_LOCK_STRIPES];
+	uint64 result = REGION_TX_COMMITTED;
+
+	/* Resized since the request was checked; every page read has changed */
+	region_enter();
+	for(int i = 0; i < read_count && result == REGION_TX_COMMITTED; i++)
+	{
+		if(!region_within(reads[i].offset, shared_page_size))
+			result = reads[i].offset;
+	}
+	for(int i = 0; i < write_count && result == REGION_TX_COMMITTED; i++)
+	{
+		if(!region_within(writes[i].offset, writes[i].length))
+			result = read_count ? reads[0].offset : writes[i].offset;
+	}
+	if(result != REGION_TX_COMMITTED)
+	{
+		region_leave();
+		return result;
+	}
+
+	for(int i = 0; i < read_count; i++)
+	{
+		region_fault(reads[i].offset, shared_page_size);
+		pages.push_back(reads[i].offset / shared_page_size);
+	}
+	for(int i = 0; i < write_count; i++)
+	{
+		region_fault(writes[i].offset, writes[i].length);
+		for(uint64 page = writes[i].offset / shared_page_size;
+			page <= (writes[i].offset + writes[i].length - 1) / shared_page_size; page++)
+			written.push_back(page);
+	}
+	sort(written.begin(), written.end());
+	written.erase(unique(written.begin(), written.end()), written.end());
+	pages.insert(pages.end(), written.begin(), written.end());
+	sort(pages.begin(), pages.end());
+	pages.erase(unique(pages.begin(), pages.end()), pages.end());
+
+	memset(stripes, 0, sizeof(stripes));
+	for(size_t i = 0; i < pages.size(); i++)
+		stripes[pages[i] % REGION_LOCK_STRIPES] = true;
+
+	/* With -tier a page may be dropped before its stripe is held */
+	while(true)
+	{
+		uint64 absent = region_page_count;
+
+		region_lock_stripes(stripes);
+		for(size_t i = 0; i < pages.size() && absent == region_page_count; i++)
+		{
+			if(__atomic_load_n(&region_page_loaded[pages[i]], __ATOMIC_ACQUIRE) != REGION_PAGE_LOADED)
+				absent = pages[i];
+		}
+		if(absent == region_page_count)
+			break;
+		region_unlock_stripes(stripes);
+		region_fault(absent * shared_page_size, shared_page_size);
+	}
+
+	/* Writers hold the stripe while a count is odd, so these are stable */
+	for(int i = 0; i < read_count && result == REGION_TX_COMMITTED; i++)
+	{
+		uint64 page = reads[i].offset / shared_page_size;
+		if(region_page_seq[page].seq != 2 * reads[i].version)
+			result = reads[i].offset;
+	}
+
+	if(result == REGION_TX_COMMITTED)
+	{
+		vector<uint64> low(written.size(), ~(uint64)0);
+		vector<uint64> high(written.size(), 0);
+
+		for(size_t i = 0; i < written.size(); i++)
+			region_modify_begin(written[i]);
+
+		for(int i = 0; i < write_count; i++)
+		{
+			uint64 offset = writes[i].offset;
+			uint64 end = offset + writes[i].length;
+			const uint8 *data = writes[i].data;
+
+			while(offset < end)
+			{
+				uint64 page = offset / shared_page_size;
+				uint64 chunk = MIN(end, (page + 1) * shared_page_size) - offset;
+				size_t index = lower_bound(written.begin(), written.end(), page) - written.begin();
+
+				memcpy(region_pages[page] + (offset - page * shared_page_size), data, chunk);
+				low[index] = MIN(low[index], offset);
+				high[index] = MAX(high[index], offset + chunk);
+				data += chunk;
+				offset += chunk;
+			}
+		}
+
+		for(size_t i = 0; i < written.size(); i++)
+			region_modify_end(written[i], low[i], high[i] - low[i]);
+	}
+	region_unlock_stripes(stripes);
+
+	if(result == REGION_TX_COMMITTED)
+	{
+		for(int i = 0; i < read_count; i++)
+			region_touch(reads[i].offset, shared_page_size, false);
+		for(int i = 0; i < write_count; i++)
+		{
+			region_touch(writes[i].offset, writes[i].length, true);
+			subscribe_notify(writes[i].offset, writes[i].length);
+		}
+	}
+	region_leave();
+
+	return result;
+}
+
+/* True if a copy of a page with the given CRC32C is up to date */
+bool region_page_current(uint64 offset, uint32_t crc)
+{
+	uint64 page = offset / shared_page_size;
+	bool current = false;
+
+	region_enter();
+	if(!(offset % shared_page_size) && page < region_page_count &&
+		!__atomic_load_n(&region_page_writing[page], __ATOMIC_ACQUIRE))
+		current = (region_crc_table[page] == crc);
+	region_leave();
+	return current;
+}
+
+/* True if shared.bin holds the current contents of every page in a range */
+static bool region_clean(uint64 offset, uint64 length)
+{
+	uint64 first = offset / shared_page_size;
+	uint64 last = (offset + length - 1) / shared_page_size;
+
+	for(uint64 i = first; i <= last && i < region_page_count; i++)
+	{
+		if(__atomic_load_n(&region_page_writing[i], __ATOMIC_ACQUIRE))
+			return false;
+	}
+	return true;
+}
+
+/*
+	Send a range to a socket back-to-back. Writes go through to the file,
+	so chunks with no write in progress are sent from shared.bin with
+	sendfile() without being paged in; the rest are copied from memory.
+	A write racing with a chunk sent from the file may be seen half done;
+	chunks copied from memory are consistent page by page.
+*/
+void region_stream(int socket_fd, uint64 offset, uint64 length)
+{
+	uint64 end = offset + length;
+	uint8 *buffer = NULL;
+
+	/* Only counted as heat; a bulk read should not steer prefetch or tiering */
+	if(length)
+	{
+		uint64 last = (end - 1) / shared_page_size;
+
+		region_enter();
+		for(uint64 i = offset / shared_page_size; i <= last && i < region_page_count; i++)
+			heat_access(i, false);
+		region_leave();
+	}
+
+	/* Only inside the region between chunks, never while the socket blocks */
+	while(offset < end)
+	{
+		uint64 chunk = MIN(end - offset, REGION_STREAM_CHUNK);
+		uint64 sent = 0;
+
+		region_enter();
+		bool clean = region_clean(offset, chunk);
+		region_leave();
+		if(clean)
+		{
+			off_t file_offset = REGION_HEADER_SIZE + offset;
+
+			while(sent < chunk)
+			{
+				ssize_t count = sendfile(socket_fd, region_fd, &file_offset, chunk - sent);
+				if(count == -1 && errno == EINTR)
+					continue;
+				if(count <= 0)
+					break;
+				sent += count;
+			}
+		}
+
+		/* Dirty chunk, or the file ended early */
+		if(sent < chunk)
+		{
+			if(!buffer)
+				buffer = new uint8 [REGION_STREAM_CHUNK];
+			region_copy(offset + sent, buffer, chunk - sent);
+			comms_send(socket_fd, buffer, chunk - sent);
+		}
+
+		offset += chunk;
+	}
+
+	delete []buffer;
+}
+
+/*------------------------------------------------*/
+
+/* Read in the pages that were hottest before the last shutdown */
+static void *region_prefetch_thread(void *arg)
+{
+	uint64 page;
+	int count = 0;
+	FILE *fd = fopen(REGION_HOT_FILENAME, "rb");
+
+	if(!fd)
+		return NULL;
+
+	while(fread(&page, sizeof(uint64), 1, fd) == 1)
+	{
+		if(page >= region_page_count)
+			continue;
+		region_fault(page * shared_page_size, shared_page_size);
+		count++;
+	}
+	fclose(fd);
+
+	printf("Server: Prefetched %d hot pages from %s.\n", count, REGION_FILENAME);
+	return NULL;
+}
+
+void region_prefetch_start(void)
+{
+	pthread_t thread;
+
+	if(pthread_create(&thread, NULL, region_prefetch_thread, NULL) == 0)
+		pthread_detach(thread);
+}
+
+/* End */
@@ -0,0 +1,73 @@
+#ifndef _REGION_H_
+#define _REGION_H_
+
+#define REGION_FILENAME		"shared.bin"
+#define REGION_HOT_FILENAME	"shared.hot"
+#define REGION_HOT_MAX		4096	/* Pages remembered for prefetch */
+#define REGION_STREAM_CHUNK	0x100000	/* Bytes per step of a streamed range */
+
+/*
+	shared.bin layout:
+	header     - REGION_HEADER_SIZE bytes, struct region_header at the start
+	data       - region_size bytes of shared memory
+	padding    - up to the next REGION_TABLE_ALIGN boundary
+	crc table  - one CRC32C per page of data
+*/
+#define REGION_MAGIC		"NMREGION"
+#define REGION_VERSION		1
+#define REGION_HEADER_SIZE	0x1000
+#define REGION_LOCK_STRIPES	64
+#define REGION_CACHE_LINE	64	/* Each page's sequence count has its own */
+#define REGION_HITS_EXACT	64	/* Accesses counted exactly, then sampled */
+#define REGION_RESIZE_POLL_US	100	/* Wait between checks while a resize drains readers */
+
+struct region_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+	uint64 region_size;
+	uint64 generation;	/* Bumped every time the server opens the file */
+	uint32_t header_crc;	/* CRC32C of the fields above */
+};
+
+#define REGION_TABLE_ALIGN	0x1000	/* The table is mapped, so it starts on a page */
+#define REGION_TABLE_OFFSET(size)	(REGION_HEADER_SIZE + (((size) + REGION_TABLE_ALIGN - 1) & ~(uint64)(REGION_TABLE_ALIGN - 1)))
+#define REGION_FILE_SIZE(size, page)	(REGION_TABLE_OFFSET(size) + (size) / (page) * sizeof(uint32_t))
+
+#define REGION_TX_COMMITTED	(~(uint64)0)	/* region_commit() found no conflict */
+
+/* Page a transaction read, at the version region_read_version() gave */
+struct region_tx_read {
+	uint64 offset;
+	uint64 version;
+};
+
+struct region_tx_write {
+	uint64 offset;
+	uint64 length;
+	const uint8 *data;
+};
+
+/* Function prototypes */
+bool region_read_header(int fd, struct region_header *header);
+bool region_size_valid(uint64 memory_size);
+void region_open(bool fresh);
+bool region_resize(uint64 memory_size);
+void region_close(void);
+void region_prefetch_start(void);
+void region_fault(uint64 offset, uint64 length);
+bool region_snapshot_page(uint64 page, uint8 *buffer);
+void region_copy(uint64 offset, uint8 *buffer, uint64 length);
+void region_read(uint64 offset, uint8 *buffer, uint64 length);
+void region_write(uint64 offset, const uint8 *buffer, uint64 length);
+void region_fill(uint64 offset, uint64 length, const uint8 *pattern, uint64 pattern_length);
+uint64 region_atomic(uint8 opcode, uint64 offset, uint64 arg1, uint64 arg2);
+void region_stream(int socket_fd, uint64 offset, uint64 length);
+bool region_page_current(uint64 offset, uint32_t crc);
+uint64 region_read_version(uint64 offset, uint8 *buffer);
+void region_lock_all(void);
+void region_unlock_all(void);
+uint64 region_commit(const struct region_tx_read *reads, int read_count,
+	const struct region_tx_write *writes, int write_count);
+
+#endif /* _REGION_H_ */
@@ -0,0 +1,463 @@
+/*
+	File:
+		replay.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Re-drives a trace recorded with -trace against a server and
+		reports latency per request type. Each traced connection gets its
+		own connection and thread, and requests keep their original spacing
+		divided by -speed; with -speed 0 they are sent back-to-back.
+
+		Traces hold no data, so writes carry a fixed fill pattern and
+		atomics are replayed as a fetch-add of zero. Replay against a
+		scratch region, or pass -readonly to leave writes out.
+
+		With -replica, connections are spread over the replicas listed and
+		send their page reads there as REQUEST_PAGE_BOUNDED with -maxlag,
+		falling back to the primary when a replica is too far behind;
+		everything else still goes to the primary. Reads served by a
+		replica are reported as "replica page", and the primary's
+		replication lag is printed at the end.
+*/
+
+#include "shared.h"
+#include <netinet/tcp.h>
+#include <vector>
+#include <map>
+#include <string>
+using namespace std;
+
+#define REPLAY_MAX_CONNECTIONS	256	/* Extra traced connections are folded in */
+#define REPLAY_FILL		0xA5
+
+struct replay_stream {
+	pthread_t thread;
+	vector<struct trace_record> records;
+	map<uint8, vector<uint64> > latency;	/* Opcode -> ns per request */
+	int replica;			/* Index in replay_replicas, or -1 */
+	uint64 skipped;
+	uint64 fallbacks;		/* Page reads a replica refused */
+	uint64 late_ns;		/* Time spent behind schedule */
+	uint64 late_max_ns;
+};
+
+static char *replay_hostname;
+static int replay_port;
+static uint64 replay_memory_size = 0x10000;
+static double replay_speed = 1.0;
+static bool replay_readonly = false;
+static uint64 replay_trace_start = 0;	/* First traced timestamp */
+static uint64 replay_start = 0;		/* When replay began */
+static vector<pair<string, int> > replay_replicas;	/* Host and port */
+static uint64 replay_max_lag_ms = REPLICA_MAX_LAG_MS;
+static struct nm_shard_map replay_shards;	/* node_count 0 unless -sharded */
+
+static const char *replay_opcode_name(uint8 opcode)
+{
+	switch(opcode)
+	{
+		case REQUEST_PAGE:		return "page";
+		case REQUEST_PAGE_BOUNDED:	return "replica page";
+		case REQUEST_PAGE_SYNC:		return "page sync";
+		case REQUEST_READ_RANGE:	return "read range";
+		case REQUEST_WRITE_RANGE:	return "write range";
+		case REQUEST_STREAM_RANGE:	return "stream range";
+		case REQUEST_RANGE_FILL:	return "fill";
+		case REQUEST_RANGE_MOVE:	return "move";
+		case REQUEST_RANGE_COMPARE:	return "compare";
+		case REQUEST_RANGE_FIND:	return "find";
+		case REQUEST_TX_READ:		return "tx read";
+		case REQUEST_TX_COMMIT:		return "tx commit";
+		case REQUEST_ATOMIC_CAS:	return "atomic cas";
+		case REQUEST_ATOMIC_FADD:	return "atomic fadd";
+		case REQUEST_ATOMIC_XCHG:	return "atomic xchg";
+	}
+	return "other";
+}
+
+static bool replay_is_write(uint8 opcode)
+{
+	return opcode != REQUEST_PAGE && opcode != REQUEST_PAGE_BOUNDED && opcode != REQUEST_READ_RANGE &&
+		opcode != REQUEST_STREAM_RANGE && opcode != REQUEST_RANGE_COMPARE &&
+		opcode != REQUEST_RANGE_FIND && opcode != REQUEST_TX_READ;
+}
+
+static int replay_dial(const char *hostname, int port)
+{
+	struct sockaddr_in server_addr;
+	int nodelay = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if(fd == -1)
+		die_errno("Error: socket(): ");
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	inet_pton(AF_INET, hostname, &server_addr.sin_addr.s_addr);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	if(connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+		die_errno("Error: connect(): ");
+	if(!nm_client_connect(fd, CLIENT_PAGE_SIZE, replay_memory_size))
+		die("Error: Server refused a region of %llX bytes.\n", replay_memory_size);
+	return fd;
+}
+
+/* Send one traced request and wait for the server to finish it */
+static void replay_issue(int fd, struct trace_record *record, uint8 *buffer)
+{
+	switch(record->opcode)
+	{
+		case REQUEST_PAGE:
+			nm_client_request_page(fd, record->offset, buffer);
+			break;
+
+		case REQUEST_PAGE_BOUNDED:
+			nm_client_request_page_bounded(fd, record->offset, replay_max_lag_ms, buffer);
+			break;
+
+		case REQUEST_PAGE_SYNC:
+			/* Syncs are not acknowledged; an empty read marks completion */
+			nm_client_request_sync(fd, record->offset, buffer);
+			nm_client_read_range(fd, 0, 0, buffer);
+			break;
+
+		case REQUEST_READ_RANGE:
+			nm_client_read_range(fd, record->offset, record->length, buffer);
+			break;
+
+		case REQUEST_WRITE_RANGE:
+			nm_client_write_range(fd, record->offset, record->length, buffer);
+			break;
+
+		case REQUEST_STREAM_RANGE:
+			nm_client_stream_range(fd, record->offset, record->length, buffer);
+			break;
+
+		/* Sources are not traced; moves and compares use the range itself */
+		case REQUEST_RANGE_FILL:
+			nm_client_fill(fd, record->offset, record->length, buffer, 1);
+			break;
+
+		case REQUEST_RANGE_MOVE:
+			nm_client_move(fd, record->offset, record->offset, record->length);
+			break;
+
+		case REQUEST_RANGE_COMPARE:
+			nm_client_compare(fd, record->offset, record->offset, record->length, NULL);
+			break;
+
+		case REQUEST_RANGE_FIND:
+		{
+			uint64_t match;
+			nm_client_find(fd, record->offset, record->length, buffer, 1, &match, 1);
+			break;
+		}
+
+		/* Read sets are not traced; a commit writes the span of its writes */
+		case REQUEST_TX_READ:
+		{
+			uint64_t versions[TX_PAGES_MAX];
+			nm_client_tx_read(fd, record->offset, (int)MIN(record->length / CLIENT_PAGE_SIZE, TX_PAGES_MAX),
+				buffer, versions);
+			break;
+		}
+
+		case REQUEST_TX_COMMIT:
+		{
+			struct nm_tx_write write = { record->offset, record->length, buffer };
+			nm_client_tx_commit(fd, NULL, 0, &write, record->length ? 1 : 0, NULL);
+			break;
+		}
+
+		default:
+			nm_client_atomic_fetch_add(fd, record->offset, 0, NULL);
+			break;
+	}
+}
+
+/* Connection a request goes on: its page's owner for faults and syncs */
+static int replay_route(struct trace_record *record, int fd, int *shard_fd)
+{
+	if(!replay_shards.node_count ||
+		(record->opcode != REQUEST_PAGE && record->opcode != REQUEST_PAGE_SYNC))
+		return fd;
+
+	int node = nm_client_shard_owner(&replay_shards, record->offset);
+	if(node == -1 || (replay_shards.nodes[node].port == replay_port &&
+		!strcmp(replay_shards.nodes[node].host, replay_hostname)))
+		return fd;
+
+	if(shard_fd[node] == -1)
+		shard_fd[node] = replay_dial(replay_shards.nodes[node].host, replay_shards.nodes[node].port);
+	return shard_fd[node];
+}
+
+static void *replay_thread(void *arg)
+{
+	struct replay_stream *stream = (struct replay_stream *)arg;
+	uint8 *buffer = new uint8 [MAX(replay_memory_size, CLIENT_PAGE_SIZE)];
+	int fd = replay_dial(replay_hostname, replay_port);
+	int replica_fd = -1;
+	int shard_fd[SHARD_NODES_MAX];
+
+	for(int i = 0; i < SHARD_NODES_MAX; i++)
+		shard_fd[i] = -1;
+
+	if(stream->replica != -1)
+		replica_fd = replay_dial(replay_replicas[stream->replica].first.c_str(),
+			replay_replicas[stream->replica].second);
+
+	memset(buffer, REPLAY_FILL, MAX(replay_memory_size, CLIENT_PAGE_SIZE));
+	for(size_t i = 0; i < stream->records.size(); i++)
+	{
+		struct trace_record *record = &stream->records[i];
+
+		/* Recorded against a larger region, or not wanted */
+		if(record->offset + record->length > replay_memory_size ||
+			(replay_readonly && replay_is_write(record->opcode)))
+		{
+			stream->skipped++;
+			continue;
+		}
+
+		/* Hold back until the request is due */
+		if(replay_speed > 0)
+		{
+			uint64 due = replay_start + (uint64)((record->time_ns - replay_trace_start) / replay_speed);
+			uint64 now = trace_time();
+
+			if(now < due)
+				usleep((due - now) / 1000);
+			else
+			{
+				stream->late_ns += now - due;
+				stream->late_max_ns = MAX(stream->late_max_ns, now - due);
+			}
+		}
+
+		uint64 start = trace_time();
+		if(replica_fd != -1 && record->opcode == REQUEST_PAGE)
+		{
+			/* Too far behind; the primary serves it, at the cost of both */
+			if(nm_client_request_page_bounded(replica_fd, record->offset, replay_max_lag_ms, buffer))
+			{
+				stream->latency[REQUEST_PAGE_BOUNDED].push_back(trace_time() - start);
+				continue;
+			}
+			stream->fallbacks++;
+		}
+		replay_issue(replay_route(record, fd, shard_fd), record, buffer);
+		stream->latency[record->opcode].push_back(trace_time() - start);
+	}
+
+	for(int i = 0; i < SHARD_NODES_MAX; i++)
+	{
+		if(shard_fd[i] == -1)
+			continue;
+		nm_client_disconnect(shard_fd[i]);
+		close(shard_fd[i]);
+	}
+
+	if(replica_fd != -1)
+	{
+		nm_client_disconnect(replica_fd);
+		close(replica_fd);
+	}
+	nm_client_disconnect(fd);
+	close(fd);
+	delete []buffer;
+	return NULL;
+}
+
+static bool replay_earlier(const struct trace_record &a, const struct trace_record &b)
+{
+	return a.time_ns < b.time_ns;
+}
+
+/* Read the ring back oldest first */
+static void replay_load(char *filename, vector<struct trace_record> &records)
+{
+	struct trace_header header;
+	int fd = open(filename, O_RDONLY);
+
+	if(fd == -1)
+		die_errno("Error: open(): %s: ", filename);
+	if(pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.record_size != sizeof(struct trace_record) || !header.capacity)
+		die("Error: %s is not a trace file.\n", filename);
+
+	uint64 count = MIN(header.head, header.capacity);
+	vector<struct trace_record> ring(header.capacity);
+	uint64 length = header.capacity * sizeof(struct trace_record);
+	if(pread(fd, &ring[0], length, TRACE_HEADER_SIZE) != (ssize_t)length)
+		die("Error: %s is truncated.\n", filename);
+	close(fd);
+
+	for(uint64 i = header.head - count; i < header.head; i++)
+	{
+		if(ring[i % header.capacity].time_ns)
+			records.push_back(ring[i % header.capacity]);
+	}
+
+	/* Slots are claimed before they are stamped; order by time */
+	stable_sort(records.begin(), records.end(), replay_earlier);
+
+	printf("Trace:       %s (%s side)\n", filename,
+		header.source == TRACE_SOURCE_SERVER ? "server" : "client");
+	printf("Requests:    %llu of %llu recorded\n", (uint64)records.size(), header.head);
+}
+
+int run_replay(char *hostname, int port, int argc, char *argv[])
+{
+	char *filename = TRACE_DEFAULT_FILENAME;
+	vector<struct trace_record> records;
+	map<uint32_t, struct replay_stream *> streams;
+	int index;
+
+	if((index = find_option(argc, argv, "-f")) != -1 && index + 1 < argc)
+		filename = argv[index + 1];
+	if((index = find_option(argc, argv, "-speed")) != -1 && index + 1 < argc)
+		replay_speed = MAX(atof(argv[index + 1]), 0.0);
+	if((index = find_option(argc, argv, "-m")) != -1 && index + 1 < argc)
+		replay_memory_size = strtoull(argv[index + 1], NULL, 0);
+	replay_readonly = (find_option(argc, argv, "-readonly") != -1);
+	if((index = find_option(argc, argv, "-maxlag")) != -1 && index + 1 < argc)
+		replay_max_lag_ms = strtoull(argv[index + 1], NULL, 0);
+	if((index = find_option(argc, argv, "-replica")) != -1 && index + 1 < argc)
+	{
+		string list = argv[index + 1];
+
+		for(size_t start = 0; start < list.size(); )
+		{
+			size_t end = list.find(',', start);
+			string entry = list.substr(start, end == string::npos ? string::npos : end - start);
+			size_t colon = entry.rfind(':');
+
+			if(colon == string::npos)
+				die("Error: -replica needs host:port[,host:port...].\n");
+			replay_replicas.push_back(make_pair(entry.substr(0, colon), atoi(entry.c_str() + colon + 1)));
+			start = (end == string::npos) ? list.size() : end + 1;
+		}
+	}
+	replay_hostname = hostname;
+	replay_port = port;
+
+	replay_load(filename, records);
+	if(records.empty())
+		return 1;
+
+	if(find_option(argc, argv, "-sharded") != -1)
+	{
+		int fd = replay_dial(replay_hostname, replay_port);
+
+		if(!nm_client_shard_map(fd, &replay_shards))
+			die("Error: No shard map.\n");
+		nm_client_disconnect(fd);
+		close(fd);
+		printf("Shards:      %d nodes, map epoch %llu\n", replay_shards.node_count, (uint64)replay_shards.epoch);
+	}
+
+	/* One stream per traced connection */
+	for(size_t i = 0; i < records.size(); i++)
+	{
+		uint32_t connection = records[i].connection % REPLAY_MAX_CONNECTIONS;
+
+		if(!streams.count(connection))
+		{
+			streams[connection] = new replay_stream;
+			streams[connection]->replica = replay_replicas.empty() ? -1 :
+				(int)(streams.size() - 1) % (int)replay_replicas.size();
+			streams[connection]->skipped = 0;
+			streams[connection]->fallbacks = 0;
+			streams[connection]->late_ns = 0;
+			streams[connection]->late_max_ns = 0;
+		}
+		streams[connection]->records.push_back(records[i]);
+	}
+
+	double duration = (records.back().time_ns - records.front().time_ns) / 1e9;
+	printf("Duration:    %.3f s over %d connections\n", duration, (int)streams.size());
+	if(replay_speed > 0)
+		printf("Speed:       %.2fx\n", replay_speed);
+	else
+		printf("Speed:       as fast as possible\n");
+	if(!replay_replicas.empty())
+		printf("Replicas:    %d, page reads at most %llu ms behind\n", (int)replay_replicas.size(), replay_max_lag_ms);
+
+	replay_trace_start = records.front().time_ns;
+	replay_start = trace_time();
+	for(map<uint32_t, struct replay_stream *>::iterator it = streams.begin(); it != streams.end(); it++)
+	{
+		if(pthread_create(&it->second->thread, NULL, replay_thread, it->second) != 0)
+			die("Error: pthread_create()\n");
+	}
+
+	/* Merge the results of every connection */
+	map<uint8, vector<uint64> > latency;
+	uint64 skipped = 0, fallbacks = 0, late_ns = 0, late_max_ns = 0, sent = 0;
+	for(map<uint32_t, struct replay_stream *>::iterator it = streams.begin(); it != streams.end(); it++)
+	{
+		struct replay_stream *stream = it->second;
+
+		pthread_join(stream->thread, NULL);
+		for(map<uint8, vector<uint64> >::iterator op = stream->latency.begin(); op != stream->latency.end(); op++)
+		{
+			latency[op->first].insert(latency[op->first].end(), op->second.begin(), op->second.end());
+			sent += op->second.size();
+		}
+		skipped += stream->skipped;
+		fallbacks += stream->fallbacks;
+		late_ns += stream->late_ns;
+		late_max_ns = MAX(late_max_ns, stream->late_max_ns);
+		delete stream;
+	}
+	double seconds = (trace_time() - replay_start) / 1e9;
+
+	printf("Replayed %llu requests in %.3f s (%.0f requests/s), %llu skipped\n",
+		sent, seconds, seconds > 0 ? sent / seconds : 0.0, skipped);
+	if(replay_speed > 0)
+		printf("Behind schedule: avg %.1f us, max %.1f us\n",
+			sent ? late_ns / 1e3 / sent : 0.0, late_max_ns / 1e3);
+
+	printf("%-14s %10s %10s %10s %10s %10s\n", "Request", "Count", "Avg us", "p50 us", "p99 us", "Max us");
+	for(map<uint8, vector<uint64> >::iterator op = latency.begin(); op != latency.end(); op++)
+	{
+		vector<uint64> &ns = op->second;
+		uint64 total = 0;
+
+		sort(ns.begin(), ns.end());
+		for(size_t i = 0; i < ns.size(); i++)
+			total += ns[i];
+		printf("%-14s %10llu %10.1f %10.1f %10.1f %10.1f\n",
+			replay_opcode_name(op->first), (uint64)ns.size(),
+			total / 1e3 / ns.size(), ns[ns.size() / 2] / 1e3,
+			ns[ns.size() * 99 / 100] / 1e3, ns.back() / 1e3);
+	}
+
+	/* Replication lag as the primary measured it */
+	if(!replay_replicas.empty())
+	{
+		char text[STATS_TEXT_MAX];
+		int fd = replay_dial(replay_hostname, replay_port);
+
+		printf("Replica fallbacks to the primary: %llu\n", fallbacks);
+		if(nm_client_stats(fd, text, sizeof(text)) > 0)
+		{
+			for(char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n"))
+			{
+				if(!strncmp(line, "replica", 7))
+					printf("%s\n", line);
+			}
+		}
+		nm_client_disconnect(fd);
+		close(fd);
+	}
+
+	return 0;
+}
+
+/* End */
@@ -0,0 +1,7 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_
+
+/* Function prototypes */
+int run_replay(char *hostname, int port, int argc, char *argv[]);
+
+#endif /* _REPLAY_H_ */
@@ -0,0 +1,594 @@
+/*
+	File:
+		replica.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Primary/replica replication. A server started with -replicaof
+		connects to the primary and sends CLIENT_REPLICATE. The primary
+		copies the whole region to it and then streams every write it
+		applies, in the order it applied them, followed by a heartbeat
+		each time its queue for the replica runs dry and at least every
+		REPLICA_HEARTBEAT_MS. Writes are queued from region_modify_end()
+		under the page's stripe, so writes to one page reach the replica
+		in the same order. Writes queued while the region was being copied
+		are applied over the copy, which brings it up to date.
+
+		A heartbeat tells the replica it has everything the primary had
+		applied when it was sent, so the time since the replica applied
+		its last heartbeat bounds how far behind it is without any clock
+		shared between the machines. The replica acknowledges each
+		heartbeat once applied; the primary reports the round trip as the
+		replication lag.
+
+		A replica serves reads and refuses writes: a connection that sends
+		one is closed, since writes belong on the primary. Plain reads wait
+		until the replica is within -maxlag of the primary; a
+		REQUEST_PAGE_BOUNDED read carries its own bound and fails instead
+		of waiting, so a client can fall back to the primary. A multi-page
+		write such as a transaction may be seen partly applied on a
+		replica.
+
+		A replica that falls REPLICA_QUEUE_MAX bytes behind, or any replica
+		when the primary's region is resized, is dropped; it reconnects
+		and copies the region again. A replica keeps its own shared.bin in
+		its working directory, so one on the same machine as the primary
+		must be started from a different directory.
+
+		Server options:
+		-replicaof <host:port>	follow the primary at host:port
+		-maxlag <ms>		staleness plain reads on a replica wait for
+*/
+
+#include "shared.h"
+#include <netinet/tcp.h>
+#include <sys/time.h>
+#include <map>
+#include <deque>
+#include <vector>
+using namespace std;
+
+struct replica_record {
+	uint64 offset;
+	vector<uint8> data;
+};
+
+/* A replica attached to this server */
+struct replica_peer {
+	int socket_fd;
+	pthread_t ack_thread;		/* Reads acknowledgements */
+	bool ack_running;
+	pthread_cond_t cond;
+	deque<replica_record> queue;
+	uint64 queued_bytes;
+	bool dropped;			/* Fell behind, or the region changed */
+	uint64 sequence;		/* Last heartbeat sent */
+	map<uint64, uint64> sent_us;	/* Heartbeat -> when it was sent */
+	uint64 lag_us;			/* Heartbeat sent to acknowledged */
+	uint64 lag_max_us;
+	uint64 records;
+	uint64 bytes;
+};
+
+static pthread_mutex_t replica_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<int, replica_peer *> replica_peers;
+static int replica_peer_count = 0;	/* Read without the mutex on every write */
+
+/* Following a primary, all under replica_mutex */
+static char replica_primary_host[256];
+static int replica_primary_port = 0;
+static bool replica_follow = false;
+static bool replica_synced = false;		/* Copy done, a heartbeat applied */
+static uint64 replica_fresh_us = 0;		/* When the last heartbeat was applied */
+static pthread_cond_t replica_fresh_cond = PTHREAD_COND_INITIALIZER;
+static uint64 replica_max_lag_ms = REPLICA_MAX_LAG_MS;
+static uint64 replica_applied = 0;
+static uint64 replica_applied_bytes = 0;
+static uint64 replica_syncs = 0;
+static uint64 replica_refused = 0;		/* Bounded reads that were too stale */
+
+static uint64 replica_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (uint64)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+void replica_setup(int argc, char *argv[])
+{
+	int index;
+
+	if((index = find_option(argc, argv, "-maxlag")) != -1 && index + 1 < argc)
+		replica_max_lag_ms = strtoull(argv[index + 1], NULL, 0);
+	if((index = find_option(argc, argv, "-replicaof")) == -1 || index + 1 >= argc)
+		return;
+
+	char *colon = strrchr(argv[index + 1], ':');
+	if(!colon || colon - argv[index + 1] >= (int)sizeof(replica_primary_host))
+		die("Error: -replicaof needs host:port.\n");
+	memcpy(replica_primary_host, argv[index + 1], colon - argv[index + 1]);
+	replica_primary_host[colon - argv[index + 1]] = '\0';
+	replica_primary_port = atoi(colon + 1);
+	replica_follow = true;
+}
+
+bool replica_following(void)
+{
+	return replica_follow;
+}
+
+/* Requests a replica serves; everything else must go to the primary */
+bool replica_accepts(uint8 opcode)
+{
+	if(!replica_follow)
+		return true;
+
+	switch(opcode)
+	{
+		case CLIENT_CONNECT:
+		case CLIENT_ATTACH:
+		case CLIENT_DISCONNECT:
+		case CLIENT_REPLICATE:
+		case REQUEST_PAGE:
+		case REQUEST_PAGE_BOUNDED:
+		case REQUEST_READ_RANGE:
+		case REQUEST_STREAM_RANGE:
+		case REQUEST_RANGE_COMPARE:
+		case REQUEST_RANGE_FIND:
+		case REQUEST_SUBSCRIBE:
+		case REQUEST_UNSUBSCRIBE:
+		case REQUEST_STATS:
+		case REQUEST_HEATMAP:
+		case REQUEST_QOS_CONFIG:
+		case REQUEST_SHARD_MAP:
+			return true;
+	}
+	return false;
+}
+
+/* True if this server is at most max_ms behind its primary; caller holds replica_mutex */
+static bool replica_fresh(uint64 max_ms)
+{
+	if(!replica_follow)
+		return true;
+	return replica_synced && replica_now() - replica_fresh_us <= max_ms * 1000;
+}
+
+/* Hold a plain read on a replica until it is within -maxlag of the primary */
+void replica_wait_fresh(void)
+{
+	if(!replica_follow)
+		return;
+
+	pthread_mutex_lock(&replica_mutex);
+	while(!replica_fresh(replica_max_lag_ms))
+	{
+		struct timespec until;
+		uint64 deadline = replica_now() + REPLICA_HEARTBEAT_MS * 1000;
+
+		until.tv_sec = deadline / 1000000;
+		until.tv_nsec = (deadline % 1000000) * 1000;
+		pthread_cond_timedwait(&replica_fresh_cond, &replica_mutex, &until);
+	}
+	pthread_mutex_unlock(&replica_mutex);
+}
+
+/*------------------------------------------------*/
+
+/* A range was modified; caller holds the stripe of its page */
+void replica_log(uint64 offset, const uint8 *data, uint64 length)
+{
+	if(!__atomic_load_n(&replica_peer_count, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&replica_mutex);
+	for(map<int, replica_peer *>::iterator it = replica_peers.begin(); it != replica_peers.end(); ++it)
+	{
+		replica_peer *peer = it->second;
+
+		if(peer->dropped)
+			continue;
+		peer->queue.push_back(replica_record());
+		peer->queue.back().offset = offset;
+		peer->queue.back().data.assign(data, data + length);
+		peer->queued_bytes += length;
+		if(peer->queued_bytes > REPLICA_QUEUE_MAX)
+			peer->dropped = true;
+		pthread_cond_signal(&peer->cond);
+	}
+	pthread_mutex_unlock(&replica_mutex);
+}
+
+/* Replicas hold a copy of the old region; they have to start over */
+void replica_region_changed(void)
+{
+	pthread_mutex_lock(&replica_mutex);
+	for(map<int, replica_peer *>::iterator it = replica_peers.begin(); it != replica_peers.end(); ++it)
+	{
+		it->second->dropped = true;
+		pthread_cond_signal(&it->second->cond);
+	}
+	pthread_mutex_unlock(&replica_mutex);
+}
+
+void replica_disconnect(int client_socket_fd)
+{
+	replica_peer *peer = NULL;
+
+	pthread_mutex_lock(&replica_mutex);
+	map<int, replica_peer *>::iterator it = replica_peers.find(client_socket_fd);
+	if(it != replica_peers.end())
+	{
+		peer = it->second;
+		replica_peers.erase(it);
+		__atomic_store_n(&replica_peer_count, (int)replica_peers.size(), __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&replica_mutex);
+
+	if(!peer)
+		return;
+
+	/* Wake the acknowledgement reader before the socket is closed */
+	if(peer->ack_running)
+	{
+		shutdown(client_socket_fd, SHUT_RDWR);
+		pthread_join(peer->ack_thread, NULL);
+	}
+	pthread_cond_destroy(&peer->cond);
+	delete peer;
+}
+
+/* Time each heartbeat from being sent to being acknowledged */
+static void *replica_ack_thread(void *arg)
+{
+	replica_peer *peer = (replica_peer *)arg;
+	uint8 ack[1 + PTR_SIZE];
+
+	socket_error_mode(SOCKET_ERRORS_RETURN);
+	while(true)
+	{
+		comms_get(peer->socket_fd, ack, sizeof(ack));
+		if(socket_error_check() || ack[0] != REPLICA_ACK)
+			break;
+
+		uint64 now = replica_now();
+
+		pthread_mutex_lock(&replica_mutex);
+		map<uint64, uint64>::iterator sent = peer->sent_us.find(*(uint64 *)&ack[1]);
+		if(sent != peer->sent_us.end())
+		{
+			peer->lag_us = now - sent->second;
+			peer->lag_max_us = MAX(peer->lag_max_us, peer->lag_us);
+			peer->sent_us.erase(peer->sent_us.begin(), ++sent);
+		}
+		pthread_mutex_unlock(&replica_mutex);
+	}
+
+	return NULL;
+}
+
+/*
+	Replica sends
+	byte  - opcode
+	Server responds with
+	byte  - RESPONSE_REPLICATE
+	qword - page size
+	qword - shared memory size
+	bytes - the whole of shared memory
+	and then, until the connection closes, a stream of
+	byte  - REPLICA_WRITE, qword offset, qword length, data
+	byte  - REPLICA_HEARTBEAT, qword sequence; everything applied before
+	        it was sent has been sent
+	Replica sends
+	byte  - REPLICA_ACK, qword sequence of each heartbeat once applied
+*/
+void command_replicate(int client_socket_fd)
+{
+	replica_peer *peer = new replica_peer;
+	uint8 buffer[REPLICA_CHUNK];
+	int nodelay = 1;
+
+	/* Debug */
+	printf("* Replicate request\n");
+
+	peer->socket_fd = client_socket_fd;
+	peer->ack_running = false;
+	pthread_cond_init(&peer->cond, NULL);
+	peer->queued_bytes = 0;
+	peer->dropped = false;
+	peer->sequence = 0;
+	peer->lag_us = 0;
+	peer->lag_max_us = 0;
+	peer->records = 0;
+	peer->bytes = 0;
+	setsockopt(client_socket_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	/* Writes from here on are queued and bring the copy up to date */
+	pthread_mutex_lock(&replica_mutex);
+	replica_peers[client_socket_fd] = peer;
+	__atomic_store_n(&replica_peer_count, (int)replica_peers.size(), __ATOMIC_RELEASE);
+	uint64 memory_size = shared_memory_size;
+	pthread_mutex_unlock(&replica_mutex);
+
+	comms_sendb(client_socket_fd, RESPONSE_REPLICATE);
+	comms_sendq(client_socket_fd, shared_page_size);
+	comms_sendq(client_socket_fd, memory_size);
+	for(uint64 offset = 0; offset < memory_size; offset += REPLICA_CHUNK)
+	{
+		uint64 chunk = MIN(memory_size - offset, REPLICA_CHUNK);
+
+		region_copy(offset, buffer, chunk);
+		comms_send(client_socket_fd, buffer, chunk);
+	}
+	peer->ack_running = (pthread_create(&peer->ack_thread, NULL, replica_ack_thread, peer) == 0);
+
+	while(true)
+	{
+		deque<replica_record> records;
+		vector<uint8> out;
+		struct timespec until;
+		uint64 deadline = replica_now() + REPLICA_HEARTBEAT_MS * 1000;
+
+		until.tv_sec = deadline / 1000000;
+		until.tv_nsec = (deadline % 1000000) * 1000;
+
+		pthread_mutex_lock(&replica_mutex);
+		if(peer->queue.empty() && !peer->dropped)
+			pthread_cond_timedwait(&peer->cond, &replica_mutex, &until);
+		if(peer->dropped)
+		{
+			pthread_mutex_unlock(&replica_mutex);
+			break;
+		}
+		records.swap(peer->queue);
+		peer->queued_bytes = 0;
+		uint64 sequence = ++peer->sequence;
+		peer->sent_us[sequence] = replica_now();
+		pthread_mutex_unlock(&replica_mutex);
+
+		/* Everything queued goes out in one write, heartbeat last */
+		uint64 bytes = 0;
+		for(size_t i = 0; i < records.size(); i++)
+		{
+			uint8 header[1 + 2 * PTR_SIZE];
+
+			header[0] = REPLICA_WRITE;
+			*(uint64 *)&header[1] = records[i].offset;
+			*(uint64 *)&header[1 + PTR_SIZE] = records[i].data.size();
+			out.insert(out.end(), header, header + sizeof(header));
+			out.insert(out.end(), records[i].data.begin(), records[i].data.end());
+			bytes += records[i].data.size();
+		}
+		out.push_back(REPLICA_HEARTBEAT);
+		out.insert(out.end(), (uint8 *)&sequence, (uint8 *)&sequence + PTR_SIZE);
+
+		comms_send(client_socket_fd, &out[0], out.size());
+
+		pthread_mutex_lock(&replica_mutex);
+		peer->records += records.size();
+		peer->bytes += bytes;
+		pthread_mutex_unlock(&replica_mutex);
+	}
+
+	/* The caller ends the connection; the replica reconnects */
+	printf("- Dropping replica\n");
+}
+
+/*------------------------------------------------*/
+
+static int replica_dial(void)
+{
+	struct sockaddr_in server_addr;
+	int nodelay = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if(fd == -1)
+		return -1;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(replica_primary_port);
+	inet_pton(AF_INET, replica_primary_host, &server_addr.sin_addr.s_addr);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	if(connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Copy the primary's region, then apply its stream until the connection drops */
+static void replica_sync(int fd)
+{
+	vector<uint8> buffer(REPLICA_CHUNK);
+
+	comms_sendb(fd, CLIENT_REPLICATE);
+	if(comms_getb(fd) != RESPONSE_REPLICATE || socket_error_check())
+		return;
+	uint64 page_size = comms_getq(fd);
+	uint64 memory_size = comms_getq(fd);
+	if(socket_error_check())
+		return;
+	if(page_size != (uint64)shared_page_size || server_resize(memory_size))
+	{
+		printf("Replica: Primary region of %llX bytes in %llX byte pages cannot be followed.\n",
+			memory_size, page_size);
+		return;
+	}
+
+	for(uint64 offset = 0; offset < memory_size; offset += REPLICA_CHUNK)
+	{
+		uint64 chunk = MIN(memory_size - offset, REPLICA_CHUNK);
+
+		comms_get(fd, &buffer[0], chunk);
+		if(socket_error_check())
+			return;
+		region_write(offset, &buffer[0], chunk);
+	}
+	printf("Replica: Copied %llX bytes from %s:%d.\n", memory_size, replica_primary_host, replica_primary_port);
+
+	pthread_mutex_lock(&replica_mutex);
+	replica_syncs++;
+	pthread_mutex_unlock(&replica_mutex);
+
+	while(true)
+	{
+		uint8 opcode = comms_getb(fd);
+		uint64 value = comms_getq(fd);
+
+		if(socket_error_check())
+			return;
+
+		if(opcode == REPLICA_WRITE)
+		{
+			uint64 offset = value;
+			uint64 length = comms_getq(fd);
+
+			if(offset > memory_size || length > memory_size - offset)
+			{
+				printf("Replica: Write outside the region, resyncing.\n");
+				return;
+			}
+			if(length > buffer.size())
+				buffer.resize(length);
+			comms_get(fd, &buffer[0], length);
+			if(socket_error_check())
+				return;
+			region_write(offset, &buffer[0], length);
+
+			pthread_mutex_lock(&replica_mutex);
+			replica_applied++;
+			replica_applied_bytes += length;
+			pthread_mutex_unlock(&replica_mutex);
+		}
+		else if(opcode == REPLICA_HEARTBEAT)
+		{
+			uint8 ack[1 + PTR_SIZE];
+
+			pthread_mutex_lock(&replica_mutex);
+			replica_synced = true;
+			replica_fresh_us = replica_now();
+			pthread_cond_broadcast(&replica_fresh_cond);
+			pthread_mutex_unlock(&replica_mutex);
+
+			ack[0] = REPLICA_ACK;
+			*(uint64 *)&ack[1] = value;
+			comms_send(fd, ack, sizeof(ack));
+		}
+		else
+		{
+			printf("Replica: Unexpected opcode %02X from primary, resyncing.\n", opcode);
+			return;
+		}
+	}
+}
+
+static void *replica_follow_thread(void *arg)
+{
+	socket_error_mode(SOCKET_ERRORS_RETURN);
+
+	while(true)
+	{
+		int fd = replica_dial();
+
+		if(fd != -1)
+		{
+			replica_sync(fd);
+			close(fd);
+		}
+
+		pthread_mutex_lock(&replica_mutex);
+		replica_synced = false;
+		pthread_mutex_unlock(&replica_mutex);
+
+		printf("Replica: Lost %s:%d, retrying.\n", replica_primary_host, replica_primary_port);
+		usleep(REPLICA_RETRY_MS * 1000);
+	}
+
+	return NULL;
+}
+
+/* Start following the primary once the region is open */
+void replica_start(void)
+{
+	pthread_t thread;
+
+	if(!replica_follow)
+		return;
+	if(pthread_create(&thread, NULL, replica_follow_thread, NULL) != 0)
+		die("Error: pthread_create(): replica\n");
+	pthread_detach(thread);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - page offset
+	qword - most milliseconds the page may be behind the primary
+	Server responds with
+	byte  - RESPONSE_PAGE_OK, followed by the page
+	or
+	byte  - RESPONSE_PAGE_ERR if this server is a replica further behind
+	        than that, or the page is outside shared memory
+*/
+void command_request_page_bounded(int client_socket_fd)
+{
+	uint8 response[1 + CLIENT_PAGE_SIZE];
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 max_ms = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Bounded page request, shared memory offset: %016llX, max lag: %lld ms\n",
+		offset, max_ms);
+	trace_add(client_socket_fd, REQUEST_PAGE_BOUNDED, offset, shared_page_size);
+
+	pthread_mutex_lock(&replica_mutex);
+	bool fresh = replica_fresh(max_ms);
+	if(!fresh)
+		replica_refused++;
+	pthread_mutex_unlock(&replica_mutex);
+
+	if(!fresh || offset % shared_page_size || offset >= (uint64)shared_memory_size)
+	{
+		comms_sendb(client_socket_fd, RESPONSE_PAGE_ERR);
+		return;
+	}
+
+	response[0] = RESPONSE_PAGE_OK;
+	region_read(offset, &response[1], shared_page_size);
+	comms_send(client_socket_fd, response, 1 + shared_page_size);
+}
+
+/* Print the state of each replica, or of following the primary */
+int replica_report(char *text, int size)
+{
+	int length = 0;
+
+	pthread_mutex_lock(&replica_mutex);
+	if(replica_follow)
+	{
+		length += snprintf(text, size,
+			"replica: following %s:%d, %s, %.1f ms behind, %llu writes (%llu bytes) applied, "
+			"%llu copies, %llu stale reads refused\n",
+			replica_primary_host, replica_primary_port, replica_synced ? "synced" : "not synced",
+			replica_synced ? (replica_now() - replica_fresh_us) / 1e3 : 0.0,
+			replica_applied, replica_applied_bytes, replica_syncs, replica_refused);
+	}
+	for(map<int, replica_peer *>::iterator it = replica_peers.begin(); it != replica_peers.end(); ++it)
+	{
+		replica_peer *peer = it->second;
+
+		length += snprintf(&text[MIN(length, size)], MAX(size - length, 0),
+			"replica %d: %llu writes (%llu bytes) sent, %llu bytes queued, lag %.2f ms, max %.2f ms\n",
+			peer->socket_fd, peer->records, peer->bytes, peer->queued_bytes,
+			peer->lag_us / 1e3, peer->lag_max_us / 1e3);
+	}
+	pthread_mutex_unlock(&replica_mutex);
+
+	return length;
+}
+
+/* End */
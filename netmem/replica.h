@@ -0,0 +1,23 @@
+#ifndef _REPLICA_H_
+#define _REPLICA_H_
+
+#define REPLICA_HEARTBEAT_MS	50	/* Longest gap between heartbeats to a replica */
+#define REPLICA_MAX_LAG_MS	1000	/* Default staleness plain reads on a replica wait for */
+#define REPLICA_QUEUE_MAX	0x4000000	/* Bytes queued for a replica before it is dropped */
+#define REPLICA_RETRY_MS	500	/* Delay before a replica reconnects */
+#define REPLICA_CHUNK		0x10000	/* Bytes per step of the initial copy */
+
+/* Function prototypes */
+void replica_setup(int argc, char *argv[]);
+void replica_start(void);
+bool replica_following(void);
+bool replica_accepts(uint8 opcode);
+void replica_wait_fresh(void);
+void replica_log(uint64 offset, const uint8 *data, uint64 length);
+void replica_region_changed(void);
+void replica_disconnect(int client_socket_fd);
+void command_replicate(int client_socket_fd);
+void command_request_page_bounded(int client_socket_fd);
+int replica_report(char *text, int size);
+
+#endif /* _REPLICA_H_ */
@@ -8,20 +8,23 @@
 */
 
 #include "shared.h"
+#include <netinet/tcp.h>
 using namespace std;
 
-void save_write(void);
-
 /*------------------------------------------------*/
 
 /* This is the network memory */
 uint8 *shared_memory = NULL;
-static int shared_memory_size = 0x10000; 	/* Fixed: 64K */
-static int shared_page_size = 0x1000;	/* Fixed: 4K */
+int shared_memory_size = 0x10000; 	/* Fixed: 64K */
+int shared_page_size = 0x1000;	/* Fixed: 4K */
+static pthread_mutex_t shared_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define RANGE_CHUNK_SIZE	0x10000	/* Bytes staged per step of a range transfer */
 
 void command_request_page_sync(int client_socket_fd)
 {
 	uint64 shared_memory_offset;
+	uint8 page[CLIENT_PAGE_SIZE];
 		
 	/* Get offset of page from client */
 	shared_memory_offset = comms_getq(client_socket_fd);
@@ -29,21 +32,22 @@ void command_request_page_sync(int client_socket_fd)
 	/* Debug */
 	printf("* Page sync request, shared memory offset: %016llX\n", 
 		shared_memory_offset);
+	trace_add(client_socket_fd, REQUEST_PAGE_SYNC, shared_memory_offset, shared_page_size);
 
 	/* Read memory */
 	comms_get(
 		client_socket_fd, 
-		&shared_memory[shared_memory_offset], 
+		page, 
 		shared_page_size 
 		);
 
-	save_write();
+	shard_write_page(shared_memory_offset, page);
 }
 
 void command_request_page(int client_socket_fd)
 {
 	uint64 shared_memory_offset;
-	int transferred;
+	uint8 page[CLIENT_PAGE_SIZE];
 		
 	/* Get offset of page from client */
 	shared_memory_offset = comms_getq(client_socket_fd);
@@ -51,15 +55,312 @@ void command_request_page(int client_socket_fd)
 	/* Debug */
 	printf("* Page data request, shared memory offset: %016llX\n", 
 		shared_memory_offset);
+	trace_add(client_socket_fd, REQUEST_PAGE, shared_memory_offset, shared_page_size);
+
+	replica_wait_fresh();
+	shard_read_page(shared_memory_offset, page);
 
 	/* Write memory*/
 	comms_send(
 		client_socket_fd, 
-		&shared_memory[shared_memory_offset], 
+		page, 
 		shared_page_size
 		);
 }
 
+/* Check that a byte range lies entirely within shared memory */
+static bool range_valid(uint64 offset, uint64 length)
+{
+	if(offset > (uint64)shared_memory_size)
+		return false;
+	if(length > (uint64)shared_memory_size - offset)
+		return false;
+	return true;
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of first byte
+	qword - number of bytes
+	Server responds with
+	byte  - RESPONSE_RANGE_OK, followed by the bytes
+	or
+	byte  - RESPONSE_RANGE_ERR if the range is outside shared memory
+*/
+void command_read_range(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Range read request, offset: %016llX, length: %lld\n",
+		offset, length);
+	trace_add(client_socket_fd, REQUEST_READ_RANGE, offset, length);
+
+	if(!range_valid(offset, length))
+	{
+		comms_sendb(client_socket_fd, RESPONSE_RANGE_ERR);
+		return;
+	}
+	replica_wait_fresh();
+
+	comms_sendb(client_socket_fd, RESPONSE_RANGE_OK);
+	while(length)
+	{
+		uint8 buffer[RANGE_CHUNK_SIZE];
+		uint64 chunk = MIN(length, RANGE_CHUNK_SIZE);
+
+		region_read(offset, buffer, chunk);
+		comms_send(client_socket_fd, buffer, chunk);
+		offset += chunk;
+		length -= chunk;
+	}
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of first byte
+	qword - number of bytes
+	bytes - data
+	Server responds with
+	byte  - RESPONSE_RANGE_OK or RESPONSE_RANGE_ERR
+	RESPONSE_RANGE_ERR also means another node of a sharded region owns
+	part of the range; chunks owned here may have been written. A length
+	beyond the size of shared memory closes the connection.
+*/
+void command_write_range(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	bool owned = true;
+
+	/* Debug */
+	printf("* Range write request, offset: %016llX, length: %lld\n",
+		offset, length);
+	trace_add(client_socket_fd, REQUEST_WRITE_RANGE, offset, length);
+
+	if(length > (uint64)shared_memory_size)
+	{
+		socket_drop(client_socket_fd, "Range write longer than shared memory, dropping client.");
+		return;
+	}
+	if(!range_valid(offset, length))
+	{
+		comms_skip(client_socket_fd, length);
+		comms_sendb(client_socket_fd, RESPONSE_RANGE_ERR);
+		return;
+	}
+
+	while(length)
+	{
+		uint8 buffer[RANGE_CHUNK_SIZE];
+		uint64 chunk = MIN(length, RANGE_CHUNK_SIZE);
+
+		/* Ownership is held per chunk, never while the socket blocks */
+		comms_get(client_socket_fd, buffer, chunk);
+		shard_serve_begin();
+		owned = owned && shard_owns(offset, chunk);
+		if(owned)
+			region_write(offset, buffer, chunk);
+		shard_serve_end();
+		offset += chunk;
+		length -= chunk;
+	}
+
+	comms_sendb(client_socket_fd, owned ? RESPONSE_RANGE_OK : RESPONSE_RANGE_ERR);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of first byte
+	qword - number of bytes
+	Server responds with
+	byte  - RESPONSE_RANGE_OK, followed by the bytes back-to-back
+	or
+	byte  - RESPONSE_RANGE_ERR if the range is outside shared memory
+*/
+void command_stream_range(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Range stream request, offset: %016llX, length: %lld\n",
+		offset, length);
+	trace_add(client_socket_fd, REQUEST_STREAM_RANGE, offset, length);
+
+	if(!range_valid(offset, length))
+	{
+		comms_sendb(client_socket_fd, RESPONSE_RANGE_ERR);
+		return;
+	}
+
+	replica_wait_fresh();
+	comms_sendb(client_socket_fd, RESPONSE_RANGE_OK);
+	region_stream(client_socket_fd, offset, length);
+}
+
+/* Check that an atomic word lies aligned and entirely within shared memory */
+static bool atomic_offset_valid(uint64 offset)
+{
+	if(offset & (ATOMIC_WORD_SIZE - 1))
+		return false;
+	if(offset + ATOMIC_WORD_SIZE > (uint64)shared_memory_size)
+		return false;
+	return true;
+}
+
+/*
+	Client sends
+	byte  - opcode (CAS, FADD or XCHG)
+	qword - word offset (8-byte aligned)
+	qword - argument 1 (expected value, addend or new value)
+	qword - argument 2 (desired value, CAS only)
+	Server responds with
+	byte  - RESPONSE_ATOMIC_OK, or RESPONSE_ATOMIC_ERR if the word is
+	        invalid or owned by another node of a sharded region
+	qword - old value of the word
+*/
+void command_atomic(int client_socket_fd, uint8 opcode)
+{
+	uint8 request[3 * ATOMIC_WORD_SIZE];
+	uint8 response[1 + ATOMIC_WORD_SIZE];
+	int args = (opcode == REQUEST_ATOMIC_CAS) ? 3 : 2;
+	uint64 offset, arg1, arg2, old;
+	bool valid;
+
+	/* Get offset and arguments in one read */
+	comms_get(client_socket_fd, request, args * ATOMIC_WORD_SIZE);
+	offset = *(uint64 *)&request[0];
+	arg1 = *(uint64 *)&request[8];
+	arg2 = (args == 3) ? *(uint64 *)&request[16] : 0;
+
+	shard_serve_begin();
+	valid = atomic_offset_valid(offset) && shard_owns(offset, ATOMIC_WORD_SIZE);
+	old = valid ? region_atomic(opcode, offset, arg1, arg2) : 0;
+	shard_serve_end();
+
+	/* Debug */
+	printf("* Atomic %02X request, shared memory offset: %016llX\n",
+		opcode, offset);
+	trace_add(client_socket_fd, opcode, offset, ATOMIC_WORD_SIZE);
+
+	response[0] = valid ? RESPONSE_ATOMIC_OK : RESPONSE_ATOMIC_ERR;
+	*(uint64 *)&response[1] = old;
+	comms_send(client_socket_fd, response, sizeof(response));
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - number of entries (at most ATOMIC_BATCH_MAX)
+	entry - byte opcode, qword offset, qword arg1, qword arg2 (repeated)
+	Server responds with
+	byte  - RESPONSE_ATOMIC_OK, followed by one qword old value per entry
+	or
+	byte  - RESPONSE_ATOMIC_ERR if any entry is invalid or owned by
+	        another node of a sharded region (nothing applied)
+	More than ATOMIC_BATCH_MAX entries closes the connection.
+*/
+void command_atomic_batch(int client_socket_fd)
+{
+	uint8 request[ATOMIC_BATCH_MAX * ATOMIC_ENTRY_SIZE];
+	uint8 response[1 + ATOMIC_BATCH_MAX * ATOMIC_WORD_SIZE];
+	uint64 count = comms_getq(client_socket_fd);
+	bool valid = true;
+
+	/* Debug */
+	printf("* Atomic batch request, entries: %lld\n", count);
+
+	/* Oversized batch; its size cannot be trusted to drain it */
+	if(count > ATOMIC_BATCH_MAX)
+	{
+		socket_drop(client_socket_fd, "Atomic batch too large, dropping client.");
+		return;
+	}
+
+	comms_get(client_socket_fd, request, count * ATOMIC_ENTRY_SIZE);
+
+	/* Validate every entry before applying any of them */
+	shard_serve_begin();
+	for(uint64 i = 0; i < count && valid; i++)
+	{
+		uint8 *entry = &request[i * ATOMIC_ENTRY_SIZE];
+		uint8 opcode = entry[0];
+
+		if(opcode != REQUEST_ATOMIC_CAS && opcode != REQUEST_ATOMIC_FADD &&
+			opcode != REQUEST_ATOMIC_XCHG)
+			valid = false;
+		if(!atomic_offset_valid(*(uint64 *)&entry[1]) ||
+			!shard_owns(*(uint64 *)&entry[1], ATOMIC_WORD_SIZE))
+			valid = false;
+	}
+
+	if(!valid)
+	{
+		shard_serve_end();
+		comms_sendb(client_socket_fd, RESPONSE_ATOMIC_ERR);
+		return;
+	}
+
+	response[0] = RESPONSE_ATOMIC_OK;
+	for(uint64 i = 0; i < count; i++)
+	{
+		uint8 *entry = &request[i * ATOMIC_ENTRY_SIZE];
+		*(uint64 *)&response[1 + i * ATOMIC_WORD_SIZE] = region_atomic(
+			entry[0],
+			*(uint64 *)&entry[1],
+			*(uint64 *)&entry[9],
+			*(uint64 *)&entry[17]
+			);
+	}
+	shard_serve_end();
+	comms_send(client_socket_fd, response, 1 + count * ATOMIC_WORD_SIZE);
+}
+
+/* Resize the region for every client; true if the size is not allowed */
+bool server_resize(uint64 memory_size)
+{
+	bool error = false;
+
+	/* The size is the client's; never die on it. Each node of a sharded region holds its share */
+	if(!region_size_valid(memory_size) || memory_size > (uint64)SERVER_MEMORY_MAX * shard_node_count())
+		return true;
+
+	/* Other clients may already share the region; only resize it */
+	pthread_mutex_lock(&shared_memory_mutex);
+	if(memory_size != (uint64)shared_memory_size)
+	{
+		/* Reallocate new memory, zero-filled */
+		error = !region_resize(memory_size);
+		if(!error)
+		{
+			session_region_changed();
+			replica_region_changed();
+			shard_region_changed();
+		}
+	}
+	pthread_mutex_unlock(&shared_memory_mutex);
+
+	return error;
+}
+
+/* Check a client's sizes and resize the region to match; true on error */
+static bool server_attach(uint64 page_size, uint64 memory_size)
+{
+	if(page_size != 0x1000)
+		return true;
+
+	/* A replica's size is the primary's */
+	if(replica_following())
+		return memory_size != (uint64)shared_memory_size;
+
+	return server_resize(memory_size);
+}
+
 /*
 	Client sends
 	byte  - opcode
@@ -71,47 +372,152 @@ void command_request_page(int client_socket_fd)
 */
 bool command_connect(int client_socket_fd)
 {
-	bool error = false;
-	
 	uint64 page_size = comms_getq(client_socket_fd);
 	uint64 memory_size = comms_getq(client_socket_fd);
 	
 	printf("Client connect: page_size=%016llX, memory_size=%016llx\n",
 		page_size, memory_size);
-		
-	if(page_size != 0x1000)
-		error = true;
-	if(memory_size > 0x10000)
-		error = true;
-		
-	/* If default memory exists, deallocate */
-	if(shared_memory) delete []shared_memory;
-	
-	/* Reallocate new memory */
-	shared_memory = new uint8 [memory_size];
-	if(!shared_memory)
-		error = true;
-		
-	/* Update globals */
-	shared_page_size = page_size;
-	shared_memory_size = memory_size;
 
+	bool error = server_attach(page_size, memory_size);
 	comms_sendb(client_socket_fd, error ? NM_RESPONSE_NACK : NM_RESPONSE_ACK);	
 	
 	return error;
 }
 
-void command_disconnect(int client_socket_fd)
+/*
+	Client sends
+	byte  - opcode
+	qword - local page size
+	qword - shared memory size
+	Server responds with
+	ACK - Sizes match the region
+	NACK - Connection denied (another page size or memory size); the
+	       region is left as it is
+*/
+bool command_attach(int client_socket_fd)
 {
-	/* */
+	uint64 page_size = comms_getq(client_socket_fd);
+	uint64 memory_size = comms_getq(client_socket_fd);
+
+	printf("Client attach: page_size=%016llX, memory_size=%016llx\n",
+		page_size, memory_size);
+
+	bool error = page_size != (uint64)shared_page_size || memory_size != (uint64)shared_memory_size;
+	comms_sendb(client_socket_fd, error ? NM_RESPONSE_NACK : NM_RESPONSE_ACK);
+
+	return error;
 }
 
-void save_write(void) {
-	/* Save (possibly synchronized) shared memory) */
-	FILE *fd;
-	fd = fopen("shared.bin", "wb");
-	fwrite(shared_memory, shared_memory_size, 1, fd);
-	fclose(fd);
+/*
+	Client sends
+	byte  - opcode
+	qword - session to resume, or 0 for a new one
+	qword - local page size
+	qword - shared memory size
+	Server responds with
+	ACK   - Page size and memory size accepted, followed by
+	qword - session ID
+	byte  - 1 if the session was resumed and cached pages may be
+	        revalidated, 0 if it is new and they must be dropped
+	or
+	NACK  - Connection denied (invalid page size or memory size)
+*/
+bool command_resume(int client_socket_fd)
+{
+	uint8 response[1 + PTR_SIZE + 1];
+	uint64 session = comms_getq(client_socket_fd);
+	uint64 page_size = comms_getq(client_socket_fd);
+	uint64 memory_size = comms_getq(client_socket_fd);
+	bool resumed = false;
+	bool error = false;
+
+	printf("Client resume: session=%016llX, page_size=%016llX, memory_size=%016llx\n",
+		session, page_size, memory_size);
+
+	/* A resumed session never resizes; its region is still in place */
+	if(session)
+		resumed = session_resume(client_socket_fd, session, memory_size);
+	if(!resumed)
+	{
+		error = server_attach(page_size, memory_size);
+		if(!error)
+			session = session_create(client_socket_fd, memory_size);
+	}
+
+	if(error)
+	{
+		comms_sendb(client_socket_fd, NM_RESPONSE_NACK);
+		return error;
+	}
+
+	response[0] = NM_RESPONSE_ACK;
+	*(uint64 *)&response[1] = session;
+	response[1 + PTR_SIZE] = resumed;
+	comms_send(client_socket_fd, response, sizeof(response));
+
+	return error;
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - session the connection joins
+	Server responds with
+	ACK   - Connection is now a lane of the session
+	NACK  - Session unknown or not attached; the connection stays open
+*/
+void command_join(int client_socket_fd)
+{
+	uint64 session = comms_getq(client_socket_fd);
+	bool joined = session_join(client_socket_fd, session);
+
+	printf("Client join: session=%016llX, %s\n", session, joined ? "joined" : "refused");
+	comms_sendb(client_socket_fd, joined ? NM_RESPONSE_ACK : NM_RESPONSE_NACK);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	Server responds with
+	byte  - RESPONSE_STATS
+	qword - length of the report
+	bytes - report text
+*/
+void command_stats(int client_socket_fd)
+{
+	char text[STATS_TEXT_MAX];
+	uint64 length = 0;
+
+	/* Debug */
+	printf("* Stats request\n");
+
+	length += dedup_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+	length += tier_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+	length += session_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+	length += qos_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+	length += compute_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+	length += heat_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+	length += tx_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+	length += replica_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+	length += shard_report(&text[length], sizeof(text) - length);
+	length = MIN(length, sizeof(text) - 1);
+
+	comms_sendb(client_socket_fd, RESPONSE_STATS);
+	comms_sendq(client_socket_fd, length);
+	comms_send(client_socket_fd, (uint8 *)text, length);
+}
+
+void command_disconnect(int client_socket_fd)
+{
+	/* */
 }
 
 void server_dispatch_command(int client_socket_fd)
@@ -123,6 +529,23 @@ void server_dispatch_command(int client_socket_fd)
 	while(running)
 	{
 		uint8 opcode = comms_getb(client_socket_fd);
+
+		/* Writes belong on the primary */
+		if(!replica_accepts(opcode))
+		{
+			printf("* Request %02X refused, this server is a replica\n", opcode);
+			return;
+		}
+
+		/* A push channel only carries subscription traffic */
+		if(!subscribe_accepts(client_socket_fd, opcode))
+		{
+			printf("* Request %02X refused, connection is a push channel\n", opcode);
+			return;
+		}
+
+		/* Data requests wait their turn behind other clients */
+		bool scheduled = qos_begin(client_socket_fd, opcode);
 	
 		switch(opcode)
 		{
@@ -133,11 +556,147 @@ void server_dispatch_command(int client_socket_fd)
 			case REQUEST_PAGE: /* Request page data */
 				command_request_page(client_socket_fd);
 				break;
-				
+
+			case REQUEST_PAGE_BOUNDED: /* Page no staler than a bound */
+				command_request_page_bounded(client_socket_fd);
+				break;
+
+			case REQUEST_READ_RANGE: /* Read bytes within shared memory */
+				command_read_range(client_socket_fd);
+				break;
+
+			case REQUEST_WRITE_RANGE: /* Write bytes within shared memory */
+				command_write_range(client_socket_fd);
+				break;
+
+			case REQUEST_STREAM_RANGE: /* Bulk read of a whole range */
+				command_stream_range(client_socket_fd);
+				break;
+
+			case REQUEST_RANGE_FILL: /* Near-data operations on a range */
+				command_fill(client_socket_fd);
+				break;
+
+			case REQUEST_RANGE_MOVE:
+				command_move(client_socket_fd);
+				break;
+
+			case REQUEST_RANGE_COMPARE:
+				command_compare(client_socket_fd);
+				break;
+
+			case REQUEST_RANGE_FIND:
+				command_find(client_socket_fd);
+				break;
+
+			case REQUEST_TX_READ: /* Optimistic transactions */
+				command_tx_read(client_socket_fd);
+				break;
+
+			case REQUEST_TX_COMMIT:
+				command_tx_commit(client_socket_fd);
+				break;
+
+			case REQUEST_ATOMIC_CAS: /* Atomic operations on a word */
+			case REQUEST_ATOMIC_FADD:
+			case REQUEST_ATOMIC_XCHG:
+				command_atomic(client_socket_fd, opcode);
+				break;
+
+			case REQUEST_ATOMIC_BATCH: /* Several atomic operations */
+				command_atomic_batch(client_socket_fd);
+				break;
+
+			case REQUEST_LOCK_ACQUIRE: /* Lock service, may park */
+				command_lock_acquire(client_socket_fd);
+				break;
+
+			case REQUEST_LOCK_RELEASE:
+				command_lock_release(client_socket_fd);
+				break;
+
+			case REQUEST_BARRIER_WAIT:
+				command_barrier_wait(client_socket_fd);
+				break;
+
+			case REQUEST_SEM_WAIT:
+				command_sem_wait(client_socket_fd);
+				break;
+
+			case REQUEST_SEM_POST:
+				command_sem_post(client_socket_fd);
+				break;
+
+			case REQUEST_SUBSCRIBE: /* Push updates for a range */
+				command_subscribe(client_socket_fd);
+				break;
+
+			case REQUEST_UNSUBSCRIBE:
+				command_unsubscribe(client_socket_fd);
+				break;
+
+			case REQUEST_SNAPSHOT: /* Start a background snapshot */
+				command_snapshot(client_socket_fd);
+				break;
+
+			case REQUEST_SNAPSHOT_STATUS:
+				command_snapshot_status(client_socket_fd);
+				break;
+
+			case REQUEST_STATS: /* Report server statistics */
+				command_stats(client_socket_fd);
+				break;
+
+			case REQUEST_QOS_CONFIG: /* Scheduling class and cap */
+				command_qos_config(client_socket_fd);
+				break;
+
+			case REQUEST_HEATMAP: /* Access heat over a range */
+				command_heatmap(client_socket_fd);
+				break;
+
 			case CLIENT_CONNECT: /* Client protocol connect to server */
 				if(command_connect(client_socket_fd))
 					return;
 				break;
+
+			case CLIENT_ATTACH: /* Connect without resizing */
+				if(command_attach(client_socket_fd))
+					return;
+				break;
+
+			case CLIENT_RESUME: /* Connect, reattaching to a session */
+				if(command_resume(client_socket_fd))
+					return;
+				break;
+
+			case CLIENT_JOIN: /* Extra connection of a session */
+				command_join(client_socket_fd);
+				break;
+
+			case REQUEST_SHARD_MAP: /* Page ranges of each node */
+				command_shard_map(client_socket_fd);
+				break;
+
+			case REQUEST_SHARD_MAP_SET:
+				command_shard_map_set(client_socket_fd);
+				break;
+
+			case REQUEST_SHARD_COPY: /* Pages migrating to this node */
+				command_shard_copy(client_socket_fd);
+				break;
+
+			case REQUEST_SHARD_MOVE: /* Hand pages to another node */
+				command_shard_move(client_socket_fd);
+				break;
+
+			case CLIENT_REPLICATE: /* Replica following this server */
+				command_replicate(client_socket_fd);
+				return;
+
+			case REQUEST_REVALIDATE: /* Check cached pages in bulk */
+				command_revalidate(client_socket_fd);
+				break;
 			
 			case CLIENT_DISCONNECT: /* Client protocol disconnect from server */
 				command_disconnect(client_socket_fd);
@@ -147,20 +706,101 @@ void server_dispatch_command(int client_socket_fd)
 				break;
 			
 			default: /* Unknown instruction */
-				die("ERROR: Server receieved unknown command %02X from client.\n", 
+				printf("ERROR: Server receieved unknown command %02X from client, closing connection.\n",
 					opcode);
-				break;
+
+				/* Only this client is dropped; the others keep running */
+				if(scheduled)
+					qos_end(client_socket_fd);
+				return;
 		}
+
+		if(scheduled)
+			qos_end(client_socket_fd);
 	}
 }
 
-/*------------------------------------------------*/
+/* Tear down one client connection, however its thread ended */
+static void server_client_cleanup(void *arg)
+{
+	int client_socket_fd = (int)(intptr_t)arg;
+	int status;
 
-void run_server(char *hostname, int port, int argc, char *argv[])
+	/* Release anything the client left locked */
+	locks_disconnect(client_socket_fd);
+	subscribe_disconnect(client_socket_fd);
+	qos_disconnect(client_socket_fd);
+	heat_disconnect(client_socket_fd);
+	replica_disconnect(client_socket_fd);
+	session_detach(client_socket_fd);
+
+	// Close client socket
+	puts("- Closing client socket");
+	status = close(client_socket_fd);
+	if(status == -1)
+		die_errno("Error: close(): client ");
+}
+
+/* Thread body serving one client connection */
+static void *server_client_thread(void *arg)
 {
+	int client_socket_fd = (int)(intptr_t)arg;
 
-	static int buffer_length = 256;
+	/* A dropped connection ends this thread only; cleanup still runs */
+	socket_error_mode(SOCKET_ERRORS_EXIT_THREAD);
+	pthread_cleanup_push(server_client_cleanup, arg);
 
+	/* Run dispatch until quit requested by client */
+	locks_connect(client_socket_fd);
+	qos_connect(client_socket_fd);
+	heat_connect(client_socket_fd);
+	trace_connect(client_socket_fd);
+	server_dispatch_command(client_socket_fd);
+	
+	printf("\n***Server dispatch loop exit.\n");
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/* Save state and exit on SIGINT or SIGTERM */
+static void *server_signal_thread(void *arg)
+{
+	sigset_t *signals = (sigset_t *)arg;
+	int signal_number;
+
+	sigwait(signals, &signal_number);
+	printf("\n***Server caught signal %d, shutting down.\n", signal_number);
+
+	trace_close();
+	region_close();
+	exit(0);
+
+	return NULL;
+}
+
+/* Block shutdown signals in every thread but the one that handles them */
+static void server_signal_start(void)
+{
+	static sigset_t signals;
+	pthread_t thread;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	/* Writes to a dropped client fail with EPIPE instead */
+	signal(SIGPIPE, SIG_IGN);
+
+	if(pthread_create(&thread, NULL, server_signal_thread, &signals) == 0)
+		pthread_detach(thread);
+}
+
+/*------------------------------------------------*/
+
+void run_server(char *hostname, int port, int argc, char *argv[])
+{
 	struct sockaddr_in server_addr;
 	struct sockaddr_in client_addr;
 	
@@ -214,40 +854,66 @@ void run_server(char *hostname, int port, int argc, char *argv[])
 	printf("Name: [%s]\n", temp);
 #endif
 
-	// Accept connection to server socket
-	puts("- Accepting client socket");
-	socket_length = sizeof(client_addr);
-	client_socket_fd = accept(
-		server_socket_fd,
-		(struct sockaddr *)&client_addr,
-		&socket_length
-		);	
-	if(client_socket_fd == -1)
-		die_errno("Error: accept(): ");
-		
 	//----------------------------------------------------------------------
-	// Allocate shared memory
+	// Allocate shared memory, reopening shared.bin from a previous run
 	
-	shared_memory = new uint8 [shared_memory_size];
-	memset(shared_memory, 0x20, shared_memory_size);
-	strcpy((char *)shared_memory, "HELLO THIS IS US. WE ARE SPARTA: RYAN, CHARLES, BRITTO, ANDREW, EDWIN\n\x00");
-
-	printf("Server: Allocated %08X bytes of network-shared memory.\n", shared_memory_size);
+	placement_setup(argc, argv);
+	dedup_enabled = (find_option(argc, argv, "-dedup") != -1);
+	tier_setup(argc, argv);
+	if(dedup_enabled && tier_enabled)
+		die("Error: -dedup and -tier cannot be used together.\n");
+	qos_setup(argc, argv);
+	trace_setup(argc, argv, TRACE_SOURCE_SERVER);
+	heat_setup(argc, argv);
+	replica_setup(argc, argv);
+	shard_setup(argc, argv);
+	region_open(find_option(argc, argv, "-fresh") != -1);
+	shard_region_changed();
+	if(find_option(argc, argv, "-prefetch") != -1)
+		region_prefetch_start();
+
+	server_signal_start();
+	replica_start();
 	
 	//----------------------------------------------------------------------
 
-	/* Run dispatch until quit requested by client */
-	server_dispatch_command(client_socket_fd);
-	
-	printf("\n***Server dispatch loop exit.\n");
+	/* Accept clients until the listening socket fails */
+	while(1)
+	{
+		pthread_t thread;
+
+		// Accept connection to server socket
+		puts("- Accepting client socket");
+		socket_length = sizeof(client_addr);
+		client_socket_fd = accept(
+			server_socket_fd,
+			(struct sockaddr *)&client_addr,
+			&socket_length
+			);	
+		if(client_socket_fd == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("Error: accept(): ");
+			break;
+		}
 
-	delete []shared_memory;
+		/* Replies must not wait behind Nagle when clients pipeline requests */
+		setsockopt(client_socket_fd, IPPROTO_TCP, TCP_NODELAY, (char *)&sockoptval, sizeof(sockoptval));
+
+		/* Each client gets its own dispatch thread */
+		status = pthread_create(
+			&thread,
+			NULL,
+			server_client_thread,
+			(void *)(intptr_t)client_socket_fd
+			);
+		if(status != 0)
+			die("Error: pthread_create(): %s\n", strerror(status));
+		pthread_detach(thread);
+	}
 
-	// Close client socket
-	puts("- Closing client socket");
-	status = close(client_socket_fd);
-	if(status == -1)
-		die_errno("Error: close(): client ");
+	region_close();
 
 	// Close server socket
 	puts("- Closing server socket");
@@ -1,7 +1,16 @@
 #ifndef _SERVER_H_
 #define _SERVER_H_
 
+#define SERVER_MEMORY_MAX	0x10000	/* Largest region per server process */
+
+/* Network memory owned by the server */
+extern uint8 *shared_memory;
+extern int shared_memory_size;
+extern int shared_page_size;
+
 /* Function prototypes */
+bool server_resize(uint64 memory_size);
+void server_dispatch_command(int client_socket_fd);
 void run_server(char *hostname, int port, int argc, char *argv[]);
 
 #endif /* _SERVER_H_ */
@@ -0,0 +1,218 @@
+/*
+	File:
+		session.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Client sessions. CLIENT_RESUME hands out a session ID that stays
+		valid for SESSION_LINGER_S seconds after the connection drops, so
+		a client that reconnects with it knows the region it cached pages
+		from is still the same one and it only has to revalidate them.
+		Any resize of the region ends every session.
+
+		A client may bind extra connections to its session with
+		CLIENT_JOIN and stripe bulk traffic across them. These lanes share
+		the region of the session but do not own it; losing one does not
+		detach the session.
+
+		Revalidation compares the CRC32C a client holds for each page with
+		the region's CRC table, so a whole working set is checked in one
+		round trip without sending any page data.
+*/
+
+#include "shared.h"
+#include <map>
+#include <vector>
+using namespace std;
+
+struct nm_session {
+	int socket_fd;		/* -1 while detached */
+	time_t detached_at;
+	uint64 memory_size;
+	uint64 epoch;		/* Region the session was created on */
+};
+
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static map<uint64, nm_session> session_table;
+static map<int, uint64> session_lanes;	/* Joined socket -> session */
+static uint64 session_epoch = 0;
+static uint64 session_counter = 0;
+static uint64 session_resumes = 0;
+static uint64 session_checked = 0;	/* Pages revalidated */
+static uint64 session_stale = 0;	/* ...that had changed */
+
+/* Forget sessions detached for too long; caller holds session_mutex */
+static void session_expire(void)
+{
+	time_t now = time(NULL);
+
+	for(map<uint64, nm_session>::iterator it = session_table.begin(); it != session_table.end(); )
+	{
+		if(it->second.socket_fd == -1 && now - it->second.detached_at > SESSION_LINGER_S)
+			session_table.erase(it++);
+		else
+			++it;
+	}
+}
+
+/* Reattach a known session; false if it expired or the region changed */
+bool session_resume(int client_socket_fd, uint64 session, uint64 memory_size)
+{
+	bool resumed = false;
+
+	pthread_mutex_lock(&session_mutex);
+	session_expire();
+	map<uint64, nm_session>::iterator it = session_table.find(session);
+	if(it != session_table.end() && it->second.epoch == session_epoch &&
+		it->second.memory_size == memory_size)
+	{
+		/* The old connection may not have noticed the drop yet */
+		it->second.socket_fd = client_socket_fd;
+		session_resumes++;
+		resumed = true;
+	}
+	pthread_mutex_unlock(&session_mutex);
+
+	return resumed;
+}
+
+uint64 session_create(int client_socket_fd, uint64 memory_size)
+{
+	nm_session entry;
+
+	entry.socket_fd = client_socket_fd;
+	entry.detached_at = 0;
+	entry.memory_size = memory_size;
+
+	/* Unique across restarts, which start with an empty table */
+	pthread_mutex_lock(&session_mutex);
+	uint64 session = ((uint64)time(NULL) << 24) ^ ++session_counter;
+	entry.epoch = session_epoch;
+	session_table[session] = entry;
+	pthread_mutex_unlock(&session_mutex);
+
+	return session;
+}
+
+/* Bind another connection to a session that is attached right now */
+bool session_join(int client_socket_fd, uint64 session)
+{
+	bool joined = false;
+
+	pthread_mutex_lock(&session_mutex);
+	map<uint64, nm_session>::iterator it = session_table.find(session);
+	if(it != session_table.end() && it->second.socket_fd != -1 && it->second.epoch == session_epoch)
+	{
+		session_lanes[client_socket_fd] = session;
+		joined = true;
+	}
+	pthread_mutex_unlock(&session_mutex);
+
+	return joined;
+}
+
+void session_detach(int client_socket_fd)
+{
+	pthread_mutex_lock(&session_mutex);
+
+	/* A lane going away leaves the session as it is */
+	map<int, uint64>::iterator lane = session_lanes.find(client_socket_fd);
+	if(lane != session_lanes.end())
+	{
+		session_lanes.erase(lane);
+		pthread_mutex_unlock(&session_mutex);
+		return;
+	}
+
+	for(map<uint64, nm_session>::iterator it = session_table.begin(); it != session_table.end(); ++it)
+	{
+		if(it->second.socket_fd == client_socket_fd)
+		{
+			it->second.socket_fd = -1;
+			it->second.detached_at = time(NULL);
+		}
+	}
+	pthread_mutex_unlock(&session_mutex);
+}
+
+/* Region was replaced; cached pages of every session are meaningless */
+void session_region_changed(void)
+{
+	pthread_mutex_lock(&session_mutex);
+	session_epoch++;
+	session_table.clear();
+	session_lanes.clear();
+	pthread_mutex_unlock(&session_mutex);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - number of entries
+	entry - qword page offset, dword CRC32C of the client's copy (repeated)
+	Server responds with
+	byte  - RESPONSE_REVALIDATE
+	qword - number of stale pages
+	qword - offset of each stale page
+*/
+void command_revalidate(int client_socket_fd)
+{
+	uint64 count = comms_getq(client_socket_fd);
+	uint8 entries[REVALIDATE_MAX * REVALIDATE_ENTRY_SIZE];
+	vector<uint64> stale;
+
+	/* Debug */
+	printf("* Revalidate request, pages: %lld\n", count);
+
+	for(uint64 done = 0; done < count; )
+	{
+		uint64 chunk = MIN(count - done, REVALIDATE_MAX);
+
+		comms_get(client_socket_fd, entries, chunk * REVALIDATE_ENTRY_SIZE);
+		for(uint64 i = 0; i < chunk; i++)
+		{
+			uint8 *entry = &entries[i * REVALIDATE_ENTRY_SIZE];
+			uint64 offset = *(uint64 *)&entry[0];
+			uint32_t crc = *(uint32_t *)&entry[PTR_SIZE];
+
+			if(!region_page_current(offset, crc))
+				stale.push_back(offset);
+		}
+		done += chunk;
+	}
+
+	pthread_mutex_lock(&session_mutex);
+	session_checked += count;
+	session_stale += stale.size();
+	pthread_mutex_unlock(&session_mutex);
+
+	comms_sendb(client_socket_fd, RESPONSE_REVALIDATE);
+	comms_sendq(client_socket_fd, stale.size());
+	if(!stale.empty())
+		comms_send(client_socket_fd, (uint8 *)&stale[0], stale.size() * sizeof(uint64));
+}
+
+/* Print session counts into text, returns its length */
+int session_report(char *text, int size)
+{
+	uint64 attached = 0, detached = 0;
+
+	pthread_mutex_lock(&session_mutex);
+	uint64 lanes = session_lanes.size();
+	for(map<uint64, nm_session>::iterator it = session_table.begin(); it != session_table.end(); ++it)
+	{
+		if(it->second.socket_fd == -1)
+			detached++;
+		else
+			attached++;
+	}
+	int length = snprintf(text, size,
+		"session: %llu attached, %llu detached, %llu lanes, %llu resumes, "
+		"%llu pages revalidated, %llu stale\n",
+		attached, detached, lanes, session_resumes, session_checked, session_stale);
+	pthread_mutex_unlock(&session_mutex);
+
+	return length;
+}
+
+/* End */
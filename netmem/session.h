@@ -0,0 +1,15 @@
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+#define SESSION_LINGER_S	300	/* Detached sessions kept this long */
+
+/* Function prototypes */
+bool session_resume(int client_socket_fd, uint64 session, uint64 memory_size);
+uint64 session_create(int client_socket_fd, uint64 memory_size);
+bool session_join(int client_socket_fd, uint64 session);
+void session_detach(int client_socket_fd);
+void session_region_changed(void);
+void command_revalidate(int client_socket_fd);
+int session_report(char *text, int size);
+
+#endif /* _SESSION_H_ */
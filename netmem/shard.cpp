@@ -0,0 +1,795 @@
+/*
+	File:
+		shard.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Splits one region over several server processes by page range.
+		Every node is started with the same -shards list and its own
+		position in it with -shardid. Each node keeps the whole address
+		space but only serves the pages it owns; memory is mapped lazily,
+		so a node only holds the pages it owns (with -tier, only those
+		take frames). A fresh or resized region is split evenly in list
+		order.
+
+		Clients fetch the map with REQUEST_SHARD_MAP once connected and
+		send page faults and syncs straight to the owner. A node that gets
+		one for a page it does not own forwards it to the owner over a
+		connection of its own and relays the reply, so a client with an
+		old map stays correct and only pays an extra hop. Range reads act
+		on the node they are sent to. Range writes, fills, moves, atomics
+		and transactions are refused with their usual error reply unless
+		every page they touch is owned here; applied anywhere else they
+		would only change a copy nobody serves.
+
+		REQUEST_SHARD_MOVE migrates a page range away from its owner while
+		it stays in service. The pages are copied to the new owner with
+		REQUEST_SHARD_COPY, which writes whether or not the node owns the
+		pages yet, then page traffic on the old owner pauses while the
+		pages that changed during the copy are sent again. The new owner
+		takes the new map first and the old owner second, so following
+		owners from any node's map always leads forward to the current
+		one; the other nodes are told last. Clients must connect to every
+		node with the same region size: a resize resets the map to the
+		even split. Nodes reach each other with CLIENT_ATTACH, which is
+		refused while the sizes differ rather than resizing the peer. A
+		sharded region may grow to SERVER_MEMORY_MAX bytes per node.
+
+		Server options:
+		-shards <host:port,...>	every node of the region, in order
+		-shardid <n>		position of this node in that list
+*/
+
+#include "shared.h"
+#include <netinet/tcp.h>
+#include <vector>
+#include <string>
+using namespace std;
+
+struct shard_node {
+	char host[SHARD_HOST_MAX];
+	int port;
+};
+
+struct shard_range {
+	uint64 offset;
+	uint64 length;
+	int node;
+};
+
+/* Connection to another node, dialled on first use */
+struct shard_peer {
+	int socket_fd;
+	pthread_mutex_t mutex;
+};
+
+static bool shard_enabled = false;
+static int shard_self = 0;
+static vector<struct shard_node> shard_nodes;
+static struct shard_peer shard_peers[SHARD_NODES_MAX];
+
+/* The map; ranges are sorted and cover the region */
+static pthread_mutex_t shard_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<struct shard_range> shard_ranges;
+static uint64 shard_epoch = 0;
+
+/* Held shared while a page is served here, exclusively to hand pages over */
+static pthread_rwlock_t shard_serve_lock;
+static pthread_mutex_t shard_move_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64 shard_forwarded_reads = 0;
+static uint64 shard_forwarded_syncs = 0;
+static uint64 shard_moves = 0;
+static uint64 shard_pages_moved = 0;
+static uint64 shard_pages_resent = 0;	/* Changed during a copy */
+
+void shard_setup(int argc, char *argv[])
+{
+	pthread_rwlockattr_t attr;
+	int index;
+
+	/* A migration must not wait behind a steady stream of reads */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&shard_serve_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	if((index = find_option(argc, argv, "-shards")) == -1 || index + 1 >= argc)
+		return;
+
+	string list = argv[index + 1];
+	for(size_t start = 0; start < list.size(); )
+	{
+		size_t end = list.find(',', start);
+		string entry = list.substr(start, end == string::npos ? string::npos : end - start);
+		size_t colon = entry.rfind(':');
+		struct shard_node node;
+
+		if(colon == string::npos || colon >= SHARD_HOST_MAX)
+			die("Error: -shards needs host:port[,host:port...].\n");
+		memset(&node, 0, sizeof(node));
+		memcpy(node.host, entry.c_str(), colon);
+		node.port = atoi(entry.c_str() + colon + 1);
+		shard_nodes.push_back(node);
+		start = (end == string::npos) ? list.size() : end + 1;
+	}
+
+	if((index = find_option(argc, argv, "-shardid")) != -1 && index + 1 < argc)
+		shard_self = atoi(argv[index + 1]);
+	if(shard_nodes.empty() || shard_nodes.size() > SHARD_NODES_MAX)
+		die("Error: -shards lists 1 to %d nodes.\n", SHARD_NODES_MAX);
+	if(shard_self < 0 || shard_self >= (int)shard_nodes.size())
+		die("Error: -shardid must be below %d.\n", (int)shard_nodes.size());
+
+	for(int i = 0; i < SHARD_NODES_MAX; i++)
+	{
+		shard_peers[i].socket_fd = -1;
+		pthread_mutex_init(&shard_peers[i].mutex, NULL);
+	}
+	shard_enabled = true;
+
+	printf("Shard: Node %d of %d (%s:%d).\n", shard_self, (int)shard_nodes.size(),
+		shard_nodes[shard_self].host, shard_nodes[shard_self].port);
+}
+
+/* Split a new region evenly over the nodes */
+void shard_region_changed(void)
+{
+	uint64 pages = shared_memory_size / shared_page_size;
+	int count = (int)shard_nodes.size();
+
+	if(!shard_enabled)
+		return;
+
+	pthread_mutex_lock(&shard_map_mutex);
+	shard_ranges.clear();
+	for(int i = 0; i < count; i++)
+	{
+		struct shard_range range;
+		uint64 first = pages * i / count;
+		uint64 last = pages * (i + 1) / count;
+
+		if(first == last)
+			continue;
+		range.offset = first * shared_page_size;
+		range.length = (last - first) * shared_page_size;
+		range.node = i;
+		shard_ranges.push_back(range);
+	}
+	shard_epoch++;
+	pthread_mutex_unlock(&shard_map_mutex);
+}
+
+/* Server processes the region is split over; 1 if it is not sharded */
+int shard_node_count(void)
+{
+	return shard_enabled ? (int)shard_nodes.size() : 1;
+}
+
+/* Node owning a page, or -1 outside the map; caller holds shard_map_mutex */
+static int shard_owner_locked(uint64 offset)
+{
+	int low = 0, high = (int)shard_ranges.size() - 1;
+
+	while(low <= high)
+	{
+		int middle = (low + high) / 2;
+		struct shard_range *range = &shard_ranges[middle];
+
+		if(offset < range->offset)
+			high = middle - 1;
+		else if(offset >= range->offset + range->length)
+			low = middle + 1;
+		else
+			return range->node;
+	}
+	return -1;
+}
+
+static int shard_owner(uint64 offset)
+{
+	pthread_mutex_lock(&shard_map_mutex);
+	int owner = shard_owner_locked(offset);
+	pthread_mutex_unlock(&shard_map_mutex);
+	return owner;
+}
+
+/* Give a range to a node, merging neighbours with the same owner */
+static void shard_assign(vector<struct shard_range> &ranges, uint64 offset, uint64 length, int node)
+{
+	vector<struct shard_range> result;
+	uint64 end = offset + length;
+
+	for(size_t i = 0; i < ranges.size(); i++)
+	{
+		struct shard_range piece = ranges[i];
+		uint64 piece_end = piece.offset + piece.length;
+
+		/* Keep whatever lies outside the moved range */
+		if(piece.offset < offset)
+		{
+			struct shard_range head = piece;
+			head.length = MIN(piece_end, offset) - piece.offset;
+			result.push_back(head);
+		}
+		if(piece.offset < end && piece_end > offset)
+		{
+			struct shard_range moved;
+			moved.offset = MAX(piece.offset, offset);
+			moved.length = MIN(piece_end, end) - moved.offset;
+			moved.node = node;
+			result.push_back(moved);
+		}
+		if(piece_end > end)
+		{
+			struct shard_range tail = piece;
+			tail.offset = MAX(piece.offset, end);
+			tail.length = piece_end - tail.offset;
+			result.push_back(tail);
+		}
+	}
+
+	ranges.clear();
+	for(size_t i = 0; i < result.size(); i++)
+	{
+		if(!ranges.empty() && ranges.back().node == result[i].node &&
+			ranges.back().offset + ranges.back().length == result[i].offset)
+			ranges.back().length += result[i].length;
+		else
+			ranges.push_back(result[i]);
+	}
+}
+
+/* Map as sent on the wire; see REQUEST_SHARD_MAP */
+static void shard_encode(vector<uint8> &out, uint64 epoch, const vector<struct shard_range> &ranges)
+{
+	uint64 value;
+
+	out.insert(out.end(), (uint8 *)&epoch, (uint8 *)&epoch + PTR_SIZE);
+	value = shard_nodes.size();
+	out.insert(out.end(), (uint8 *)&value, (uint8 *)&value + PTR_SIZE);
+	for(size_t i = 0; i < shard_nodes.size(); i++)
+	{
+		value = shard_nodes[i].port;
+		out.insert(out.end(), (uint8 *)&value, (uint8 *)&value + PTR_SIZE);
+		out.insert(out.end(), (uint8 *)shard_nodes[i].host, (uint8 *)shard_nodes[i].host + SHARD_HOST_MAX);
+	}
+	value = ranges.size();
+	out.insert(out.end(), (uint8 *)&value, (uint8 *)&value + PTR_SIZE);
+	for(size_t i = 0; i < ranges.size(); i++)
+	{
+		uint64 entry[3] = { ranges[i].offset, ranges[i].length, (uint64)ranges[i].node };
+		out.insert(out.end(), (uint8 *)entry, (uint8 *)entry + sizeof(entry));
+	}
+}
+
+/*------------------------------------------------*/
+
+static int shard_dial(int node)
+{
+	struct sockaddr_in server_addr;
+	int nodelay = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if(fd == -1)
+		return -1;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(shard_nodes[node].port);
+	inet_pton(AF_INET, shard_nodes[node].host, &server_addr.sin_addr.s_addr);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	if(connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1 ||
+		!nm_client_attach(fd, shared_page_size, shared_memory_size) || socket_error_check())
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* One request to another node, redialling once; caller holds the peer */
+static bool shard_peer_request(int node, uint8 opcode, uint64 offset, uint64 length, uint8 *data)
+{
+	struct shard_peer *peer = &shard_peers[node];
+
+	for(int attempt = 0; attempt < 2; attempt++)
+	{
+		bool done = false;
+
+		if(peer->socket_fd == -1 && (peer->socket_fd = shard_dial(node)) == -1)
+			continue;
+
+		switch(opcode)
+		{
+			case REQUEST_PAGE:
+				done = nm_client_request_page(peer->socket_fd, offset, data);
+				break;
+
+			/* Syncs are not acknowledged; an empty read marks completion */
+			case REQUEST_PAGE_SYNC:
+				nm_client_request_sync(peer->socket_fd, offset, data);
+				done = nm_client_read_range(peer->socket_fd, 0, 0, data);
+				break;
+
+			case REQUEST_SHARD_COPY:
+			{
+				uint8 request[1 + 2 * PTR_SIZE];
+
+				request[0] = REQUEST_SHARD_COPY;
+				*(uint64 *)&request[1] = offset;
+				*(uint64 *)&request[1 + PTR_SIZE] = length;
+				comms_send(peer->socket_fd, request, sizeof(request));
+				comms_send(peer->socket_fd, data, length);
+				done = (comms_getb(peer->socket_fd) == RESPONSE_SHARD_OK);
+				break;
+			}
+
+			case REQUEST_SHARD_MAP_SET:
+				comms_send(peer->socket_fd, data, length);
+				done = (comms_getb(peer->socket_fd) == RESPONSE_SHARD_OK);
+				break;
+		}
+
+		if(!socket_error_check())
+			return done;
+		close(peer->socket_fd);
+		peer->socket_fd = -1;
+	}
+
+	return false;
+}
+
+/* Run a request on another node from a connection thread */
+static bool shard_peer_call(int node, uint8 opcode, uint64 offset, uint64 length, uint8 *data)
+{
+	pthread_mutex_lock(&shard_peers[node].mutex);
+	socket_error_mode(SOCKET_ERRORS_RETURN);
+	bool done = shard_peer_request(node, opcode, offset, length, data);
+	socket_error_mode(SOCKET_ERRORS_EXIT_THREAD);
+	pthread_mutex_unlock(&shard_peers[node].mutex);
+
+	return done;
+}
+
+/* Relay a fault or sync to its owner; the client retries if the owner is gone */
+static void shard_forward(int node, uint8 opcode, uint64 offset, uint8 *page)
+{
+	if(shard_peer_call(node, opcode, offset, shared_page_size, page))
+		return;
+
+	/* As for a dropped connection; cleanup handlers close it */
+	printf("Shard: Node %d (%s:%d) unreachable, dropping client.\n", node,
+		shard_nodes[node].host, shard_nodes[node].port);
+	pthread_exit(NULL);
+}
+
+/* Page fault, served here or by the page's owner */
+void shard_read_page(uint64 offset, uint8 *page)
+{
+	if(!shard_enabled)
+	{
+		region_read(offset, page, shared_page_size);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&shard_serve_lock);
+	int owner = shard_owner(offset);
+	if(owner == shard_self || owner == -1)
+	{
+		region_read(offset, page, shared_page_size);
+		pthread_rwlock_unlock(&shard_serve_lock);
+		return;
+	}
+	pthread_rwlock_unlock(&shard_serve_lock);
+
+	shard_forward(owner, REQUEST_PAGE, offset, page);
+	__atomic_fetch_add(&shard_forwarded_reads, 1, __ATOMIC_RELAXED);
+}
+
+/* Page sync, applied here or by the page's owner */
+void shard_write_page(uint64 offset, const uint8 *page)
+{
+	if(!shard_enabled)
+	{
+		region_write(offset, page, shared_page_size);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&shard_serve_lock);
+	int owner = shard_owner(offset);
+	if(owner == shard_self || owner == -1)
+	{
+		region_write(offset, page, shared_page_size);
+		pthread_rwlock_unlock(&shard_serve_lock);
+		return;
+	}
+	pthread_rwlock_unlock(&shard_serve_lock);
+
+	shard_forward(owner, REQUEST_PAGE_SYNC, offset, (uint8 *)page);
+	__atomic_fetch_add(&shard_forwarded_syncs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+	Hold page ownership steady while a request modifies pages here; a
+	migration waits for it. Requests hold it once, never nested.
+*/
+void shard_serve_begin(void)
+{
+	if(shard_enabled)
+		pthread_rwlock_rdlock(&shard_serve_lock);
+}
+
+void shard_serve_end(void)
+{
+	if(shard_enabled)
+		pthread_rwlock_unlock(&shard_serve_lock);
+}
+
+/* True if no other node owns a page of a range; call between the two above */
+bool shard_owns(uint64 offset, uint64 length)
+{
+	bool owned = true;
+
+	if(!shard_enabled || !length)
+		return true;
+
+	pthread_mutex_lock(&shard_map_mutex);
+	for(size_t i = 0; i < shard_ranges.size() && owned; i++)
+	{
+		struct shard_range *range = &shard_ranges[i];
+
+		if(range->offset < offset + length && range->offset + range->length > offset)
+			owned = (range->node == shard_self);
+	}
+	pthread_mutex_unlock(&shard_map_mutex);
+
+	return owned;
+}
+
+/*------------------------------------------------*/
+
+/*
+	Client sends
+	byte  - opcode
+	Server responds with
+	byte  - RESPONSE_SHARD_MAP
+	qword - epoch, raised by every migration
+	qword - number of nodes, 0 if the region is not sharded
+	entry - qword port, SHARD_HOST_MAX bytes host (repeated)
+	qword - number of ranges
+	entry - qword offset, qword length, qword node (repeated)
+*/
+void command_shard_map(int client_socket_fd)
+{
+	vector<uint8> reply(1, RESPONSE_SHARD_MAP);
+
+	/* Debug */
+	printf("* Shard map request\n");
+
+	pthread_mutex_lock(&shard_map_mutex);
+	shard_encode(reply, shard_epoch, shard_ranges);
+	pthread_mutex_unlock(&shard_map_mutex);
+
+	comms_send(client_socket_fd, &reply[0], reply.size());
+}
+
+/*
+	Node sends
+	byte  - opcode
+	map   - as in RESPONSE_SHARD_MAP
+	Server responds with
+	byte  - RESPONSE_SHARD_OK once the map is in place, or kept because
+	        it is not newer than the one held
+	or
+	byte  - RESPONSE_SHARD_ERR if it does not fit this region
+	More than SHARD_NODES_MAX nodes or SHARD_RANGES_MAX ranges closes the
+	connection.
+*/
+void command_shard_map_set(int client_socket_fd)
+{
+	uint64 epoch = comms_getq(client_socket_fd);
+	uint64 nodes = comms_getq(client_socket_fd);
+	vector<struct shard_range> ranges;
+	uint64 next = 0;
+
+	if(nodes > SHARD_NODES_MAX)
+	{
+		socket_drop(client_socket_fd, "Shard map with too many nodes, dropping connection.");
+		return;
+	}
+	comms_skip(client_socket_fd, nodes * (PTR_SIZE + SHARD_HOST_MAX));
+	uint64 count = comms_getq(client_socket_fd);
+	if(count > SHARD_RANGES_MAX)
+	{
+		socket_drop(client_socket_fd, "Shard map with too many ranges, dropping connection.");
+		return;
+	}
+	bool valid = shard_enabled && nodes == shard_nodes.size();
+
+	/* Debug */
+	printf("* Shard map update, epoch: %lld, ranges: %lld\n", epoch, count);
+
+	for(uint64 i = 0; i < count; i++)
+	{
+		struct shard_range range;
+
+		range.offset = comms_getq(client_socket_fd);
+		range.length = comms_getq(client_socket_fd);
+		range.node = (int)comms_getq(client_socket_fd);
+		if(range.offset != next || !range.length || range.node < 0 || range.node >= (int)nodes)
+			valid = false;
+		next = range.offset + range.length;
+		if(valid)
+			ranges.push_back(range);
+	}
+	if(next != (uint64)shared_memory_size)
+		valid = false;
+
+	if(valid)
+	{
+		pthread_mutex_lock(&shard_map_mutex);
+		if(epoch > shard_epoch)
+		{
+			shard_ranges.swap(ranges);
+			shard_epoch = epoch;
+		}
+		pthread_mutex_unlock(&shard_map_mutex);
+	}
+
+	comms_sendb(client_socket_fd, valid ? RESPONSE_SHARD_OK : RESPONSE_SHARD_ERR);
+}
+
+/*
+	Node sends
+	byte  - opcode
+	qword - offset of first byte
+	qword - number of bytes
+	bytes - data
+	Server responds with
+	byte  - RESPONSE_SHARD_OK once written
+	or
+	byte  - RESPONSE_SHARD_ERR if the region is not sharded or the range
+	        is outside shared memory
+	Pages being migrated here are not owned yet, so unlike a range write
+	this does not look at the map. A copy longer than shared memory
+	closes the connection.
+*/
+void command_shard_copy(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	vector<uint8> page(shared_page_size);
+
+	/* Debug */
+	printf("* Shard copy request, offset: %016llX, length: %lld\n", offset, length);
+
+	if(length > (uint64)shared_memory_size)
+	{
+		socket_drop(client_socket_fd, "Shard copy longer than shared memory, dropping connection.");
+		return;
+	}
+	if(!shard_enabled || offset > (uint64)shared_memory_size || length > shared_memory_size - offset)
+	{
+		comms_skip(client_socket_fd, length);
+		comms_sendb(client_socket_fd, RESPONSE_SHARD_ERR);
+		return;
+	}
+
+	while(length)
+	{
+		uint64 chunk = MIN(length, (uint64)shared_page_size);
+
+		comms_get(client_socket_fd, &page[0], chunk);
+		region_write(offset, &page[0], chunk);
+		offset += chunk;
+		length -= chunk;
+	}
+
+	comms_sendb(client_socket_fd, RESPONSE_SHARD_OK);
+}
+
+/* Hand a range owned here to another node; false if nothing changed hands */
+static bool shard_move(uint64 offset, uint64 length, int node)
+{
+	uint64 pages = length / shared_page_size;
+	vector<uint64> versions(pages);
+	vector<uint8> page(shared_page_size);
+	vector<uint8> message(1, REQUEST_SHARD_MAP_SET);
+	vector<struct shard_range> ranges;
+	uint64 epoch;
+	bool owned = true;
+
+	pthread_mutex_lock(&shard_map_mutex);
+	for(uint64 i = 0; i < pages; i++)
+		owned = owned && shard_owner_locked(offset + i * shared_page_size) == shard_self;
+	pthread_mutex_unlock(&shard_map_mutex);
+	if(!owned)
+		return false;
+
+	/* Bulk copy while the pages stay in service */
+	for(uint64 i = 0; i < pages; i++)
+	{
+		uint64 address = offset + i * shared_page_size;
+
+		versions[i] = region_read_version(address, &page[0]);
+		if(!shard_peer_call(node, REQUEST_SHARD_COPY, address, shared_page_size, &page[0]))
+			return false;
+	}
+
+	/* Pause page traffic here, send what changed meanwhile and hand over */
+	pthread_rwlock_wrlock(&shard_serve_lock);
+	uint64 resent = 0;
+	for(uint64 i = 0; i < pages; i++)
+	{
+		uint64 address = offset + i * shared_page_size;
+
+		if(region_read_version(address, &page[0]) == versions[i])
+			continue;
+		if(!shard_peer_call(node, REQUEST_SHARD_COPY, address, shared_page_size, &page[0]))
+		{
+			pthread_rwlock_unlock(&shard_serve_lock);
+			return false;
+		}
+		resent++;
+	}
+
+	pthread_mutex_lock(&shard_map_mutex);
+	ranges = shard_ranges;
+	epoch = shard_epoch + 1;
+	pthread_mutex_unlock(&shard_map_mutex);
+	shard_assign(ranges, offset, length, node);
+	shard_encode(message, epoch, ranges);
+
+	/* The new owner first, so no node ever forwards back to a stale copy */
+	if(!shard_peer_call(node, REQUEST_SHARD_MAP_SET, 0, message.size(), &message[0]))
+	{
+		pthread_rwlock_unlock(&shard_serve_lock);
+		return false;
+	}
+	pthread_mutex_lock(&shard_map_mutex);
+	shard_ranges = ranges;
+	shard_epoch = epoch;
+	pthread_mutex_unlock(&shard_map_mutex);
+	pthread_rwlock_unlock(&shard_serve_lock);
+
+	/* Nodes that miss this forward here and are sent on */
+	for(int i = 0; i < (int)shard_nodes.size(); i++)
+	{
+		if(i != shard_self && i != node &&
+			!shard_peer_call(i, REQUEST_SHARD_MAP_SET, 0, message.size(), &message[0]))
+			printf("Shard: Node %d did not take map %llu.\n", i, epoch);
+	}
+
+	__atomic_fetch_add(&shard_moves, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard_pages_moved, pages, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard_pages_resent, resent, __ATOMIC_RELAXED);
+	return true;
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of first page
+	qword - length in bytes, a multiple of the page size
+	qword - node to move the pages to
+	Server responds with
+	byte  - RESPONSE_SHARD_OK once the new owner serves the pages
+	or
+	byte  - RESPONSE_SHARD_ERR if the region is not sharded, this node
+	        does not own the whole range or the new owner cannot be reached
+*/
+void command_shard_move(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	uint64 node = comms_getq(client_socket_fd);
+	bool moved = false;
+
+	/* Debug */
+	printf("* Shard move request, offset: %016llX, length: %lld, node: %lld\n", offset, length, node);
+
+	if(shard_enabled && node < shard_nodes.size() && (int)node != shard_self && length &&
+		!(offset % shared_page_size) && !(length % shared_page_size) &&
+		offset < (uint64)shared_memory_size && length <= shared_memory_size - offset)
+	{
+		/* One migration at a time from each node */
+		pthread_mutex_lock(&shard_move_mutex);
+		moved = shard_move(offset, length, (int)node);
+		pthread_mutex_unlock(&shard_move_mutex);
+	}
+
+	comms_sendb(client_socket_fd, moved ? RESPONSE_SHARD_OK : RESPONSE_SHARD_ERR);
+}
+
+/* Print this node's share of the region into text, returns its length */
+int shard_report(char *text, int size)
+{
+	uint64 owned = 0;
+	int ranges = 0;
+
+	if(!shard_enabled)
+		return snprintf(text, size, "shard: off\n");
+
+	pthread_mutex_lock(&shard_map_mutex);
+	for(size_t i = 0; i < shard_ranges.size(); i++)
+	{
+		if(shard_ranges[i].node == shard_self)
+		{
+			owned += shard_ranges[i].length / shared_page_size;
+			ranges++;
+		}
+	}
+	uint64 epoch = shard_epoch;
+	pthread_mutex_unlock(&shard_map_mutex);
+
+	return snprintf(text, size,
+		"shard: node %d of %d, epoch %llu, %llu pages owned in %d ranges, %llu reads and %llu syncs forwarded, "
+		"%llu moves (%llu pages, %llu sent again)\n",
+		shard_self, (int)shard_nodes.size(), epoch, owned, ranges,
+		__atomic_load_n(&shard_forwarded_reads, __ATOMIC_RELAXED),
+		__atomic_load_n(&shard_forwarded_syncs, __ATOMIC_RELAXED),
+		__atomic_load_n(&shard_moves, __ATOMIC_RELAXED),
+		__atomic_load_n(&shard_pages_moved, __ATOMIC_RELAXED),
+		__atomic_load_n(&shard_pages_resent, __ATOMIC_RELAXED));
+}
+
+/*------------------------------------------------*/
+
+/* Show the shard map of a server, optionally moving a range first */
+int run_shard(char *hostname, int port, int argc, char *argv[])
+{
+	static struct nm_shard_map map;
+	struct sockaddr_in server_addr;
+	uint64 memory_size = 0x10000;
+	int index;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if((index = find_option(argc, argv, "-m")) != -1 && index + 1 < argc)
+		memory_size = strtoull(argv[index + 1], NULL, 0);
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	inet_pton(AF_INET, hostname, &server_addr.sin_addr.s_addr);
+	if(fd == -1 || connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1)
+		die_errno("Error: connect(): ");
+	if(!nm_client_attach(fd, CLIENT_PAGE_SIZE, memory_size))
+		die("Error: Server region is not %llX bytes, give its size with -m.\n", memory_size);
+
+	if((index = find_option(argc, argv, "-move")) != -1 && index + 3 < argc)
+	{
+		uint64 offset = strtoull(argv[index + 1], NULL, 0);
+		uint64 length = strtoull(argv[index + 2], NULL, 0);
+		int node = atoi(argv[index + 3]);
+		uint64 start = trace_time();
+		bool moved = nm_client_shard_move(fd, offset, length, node);
+
+		printf("Move %016llX+%llX to node %d: %s in %.3f ms\n", offset, length, node,
+			moved ? "done" : "failed", (trace_time() - start) / 1e6);
+	}
+
+	if(!nm_client_shard_map(fd, &map))
+		die("Error: No shard map.\n");
+	if(!map.node_count)
+		printf("Not sharded\n");
+	else
+	{
+		printf("Epoch %llu, %d nodes\n", (uint64)map.epoch, map.node_count);
+		for(int i = 0; i < map.range_count; i++)
+		{
+			struct nm_shard_range *range = &map.ranges[i];
+
+			printf("%016llX %016llX node %d (%s:%d)\n", (uint64)range->offset,
+				(uint64)range->length, range->node, map.nodes[range->node].host,
+				map.nodes[range->node].port);
+		}
+	}
+
+	nm_client_disconnect(fd);
+	close(fd);
+	return 0;
+}
+
+/* End */
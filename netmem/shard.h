@@ -0,0 +1,24 @@
+#ifndef _SHARD_H_
+#define _SHARD_H_
+
+#define SHARD_NODES_MAX		16	/* Server processes a region is split over */
+#define SHARD_HOST_MAX		64	/* Longest host name in the shard map */
+#define SHARD_RANGES_MAX	4096	/* Page ranges in the shard map */
+
+/* Function prototypes */
+void shard_setup(int argc, char *argv[]);
+void shard_region_changed(void);
+int shard_node_count(void);
+void shard_read_page(uint64 offset, uint8 *page);
+void shard_write_page(uint64 offset, const uint8 *page);
+void shard_serve_begin(void);
+void shard_serve_end(void);
+bool shard_owns(uint64 offset, uint64 length);
+void command_shard_map(int client_socket_fd);
+void command_shard_map_set(int client_socket_fd);
+void command_shard_copy(int client_socket_fd);
+void command_shard_move(int client_socket_fd);
+int shard_report(char *text, int size);
+int run_shard(char *hostname, int port, int argc, char *argv[]);
+
+#endif /* _SHARD_H_ */
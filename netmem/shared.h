@@ -16,26 +16,134 @@ typedef unsigned long long uint64;
 #define REQUEST_PAGE 		0x80
 #define RESPONSE_PAGE_OK 	0x81
 #define RESPONSE_PAGE_ERR 	0x82
+#define REQUEST_PAGE_BOUNDED	0x83 /* op:1, offset:8, max lag ms:8; replies OK + page or ERR */
 
 #define REQUEST_PAGE_SYNC 	0x90
 #define RESPONSE_PAGE_SYNC_OK 	0x91
 #define RESPONSE_PAGE_SYNC_ERR 	0x92
+#define REQUEST_SYNC_BARRIER	0x93 /* op:1, from the kernel on msync(MS_SYNC); replies as a sync */
+
+/* Byte ranges of shared memory, may span pages */
+#define REQUEST_READ_RANGE	0x88 /* op:1, offset:8, length:8 */
+#define RESPONSE_RANGE_OK	0x89 /* op:1, [length bytes for reads] */
+#define RESPONSE_RANGE_ERR	0x8A /* op:1 */
+#define REQUEST_WRITE_RANGE	0x98 /* op:1, offset:8, length:8, data */
+#define REQUEST_STREAM_RANGE	0x8B /* op:1, offset:8, length:8; replies as a read */
+
+/* Page subscriptions; once subscribed, every server message is framed */
+#define REQUEST_SUBSCRIBE	0x50 /* op:1, offset:8, length:8, interval ms:8 */
+#define RESPONSE_SUBSCRIBE_OK	0x51 /* op:1 */
+#define RESPONSE_SUBSCRIBE_ERR	0x52 /* op:1 */
+#define REQUEST_UNSUBSCRIBE	0x53 /* op:1, offset:8, length:8 */
+#define PUSH_PAGE_UPDATE	0x54 /* op:1, offset:8, length:8, data */
+
+/* Point-in-time snapshot of shared memory, dumped in the background */
+#define REQUEST_SNAPSHOT	0x60 /* op:1 */
+#define RESPONSE_SNAPSHOT_OK	0x61 /* op:1, generation:8 | pages left:8 */
+#define RESPONSE_SNAPSHOT_ERR	0x62 /* op:1 */
+#define REQUEST_SNAPSHOT_STATUS	0x63 /* op:1, generation:8 */
 
 #define RESPONSE_PAGE_ALL_SYNC	0x70 /* sync all pages */
 
+/* Server statistics as text, one line per feature */
+#define REQUEST_STATS		0x40 /* op:1 */
+#define RESPONSE_STATS		0x41 /* op:1, length:8, text */
+#define STATS_TEXT_MAX		4096
+
+/* Scheduling class and bandwidth cap of a connection */
+#define REQUEST_QOS_CONFIG	0x42 /* op:1, class:1, bytes per second:8 */
+#define RESPONSE_QOS_OK	0x43 /* op:1 */
+#define RESPONSE_QOS_ERR	0x44 /* op:1 */
+
+/* Decayed access counts over equal parts of a range */
+#define REQUEST_HEATMAP		0x45 /* op:1, offset:8, length:8, parts:8 */
+#define RESPONSE_HEATMAP	0x46 /* op:1, parts:8, pages per part:8, parts * (reads:8, writes:8) */
+#define RESPONSE_HEATMAP_ERR	0x47 /* op:1 */
+#define HEATMAP_PARTS_MAX	4096
+
+/* Page ranges owned by each server process of a sharded region */
+#define REQUEST_SHARD_MAP	0x48 /* op:1 */
+#define RESPONSE_SHARD_MAP	0x49 /* op:1, epoch:8, nodes:8, nodes * (port:8, host), ranges:8, ranges * (offset:8, length:8, node:8) */
+#define REQUEST_SHARD_MOVE	0x4A /* op:1, offset:8, length:8, node:8 */
+#define RESPONSE_SHARD_OK	0x4B /* op:1 */
+#define RESPONSE_SHARD_ERR	0x4C /* op:1 */
+#define REQUEST_SHARD_MAP_SET	0x4D /* op:1, map as in RESPONSE_SHARD_MAP; between nodes */
+#define REQUEST_SHARD_COPY	0x4E /* op:1, offset:8, length:8, data; migration between nodes */
+
 #define CLIENT_CONNECT		0xA0 /* op:1, pagesize:4, memorysize:4 */
 
 #define CLIENT_DISCONNECT	0xB0 /* op:1 */
 
+/* Sessions outlive connections so a client can reattach after a drop */
+#define CLIENT_RESUME		0xA1 /* op:1, session:8 (0 for new), pagesize:8, memorysize:8 */
+#define CLIENT_JOIN		0xA2 /* op:1, session:8; extra connection of an attached session */
+#define CLIENT_ATTACH		0xA3 /* op:1, pagesize:8, memorysize:8; as CLIENT_CONNECT, but NACKs another size instead of resizing */
+#define REQUEST_REVALIDATE	0xA4 /* op:1, count:8, count * (offset:8, crc32c:4) */
+#define RESPONSE_REVALIDATE	0xA5 /* op:1, count:8, count * stale offset:8 */
+#define REVALIDATE_ENTRY_SIZE	(sizeof(uint64_t) + sizeof(uint32_t))
+#define REVALIDATE_MAX		4096	/* Entries handled per step */
+
+/* Replication; a replica copies the region then follows the primary's writes */
+#define CLIENT_REPLICATE	0xA6 /* op:1 */
+#define RESPONSE_REPLICATE	0xA7 /* op:1, pagesize:8, memorysize:8, region */
+#define REPLICA_WRITE		0xA8 /* op:1, offset:8, length:8, data */
+#define REPLICA_HEARTBEAT	0xA9 /* op:1, sequence:8; every earlier write has been sent */
+#define REPLICA_ACK		0xAA /* op:1, sequence:8; from the replica once applied */
+
+/* Near-data operations; the server works on the range and replies with a result */
+#define REQUEST_RANGE_FILL	0x30 /* op:1, offset:8, length:8, pattern length:8, pattern */
+#define REQUEST_RANGE_MOVE	0x31 /* op:1, source:8, destination:8, length:8 */
+#define REQUEST_RANGE_COMPARE	0x32 /* op:1, offset:8, other offset:8, length:8 */
+#define REQUEST_RANGE_FIND	0x33 /* op:1, offset:8, length:8, max matches:8, pattern length:8, pattern */
+#define RESPONSE_COMPUTE_OK	0x34 /* op:1, result:8, [result * match offset:8 for finds] */
+#define RESPONSE_COMPUTE_ERR	0x35 /* op:1 */
+#define COMPUTE_PATTERN_MAX	256
+#define COMPUTE_FIND_MAX	4096
+
+/* Optimistic transactions over several pages, checked against page versions */
+#define REQUEST_TX_READ		0x38 /* op:1, offset:8, pages:8 */
+#define RESPONSE_TX_READ	0x39 /* op:1, pages * (version:8, page data) */
+#define REQUEST_TX_COMMIT	0x3A /* op:1, reads:8, writes:8, reads * (offset:8, version:8), writes * (offset:8, length:8, data) */
+#define RESPONSE_TX_COMMITTED	0x3B /* op:1 */
+#define RESPONSE_TX_ABORTED	0x3C /* op:1, offset of a page that changed:8 */
+#define RESPONSE_TX_ERR		0x3D /* op:1 */
+#define TX_PAGES_MAX		256	/* Pages one transaction may read and write */
+
+/* Atomic operations on 8-byte aligned words of shared memory */
+#define REQUEST_ATOMIC_CAS	0xC0 /* op:1, offset:8, expected:8, desired:8 */
+#define RESPONSE_ATOMIC_OK	0xC1 /* op:1, old value:8 */
+#define RESPONSE_ATOMIC_ERR	0xC2 /* op:1, old value:8 (zero) */
+#define REQUEST_ATOMIC_FADD	0xC3 /* op:1, offset:8, addend:8 */
+#define REQUEST_ATOMIC_XCHG	0xC4 /* op:1, offset:8, value:8 */
+#define REQUEST_ATOMIC_BATCH	0xC5 /* op:1, count:8, count * entry */
+
+#define ATOMIC_WORD_SIZE	sizeof(uint64_t)
+#define ATOMIC_ENTRY_SIZE	(sizeof(uint8_t) + 3 * sizeof(uint64_t)) /* op, offset, arg1, arg2 */
+#define ATOMIC_BATCH_MAX	1024
+
+/* Lock, barrier and semaphore service; waiters are parked on the server */
+#define REQUEST_LOCK_ACQUIRE	0xD0 /* op:1, id:8, mode:1 */
+#define RESPONSE_LOCK_OK	0xD1 /* op:1, count:8, count * dirty offset:8 */
+#define RESPONSE_LOCK_ERR	0xD2 /* op:1 */
+#define REQUEST_LOCK_RELEASE	0xD3 /* op:1, id:8, count:8, count * dirty offset:8 */
+#define REQUEST_BARRIER_WAIT	0xD4 /* op:1, id:8, parties:8 */
+#define REQUEST_SEM_WAIT	0xD5 /* op:1, id:8 */
+#define REQUEST_SEM_POST	0xD6 /* op:1, id:8, count:8 */
+
+#define LOCK_MODE_EXCLUSIVE	0x00
+#define LOCK_MODE_SHARED	0x01
+#define LOCK_DIRTY_MAX		4096
+#define LOCK_POLL_MS		100	/* A barrier waiter checks its client is still there */
+
 #define NM_RESPONSE_ACK		0xE0
 #define NM_RESPONSE_NACK	0xF0
 
 #define CLIENT_PAGE_SIZE 4096
 #define PAGE_OFFSET_SIZE sizeof(uint64_t)
 
-#define PAGE_REQUEST_SIZE sizeof(uint8_t) + PAGE_OFFSET_SIZE
-#define PAGE_RESPONSE_SIZE sizeof(uint8_t) + CLIENT_PAGE_SIZE
-#define SYNC_REQUEST_SIZE sizeof(uint8_t) + PAGE_OFFSET_SIZE + CLIENT_PAGE_SIZE
+#define PAGE_REQUEST_SIZE (sizeof(uint8_t) + PAGE_OFFSET_SIZE)
+#define PAGE_RESPONSE_SIZE (sizeof(uint8_t) + CLIENT_PAGE_SIZE)
+#define SYNC_REQUEST_SIZE (sizeof(uint8_t) + PAGE_OFFSET_SIZE + CLIENT_PAGE_SIZE)
 #define SYNC_RESPONSE_SIZE sizeof(uint8_t)
 #define MAX_RECV_SIZE max(PAGE_REQUEST_SIZE,SYNC_REQUEST_SIZE)
 
@@ -45,6 +153,7 @@ typedef unsigned long long uint64;
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
 
 #include <signal.h>
 #include <fcntl.h>
@@ -63,11 +172,33 @@ typedef unsigned long long uint64;
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "util.h"
 #include "comms.h"
 #include "server.h"
+#include "locks.h"
+#include "snapshot.h"
+#include "subscribe.h"
+#include "session.h"
+#include "dedup.h"
+#include "tier.h"
+#include "placement.h"
+#include "qos.h"
+#include "region.h"
+#include "compute.h"
+#include "heat.h"
+#include "tx.h"
+#include "replica.h"
+#include "shard.h"
+#include "verify.h"
+#include "trace.h"
+#include "replay.h"
+#include "bench.h"
+#include "protocol.h"
 #include "client.h"
+#include "writeback.h"
+#include "manifest.h"
 #include <algorithm>
 
 
@@ -0,0 +1,244 @@
+/*
+	File:
+		snapshot.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Point-in-time snapshots of shared memory. Taking a snapshot only
+		bumps a generation number and starts a dump thread. Before a page
+		is modified, region_modify_begin() calls snapshot_preserve() under
+		the page's stripe, which keeps the old contents if the dump thread
+		has not reached it yet, so only pages written during the dump are
+		ever duplicated. The dump takes each page under its stripe too.
+
+		The generation is bumped with every stripe held, so each write to
+		a page, and each transaction as a whole, lands entirely before or
+		after the snapshot. The generation table and page count only
+		change then, so holding any stripe keeps them stable.
+
+		A resize replaces the region under a running dump. The image would
+		then mix old and new contents, so the dump stops and is thrown away.
+*/
+
+#include "shared.h"
+#include <map>
+#include <set>
+using namespace std;
+
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool snapshot_active = false;
+static uint64 snapshot_generation = 0;
+static uint64 *snapshot_page_generation = NULL;	/* Generation each page was captured in */
+static uint64 snapshot_page_count = 0;
+static uint64 snapshot_pages_left = 0;
+static bool snapshot_resized = false;		/* The running dump is no longer the snapshot */
+static set<uint64> snapshot_discarded;		/* Generations whose image was thrown away */
+static map<uint64, uint8 *> snapshot_copies;	/* Page index -> preserved contents */
+
+/* Dump every page of the snapshot to its file, oldest contents first */
+static void *snapshot_thread(void *arg)
+{
+	uint64 generation = (uint64)(intptr_t)arg;
+	uint64 copied = 0;
+	uint64 pages;
+	char filename[64], tempname[sizeof(filename) + sizeof(".tmp")];
+	uint8 *page = new uint8 [shared_page_size];
+	FILE *fd;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	pages = snapshot_page_count;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	sprintf(filename, "snapshot.%llu.bin", generation);
+	sprintf(tempname, "%s.tmp", filename);
+	fd = fopen(tempname, "wb");
+	if(!fd)
+		perror("snapshot_thread(): fopen(): ");
+
+	bool resized = false;
+	for(uint64 i = 0; i < pages && !resized; i++)
+	{
+		if(region_snapshot_page(i, page))
+			copied++;
+		resized = __atomic_load_n(&snapshot_resized, __ATOMIC_ACQUIRE);
+		if(fd && !resized)
+			fwrite(page, shared_page_size, 1, fd);
+	}
+
+	/* Only publish the image once it is complete */
+	if(fd)
+	{
+		fclose(fd);
+		if(resized)
+			unlink(tempname);
+		else
+			rename(tempname, filename);
+	}
+	delete []page;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	for(map<uint64, uint8 *>::iterator it = snapshot_copies.begin(); it != snapshot_copies.end(); ++it)
+		delete []it->second;
+	snapshot_copies.clear();
+	if(resized)
+		snapshot_discarded.insert(generation);
+	__atomic_store_n(&snapshot_active, false, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	if(resized)
+		printf("Snapshot %llu: region was resized, image discarded\n", generation);
+	else
+		printf("Snapshot %llu: wrote %llu pages (%llu copied on write) to %s\n",
+			generation, pages, copied, filename);
+
+	return NULL;
+}
+
+/*
+	Image of a page for the dump, from the copy a writer preserved or else
+	from the frame as it is now. Caller holds the page's stripe. Returns
+	true if a preserved copy was used.
+*/
+bool snapshot_capture(uint64 page, const uint8 *frame, uint8 *buffer)
+{
+	bool preserved = false;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	map<uint64, uint8 *>::iterator it = snapshot_copies.find(page);
+	if(it != snapshot_copies.end())
+	{
+		/* A writer got here first and kept the old contents */
+		memcpy(buffer, it->second, shared_page_size);
+		delete []it->second;
+		snapshot_copies.erase(it);
+		preserved = true;
+	}
+	else
+	{
+		memcpy(buffer, frame, shared_page_size);
+		__atomic_store_n(&snapshot_page_generation[page], snapshot_generation, __ATOMIC_RELEASE);
+	}
+	snapshot_pages_left--;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	return preserved;
+}
+
+/* Preserve a page about to be modified if the dump has not reached it; caller holds its stripe */
+void snapshot_preserve(uint64 page, const uint8 *frame)
+{
+	if(!__atomic_load_n(&snapshot_active, __ATOMIC_ACQUIRE))
+		return;
+
+	/* Only written with this page's stripe held, which we hold */
+	if(page >= snapshot_page_count || snapshot_page_generation[page] == snapshot_generation)
+		return;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	if(snapshot_active)
+	{
+		uint8 *copy = new uint8 [shared_page_size];
+		memcpy(copy, frame, shared_page_size);
+		snapshot_copies[page] = copy;
+		__atomic_store_n(&snapshot_page_generation[page], snapshot_generation, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/* The region was replaced while no thread was inside it; stop any dump */
+void snapshot_region_changed(void)
+{
+	pthread_mutex_lock(&snapshot_mutex);
+	if(snapshot_active)
+		__atomic_store_n(&snapshot_resized, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	Server responds with
+	byte  - RESPONSE_SNAPSHOT_OK
+	qword - snapshot generation (image is written to snapshot.<generation>.bin)
+	or
+	byte  - RESPONSE_SNAPSHOT_ERR if a snapshot is already being dumped
+*/
+void command_snapshot(int client_socket_fd)
+{
+	uint8 response[1 + PTR_SIZE];
+	uint64 generation = 0;
+	pthread_t thread;
+	bool started = false;
+
+	/* Debug */
+	printf("* Snapshot request\n");
+
+	/* No page is part way through a write while the generation changes */
+	region_lock_all();
+	pthread_mutex_lock(&snapshot_mutex);
+	if(!snapshot_active)
+	{
+		uint64 pages = shared_memory_size / shared_page_size;
+
+		/* Only resized regions need a new generation table */
+		if(pages != snapshot_page_count)
+		{
+			delete []snapshot_page_generation;
+			snapshot_page_generation = new uint64 [pages];
+			memset(snapshot_page_generation, 0, pages * sizeof(uint64));
+			snapshot_page_count = pages;
+		}
+
+		generation = snapshot_generation + 1;
+		snapshot_pages_left = pages;
+		snapshot_resized = false;
+		__atomic_store_n(&snapshot_generation, generation, __ATOMIC_RELEASE);
+		__atomic_store_n(&snapshot_active, true, __ATOMIC_RELEASE);
+
+		if(pthread_create(&thread, NULL, snapshot_thread, (void *)(intptr_t)generation) == 0)
+		{
+			pthread_detach(thread);
+			started = true;
+		}
+		else
+			snapshot_active = false;
+	}
+	pthread_mutex_unlock(&snapshot_mutex);
+	region_unlock_all();
+
+	response[0] = started ? RESPONSE_SNAPSHOT_OK : RESPONSE_SNAPSHOT_ERR;
+	*(uint64 *)&response[1] = generation;
+	comms_send(client_socket_fd, response, started ? sizeof(response) : 1);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - snapshot generation
+	Server responds with
+	byte  - RESPONSE_SNAPSHOT_OK
+	qword - pages still to be dumped (zero once the image is complete)
+	or
+	byte  - RESPONSE_SNAPSHOT_ERR for an unknown generation, or one whose
+	        image was discarded because the region was resized
+*/
+void command_snapshot_status(int client_socket_fd)
+{
+	uint64 generation = comms_getq(client_socket_fd);
+	uint8 response[1 + PTR_SIZE];
+	bool known;
+	uint64 left = 0;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	known = (generation != 0 && generation <= snapshot_generation &&
+		!snapshot_discarded.count(generation));
+	if(known && generation == snapshot_generation && snapshot_active)
+		left = snapshot_pages_left;
+	pthread_mutex_unlock(&snapshot_mutex);
+
+	response[0] = known ? RESPONSE_SNAPSHOT_OK : RESPONSE_SNAPSHOT_ERR;
+	*(uint64 *)&response[1] = left;
+	comms_send(client_socket_fd, response, known ? sizeof(response) : 1);
+}
+
+/* End */
@@ -0,0 +1,11 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+/* Function prototypes */
+void command_snapshot(int client_socket_fd);
+void command_snapshot_status(int client_socket_fd);
+bool snapshot_capture(uint64 page, const uint8 *frame, uint8 *buffer);
+void snapshot_preserve(uint64 page, const uint8 *frame);
+void snapshot_region_changed(void);
+
+#endif /* _SNAPSHOT_H_ */
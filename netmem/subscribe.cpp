@@ -0,0 +1,332 @@
+/*
+	File:
+		subscribe.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Push updates to clients that subscribed to a range of shared
+		memory. Writes only record which bytes of each page changed; a
+		sender thread per subscriber pushes the changed bytes, at most once
+		per interval, so many writes to a page collapse into one push and
+		a slow subscriber never holds up writers.
+*/
+
+#include "shared.h"
+#include <map>
+#include <vector>
+#include <sys/time.h>
+using namespace std;
+
+struct nm_subscriber {
+	int socket_fd;
+	pthread_t thread;
+	pthread_mutex_t mutex;		/* Guards ranges and dirty */
+	pthread_mutex_t send_mutex;	/* Keeps frames on the socket whole */
+	pthread_cond_t cond;
+	bool running;
+	uint64 interval;		/* Minimum ms between pushes */
+	vector<pair<uint64, uint64> > ranges;	/* Offset and length */
+	map<uint64, pair<uint64, uint64> > dirty;	/* Page -> changed bytes [lo, hi) */
+	uint64 pushes;
+	uint64 coalesced;
+	uint64 bytes;
+};
+
+static pthread_rwlock_t subscribe_lock = PTHREAD_RWLOCK_INITIALIZER;
+static map<int, nm_subscriber *> subscribers;
+static int subscribe_count = 0;		/* Read without the lock on every write */
+
+static uint64 subscribe_now(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000ULL + now.tv_usec / 1000;
+}
+
+/* Push changed bytes to one subscriber until it disconnects */
+static void *subscribe_thread(void *arg)
+{
+	nm_subscriber *subscriber = (nm_subscriber *)arg;
+	uint8 *frame = new uint8 [1 + 2 * PTR_SIZE + shared_page_size];
+	uint64 last_push = 0;
+
+	/* A push to a dropped client fails quietly; its connection cleans up */
+	socket_error_mode(SOCKET_ERRORS_RETURN);
+
+	pthread_mutex_lock(&subscriber->mutex);
+	while(subscriber->running)
+	{
+		if(subscriber->dirty.empty())
+		{
+			pthread_cond_wait(&subscriber->cond, &subscriber->mutex);
+			continue;
+		}
+
+		/* Rate limit; writes arriving meanwhile are merged into dirty */
+		uint64 now = subscribe_now();
+		if(now < last_push + subscriber->interval)
+		{
+			uint64 wake = last_push + subscriber->interval;
+			struct timespec deadline;
+			deadline.tv_sec = wake / 1000;
+			deadline.tv_nsec = (wake % 1000) * 1000000;
+			pthread_cond_timedwait(&subscriber->cond, &subscriber->mutex, &deadline);
+			continue;
+		}
+
+		map<uint64, pair<uint64, uint64> > batch;
+		batch.swap(subscriber->dirty);
+		last_push = now;
+		pthread_mutex_unlock(&subscriber->mutex);
+
+		/* Writers keep marking pages while we are blocked sending */
+		pthread_mutex_lock(&subscriber->send_mutex);
+		for(map<uint64, pair<uint64, uint64> >::iterator it = batch.begin(); it != batch.end(); ++it)
+		{
+			uint64 offset = it->first * shared_page_size + it->second.first;
+			uint64 length = it->second.second - it->second.first;
+
+			frame[0] = PUSH_PAGE_UPDATE;
+			*(uint64 *)&frame[1] = offset;
+			*(uint64 *)&frame[1 + PTR_SIZE] = length;
+			region_copy(offset, &frame[1 + 2 * PTR_SIZE], length);
+
+			comms_send(subscriber->socket_fd, frame, 1 + 2 * PTR_SIZE + length);
+			subscriber->pushes++;
+			subscriber->bytes += length;
+		}
+		pthread_mutex_unlock(&subscriber->send_mutex);
+
+		pthread_mutex_lock(&subscriber->mutex);
+	}
+	pthread_mutex_unlock(&subscriber->mutex);
+
+	delete []frame;
+	return NULL;
+}
+
+/* Record a write for every subscriber whose ranges it overlaps */
+void subscribe_notify(uint64 offset, uint64 length)
+{
+	if(!__atomic_load_n(&subscribe_count, __ATOMIC_ACQUIRE) || !length)
+		return;
+
+	pthread_rwlock_rdlock(&subscribe_lock);
+	for(map<int, nm_subscriber *>::iterator it = subscribers.begin(); it != subscribers.end(); ++it)
+	{
+		nm_subscriber *subscriber = it->second;
+		bool signal = false;
+
+		pthread_mutex_lock(&subscriber->mutex);
+		for(size_t r = 0; r < subscriber->ranges.size(); r++)
+		{
+			uint64 lo = MAX(offset, subscriber->ranges[r].first);
+			uint64 hi = MIN(offset + length, subscriber->ranges[r].first + subscriber->ranges[r].second);
+
+			/* Split the overlap per page and widen each page's dirty span */
+			while(lo < hi)
+			{
+				uint64 page = lo / shared_page_size;
+				uint64 end = MIN(hi, (page + 1) * shared_page_size);
+				uint64 page_lo = lo - page * shared_page_size;
+				uint64 page_hi = end - page * shared_page_size;
+				map<uint64, pair<uint64, uint64> >::iterator d = subscriber->dirty.find(page);
+
+				if(d == subscriber->dirty.end())
+					subscriber->dirty[page] = make_pair(page_lo, page_hi);
+				else
+				{
+					d->second.first = MIN(d->second.first, page_lo);
+					d->second.second = MAX(d->second.second, page_hi);
+					subscriber->coalesced++;
+				}
+				signal = true;
+				lo = end;
+			}
+		}
+		if(signal)
+			pthread_cond_signal(&subscriber->cond);
+		pthread_mutex_unlock(&subscriber->mutex);
+	}
+	pthread_rwlock_unlock(&subscribe_lock);
+}
+
+/* Cleanup handler for a send that ends the connection thread */
+static void subscribe_send_unlock(void *arg)
+{
+	pthread_mutex_unlock((pthread_mutex_t *)arg);
+}
+
+/* Reply in step with pushes; the lock is let go even if the client drops */
+static void subscribe_reply(nm_subscriber *subscriber, int client_socket_fd, uint8 response)
+{
+	pthread_mutex_lock(&subscriber->send_mutex);
+	pthread_cleanup_push(subscribe_send_unlock, &subscriber->send_mutex);
+	comms_sendb(client_socket_fd, response);
+	pthread_cleanup_pop(1);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of range
+	qword - length of range
+	qword - minimum interval between pushes in ms
+	Server responds with
+	byte  - RESPONSE_SUBSCRIBE_OK or RESPONSE_SUBSCRIBE_ERR
+	From then on the server sends
+	byte  - PUSH_PAGE_UPDATE
+	qword - offset of changed bytes
+	qword - number of changed bytes (never crosses a page)
+	bytes - current contents
+*/
+void command_subscribe(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	uint64 interval = comms_getq(client_socket_fd);
+	bool valid = (length && offset < (uint64)shared_memory_size &&
+		length <= (uint64)shared_memory_size - offset);
+
+	/* Debug */
+	printf("* Subscribe request, offset: %016llX, length: %lld, interval: %lld ms\n",
+		offset, length, interval);
+
+	/* Only this connection's thread adds or removes its subscriber */
+	nm_subscriber *subscriber = NULL;
+	pthread_rwlock_rdlock(&subscribe_lock);
+	map<int, nm_subscriber *>::iterator it = subscribers.find(client_socket_fd);
+	if(it != subscribers.end())
+		subscriber = it->second;
+	pthread_rwlock_unlock(&subscribe_lock);
+
+	if(!subscriber && valid)
+	{
+		/* First subscription turns the connection into a push channel */
+		subscriber = new nm_subscriber();
+		subscriber->socket_fd = client_socket_fd;
+		subscriber->running = true;
+		pthread_mutex_init(&subscriber->mutex, NULL);
+		pthread_mutex_init(&subscriber->send_mutex, NULL);
+		pthread_cond_init(&subscriber->cond, NULL);
+		if(pthread_create(&subscriber->thread, NULL, subscribe_thread, subscriber) != 0)
+			die("Error: pthread_create(): subscriber\n");
+
+		pthread_rwlock_wrlock(&subscribe_lock);
+		subscribers[client_socket_fd] = subscriber;
+		__atomic_add_fetch(&subscribe_count, 1, __ATOMIC_RELEASE);
+		pthread_rwlock_unlock(&subscribe_lock);
+	}
+
+	if(!subscriber)
+	{
+		comms_sendb(client_socket_fd, RESPONSE_SUBSCRIBE_ERR);
+		return;
+	}
+
+	if(valid)
+	{
+		pthread_mutex_lock(&subscriber->mutex);
+		subscriber->ranges.push_back(make_pair(offset, length));
+		subscriber->interval = interval;
+		pthread_mutex_unlock(&subscriber->mutex);
+	}
+
+	subscribe_reply(subscriber, client_socket_fd, valid ? RESPONSE_SUBSCRIBE_OK : RESPONSE_SUBSCRIBE_ERR);
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of range, as subscribed
+	qword - length of range, as subscribed
+	Server responds with
+	byte  - RESPONSE_SUBSCRIBE_OK or RESPONSE_SUBSCRIBE_ERR (not subscribed)
+*/
+void command_unsubscribe(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 length = comms_getq(client_socket_fd);
+	bool found = false;
+
+	/* Debug */
+	printf("* Unsubscribe request, offset: %016llX, length: %lld\n", offset, length);
+
+	nm_subscriber *subscriber = NULL;
+	pthread_rwlock_rdlock(&subscribe_lock);
+	map<int, nm_subscriber *>::iterator it = subscribers.find(client_socket_fd);
+	if(it != subscribers.end())
+		subscriber = it->second;
+	pthread_rwlock_unlock(&subscribe_lock);
+
+	if(!subscriber)
+	{
+		comms_sendb(client_socket_fd, RESPONSE_SUBSCRIBE_ERR);
+		return;
+	}
+
+	pthread_mutex_lock(&subscriber->mutex);
+	for(size_t r = 0; r < subscriber->ranges.size() && !found; r++)
+	{
+		if(subscriber->ranges[r] == make_pair(offset, length))
+		{
+			subscriber->ranges.erase(subscriber->ranges.begin() + r);
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&subscriber->mutex);
+
+	subscribe_reply(subscriber, client_socket_fd, found ? RESPONSE_SUBSCRIBE_OK : RESPONSE_SUBSCRIBE_ERR);
+}
+
+/*
+	Only subscription requests may arrive on a push channel. Their replies
+	are sent under send_mutex; any other reply could land in the middle
+	of a push.
+*/
+bool subscribe_accepts(int client_socket_fd, uint8 opcode)
+{
+	bool subscribed;
+
+	if(opcode == REQUEST_SUBSCRIBE || opcode == REQUEST_UNSUBSCRIBE || opcode == CLIENT_DISCONNECT)
+		return true;
+	if(!__atomic_load_n(&subscribe_count, __ATOMIC_ACQUIRE))
+		return true;
+
+	pthread_rwlock_rdlock(&subscribe_lock);
+	subscribed = (subscribers.find(client_socket_fd) != subscribers.end());
+	pthread_rwlock_unlock(&subscribe_lock);
+
+	return !subscribed;
+}
+
+/* Stop pushing to a client that is going away */
+void subscribe_disconnect(int client_socket_fd)
+{
+	nm_subscriber *subscriber = NULL;
+
+	pthread_rwlock_wrlock(&subscribe_lock);
+	map<int, nm_subscriber *>::iterator it = subscribers.find(client_socket_fd);
+	if(it != subscribers.end())
+	{
+		subscriber = it->second;
+		subscribers.erase(it);
+		__atomic_sub_fetch(&subscribe_count, 1, __ATOMIC_RELEASE);
+	}
+	pthread_rwlock_unlock(&subscribe_lock);
+
+	if(!subscriber)
+		return;
+
+	pthread_mutex_lock(&subscriber->mutex);
+	subscriber->running = false;
+	pthread_cond_signal(&subscriber->cond);
+	pthread_mutex_unlock(&subscriber->mutex);
+	pthread_join(subscriber->thread, NULL);
+
+	printf("Subscriber %d: %llu pushes, %llu bytes, %llu writes coalesced\n",
+		client_socket_fd, subscriber->pushes, subscriber->bytes, subscriber->coalesced);
+	delete subscriber;
+}
+
+/* End */
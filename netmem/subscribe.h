@@ -0,0 +1,11 @@
+#ifndef _SUBSCRIBE_H_
+#define _SUBSCRIBE_H_
+
+/* Function prototypes */
+void command_subscribe(int client_socket_fd);
+void command_unsubscribe(int client_socket_fd);
+void subscribe_notify(uint64 offset, uint64 length);
+bool subscribe_accepts(int client_socket_fd, uint8 opcode);
+void subscribe_disconnect(int client_socket_fd);
+
+#endif /* _SUBSCRIBE_H_ */
@@ -0,0 +1,184 @@
+/*
+	File:
+		tier.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Hot/cold tiering of the server's shared memory, enabled with
+		-tier <frames>. Resident pages live in a fixed pool of DRAM frames;
+		when the pool is full the coldest resident page is dropped and
+		read back from shared.bin the next time it is touched. Writes go
+		through to the file, so a page never has to be written out when
+		it is evicted and shared.bin itself is the cold tier. Keep it on
+		local SSD to make misses cheap.
+
+		Eviction is CLOCK with a small access count per frame: every
+		access raises the count up to TIER_HEAT_MAX, the hand lowers it as
+		it sweeps past, and a frame is only taken once its count is zero.
+		Pages touched often therefore survive several sweeps, while a
+		single scan through the region only displaces other cold pages.
+
+		This file only manages frames; region.cpp picks when to evict and
+		unmaps a page under its stripe mutex before the frame is reused.
+*/
+
+#include "shared.h"
+#include <vector>
+using namespace std;
+
+bool tier_enabled = false;
+uint64 tier_capacity = 0;	/* Frames in the pool */
+
+static pthread_mutex_t tier_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint8 *tier_pool = NULL;		/* Frame data */
+static uint64 *tier_owner = NULL;	/* Page held by each frame */
+static uint8 *tier_heat = NULL;		/* Recent accesses per frame */
+static vector<uint64> tier_free_frames;
+static uint64 tier_hand = 0;
+static uint64 tier_hits = 0;		/* Accesses to resident pages */
+static uint64 tier_misses = 0;		/* Pages read back from the file */
+static uint64 tier_evictions = 0;
+static uint64 tier_busy = 0;		/* Victims skipped while in use */
+
+void tier_setup(int argc, char *argv[])
+{
+	int index;
+
+	if((index = find_option(argc, argv, "-tier")) == -1 || index + 1 >= argc)
+		return;
+
+	tier_capacity = strtoull(argv[index + 1], NULL, 0);
+	if(tier_capacity < 2)
+		die("Error: -tier needs at least 2 frames.\n");
+
+	tier_pool = placement_alloc(tier_capacity * shared_page_size);
+	tier_owner = (uint64 *)malloc(tier_capacity * sizeof(uint64));
+	tier_heat = (uint8 *)calloc(tier_capacity, sizeof(uint8));
+	if(!tier_pool || !tier_owner || !tier_heat)
+		die("tier_setup(): Out of memory.\n");
+
+	for(uint64 i = 0; i < tier_capacity; i++)
+	{
+		tier_owner[i] = TIER_NO_PAGE;
+		tier_free_frames.push_back(tier_capacity - 1 - i);
+	}
+	tier_enabled = true;
+
+	printf("Server: Keeping at most %llu pages (%llu bytes) resident.\n",
+		tier_capacity, tier_capacity * shared_page_size);
+}
+
+static uint64 tier_index(uint8 *frame)
+{
+	return (frame - tier_pool) / shared_page_size;
+}
+
+/* Free frame for a page, or NULL if the pool is full */
+uint8 *tier_alloc(uint64 page)
+{
+	uint8 *frame = NULL;
+
+	pthread_mutex_lock(&tier_mutex);
+	if(!tier_free_frames.empty())
+	{
+		uint64 index = tier_free_frames.back();
+		tier_free_frames.pop_back();
+		tier_owner[index] = page;
+		tier_heat[index] = 1;
+		frame = &tier_pool[index * shared_page_size];
+	}
+	pthread_mutex_unlock(&tier_mutex);
+
+	return frame;
+}
+
+void tier_free(uint8 *frame)
+{
+	uint64 index = tier_index(frame);
+
+	pthread_mutex_lock(&tier_mutex);
+	tier_owner[index] = TIER_NO_PAGE;
+	tier_free_frames.push_back(index);
+	pthread_mutex_unlock(&tier_mutex);
+}
+
+/* Sweep the clock to the next cold frame; false if nothing is in use */
+bool tier_victim(uint64 *page, uint8 **frame)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&tier_mutex);
+
+	/* Every frame drops to zero within TIER_HEAT_MAX + 1 turns */
+	for(uint64 step = 0; step < tier_capacity * (TIER_HEAT_MAX + 2); step++)
+	{
+		uint64 index = tier_hand;
+		tier_hand = (tier_hand + 1) % tier_capacity;
+
+		if(tier_owner[index] == TIER_NO_PAGE)
+			continue;
+		if(tier_heat[index])
+		{
+			tier_heat[index]--;
+			continue;
+		}
+
+		*page = tier_owner[index];
+		*frame = &tier_pool[index * shared_page_size];
+		found = true;
+		break;
+	}
+
+	pthread_mutex_unlock(&tier_mutex);
+	return found;
+}
+
+/* Note an access to a resident frame; races only lose a count */
+void tier_touch(uint8 *frame)
+{
+	uint64 index = tier_index(frame);
+	uint8 heat = __atomic_load_n(&tier_heat[index], __ATOMIC_RELAXED);
+
+	if(heat < TIER_HEAT_MAX)
+		__atomic_store_n(&tier_heat[index], heat + 1, __ATOMIC_RELAXED);
+}
+
+/* Count a page access that found the page resident or had to read it */
+void tier_count(bool hit)
+{
+	if(!tier_enabled)
+		return;
+	__atomic_fetch_add(hit ? &tier_hits : &tier_misses, 1, __ATOMIC_RELAXED);
+}
+
+/* Count the outcome of trying to evict a victim */
+void tier_evicted(bool done)
+{
+	__atomic_fetch_add(done ? &tier_evictions : &tier_busy, 1, __ATOMIC_RELAXED);
+}
+
+/* Print hit rates per tier into text, returns its length */
+int tier_report(char *text, int size)
+{
+	if(!tier_enabled)
+		return snprintf(text, size, "tier: off\n");
+
+	pthread_mutex_lock(&tier_mutex);
+	uint64 resident = tier_capacity - tier_free_frames.size();
+	pthread_mutex_unlock(&tier_mutex);
+
+	uint64 hits = __atomic_load_n(&tier_hits, __ATOMIC_RELAXED);
+	uint64 misses = __atomic_load_n(&tier_misses, __ATOMIC_RELAXED);
+	uint64 total = hits + misses;
+
+	return snprintf(text, size,
+		"tier: %llu of %llu frames resident, dram %llu hits (%.1f%%), "
+		"file %llu reads (%.1f%%), %llu evictions, %llu busy\n",
+		resident, tier_capacity,
+		hits, total ? 100.0 * hits / total : 0.0,
+		misses, total ? 100.0 * misses / total : 0.0,
+		__atomic_load_n(&tier_evictions, __ATOMIC_RELAXED),
+		__atomic_load_n(&tier_busy, __ATOMIC_RELAXED));
+}
+
+/* End */
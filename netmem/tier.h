@@ -0,0 +1,20 @@
+#ifndef _TIER_H_
+#define _TIER_H_
+
+#define TIER_HEAT_MAX		3	/* Sweeps a busy frame survives */
+#define TIER_NO_PAGE		((uint64)-1)
+
+extern bool tier_enabled;
+extern uint64 tier_capacity;
+
+/* Function prototypes */
+void tier_setup(int argc, char *argv[]);
+uint8 *tier_alloc(uint64 page);
+void tier_free(uint8 *frame);
+bool tier_victim(uint64 *page, uint8 **frame);
+void tier_touch(uint8 *frame);
+void tier_count(bool hit);
+void tier_evicted(bool done);
+int tier_report(char *text, int size);
+
+#endif /* _TIER_H_ */
@@ -0,0 +1,114 @@
+/*
+	File:
+		trace.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Binary trace of page and range accesses, enabled with
+		-trace <file> on the server or the client. Each request is one
+		fixed-size record in a ring mapped from the trace file, so
+		recording costs an atomic increment and a 32 byte store; the
+		kernel writes the pages out. When the ring is full the oldest
+		records are overwritten.
+
+		Options:
+		-trace <file>		record into file
+		-tracesize <records>	ring capacity (default TRACE_DEFAULT_RECORDS)
+
+		The replay tool (replay.cpp) reads the file back.
+*/
+
+#include "shared.h"
+#include <time.h>
+
+static struct trace_header *trace_file = NULL;
+static struct trace_record *trace_ring = NULL;
+static uint64 trace_length = 0;			/* Bytes mapped */
+static uint32_t trace_connections[TRACE_MAX_FDS];	/* Socket -> connection */
+static uint32_t trace_next_connection = 0;
+
+uint64 trace_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void trace_setup(int argc, char *argv[], uint32_t source)
+{
+	uint64 capacity = TRACE_DEFAULT_RECORDS;
+	char *filename;
+	int index;
+	int fd;
+
+	if((index = find_option(argc, argv, "-trace")) == -1 || index + 1 >= argc)
+		return;
+	filename = argv[index + 1];
+	if((index = find_option(argc, argv, "-tracesize")) != -1 && index + 1 < argc)
+		capacity = MAX(strtoull(argv[index + 1], NULL, 0), 1);
+
+	/* Start from an empty file so stale records are never replayed */
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1)
+		die_errno("Error: open(): %s: ", filename);
+	trace_length = TRACE_HEADER_SIZE + capacity * sizeof(struct trace_record);
+	if(ftruncate(fd, trace_length) == -1)
+		die_errno("Error: ftruncate(): %s: ", filename);
+
+	trace_file = (struct trace_header *)mmap(NULL, trace_length,
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(trace_file == MAP_FAILED)
+		die_errno("Error: mmap(): %s: ", filename);
+	close(fd);
+
+	memcpy(trace_file->magic, TRACE_MAGIC, sizeof(trace_file->magic));
+	trace_file->record_size = sizeof(struct trace_record);
+	trace_file->source = source;
+	trace_file->capacity = capacity;
+	trace_file->head = 0;
+
+	/* Published last; trace_add() does nothing until it is set */
+	__atomic_store_n(&trace_ring,
+		(struct trace_record *)((uint8 *)trace_file + TRACE_HEADER_SIZE), __ATOMIC_RELEASE);
+
+	printf("Tracing up to %llu requests to %s.\n", capacity, filename);
+}
+
+/* Stop recording and flush the ring; it stays mapped for late writers */
+void trace_close(void)
+{
+	if(!trace_ring)
+		return;
+
+	__atomic_store_n(&trace_ring, (struct trace_record *)NULL, __ATOMIC_RELEASE);
+	msync(trace_file, trace_length, MS_SYNC);
+	printf("Traced %llu requests.\n", trace_file->head);
+}
+
+/* Give a new connection the next number; socket numbers are reused */
+void trace_connect(int socket_fd)
+{
+	if(socket_fd >= 0 && socket_fd < TRACE_MAX_FDS)
+		trace_connections[socket_fd] = __atomic_add_fetch(&trace_next_connection, 1, __ATOMIC_RELAXED);
+}
+
+void trace_add(int socket_fd, uint8 opcode, uint64 offset, uint64 length)
+{
+	struct trace_record *ring = __atomic_load_n(&trace_ring, __ATOMIC_ACQUIRE);
+
+	if(!ring)
+		return;
+
+	uint64 slot = __atomic_fetch_add(&trace_file->head, 1, __ATOMIC_RELAXED) % trace_file->capacity;
+	struct trace_record *record = &ring[slot];
+
+	record->connection = (socket_fd >= 0 && socket_fd < TRACE_MAX_FDS) ?
+		trace_connections[socket_fd] : socket_fd;
+	record->opcode = opcode;
+	record->offset = offset;
+	record->length = length;
+	__atomic_store_n(&record->time_ns, trace_time(), __ATOMIC_RELEASE);
+}
+
+/* End */
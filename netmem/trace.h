@@ -0,0 +1,44 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#define TRACE_DEFAULT_FILENAME	"netmem.trace"
+#define TRACE_DEFAULT_RECORDS	0x100000	/* 32M of records */
+#define TRACE_MAX_FDS		0x10000	/* Sockets given connection numbers */
+
+/*
+	Trace file layout:
+	header   - TRACE_HEADER_SIZE bytes, struct trace_header at the start
+	records  - capacity * struct trace_record, used as a ring; record i
+	           of the run lives in slot i % capacity
+*/
+#define TRACE_MAGIC		"NMTRACE1"
+#define TRACE_HEADER_SIZE	0x1000
+
+#define TRACE_SOURCE_SERVER	'S'
+#define TRACE_SOURCE_CLIENT	'C'
+
+struct trace_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t source;	/* TRACE_SOURCE_xxx */
+	uint64 capacity;	/* Slots in the ring */
+	uint64 head;		/* Records written so far */
+};
+
+struct trace_record {
+	uint64 time_ns;		/* CLOCK_REALTIME; zero if never written */
+	uint32_t connection;	/* Numbered in order of connection */
+	uint8 opcode;
+	uint8 reserved[3];
+	uint64 offset;
+	uint64 length;
+};
+
+/* Function prototypes */
+void trace_setup(int argc, char *argv[], uint32_t source);
+void trace_close(void);
+void trace_connect(int socket_fd);
+void trace_add(int socket_fd, uint8 opcode, uint64 offset, uint64 length);
+uint64 trace_time(void);
+
+#endif /* _TRACE_H_ */
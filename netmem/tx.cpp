@@ -0,0 +1,217 @@
+/*
+	File:
+		tx.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Optimistic transactions over several pages. A client reads pages
+		with REQUEST_TX_READ, which returns each page with its version,
+		works on its copies and sends one REQUEST_TX_COMMIT carrying the
+		pages it read with the versions it saw and the bytes it wants
+		written. The server applies every write if none of those pages
+		has changed since, and nothing otherwise; the client then reads
+		again and retries.
+
+		There is no transaction lock: region_commit() only holds the
+		stripes of the pages involved, so transactions on unrelated pages
+		commit in parallel with each other and with plain writes. A commit
+		with no writes checks that a set of pages was read consistently.
+*/
+
+#include "shared.h"
+#include <vector>
+using namespace std;
+
+static uint64 tx_reads = 0;		/* Pages read with their version */
+static uint64 tx_commits = 0;
+static uint64 tx_aborts = 0;
+static uint64 tx_errors = 0;
+
+/*
+	Client sends
+	byte  - opcode
+	qword - offset of first page
+	qword - number of pages (1 to TX_PAGES_MAX)
+	Server responds with
+	byte  - RESPONSE_TX_READ, then for each page its qword version
+	        followed by the page data
+	or
+	byte  - RESPONSE_TX_ERR if the pages are not within shared memory
+*/
+void command_tx_read(int client_socket_fd)
+{
+	uint64 offset = comms_getq(client_socket_fd);
+	uint64 pages = comms_getq(client_socket_fd);
+
+	/* Debug */
+	printf("* Transaction read request, offset: %016llX, pages: %lld\n", offset, pages);
+	trace_add(client_socket_fd, REQUEST_TX_READ, offset, pages * shared_page_size);
+
+	if(!pages || pages > TX_PAGES_MAX || offset % shared_page_size ||
+		offset >= (uint64)shared_memory_size || pages > (shared_memory_size - offset) / shared_page_size)
+	{
+		__atomic_fetch_add(&tx_errors, 1, __ATOMIC_RELAXED);
+		comms_sendb(client_socket_fd, RESPONSE_TX_ERR);
+		return;
+	}
+
+	uint64 entry_size = PTR_SIZE + shared_page_size;
+	vector<uint8> reply(1 + pages * entry_size);
+
+	reply[0] = RESPONSE_TX_READ;
+	for(uint64 i = 0; i < pages; i++)
+	{
+		uint8 *entry = &reply[1 + i * entry_size];
+		*(uint64 *)entry = region_read_version(offset + i * shared_page_size, entry + PTR_SIZE);
+	}
+	__atomic_fetch_add(&tx_reads, pages, __ATOMIC_RELAXED);
+
+	comms_send(client_socket_fd, &reply[0], reply.size());
+}
+
+/*
+	Client sends
+	byte  - opcode
+	qword - number of pages read
+	qword - number of writes
+	entry - qword page offset, qword version it was read at (repeated)
+	entry - qword offset, qword length, bytes to write (repeated)
+	Server responds with
+	byte  - RESPONSE_TX_COMMITTED if every write was applied
+	or
+	byte  - RESPONSE_TX_ABORTED, qword offset of a page read that has
+	        changed since; nothing was written
+	or
+	byte  - RESPONSE_TX_ERR if an entry is outside shared memory, the
+	        transaction covers more than TX_PAGES_MAX pages or another
+	        node of a sharded region owns one of its pages
+	More than TX_PAGES_MAX reads or writes, or a write longer than shared
+	memory, closes the connection.
+*/
+void command_tx_commit(int client_socket_fd)
+{
+	uint64 read_count = comms_getq(client_socket_fd);
+	uint64 write_count = comms_getq(client_socket_fd);
+	vector<struct region_tx_read> reads;
+	vector<struct region_tx_write> writes;
+	vector<uint64> starts;		/* Where each write's bytes are in data */
+	vector<uint8> data;
+	uint64 pages = 0;
+	uint64 low = ~(uint64)0, high = 0;
+	bool valid = true;
+
+	/* Debug */
+	printf("* Transaction commit request, reads: %lld, writes: %lld\n", read_count, write_count);
+
+	/* Each entry covers a page at least; more than that cannot be drained safely */
+	if(read_count > TX_PAGES_MAX || write_count > TX_PAGES_MAX)
+	{
+		socket_drop(client_socket_fd, "Transaction too large, dropping client.");
+		return;
+	}
+
+	/* The whole request is always consumed, valid or not */
+	for(uint64 i = 0; i < read_count; i++)
+	{
+		struct region_tx_read entry;
+
+		entry.offset = comms_getq(client_socket_fd);
+		entry.version = comms_getq(client_socket_fd);
+		if(entry.offset % shared_page_size || entry.offset >= (uint64)shared_memory_size || ++pages > TX_PAGES_MAX)
+			valid = false;
+		if(valid)
+			reads.push_back(entry);
+	}
+
+	for(uint64 i = 0; i < write_count; i++)
+	{
+		struct region_tx_write entry;
+
+		entry.offset = comms_getq(client_socket_fd);
+		entry.length = comms_getq(client_socket_fd);
+		if(entry.length > (uint64)shared_memory_size)
+		{
+			socket_drop(client_socket_fd, "Transaction write longer than shared memory, dropping client.");
+			return;
+		}
+		if(!entry.length || entry.offset >= (uint64)shared_memory_size || entry.length > shared_memory_size - entry.offset)
+			valid = false;
+		else
+		{
+			pages += (entry.offset + entry.length - 1) / shared_page_size - entry.offset / shared_page_size + 1;
+			if(pages > TX_PAGES_MAX)
+				valid = false;
+		}
+		if(!valid)
+		{
+			comms_skip(client_socket_fd, entry.length);
+			continue;
+		}
+
+		starts.push_back(data.size());
+		data.resize(data.size() + entry.length);
+		comms_get(client_socket_fd, &data[starts.back()], entry.length);
+		writes.push_back(entry);
+		low = MIN(low, entry.offset);
+		high = MAX(high, entry.offset + entry.length);
+	}
+
+	/* Every page must fit in the pool at once */
+	if(tier_enabled && pages > tier_capacity)
+		valid = false;
+
+	trace_add(client_socket_fd, REQUEST_TX_COMMIT, writes.empty() ? 0 : low, writes.empty() ? 0 : high - low);
+
+	if(!valid)
+	{
+		__atomic_fetch_add(&tx_errors, 1, __ATOMIC_RELAXED);
+		comms_sendb(client_socket_fd, RESPONSE_TX_ERR);
+		return;
+	}
+
+	for(size_t i = 0; i < writes.size(); i++)
+		writes[i].data = &data[starts[i]];
+
+	/* Pages read are checked too; a copy nobody serves proves nothing */
+	shard_serve_begin();
+	for(size_t i = 0; i < reads.size() && valid; i++)
+		valid = shard_owns(reads[i].offset, shared_page_size);
+	for(size_t i = 0; i < writes.size() && valid; i++)
+		valid = shard_owns(writes[i].offset, writes[i].length);
+	if(!valid)
+	{
+		shard_serve_end();
+		__atomic_fetch_add(&tx_errors, 1, __ATOMIC_RELAXED);
+		comms_sendb(client_socket_fd, RESPONSE_TX_ERR);
+		return;
+	}
+
+	uint64 conflict = region_commit(reads.empty() ? NULL : &reads[0], (int)reads.size(),
+		writes.empty() ? NULL : &writes[0], (int)writes.size());
+	shard_serve_end();
+
+	if(conflict == REGION_TX_COMMITTED)
+	{
+		__atomic_fetch_add(&tx_commits, 1, __ATOMIC_RELAXED);
+		comms_sendb(client_socket_fd, RESPONSE_TX_COMMITTED);
+	}
+	else
+	{
+		uint8 response[1 + PTR_SIZE];
+
+		__atomic_fetch_add(&tx_aborts, 1, __ATOMIC_RELAXED);
+		response[0] = RESPONSE_TX_ABORTED;
+		*(uint64 *)&response[1] = conflict;
+		comms_send(client_socket_fd, response, sizeof(response));
+	}
+}
+
+/* Print transaction counts into text, returns its length */
+int tx_report(char *text, int size)
+{
+	return snprintf(text, size, "tx: %llu pages read, %llu commits, %llu aborts, %llu errors\n",
+		__atomic_load_n(&tx_reads, __ATOMIC_RELAXED), __atomic_load_n(&tx_commits, __ATOMIC_RELAXED),
+		__atomic_load_n(&tx_aborts, __ATOMIC_RELAXED), __atomic_load_n(&tx_errors, __ATOMIC_RELAXED));
+}
+
+/* End */
@@ -0,0 +1,9 @@
+#ifndef _TX_H_
+#define _TX_H_
+
+/* Function prototypes */
+void command_tx_read(int client_socket_fd);
+void command_tx_commit(int client_socket_fd);
+int tx_report(char *text, int size);
+
+#endif /* _TX_H_ */
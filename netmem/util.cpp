@@ -7,6 +7,10 @@
 		None
 */
 #include "shared.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <immintrin.h>
+#endif
 using namespace std;
 
 /* Print error message, print ERRNO meaning, and exit program */
@@ -31,6 +35,62 @@ void die(char *fmt, ...)
 	exit(1);
 }
 
+/* What a failed socket read or write does in this thread */
+static __thread int socket_mode = SOCKET_ERRORS_DIE;
+static __thread bool socket_failed = false;
+
+/* Set this thread's mode; returns the one it replaces */
+int socket_error_mode(int mode)
+{
+	int previous = socket_mode;
+
+	socket_mode = mode;
+	socket_failed = false;
+	return previous;
+}
+
+/* True if a socket call failed since the last check */
+bool socket_error_check(void)
+{
+	bool failed = socket_failed;
+	socket_failed = false;
+	return failed;
+}
+
+static void socket_failure(const char *message, bool use_errno)
+{
+	int err = errno;
+
+	switch(socket_mode)
+	{
+		case SOCKET_ERRORS_EXIT_THREAD: /* Cleanup handlers close the connection */
+			printf("%s%s\n", message, use_errno ? strerror(err) : "");
+			pthread_exit(NULL);
+			break;
+
+		case SOCKET_ERRORS_RETURN: /* Caller checks and reconnects */
+			socket_failed = true;
+			break;
+
+		default:
+			errno = err;
+			if(use_errno)
+				die_errno((char *)"%s", message);
+			die((char *)"%s", message);
+			break;
+	}
+}
+
+/*
+	Give up on a connection whose peer sent a length that cannot be
+	honoured; draining it could take forever. Handled as a failed socket.
+*/
+void socket_drop(int socket_fd, const char *message)
+{
+	shutdown(socket_fd, SHUT_RDWR);
+	socket_failure(message, false);
+}
+
 /* Write socket until all expected data is written */
 void write_socket_blocking(int socket_fd, uint8 *buffer, int bytes_to_write, int &bytes_written)
 {
@@ -44,23 +104,25 @@ void write_socket_blocking(int socket_fd, uint8 *buffer, int bytes_to_write, int
 	{
 		int delta = write(socket_fd, buffer + offset, count);
 		
-		offset += delta;
-		count -= delta;
-		
 		/* Process status */
 		switch(delta)
 		{
 			case 0: /* EOF; Disconnected */
-				die("write_socket_blocking(): Client disconnect.");
-				break;
+				socket_failure("write_socket_blocking(): Client disconnect.", false);
+				bytes_written = offset;
+				return;
 				
 			case -1: /* Error */
-				die_errno("write_socket_blocking(): ");
-				break;
+				socket_failure("write_socket_blocking(): ", true);
+				bytes_written = offset;
+				return;
 				
 			default: /* Data */
 				break;
 		}
+
+		offset += delta;
+		count -= delta;
 	}
 
 	/* Return the actual count read */
@@ -81,23 +143,25 @@ void read_socket_blocking(int socket_fd, uint8 *buffer, int bytes_to_read, int &
 	{
 		int delta = read(socket_fd, buffer + offset, count);
 		
-		offset += delta;
-		count -= delta;
-		
 		/* Process status */
 		switch(delta)
 		{
 			case 0: /* EOF; Disconnected */
-				die("read_socket_blocking(): Client disconnect.");
-				break;
+				socket_failure("read_socket_blocking(): Client disconnect.", false);
+				bytes_read = offset;
+				return;
 				
 			case -1: /* Error */
-				die_errno("read_socket_blocking(): ");
-				break;
+				socket_failure("read_socket_blocking(): ", true);
+				bytes_read = offset;
+				return;
 				
 			default: /* Data */
 				break;
 		}
+
+		offset += delta;
+		count -= delta;
 	}
 
 	/* Return the actual count read */
@@ -105,5 +169,163 @@ void read_socket_blocking(int socket_fd, uint8 *buffer, int bytes_to_read, int &
 }
 
 
+/* Return index of a command-line option, or -1 if it was not given */
+int find_option(int argc, char *argv[], char *name)
+{
+	for(int i = 0; i < argc; i++)
+	{
+		if(strcmp(argv[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*------------------------------------------------*/
+
+/* CRC32C (Castagnoli) lookup table for processors without SSE4.2 */
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_software(uint32_t crc, const uint8 *data, uint64 length)
+{
+	if(!crc32c_table[1])
+	{
+		for(uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t value = i;
+			for(int bit = 0; bit < 8; bit++)
+				value = (value >> 1) ^ ((value & 1) ? 0x82F63B78 : 0);
+			crc32c_table[i] = value;
+		}
+	}
+
+	while(length--)
+		crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+/* SSE4.2 CRC32 instruction, eight bytes per step */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const uint8 *data, uint64 length)
+{
+	uint64 value = crc;
+
+	while(length >= 8)
+	{
+		value = _mm_crc32_u64(value, *(const uint64 *)data);
+		data += 8;
+		length -= 8;
+	}
+	crc = (uint32_t)value;
+	while(length--)
+		crc = _mm_crc32_u8(crc, *data++);
+	return crc;
+}
+#endif
+
+/* Checksum a buffer */
+uint32_t crc32c(const uint8 *data, uint64 length)
+{
+#if defined(__x86_64__)
+	static int hardware = -1;
+	if(hardware == -1)
+		hardware = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+	if(hardware)
+		return ~crc32c_hardware(~0U, data, length);
+#endif
+	return ~crc32c_software(~0U, data, length);
+}
+
+/*------------------------------------------------*/
+
+/*
+	Fast 64-bit content hash for whole pages. Eight 64-bit lanes are mixed
+	independently over each 64-byte stripe, the same way with or without
+	AVX2, so both paths give identical results. Not cryptographic; equal
+	hashes must still be confirmed with memcmp().
+*/
+static const uint64 page_hash_secret[8] = {
+	0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL,
+	0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL,
+	0x78E5C0CC4EE679CBULL, 0x2172FFCC7DD05A82ULL,
+	0x8E2443F7744608B8ULL, 0x4C263A81E69035E0ULL
+};
+
+static void page_hash_software(uint64 *acc, const uint8 *data, uint64 stripes)
+{
+	for(uint64 s = 0; s < stripes; s++, data += 64)
+	{
+		for(int i = 0; i < 8; i++)
+		{
+			uint64 value = *(const uint64 *)(data + i * 8);
+			uint64 key = value ^ page_hash_secret[i];
+			acc[i ^ 1] += value;
+			acc[i] += (key & 0xFFFFFFFF) * (key >> 32);
+		}
+	}
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void page_hash_avx2(uint64 *acc, const uint8 *data, uint64 stripes)
+{
+	__m256i acc0 = _mm256_loadu_si256((const __m256i *)&acc[0]);
+	__m256i acc1 = _mm256_loadu_si256((const __m256i *)&acc[4]);
+	__m256i secret0 = _mm256_loadu_si256((const __m256i *)&page_hash_secret[0]);
+	__m256i secret1 = _mm256_loadu_si256((const __m256i *)&page_hash_secret[4]);
+
+	for(uint64 s = 0; s < stripes; s++, data += 64)
+	{
+		__m256i value0 = _mm256_loadu_si256((const __m256i *)data);
+		__m256i value1 = _mm256_loadu_si256((const __m256i *)(data + 32));
+		__m256i key0 = _mm256_xor_si256(value0, secret0);
+		__m256i key1 = _mm256_xor_si256(value1, secret1);
+
+		/* Low half times high half of each key, plus the neighbour lane */
+		acc0 = _mm256_add_epi64(acc0, _mm256_mul_epu32(key0, _mm256_srli_epi64(key0, 32)));
+		acc1 = _mm256_add_epi64(acc1, _mm256_mul_epu32(key1, _mm256_srli_epi64(key1, 32)));
+		acc0 = _mm256_add_epi64(acc0, _mm256_shuffle_epi32(value0, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc1 = _mm256_add_epi64(acc1, _mm256_shuffle_epi32(value1, _MM_SHUFFLE(1, 0, 3, 2)));
+	}
+
+	_mm256_storeu_si256((__m256i *)&acc[0], acc0);
+	_mm256_storeu_si256((__m256i *)&acc[4], acc1);
+}
+#endif
+
+uint64 page_hash64(const uint8 *data, uint64 length)
+{
+	uint64 acc[8];
+	uint64 stripes = length / 64;
+	uint64 hash = length * 0x9E3779B185EBCA87ULL;
+
+	for(int i = 0; i < 8; i++)
+		acc[i] = page_hash_secret[i] >> 1;
+
+#if defined(__x86_64__)
+	static int avx2 = -1;
+	if(avx2 == -1)
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	if(avx2)
+		page_hash_avx2(acc, data, stripes);
+	else
+#endif
+	page_hash_software(acc, data, stripes);
+
+	/* Fold in any bytes past the last full stripe */
+	for(uint64 i = stripes * 64; i < length; i++)
+		acc[i & 7] += (uint64)data[i] << ((i & 7) * 8);
+
+	for(int i = 0; i < 8; i++)
+	{
+		hash ^= acc[i] * 0xC2B2AE3D27D4EB4FULL;
+		hash = ((hash << 31) | (hash >> 33)) * 0x9E3779B185EBCA87ULL;
+	}
+	hash ^= hash >> 29;
+	hash *= 0x165667B19E3779F9ULL;
+	hash ^= hash >> 32;
+	return hash;
+}
+
 
 /* End */
@@ -1,11 +1,24 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+/* What a failed socket read or write does, set per thread */
+enum {
+	SOCKET_ERRORS_DIE,		/* Exit the program (default) */
+	SOCKET_ERRORS_EXIT_THREAD,	/* End the calling thread */
+	SOCKET_ERRORS_RETURN		/* Return early; see socket_error_check() */
+};
+
 /* Function prototypes */
 void die_errno(char *fmt, ...);
 void die(char *fmt, ...);
 void read_socket_blocking(int socket_fd, uint8 *buffer, int bytes_to_read, int &bytes_read);
 void write_socket_blocking(int socket_fd, uint8 *buffer, int bytes_to_write, int &bytes_written);
+int socket_error_mode(int mode);
+bool socket_error_check(void);
+void socket_drop(int socket_fd, const char *message);
+int find_option(int argc, char *argv[], char *name);
+uint32_t crc32c(const uint8 *data, uint64 length);
+uint64 page_hash64(const uint8 *data, uint64 length);
 
 #endif /* _UTIL_H_ */
 
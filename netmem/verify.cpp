@@ -0,0 +1,213 @@
+/*
+	File:
+		verify.cpp
+	Author:
+		Charles MacDonald
+	Notes:
+		Offline integrity check of shared.bin. The pages are split into
+		one contiguous slice per thread, read in large blocks and checked
+		against the CRC table, so a large region is verified at disk speed.
+		With -repair, bad pages are restored from a snapshot image given
+		with -source when its copy matches the stored CRC. Pages with no
+		good copy are reported as unrepaired and left failing, unless
+		-accept is also given, which rewrites their CRC entries to accept
+		them as they are. A truncated file is only extended with -accept,
+		as the missing pages and checksums cannot be recovered.
+*/
+
+#include "shared.h"
+#include <sys/time.h>
+using namespace std;
+
+#define VERIFY_BLOCK_PAGES	256	/* Pages read per pread() */
+
+struct verify_slice {
+	pthread_t thread;
+	uint64 first;		/* First page of the slice */
+	uint64 count;		/* Pages in the slice */
+	uint64 bad;
+	uint64 restored;
+	uint64 accepted;
+	uint64 unrepaired;
+};
+
+static int verify_fd = -1;
+static int verify_source_fd = -1;
+static bool verify_repair = false;
+static bool verify_accept = false;
+static uint32_t *verify_crc_table = NULL;
+static uint64 verify_page_size = 0;
+
+/* Deal with one page that does not match its CRC */
+static void verify_bad_page(struct verify_slice *slice, uint64 page, uint8 *data)
+{
+	slice->bad++;
+	printf("Page %016llX: CRC mismatch\n", page * verify_page_size);
+
+	if(!verify_repair)
+		return;
+
+	/* Prefer an older copy that still matches the recorded CRC */
+	if(verify_source_fd != -1)
+	{
+		uint8 *copy = new uint8 [verify_page_size];
+		bool match = pread(verify_source_fd, copy, verify_page_size, page * verify_page_size) == (ssize_t)verify_page_size
+			&& crc32c(copy, verify_page_size) == verify_crc_table[page];
+
+		if(match && pwrite(verify_fd, copy, verify_page_size,
+			REGION_HEADER_SIZE + page * verify_page_size) == (ssize_t)verify_page_size)
+		{
+			slice->restored++;
+			delete []copy;
+			return;
+		}
+		delete []copy;
+	}
+
+	/* Only bless the page as it is when told to */
+	if(!verify_accept)
+	{
+		printf("Page %016llX: no good copy, not repaired\n", page * verify_page_size);
+		slice->unrepaired++;
+		return;
+	}
+	verify_crc_table[page] = crc32c(data, verify_page_size);
+	slice->accepted++;
+}
+
+static void *verify_thread(void *arg)
+{
+	struct verify_slice *slice = (struct verify_slice *)arg;
+	uint8 *block = new uint8 [VERIFY_BLOCK_PAGES * verify_page_size];
+
+	for(uint64 done = 0; done < slice->count; )
+	{
+		uint64 pages = MIN(slice->count - done, VERIFY_BLOCK_PAGES);
+		uint64 page = slice->first + done;
+		ssize_t length = pread(verify_fd, block, pages * verify_page_size,
+			REGION_HEADER_SIZE + page * verify_page_size);
+
+		if(length < 0)
+			die_errno("Error: pread(): ");
+		memset(block + length, 0, pages * verify_page_size - length);
+
+		for(uint64 i = 0; i < pages; i++)
+		{
+			uint8 *data = block + i * verify_page_size;
+			if(crc32c(data, verify_page_size) != verify_crc_table[page + i])
+				verify_bad_page(slice, page + i, data);
+		}
+		done += pages;
+	}
+
+	delete []block;
+	return NULL;
+}
+
+/*
+	Usage: v [-f file] [-t threads] [-repair] [-source snapshot] [-accept]
+	Returns 0 if the file is intact (or every bad page was restored or
+	accepted), 1 otherwise.
+*/
+int run_verify(int argc, char *argv[])
+{
+	char *filename = REGION_FILENAME;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	struct region_header header;
+	struct stat info;
+	struct timeval start, stop;
+	int index;
+
+	if((index = find_option(argc, argv, "-f")) != -1 && index + 1 < argc)
+		filename = argv[index + 1];
+	if((index = find_option(argc, argv, "-t")) != -1 && index + 1 < argc)
+		threads = atoi(argv[index + 1]);
+	verify_repair = (find_option(argc, argv, "-repair") != -1);
+	verify_accept = verify_repair && (find_option(argc, argv, "-accept") != -1);
+	if(threads < 1)
+		threads = 1;
+
+	verify_fd = open(filename, verify_repair ? O_RDWR : O_RDONLY);
+	if(verify_fd == -1)
+		die_errno("Error: open(): %s: ", filename);
+	if((index = find_option(argc, argv, "-source")) != -1 && index + 1 < argc)
+	{
+		verify_source_fd = open(argv[index + 1], O_RDONLY);
+		if(verify_source_fd == -1)
+			die_errno("Error: open(): %s: ", argv[index + 1]);
+	}
+
+	if(!region_read_header(verify_fd, &header))
+		die("Error: %s has no valid region header.\n", filename);
+	verify_page_size = header.page_size;
+	uint64 pages = header.region_size / header.page_size;
+	uint64 expected = REGION_FILE_SIZE(header.region_size, header.page_size);
+
+	printf("File:        %s\n", filename);
+	printf("Generation:  %llu\n", header.generation);
+	printf("Page size:   %08X\n", header.page_size);
+	printf("Region size: %016llX (%llu pages)\n", header.region_size, pages);
+
+	/* Region was resized or the file was cut short */
+	fstat(verify_fd, &info);
+	if((uint64)info.st_size != expected)
+	{
+		printf("Size mismatch: file is %lld bytes, header describes %llu bytes\n",
+			(long long)info.st_size, expected);
+		/* Missing bytes cannot be checked, so only -accept fills them in */
+		if(!verify_repair || ((uint64)info.st_size < expected && !verify_accept))
+			return 1;
+		if(ftruncate(verify_fd, expected) == -1)
+			die_errno("Error: ftruncate(): ");
+	}
+
+	verify_crc_table = (uint32_t *)mmap(NULL, pages * sizeof(uint32_t),
+		verify_repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+		verify_fd, REGION_TABLE_OFFSET(header.region_size));
+	if(verify_crc_table == MAP_FAILED)
+		die_errno("Error: mmap(): ");
+
+	/* One contiguous slice of pages per thread */
+	struct verify_slice *slices = new verify_slice [threads];
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < threads; i++)
+	{
+		memset(&slices[i], 0, sizeof(slices[i]));
+		slices[i].first = pages * i / threads;
+		slices[i].count = pages * (i + 1) / threads - slices[i].first;
+		if(pthread_create(&slices[i].thread, NULL, verify_thread, &slices[i]) != 0)
+			die("Error: pthread_create()\n");
+	}
+
+	uint64 bad = 0, restored = 0, accepted = 0, unrepaired = 0;
+	for(int i = 0; i < threads; i++)
+	{
+		pthread_join(slices[i].thread, NULL);
+		bad += slices[i].bad;
+		restored += slices[i].restored;
+		accepted += slices[i].accepted;
+		unrepaired += slices[i].unrepaired;
+	}
+	gettimeofday(&stop, NULL);
+	delete []slices;
+
+	double seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+	printf("Checked %llu pages with %d threads in %.3f s (%.1f MB/s)\n",
+		pages, threads, seconds,
+		seconds > 0 ? header.region_size / seconds / 1e6 : 0.0);
+	printf("Bad pages: %llu", bad);
+	if(verify_repair)
+		printf(" (%llu restored, %llu accepted, %llu unrepaired)", restored, accepted, unrepaired);
+	printf("\n");
+
+	if(verify_repair)
+		msync(verify_crc_table, pages * sizeof(uint32_t), MS_SYNC);
+	munmap(verify_crc_table, pages * sizeof(uint32_t));
+	close(verify_fd);
+	if(verify_source_fd != -1)
+		close(verify_source_fd);
+
+	return (restored + accepted == bad) ? 0 : 1;
+}
+
+/* End */
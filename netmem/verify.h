@@ -0,0 +1,7 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+/* Function prototypes */
+int run_verify(int argc, char *argv[]);
+
+#endif /* _VERIFY_H_ */
@@ -0,0 +1,326 @@
+/*
+    File:
+        writeback.cpp
+    Author:
+        Ryan Gordon
+    Notes:
+        Write-behind queue for page syncs. A sync is acknowledged as soon
+        as the page is copied into the queue. Later versions of a queued
+        page overwrite the earlier one, and a flusher thread sends runs of
+        adjacent pages with one range write once enough pages are pending,
+        the oldest page is old enough, or a barrier asks for durability.
+
+        Each run goes on the lane of its first page. All runs of a batch
+        are sent before any reply is read, so with several lanes they
+        travel in parallel. In a sharded region a run never crosses an
+        owner, and runs of pages another node owns go to that node, since
+        a server refuses range writes to pages it does not own. A run the
+        server refuses is counted, and the next barrier reports the loss
+        instead of success.
+*/
+
+#include "shared.h"
+#include <map>
+#include <vector>
+#include <sys/time.h>
+using namespace std;
+
+typedef map<uint64_t, uint8_t *> writeback_map;
+
+static pthread_mutex_t writeback_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeback_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writeback_done = PTHREAD_COND_INITIALIZER;
+static pthread_t writeback_thread;
+static bool writeback_running = false;
+
+static writeback_map writeback_pending;     /* Offset -> newest page contents */
+static writeback_map writeback_inflight;    /* Being sent by the flusher */
+static struct timeval writeback_oldest;     /* When pending became non-empty */
+static uint64_t writeback_queued_seq = 0;   /* Bumped by every queued sync */
+static uint64_t writeback_flushed_seq = 0;  /* Syncs known to be on the server */
+static int writeback_barriers = 0;          /* Callers waiting on a barrier */
+static uint64_t writeback_failed = 0;       /* Runs refused since the last barrier */
+
+static int writeback_max_pages = WRITEBACK_MAX_PAGES;
+static int writeback_max_age = WRITEBACK_MAX_AGE;
+
+/* Statistics */
+static uint64_t writeback_stat_queued = 0;
+static uint64_t writeback_stat_coalesced = 0;
+static uint64_t writeback_stat_runs = 0;
+static uint64_t writeback_stat_pages = 0;
+static uint64_t writeback_stat_failed = 0;
+
+struct writeback_run {
+    uint64_t start;
+    int pages;
+    int node;           /* Shard node that owns the pages, -1 for the lanes */
+    uint8_t *data;
+};
+
+static void writeback_send_runs(int socket_fd, vector<writeback_run> &runs) {
+    for (size_t i = 0; i < runs.size(); i++) {
+        nm_client_write_range_send(socket_fd, runs[i].start, (uint64_t)runs[i].pages * CLIENT_PAGE_SIZE, runs[i].data);
+    }
+}
+
+/* Read the reply to every run sent on a lane; if the lane dropped, send them all again.
+   Returns the number of runs the server refused */
+static int writeback_collect(int lane, int socket_fd, vector<writeback_run> &runs) {
+    vector<bool> ok(runs.size());
+    int failed = 0;
+
+    while (true) {
+        for (size_t i = 0; i < runs.size(); i++) {
+            ok[i] = nm_client_write_range_wait(socket_fd);
+        }
+        if (!client_connection_lost(lane)) {
+            break;
+        }
+        writeback_send_runs(socket_fd, runs);
+    }
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (!ok[i]) {
+            printf("Error: write-behind of %d pages at %016llX rejected\n", runs[i].pages, (unsigned long long)runs[i].start);
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/* Read the reply to every run sent to a node; a dropped node loses the runs still unanswered */
+static int writeback_collect_node(int node, int socket_fd, vector<writeback_run> &runs) {
+    int failed = 0;
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        if (!nm_client_write_range_wait(socket_fd)) {
+            printf("Error: write-behind of %d pages at %016llX to node %d failed\n", runs[i].pages,
+                (unsigned long long)runs[i].start, node);
+            failed++;
+        }
+    }
+    client_shard_lost(node);
+    return failed;
+}
+
+/* Send one batch, merging adjacent offsets into range writes; returns the runs refused */
+static int writeback_send(writeback_map &batch) {
+    vector<writeback_run> runs[CLIENT_LANES_MAX];
+    vector<writeback_run> node_runs[SHARD_NODES_MAX];
+    int failed = 0;
+    writeback_map::iterator it = batch.begin();
+
+    while (it != batch.end()) {
+        writeback_run run;
+        run.start = it->first;
+        run.pages = 0;
+        run.node = client_shard_node(run.start);
+        run.data = (uint8_t *)malloc(WRITEBACK_MAX_RUN * CLIENT_PAGE_SIZE);
+
+        while (it != batch.end() && run.pages < WRITEBACK_MAX_RUN &&
+               it->first == run.start + (uint64_t)run.pages * CLIENT_PAGE_SIZE &&
+               (run.pages == 0 || client_shard_node(it->first) == run.node)) {
+            memcpy(&run.data[run.pages * CLIENT_PAGE_SIZE], it->second, CLIENT_PAGE_SIZE);
+            run.pages++;
+            ++it;
+        }
+        if (run.node == -1) {
+            runs[client_lane(run.start)].push_back(run);
+        } else {
+            node_runs[run.node].push_back(run);
+        }
+
+        writeback_stat_runs++;
+        writeback_stat_pages += run.pages;
+    }
+
+    /* Lanes are taken in order, so other users of one lane cannot deadlock with us */
+    int socket_fd[CLIENT_LANES_MAX];
+    for (int lane = 0; lane < CLIENT_LANES_MAX; lane++) {
+        if (!runs[lane].empty()) {
+            socket_fd[lane] = client_lane_lock(lane);
+            do {
+                writeback_send_runs(socket_fd[lane], runs[lane]);
+            } while (client_connection_lost(lane));
+        }
+    }
+    int node_fd[SHARD_NODES_MAX];
+    for (int node = 0; node < SHARD_NODES_MAX; node++) {
+        if (!node_runs[node].empty()) {
+            node_fd[node] = client_shard_lock(node);
+            if (node_fd[node] != -1) {
+                writeback_send_runs(node_fd[node], node_runs[node]);
+                if (client_shard_lost(node)) {
+                    node_fd[node] = -1;
+                }
+            }
+        }
+    }
+
+    for (int lane = 0; lane < CLIENT_LANES_MAX; lane++) {
+        if (!runs[lane].empty()) {
+            failed += writeback_collect(lane, socket_fd[lane], runs[lane]);
+            client_lane_unlock(lane);
+        }
+        for (size_t i = 0; i < runs[lane].size(); i++) {
+            free(runs[lane][i].data);
+        }
+    }
+    for (int node = 0; node < SHARD_NODES_MAX; node++) {
+        if (!node_runs[node].empty()) {
+            if (node_fd[node] != -1) {
+                failed += writeback_collect_node(node, node_fd[node], node_runs[node]);
+            } else {
+                printf("Error: write-behind of %d runs to unreachable node %d failed\n", (int)node_runs[node].size(), node);
+                failed += node_runs[node].size();
+            }
+            client_shard_unlock(node);
+        }
+        for (size_t i = 0; i < node_runs[node].size(); i++) {
+            free(node_runs[node][i].data);
+        }
+    }
+    return failed;
+}
+
+/* Milliseconds since the oldest pending page was queued */
+static int writeback_age(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - writeback_oldest.tv_sec) * 1000 + (now.tv_usec - writeback_oldest.tv_usec) / 1000;
+}
+
+static void *writeback_flusher(void *arg) {
+    socket_error_mode(SOCKET_ERRORS_RETURN);
+    pthread_mutex_lock(&writeback_mutex);
+    while (writeback_running || !writeback_pending.empty()) {
+        if (writeback_pending.empty()) {
+            pthread_cond_wait(&writeback_work, &writeback_mutex);
+            continue;
+        }
+
+        /* Give more syncs a chance to coalesce unless a trigger fired */
+        if (writeback_running && !writeback_barriers &&
+            (int)writeback_pending.size() < writeback_max_pages &&
+            writeback_age() < writeback_max_age) {
+            struct timespec deadline;
+            uint64_t usec = writeback_oldest.tv_usec + (uint64_t)writeback_max_age * 1000;
+            deadline.tv_sec = writeback_oldest.tv_sec + usec / 1000000;
+            deadline.tv_nsec = (usec % 1000000) * 1000;
+            pthread_cond_timedwait(&writeback_work, &writeback_mutex, &deadline);
+            continue;
+        }
+
+        uint64_t target = writeback_queued_seq;
+        writeback_inflight.swap(writeback_pending);
+        pthread_mutex_unlock(&writeback_mutex);
+
+        int failed = writeback_send(writeback_inflight);
+
+        pthread_mutex_lock(&writeback_mutex);
+        writeback_failed += failed;
+        writeback_stat_failed += failed;
+        for (writeback_map::iterator it = writeback_inflight.begin(); it != writeback_inflight.end(); ++it) {
+            free(it->second);
+        }
+        writeback_inflight.clear();
+        writeback_flushed_seq = target;
+        pthread_cond_broadcast(&writeback_done);
+    }
+    pthread_mutex_unlock(&writeback_mutex);
+
+    return NULL;
+}
+
+void writeback_start(int max_pages, int max_age) {
+    writeback_max_pages = max_pages;
+    writeback_max_age = max_age;
+    writeback_running = true;
+
+    if (pthread_create(&writeback_thread, NULL, writeback_flusher, NULL) != 0) {
+        die("Error: pthread_create(): write-behind flusher\n");
+    }
+    printf("- Write-behind enabled (max pages=%d, max age=%d ms)\n", max_pages, max_age);
+}
+
+/* Flush everything still queued and stop the flusher */
+void writeback_stop(void) {
+    pthread_mutex_lock(&writeback_mutex);
+    writeback_running = false;
+    pthread_cond_signal(&writeback_work);
+    pthread_mutex_unlock(&writeback_mutex);
+    pthread_join(writeback_thread, NULL);
+
+    printf("Write-behind: %llu syncs queued, %llu coalesced, %llu pages sent in %llu range writes, %llu refused\n",
+        (unsigned long long)writeback_stat_queued, (unsigned long long)writeback_stat_coalesced,
+        (unsigned long long)writeback_stat_pages, (unsigned long long)writeback_stat_runs,
+        (unsigned long long)writeback_stat_failed);
+}
+
+/* Queue a page for the server; the caller may acknowledge the sync at once */
+bool writeback_queue(uint64_t page_offset, uint8_t *page) {
+    pthread_mutex_lock(&writeback_mutex);
+
+    writeback_map::iterator it = writeback_pending.find(page_offset);
+    if (it != writeback_pending.end()) {
+        /* Only the newest version of a page is worth sending */
+        memcpy(it->second, page, CLIENT_PAGE_SIZE);
+        writeback_stat_coalesced++;
+    } else {
+        uint8_t *copy = (uint8_t *)malloc(CLIENT_PAGE_SIZE);
+        memcpy(copy, page, CLIENT_PAGE_SIZE);
+        if (writeback_pending.empty()) {
+            gettimeofday(&writeback_oldest, NULL);
+        }
+        writeback_pending[page_offset] = copy;
+    }
+    writeback_queued_seq++;
+    writeback_stat_queued++;
+
+    if ((int)writeback_pending.size() >= writeback_max_pages || writeback_pending.size() == 1) {
+        pthread_cond_signal(&writeback_work);
+    }
+    pthread_mutex_unlock(&writeback_mutex);
+
+    return true;
+}
+
+/* Serve a page fault from the queue if the server may not have the newest copy */
+bool writeback_lookup(uint64_t page_offset, uint8_t *page) {
+    bool found = false;
+
+    pthread_mutex_lock(&writeback_mutex);
+    writeback_map::iterator it = writeback_pending.find(page_offset);
+    if (it == writeback_pending.end()) {
+        it = writeback_inflight.find(page_offset);
+        found = (it != writeback_inflight.end());
+    } else {
+        found = true;
+    }
+    if (found) {
+        memcpy(page, it->second, CLIENT_PAGE_SIZE);
+    }
+    pthread_mutex_unlock(&writeback_mutex);
+
+    return found;
+}
+
+/* Durability barrier: returns once every sync queued so far has been sent.
+   False if the server refused a run since the last barrier; the pages are lost */
+bool writeback_barrier(void) {
+    pthread_mutex_lock(&writeback_mutex);
+    uint64_t target = writeback_queued_seq;
+
+    writeback_barriers++;
+    pthread_cond_signal(&writeback_work);
+    while (writeback_flushed_seq < target) {
+        pthread_cond_wait(&writeback_done, &writeback_mutex);
+    }
+    writeback_barriers--;
+    bool ok = (writeback_failed == 0);
+    writeback_failed = 0;
+    pthread_mutex_unlock(&writeback_mutex);
+
+    return ok;
+}
@@ -0,0 +1,15 @@
+#ifndef _WRITEBACK_H_
+#define _WRITEBACK_H_
+
+#define WRITEBACK_MAX_PAGES	256	/* Flush once this many pages are pending */
+#define WRITEBACK_MAX_AGE	20	/* Flush once the oldest page is this old (ms) */
+#define WRITEBACK_MAX_RUN	64	/* Adjacent pages sent in one range write */
+
+/* Function prototypes */
+void writeback_start(int max_pages, int max_age);
+void writeback_stop(void);
+bool writeback_queue(uint64_t page_offset, uint8_t *page);
+bool writeback_lookup(uint64_t page_offset, uint8_t *page);
+bool writeback_barrier(void);
+
+#endif /* _WRITEBACK_H_ */
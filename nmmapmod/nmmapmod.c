@@ -19,6 +19,7 @@
 #include <linux/mm.h>           // Needed for vm_fault and vm_area_struct
 #include <linux/skbuff.h>       // Needed for netlink
 #include <linux/connector.h>    // Needed for netlink
+#include <linux/mman.h>         // Needed for MS_SYNC
 
 static void page_recv_callback(char *page_recieved);
 static void page_sync_recv_callback(char *page_sync_resp_code);
@@ -37,6 +38,7 @@ MODULE_DESCRIPTION(DRIVER_DESC);
 #define REQUEST_PAGE_SYNC 0x90
 #define RESPONSE_PAGE_SYNC_OK 0x91
 #define RESPONSE_PAGE_SYNC_ERR 0x92
+#define REQUEST_SYNC_BARRIER 0x93
 
 #define CLIENT_PAGE_SIZE 4096
 #define PAGE_OFFSET_SIZE sizeof(uint64_t)
@@ -47,6 +49,8 @@ MODULE_DESCRIPTION(DRIVER_DESC);
  * Page Response: 1 byte (respose code) | CLIENT_PAGE_SIZE bytes (page data itself)
  * Sync Request: 1 byte (opcode) | 8 bytes (page offset 64bit number) | CLIENT_PAGE_SIZE bytes (page data itself)
  * Sync Response 1 byte (response code)
+ * Barrier Request: 1 byte (opcode), answered with a Sync Response once every
+ *                  page synced before it is on the server
  *
  */
 #define PAGE_REQUEST_SIZE sizeof(uint8_t) + PAGE_OFFSET_SIZE
@@ -59,6 +63,7 @@ static char cn_nmmap_name[] = "cn_nmmap_msg";
 
 bool g_response_recieved = false;
 char *g_response_data = NULL;
+uint8_t g_sync_response_code = 0;
 
 static void fill_with_deadbeef(char **ptr, int length) {
         int i;
@@ -116,6 +121,7 @@ static int cn_nmmap_send_msg(char *data, uint32_t length) {
 }
 
 static void page_sync_recv_callback(char *page_sync_resp_code) {
+        g_sync_response_code = *page_sync_resp_code;
         g_response_data = page_sync_resp_code;
         g_response_recieved = true;
 }
@@ -195,6 +201,16 @@ static int network_msync_handler(unsigned long start, size_t len, int flags)
         current_pos += CLIENT_PAGE_SIZE;
     }
 
+    // MS_SYNC: the client may still be holding the pages back in its queue
+    if (flags & MS_SYNC) {
+        char barrier = REQUEST_SYNC_BARRIER;
+
+        cn_nmmap_send_msg(&barrier, sizeof(barrier));
+        if (!wait_for_page_sync_response(1000) || g_sync_response_code != RESPONSE_PAGE_SYNC_OK) {
+            return -EIO;
+        }
+    }
+
     return 0;
 }
 